@@ -0,0 +1,236 @@
+/*
+ * Functions to write a shared file through a few aggregator ranks from
+ * an MPI code, a two-phase write that does not lean on the MPI library's
+ * collective buffering
+ *
+ * The written extent of the file is split into one contiguous domain per
+ * aggregator, on agg_align boundaries.  In the first phase every rank
+ * sends the part of its piece in each domain to the domain's aggregator;
+ * in the second, the aggregators write what they received with large
+ * contiguous writes.  Domains bigger than agg_bufsize take several rounds.
+ *
+ * Only files written with MPI-IO directly can use it, which here is
+ * cartiso's --vtkshared output.  The HDF5 writers of all the apps go through
+ * HDF5's MPI-IO driver, which this layer can not sit under, so they keep
+ * MPI-IO's own collective buffering and fixed hints, and --aggregators does
+ * not apply to them.
+ *
+ * Copyright (c) DoD HPCMP PETTT.  All rights reserved.
+ * See LICENSE file for details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <mpi.h>
+
+static const uint64_t agg_align = 1048576;     /* Domain boundaries, a common stripe size */
+static const uint64_t agg_bufsize = 16777216;  /* Most bytes an aggregator writes per round */
+static const uint64_t agg_maxchunk = 1 << 30;  /* Most bytes per MPI-IO call, for its int counts */
+static const int agg_tag = 7411;
+static int agg_keyval = MPI_KEYVAL_INVALID;    /* Caches the aggregators on a communicator */
+
+/* A run of bytes of the file received by an aggregator */
+struct aggrun {
+    uint64_t start;
+    uint64_t len;
+};
+
+static int aggrun_cmp(const void *a, const void *b)
+{
+    uint64_t sa = ((const struct aggrun *)a)->start;
+    uint64_t sb = ((const struct aggrun *)b)->start;
+
+    return (sa > sb) - (sa < sb);
+}
+
+static int agg_delete(MPI_Comm comm, int keyval, void *val, void *extra)
+{
+    free(val);
+    return MPI_SUCCESS;
+}
+
+/* Choose the aggregators, spread over the nodes
+ *    comm: MPI communicator of all ranks
+ *    naggs: number of aggregators, at most the size of comm
+ * returns: the ranks of the aggregators, owned by comm
+ * note: the first rank of every node is taken before the second of any,
+ *       so M up to the number of nodes gives one aggregator per node
+ * note: collective the first time; the choice is cached on comm, and made
+ *       again only for another naggs */
+
+static int *agg_pick(MPI_Comm comm, int naggs)
+{
+    MPI_Comm nodecomm;
+    int rank, nprocs, noderank, *noderanks, *cache, found;
+    int a, k, r;
+
+    if(agg_keyval == MPI_KEYVAL_INVALID)
+        MPI_Comm_create_keyval(MPI_COMM_NULL_COPY_FN, agg_delete, &agg_keyval, NULL);
+    MPI_Comm_get_attr(comm, agg_keyval, &cache, &found);
+    if(found && cache[0] == naggs)
+        return cache + 1;
+    if(found)
+        MPI_Comm_delete_attr(comm, agg_keyval);
+
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &nprocs);
+    MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &nodecomm);
+    MPI_Comm_rank(nodecomm, &noderank);
+    MPI_Comm_free(&nodecomm);
+
+    noderanks = (int *) malloc(nprocs*sizeof(int));
+    MPI_Allgather(&noderank, 1, MPI_INT, noderanks, 1, MPI_INT, comm);
+    cache = (int *) malloc((naggs+1)*sizeof(int));
+    cache[0] = naggs;
+    for(a = 0, k = 0; a < naggs; k++)
+        for(r = 0; r < nprocs && a < naggs; r++)
+            if(noderanks[r] == k)
+                cache[1 + a++] = r;
+    free(noderanks);
+    MPI_Comm_set_attr(comm, agg_keyval, cache);
+    return cache + 1;
+}
+
+/* Bytes [*wlo,*whi) of the file that aggregator a writes in a round,
+ * empty if *wlo >= *whi */
+
+static void agg_window(uint64_t base, uint64_t dsize, uint64_t lo, uint64_t hi,
+                       int a, int round, uint64_t *wlo, uint64_t *whi)
+{
+    uint64_t dhi = base + (a+1)*dsize;
+
+    *wlo = base + a*dsize + round*agg_bufsize;
+    *whi = *wlo + agg_bufsize < dhi ? *wlo + agg_bufsize : dhi;
+    if(*wlo < lo)
+        *wlo = lo;
+    if(*whi > hi)
+        *whi = hi;
+}
+
+/* Write the pieces of all ranks to a shared file
+ *    mf: file opened on comm
+ *    comm: MPI communicator of all ranks
+ *    naggs: number of aggregators; 0 writes with MPI_File_write_at_all
+ *    offset: where this rank's bytes go in the file
+ *    data, nbytes: bytes of this rank, may be 0
+ * note: collective; the pieces must not overlap, but may leave holes,
+ *       which are not written */
+
+static void agg_write_at_all(MPI_File mf, MPI_Comm comm, int naggs, uint64_t offset,
+                             const void *data, uint64_t nbytes)
+{
+    int rank, nprocs, me = -1, nreqs, nruns, nrounds, round, first, a, r;
+    int *aggs;
+    uint64_t piece[2], *pieces, lo = UINT64_MAX, hi = 0, base, dsize, wlo, whi, s, e;
+    unsigned char *buf = NULL;
+    struct aggrun *runs = NULL;
+    MPI_Request *reqs;
+    MPI_Status mstat;
+
+    if(naggs <= 0) {
+        /* Pieces past agg_maxchunk take several calls, as many on every rank */
+        nrounds = (int)((nbytes + agg_maxchunk - 1) / agg_maxchunk);
+        MPI_Allreduce(MPI_IN_PLACE, &nrounds, 1, MPI_INT, MPI_MAX, comm);
+        for(round = 0; round < nrounds; round++) {
+            s = round*agg_maxchunk < nbytes ? round*agg_maxchunk : nbytes;
+            e = s + agg_maxchunk < nbytes ? s + agg_maxchunk : nbytes;
+            MPI_File_write_at_all(mf, (MPI_Offset)(offset + s), (const unsigned char *)data + s,
+                                  (int)(e - s), MPI_BYTE, &mstat);
+        }
+        return;
+    }
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &nprocs);
+    if(naggs > nprocs)
+        naggs = nprocs;
+
+    /* Every rank learns every piece, so both sides of each exchange
+     * work out their counts on their own */
+    piece[0] = offset;
+    piece[1] = nbytes;
+    pieces = (uint64_t *) malloc(2*nprocs*sizeof(uint64_t));
+    MPI_Allgather(piece, 2, MPI_UNSIGNED_LONG_LONG, pieces, 2, MPI_UNSIGNED_LONG_LONG, comm);
+    for(r = 0; r < nprocs; r++)
+        if(pieces[2*r+1]) {
+            if(pieces[2*r] < lo)
+                lo = pieces[2*r];
+            if(pieces[2*r] + pieces[2*r+1] > hi)
+                hi = pieces[2*r] + pieces[2*r+1];
+        }
+    if(hi <= lo) {
+        free(pieces);
+        return;
+    }
+
+    aggs = agg_pick(comm, naggs);
+    for(a = 0; a < naggs; a++)
+        if(aggs[a] == rank)
+            me = a;
+
+    base = lo - lo % agg_align;
+    dsize = (hi - base + naggs - 1) / naggs;
+    dsize = (dsize + agg_align - 1) / agg_align * agg_align;
+    nrounds = (int)((dsize + agg_bufsize - 1) / agg_bufsize);
+    if(me >= 0) {
+        buf = (unsigned char *) malloc(dsize < agg_bufsize ? dsize : agg_bufsize);
+        runs = (struct aggrun *) malloc(nprocs*sizeof(struct aggrun));
+        if(!buf || !runs) {
+            fprintf(stderr, "agg error: could not allocate the aggregator buffer\n");
+            MPI_Abort(comm, 1);
+        }
+    }
+    reqs = (MPI_Request *) malloc((nprocs + naggs)*sizeof(MPI_Request));
+
+    for(round = 0; round < nrounds; round++) {
+        nreqs = nruns = 0;
+
+        /* Receive the bytes of the window of this aggregator */
+        if(me >= 0) {
+            agg_window(base, dsize, lo, hi, me, round, &wlo, &whi);
+            for(r = 0; r < nprocs && wlo < whi; r++) {
+                s = pieces[2*r] > wlo ? pieces[2*r] : wlo;
+                e = pieces[2*r] + pieces[2*r+1] < whi ? pieces[2*r] + pieces[2*r+1] : whi;
+                if(s >= e)
+                    continue;
+                MPI_Irecv(buf + (s - wlo), (int)(e - s), MPI_BYTE, r, agg_tag, comm,
+                          &reqs[nreqs++]);
+                runs[nruns].start = s;
+                runs[nruns++].len = e - s;
+            }
+        }
+
+        /* Send this rank's bytes to the aggregators whose windows they are in */
+        for(a = 0; a < naggs && nbytes; a++) {
+            agg_window(base, dsize, lo, hi, a, round, &s, &e);
+            if(s < offset)
+                s = offset;
+            if(e > offset + nbytes)
+                e = offset + nbytes;
+            if(s >= e)
+                continue;
+            MPI_Isend((const unsigned char *)data + (s - offset), (int)(e - s), MPI_BYTE,
+                      aggs[a], agg_tag, comm, &reqs[nreqs++]);
+        }
+        MPI_Waitall(nreqs, reqs, MPI_STATUSES_IGNORE);
+
+        /* Write the window, one call per run without holes */
+        if(nruns) {
+            qsort(runs, nruns, sizeof(struct aggrun), aggrun_cmp);
+            for(first = 0, r = 1; r <= nruns; r++) {
+                if(r < nruns && runs[r].start == runs[r-1].start + runs[r-1].len)
+                    continue;
+                s = runs[first].start;
+                e = runs[r-1].start + runs[r-1].len;
+                MPI_File_write_at(mf, (MPI_Offset)s, buf + (s - wlo), (int)(e - s), MPI_BYTE,
+                                  &mstat);
+                first = r;
+            }
+        }
+    }
+
+    free(reqs);
+    free(runs);
+    free(buf);
+    free(pieces);
+}
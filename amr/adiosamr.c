@@ -5,18 +5,26 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include "cubes.h"
 #include "adiosamr.h"
 
 static const int fnstrmax = 4095;
 
 void adiosamr_init(struct adiosamrinfo *nfo, char *method, char *name,
-		   MPI_Comm comm, int rank, int nprocs, int tsteps) {
+		   MPI_Comm comm, int rank, int nprocs, int tsteps,
+		   int maxlevel, float deltax, float deltay, float deltaz, int geometry, int output) {
   /* Set up struct, haven't decided if using all of these yet */
   nfo->name = name;
+  nfo->geometry = geometry;
+  nfo->output = output;
   nfo->comm = comm;
   nfo->rank = rank;
   nfo->nprocs = nprocs;
   nfo->tsteps = tsteps;
+  nfo->maxlevel = maxlevel;
+  nfo->deltas[0] = deltax;
+  nfo->deltas[1] = deltay;
+  nfo->deltas[2] = deltaz;
     
   nfo->numxvars = 0;
   nfo->maxxvars = 1000;
@@ -34,6 +42,33 @@ void adiosamr_init(struct adiosamrinfo *nfo, char *method, char *name,
   adios_define_var(nfo->gid, "cnpoints", "", adios_unsigned_long, "", "", "");
   adios_define_var(nfo->gid, "npoints", "", adios_unsigned_long, "", "", "");
   adios_define_var(nfo->gid, "cstart", "", adios_unsigned_long, "", "", "");
+
+  /* Octree key per cube; see cubes.h for the layout */
+  adios_define_var(nfo->gid, "maxlevel", "", adios_integer, "", "", "");
+  adios_define_var(nfo->gid, "deltas", "", adios_real, "3", "", "");
+  adios_define_var(nfo->gid, "cncubes", "", adios_unsigned_long, "", "", "");
+  adios_define_var(nfo->gid, "ncubes", "", adios_unsigned_long, "", "", "");
+  adios_define_var(nfo->gid, "cstartcubes", "", adios_unsigned_long, "", "", "");
+  adios_define_var(nfo->gid, "keys", "", adios_unsigned_long, "cncubes", "ncubes", "cstartcubes");
+
+  /* Cubes of each level on each rank; with bylevel each rank's cubes are
+   * sorted by level, so these give the level runs in every block */
+  adios_define_var(nfo->gid, "nwriters", "", adios_integer, "", "", "");
+  adios_define_var(nfo->gid, "nlevels", "", adios_integer, "", "", "");
+  adios_define_var(nfo->gid, "cnlevelcubes", "", adios_unsigned_long, "1,nlevels", "nwriters,nlevels", "rank,0");
+  adios_define_attribute(nfo->gid, "allnodes", "", adios_integer,
+			 (output & OUTPUT_ALLNODES) ? "1" : "0", "");
+  adios_define_attribute(nfo->gid, "bylevel", "", adios_integer,
+			 (output & OUTPUT_BYLEVEL) ? "1" : "0", "");
+
+  /* Flags of cubes that changed since the last step, when regridding */
+  adios_define_var(nfo->gid, "changed", "", adios_unsigned_byte, "cncubes", "ncubes", "cstartcubes");
+
+  /* Explicit geometry: points, and hexahedra of 8 global point indices */
+  if(geometry == GEOM_EXPLICIT) {
+    adios_define_var(nfo->gid, "points", "", adios_real, "cnpoints,3", "npoints,3", "cstart,0");
+    adios_define_var(nfo->gid, "conn", "", adios_unsigned_long, "cncubes,8", "ncubes,8", "cstartcubes,0");
+  }
 }    
 
 void adiosamr_addxvar(struct adiosamrinfo *nfo, char *varname) {
@@ -44,7 +79,9 @@ void adiosamr_addxvar(struct adiosamrinfo *nfo, char *varname) {
   adios_define_var(nfo->gid, varname, "", adios_real, "cnpoints", "npoints", "cstart");
 }
 
-void adiosamr_write(struct adiosamrinfo *nfo, int tstep, uint64_t cnpoints, float *points, float **xvals) {
+void adiosamr_write(struct adiosamrinfo *nfo, char *dir, int tstep, uint64_t cnpoints,
+		    float *points, uint64_t cncubes, uint64_t *keys, uint64_t *conn,
+		    unsigned char *changed, uint64_t *levelcounts, float **xvals) {
   char fname[fnstrmax+1];
   int timedigits = 4;
   uint64_t groupsize, totalsize;
@@ -52,12 +89,23 @@ void adiosamr_write(struct adiosamrinfo *nfo, int tstep, uint64_t cnpoints, floa
   int ret;
   int bufneeded;
   uint64_t i, totalpoints,  cstart, *npts_all;
+  uint64_t totalcubes, cstartcubes;
+  uint64_t *hconn = NULL;
+  int nlevels = nfo->maxlevel+1;
   
 
   /* numCoords = npoints * 8; */
   groupsize = sizeof(int) * 2 /*rank-numtask*/ +
     sizeof(uint64_t)*3 /*cnpoints-cstart*/ +
-    sizeof(float)*cnpoints*nfo->numxvars; /*xvars*/ 
+    sizeof(float)*cnpoints*nfo->numxvars /*xvars*/ +
+    sizeof(int) + sizeof(float)*3 /*maxlevel-deltas*/ +
+    sizeof(uint64_t)*3 /*cncubes-cstartcubes*/ +
+    sizeof(uint64_t)*cncubes /*keys*/ +
+    sizeof(int)*2 + sizeof(uint64_t)*nlevels; /*nwriters-cnlevelcubes*/
+  if(changed)
+    groupsize += cncubes; /*changed*/
+  if(nfo->geometry == GEOM_EXPLICIT)
+    groupsize += sizeof(float)*cnpoints*3 + sizeof(uint64_t)*cncubes*8; /*points-conn*/
 
   /* Allocate buffer large enough for all data to write, if not done already */
   bufneeded = (int)(groupsize/(1024*1024));
@@ -75,10 +123,16 @@ void adiosamr_write(struct adiosamrinfo *nfo, int tstep, uint64_t cnpoints, floa
       totalpoints += npts_all[i];
   for(cstart = 0, i = 0; i < nfo->rank; ++i)
       cstart += npts_all[i];
+  MPI_Allgather(&cncubes, 1, MPI_UNSIGNED_LONG_LONG,
+                npts_all, 1, MPI_UNSIGNED_LONG_LONG, nfo->comm);
+  for(totalcubes = 0, i = 0; i < nfo->nprocs; ++i)
+      totalcubes += npts_all[i];
+  for(cstartcubes = 0, i = 0; i < nfo->rank; ++i)
+      cstartcubes += npts_all[i];
   free(npts_all);
 
   /* Set filename */
-  snprintf(fname, fnstrmax, "%s.%0*d.bp", nfo->name, timedigits, tstep);
+  snprintf(fname, fnstrmax, "%s/%s.%0*d.bp", dir, nfo->name, timedigits, tstep);
 
   /* Open & Write */
   ret = adios_open(&handle, nfo->name, fname, "w", nfo->comm);
@@ -93,10 +147,27 @@ void adiosamr_write(struct adiosamrinfo *nfo, int tstep, uint64_t cnpoints, floa
   adios_write(handle, "cnpoints", &cnpoints);
   adios_write(handle, "npoints", &totalpoints);
   adios_write(handle, "cstart", &cstart);
+  adios_write(handle, "maxlevel", &nfo->maxlevel);
+  adios_write(handle, "deltas", nfo->deltas);
+  adios_write(handle, "cncubes", &cncubes);
+  adios_write(handle, "ncubes", &totalcubes);
+  adios_write(handle, "cstartcubes", &cstartcubes);
+  adios_write(handle, "keys", keys);
+  adios_write(handle, "nwriters", &nfo->nprocs);
+  adios_write(handle, "nlevels", &nlevels);
+  adios_write(handle, "cnlevelcubes", levelcounts);
+  if(changed)
+    adios_write(handle, "changed", changed);
+  if(nfo->geometry == GEOM_EXPLICIT) {
+    hconn = cubeshexconn(cncubes, conn, cstart);
+    adios_write(handle, "points", points);
+    adios_write(handle, "conn", hconn);
+  }
   for(i = 0; i < nfo->numxvars; i++){
     adios_write(handle, nfo->xvarnames[i], xvals[i]);
   }
   adios_close(handle);
+  free(hconn);
   
 }
 
@@ -12,6 +12,11 @@ struct adiosamrinfo {
   int rank;
   int nprocs;
   int tsteps;
+
+  int geometry;          /* GEOM_COMPACT or GEOM_EXPLICIT */
+  int output;            /* OUTPUT_ALLNODES and OUTPUT_BYLEVEL flags */
+  int maxlevel;          /* Needed with deltas to decode cube keys */
+  float deltas[3];
   
   int numxvars;
   int maxxvars;
@@ -22,10 +27,13 @@ struct adiosamrinfo {
   int64_t gid;
 };
 
-void adiosamr_init(struct adiosamrinfo *nfo, char *method, char *name, MPI_Comm comm, int rank, int nprocs, int tsteps);
+void adiosamr_init(struct adiosamrinfo *nfo, char *method, char *name, MPI_Comm comm, int rank, int nprocs, int tsteps,
+		   int maxlevel, float deltax, float deltay, float deltaz, int geometry, int output);
 
 void adiosamr_addxvar(struct adiosamrinfo *nfo, char *varname);
 
-void adiosamr_write(struct adiosamrinfo *nfo, int tstep, uint64_t cnpoints, float *points, float **xvals);
+void adiosamr_write(struct adiosamrinfo *nfo, char *dir, int tstep, uint64_t cnpoints,
+		    float *points, uint64_t cncubes, uint64_t *keys, uint64_t *conn,
+		    unsigned char *changed, uint64_t *levelcounts, float **xvals);
   
 void adiosamr_finalize(struct adiosamrinfo *nfo);
@@ -5,11 +5,21 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <strings.h>
 #include <mpi.h>
 #include "open-simplex-noise.h"
 #include "cubes.h"
+#include "patches.h"
+#include "balance.h"
 #include "timer.h"
+#include "asyncout.h"
+#include "bbuf.h"
+
+#ifdef HAS_OPENMP
+#  include "parrefine.h"
+#endif
 
 #ifdef HAS_VTKOUT
 #include "vtkout.h"
@@ -26,17 +36,204 @@
 
 void print_usage(int rank, const char *errstr);
 
+/* Print the spread of cube counts over ranks with the timer statistics */
+static void printcubestats(uint64_t ncubes, MPI_Comm comm, int rank, char *prefix) {
+  struct timer_statinfo stats;
+
+  timer_collectstats((double)ncubes, comm, 0, &stats);
+  if (rank == 0)
+    printf("%s cubes per rank mean = %.0f, min = %.0f, max = %.0f, std = %.1f, imbalance (max/mean) = %.2f\n",
+	   prefix, stats.mean, stats.min, stats.max, stats.std, stats.mean > 0 ? stats.max/stats.mean : 0.);
+}
+
+/* Print how many cubes a regrid changed, over all ranks */
+static void printchangedstats(cubeInfo *cubes, MPI_Comm comm, int rank) {
+  uint64_t c, counts[2], totals[2];
+
+  counts[0] = cubes->ncubes;
+  counts[1] = 0;
+  for (c = 0; c < cubes->ncubes; c++)
+    counts[1] += cubes->changed[c];
+  MPI_Reduce(counts, totals, 2, MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, comm);
+  if (rank == 0)
+    printf("      Regrid: Cubes = %llu, Changed = %llu (%.1f%%)\n",
+	   (unsigned long long)totals[0], (unsigned long long)totals[1],
+	   totals[0] ? 100.*totals[1]/totals[0] : 0.);
+}
+
+/* Print the cubes at each level, over all ranks */
+static void printlevelstats(uint64_t *levelcounts, int nlevels, MPI_Comm comm, int rank) {
+  uint64_t *totals = (uint64_t *) malloc(nlevels*sizeof(uint64_t));
+  int l;
+
+  MPI_Reduce(levelcounts, totals, nlevels, MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, comm);
+  if (rank == 0) {
+    printf("      Cubes per level =");
+    for (l = 0; l < nlevels; l++)
+      printf(" %llu", (unsigned long long)totals[l]);
+    printf("\n");
+  }
+  free(totals);
+}
+
+/* Compare a regrid with refining the base blocks again, cubes per level over
+ * all ranks; aborts if they differ */
+static void checkregrid(cubeInfo *regridded, cubeInfo *rebuilt, int nlevels, MPI_Comm comm,
+			int rank) {
+  uint64_t *counts = (uint64_t *) malloc(2*nlevels*sizeof(uint64_t));
+  uint64_t totals[2] = { 0, 0 };
+  int l, same = 1;
+
+  cubeslevelcounts(regridded, counts);
+  cubeslevelcounts(rebuilt, counts + nlevels);
+  MPI_Allreduce(MPI_IN_PLACE, counts, 2*nlevels, MPI_UNSIGNED_LONG_LONG, MPI_SUM, comm);
+  for (l = 0; l < nlevels; l++) {
+    totals[0] += counts[l];
+    totals[1] += counts[nlevels+l];
+    same = same && counts[l] == counts[nlevels+l];
+  }
+  if (rank == 0)
+    printf("      Regrid check: Cubes = %llu, Rebuilt = %llu%s\n", (unsigned long long)totals[0],
+	   (unsigned long long)totals[1], same ? "" : " MISMATCH");
+  free(counts);
+  if (!same)
+    MPI_Abort(comm, 1);
+}
+
+/* Compare (key, block) pairs by key */
+static int cmpblockkeys(const void *a, const void *b) {
+  uint64_t ka = *(const uint64_t *)a, kb = *(const uint64_t *)b;
+  return (ka > kb) - (ka < kb);
+}
+
+#ifndef HAS_OPENMP
+/* Refine the base blocks of this rank, in blockorder if not NULL */
+static void refinebase(cubeInfo *cubes, stack *octStack, int t, float thres, int *blockorder,
+		       int cni, int cnj, int cnk, int is, int js, int ks, float xs, float ys,
+		       float zs, float deltax, float deltay, float deltaz, struct osn_context *osn,
+		       int maxLevel, int debug) {
+  size_t ii;     /* data index */
+  int block_id, i, j, k;
+  float x, y, z;
+
+  for(ii = 0; ii < (size_t)cni*cnj*cnk; ii++) {
+
+    /* calculate block_id */
+    block_id = blockorder ? blockorder[ii] : ii;
+    i = block_id % cni;
+    j = (block_id / cni) % cnj;
+    k = block_id / (cni*cnj);
+    x = xs + i*deltax;
+    y = ys + j*deltay;
+    z = zs + k*deltaz;
+
+    if (debug) {
+      printf("Start from main Block_id=%d\n", block_id+1);
+    }
+    refine(cubes, octStack, t, (block_id+1), thres, 0, is+i, js+j, ks+k, x, y, z, deltax, deltay, deltaz, osn, maxLevel);
+  }
+}
+#endif
+
+/* What the output writes a time step from, so that it can run in the
+ * background while the next time step computes */
+struct amrout {
+  MPI_Comm iocomm;          /* Communicator and rank the output is written with */
+  int rank, iorank, nprocs;
+  int tt;
+  int debug;
+  int regrid;
+  cubeInfo *cubes;
+  uint64_t *levelcounts;
+  patchInfo *patches;       /* NULL if not --patches */
+#ifdef HAS_VTKOUT
+  int vtkout;
+#endif
+#ifdef HAS_ADIOS
+  struct adiosamrinfo *adiosamr_nfo;
+#endif
+#ifdef HAS_HDF5
+  struct hdf5amrinfo *hdf5amr_nfo;
+  int hdf5out;
+#endif
+  struct bbuf *bb;          /* Stage of the output, if --stagedir */
+};
+
+/* Write a time step's output, for asyncout */
+static void writeout(void *arg) {
+  struct amrout *o = (struct amrout *)arg;
+
+  bbuf_begin(o->bb);
+
+#ifdef HAS_VTKOUT 
+  if(o->vtkout) {
+    if(o->rank == 0) {
+      printf("      Writing VTK ...\n");   fflush(stdout);
+    }
+    writepvtu(bbuf_dir(o->bb), bbuf_mkdirs(o->bb), "amr", o->iocomm, o->iorank, o->nprocs,
+	      o->tt, o->cubes->npoints, o->cubes->ncubes, o->cubes->points, o->cubes->conn,
+	      o->cubes->data, "data", o->debug);
+  }
+#endif
+
+#ifdef HAS_ADIOS
+  if(o->rank == 0) {
+    printf("      Writing ADIOS ...\n");   fflush(stdout);
+  }
+  adiosamr_write(o->adiosamr_nfo, bbuf_dir(o->bb), o->tt, o->cubes->npoints,
+		 o->cubes->points, o->cubes->ncubes, o->cubes->keys, o->cubes->conn,
+		 o->regrid ? o->cubes->changed : NULL, o->levelcounts, &o->cubes->data);
+#endif
+
+#ifdef HAS_HDF5
+  if(o->hdf5out) {
+    if(o->rank == 0) {
+      printf("      Writing HDF5 ...\n");   fflush(stdout);
+    }
+    if (o->patches)
+      hdf5_writepatches(o->hdf5amr_nfo, bbuf_dir(o->bb), o->tt, o->patches);
+    else
+      hdf5_write(o->hdf5amr_nfo, bbuf_dir(o->bb), o->tt, o->cubes->npoints,
+		 o->cubes->points, o->cubes->ncubes, o->cubes->keys, o->cubes->conn,
+		 o->regrid ? o->cubes->changed : NULL, o->levelcounts, &o->cubes->data);
+  }
+#endif
+
+  bbuf_end(o->bb);
+}
+
 
 int main(int argc, char **argv) {
   int debug=0;
-  int i, j, k, a, block_id, t;  /* loop indices */
+  int i, j, k, a, t;  /* loop indices */
   int tt;                        /* Actual time step from tstart */
-  float x, y, z;
   int tstart = 0;
   int nt = 50;                   /* Number of time steps */
   float deltax, deltay, deltaz;
   int maxLevel = 4;
   float threshold=0.0;
+  int dedup = 0;            /* Share vertices between neighboring cubes */
+  int sortkeys = 0;         /* Refine blocks in key order */
+  int *blockorder = NULL;   /* Order to refine local blocks in */
+  int patches = 0;          /* Cluster cubes into per-level patches */
+  float patcheff = 0.7;     /* Minimum fraction of patch cells that are cubes */
+  patchInfo patchdata[2];   /* Built into alternately with --async */
+  int curpatch = 0;
+  stack octStack;           /* Refinement stack, reused for all blocks */
+#if defined(HAS_HDF5) || defined(HAS_ADIOS)
+  int geometry = GEOM_COMPACT;  /* Cube geometry written by HDF5 and ADIOS */
+#endif
+  int output = 0;           /* OUTPUT_ALLNODES and OUTPUT_BYLEVEL flags */
+  uint64_t *levelcounts;    /* Cubes at each level */
+  int regrid = 0;           /* Regrid from the last step's cubes */
+  int regridcheck = 0;      /* Also refine from scratch and compare */
+  cubeInfo checkcubes;
+  uint64_t *oldkeys = NULL; /* Keys of the last step's cubes */
+  uint64_t noldcubes = 0;
+  int balance = 0;          /* Repartition cubes along the curve each step */
+  balanceInfo balancedata;
+  MPI_Comm iocomm;          /* Communicator and rank the output is written with */
+  int iorank;
   int inp = 0;              /* Number of tasks in i */
   int jnp = 0;              /* Number of tasks in j */
   int knp = 0;              /* Number of tasks in k */
@@ -46,11 +243,24 @@ int main(int argc, char **argv) {
   cubeInfo cubedata;
   struct osn_context *simpnoise;    /* Open simplex noise context */
   double computetime, outtime;   /* Timers */
+  double patchtime = 0., balancetime;
+  int async = 0;            /* Write output in the background */
+  struct asyncout aout;     /* Background output context */
+  struct amrout out;        /* What the output writes from */
+  cubeInfo outcubes;        /* Snapshot of the cubes with --async */
+  char *stagedir = NULL;    /* Burst buffer stage of the output */
+  int drainthreads = 1;
+  int sharedfiles = 0;      /* Some output is one file from all ranks */
+  struct bbuf bb;           /* Stage and drain context */
+#ifdef HAS_OPENMP
+  refinePool refinepool;
+#endif
   
   /* MPI vars */
   MPI_Comm comm = MPI_COMM_WORLD;
   int cprocs[3], cpers[3], crnk[3];  /* MPI Cartesian info */
   int rank, nprocs; 
+  int provided;        /* MPI thread support */
   int cni, cnj, cnk;   /* Points in this task */
   int is, js, ks;      /* Global index starting points */
   float xs, ys, zs;    /* Global coordinate starting points */
@@ -70,7 +280,8 @@ int main(int argc, char **argv) {
   int hdf5out = 0;
 #endif
   
-  MPI_Init(&argc, &argv);
+  /* Threads for --async */
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &provided);
   MPI_Comm_rank(comm, &rank);
   MPI_Comm_size(comm, &nprocs);
   
@@ -94,6 +305,52 @@ int main(int argc, char **argv) {
       tstart = atoi(argv[++a]);
     }else if(!strcasecmp(argv[a], "--debug")) {
       debug = 1;
+    }else if(!strcasecmp(argv[a], "--dedup")) {
+      dedup = 1;
+    }else if(!strcasecmp(argv[a], "--sortkeys")) {
+      sortkeys = 1;
+#if defined(HAS_HDF5) || defined(HAS_ADIOS)
+    }else if(!strcasecmp(argv[a], "--geometry")) {
+      a++;
+      if(!strcasecmp(argv[a], "explicit")) {
+	geometry = GEOM_EXPLICIT;
+      } else if(!strcasecmp(argv[a], "compact")) {
+	geometry = GEOM_COMPACT;
+      } else {
+	if(rank == 0)   fprintf(stderr, "Geometry not recognized: %s\n\n", argv[a]);
+	print_usage(rank, NULL);
+	MPI_Abort(comm, 1);
+      }
+#endif
+    }else if(!strcasecmp(argv[a], "--output")) {
+      a++;
+      if(!strcasecmp(argv[a], "all")) {
+	output |= OUTPUT_ALLNODES;
+      } else if(!strcasecmp(argv[a], "leaves")) {
+	output &= ~OUTPUT_ALLNODES;
+      } else {
+	if(rank == 0)   fprintf(stderr, "Output not recognized: %s\n\n", argv[a]);
+	print_usage(rank, NULL);
+	MPI_Abort(comm, 1);
+      }
+    }else if(!strcasecmp(argv[a], "--bylevel")) {
+      output |= OUTPUT_BYLEVEL;
+    }else if(!strcasecmp(argv[a], "--regrid")) {
+      regrid = 1;
+    }else if(!strcasecmp(argv[a], "--regridcheck")) {
+      regrid = regridcheck = 1;
+    }else if(!strcasecmp(argv[a], "--balance")) {
+      balance = 1;
+    }else if(!strcasecmp(argv[a], "--patches")) {
+      patches = 1;
+    }else if(!strcasecmp(argv[a], "--patcheff")) {
+      patcheff = strtof(argv[++a], NULL);
+    }else if(!strcasecmp(argv[a], "--async")) {
+      async = 1;
+    }else if(!strcasecmp(argv[a], "--stagedir")) {
+      stagedir = argv[++a];
+    }else if(!strcasecmp(argv[a], "--drainthreads")) {
+      drainthreads = atoi(argv[++a]);
     }else if(!strcasecmp(argv[a], "--hdf5")) {
 #ifdef HAS_HDF5
       hdf5out = 1;
@@ -150,6 +407,35 @@ int main(int argc, char **argv) {
     print_usage(rank, "Error: number of timesteps not specified or incorrect");
     MPI_Abort(comm, 1);
   }
+
+  if (patcheff <= 0 || patcheff > 1) {
+    print_usage(rank, "Error: patch efficiency must be > 0 and <= 1");
+    MPI_Abort(comm, 1);
+  }
+
+  if (regrid && (output & OUTPUT_ALLNODES)) {
+    print_usage(rank, "Error: --regrid needs leaf cubes; it can not be used with --output all");
+    MPI_Abort(comm, 1);
+  }
+
+#if defined(HAS_HDF5) || defined(HAS_ADIOS)
+  /* Shared points map to their cubes only through the connectivity, so
+   * --dedup output always has the explicit geometry */
+  if (dedup)
+    geometry = GEOM_EXPLICIT;
+#endif
+
+  /* Cube keys pack finest cell coordinates in KEYAXISBITS per axis, which
+   * also keeps the --dedup lattice (half cells) within its 21 bits */
+  {
+    int nmax = ni > nj ? ni : nj;
+    if(nk > nmax)  nmax = nk;
+    if(maxLevel >= (1 << KEYLEVELBITS) ||
+       ((uint64_t)(nmax-1) << maxLevel) >= ((uint64_t)1 << KEYAXISBITS)) {
+      print_usage(rank, "Error: size and levels are too large for cube keys; need (N-1)*2^L < 2^19");
+      MPI_Abort(comm, 1);
+    }
+  }
   
   /* Set up Cartesian communicator */
   cprocs[0] = inp;  cprocs[1] = jnp;  cprocs[2] = knp;
@@ -177,30 +463,112 @@ int main(int argc, char **argv) {
   open_simplex_noise(12345, &simpnoise);   /* Fixed seed, for now */
 
   /* Allocate arrays */
-  cubesinit(&cubedata, cni*cnj*cnk, maxLevel, debug);
+  cubesinit(&cubedata, cni*cnj*cnk, maxLevel, dedup, debug);
+  if (regridcheck)
+    cubesinit(&checkcubes, cni*cnj*cnk, maxLevel, dedup, 0);
+  cubedata.allnodes = output & OUTPUT_ALLNODES;
+  levelcounts = (uint64_t *) malloc((maxLevel+1)*sizeof(uint64_t));
+  stack_new(&octStack, 8*(maxLevel+1), debug);
+#ifdef HAS_OPENMP
+  refinepoolinit(&refinepool, cni*cnj*cnk, maxLevel, dedup, debug);
+#endif
+
+  /* Balanced output is written in the ranks' domain origin key order */
+  iocomm = comm;
+  iorank = rank;
+  if (balance) {
+    balanceinit(&balancedata, comm, cubekey((uint64_t)is << maxLevel, (uint64_t)js << maxLevel,
+					    (uint64_t)ks << maxLevel, 0),
+		(uint64_t)cni*cnj*cnk << 3*maxLevel);
+    iocomm = balancedata.comm;
+    iorank = balancedata.rank;
+  }
+
+  /* Output context; in the background, the writers have their own
+   * communicator, a snapshot of the cubes, and the other patch buffer */
+  asyncout_init(&aout, comm, async);
+  out.rank = rank;
+  out.iorank = iorank;
+  out.nprocs = nprocs;
+  out.debug = debug;
+  out.regrid = regrid;
+  out.patches = NULL;
+  if (aout.enabled) {
+    MPI_Comm_dup(iocomm, &out.iocomm);
+    memset(&outcubes, 0, sizeof(cubeInfo));
+    out.cubes = &outcubes;
+    out.levelcounts = (uint64_t *) malloc((maxLevel+1)*sizeof(uint64_t));
+  } else {
+    out.iocomm = iocomm;
+    out.cubes = &cubedata;
+    out.levelcounts = levelcounts;
+  }
+  if (patches) {
+    patchesinit(&patchdata[0], maxLevel, patcheff, debug);
+    if (aout.enabled)
+      patchesinit(&patchdata[1], maxLevel, patcheff, debug);
+  }
+#ifdef HAS_VTKOUT
+  out.vtkout = vtkout;
+#endif
+
+  /* Blocks refined in key order leave the cubes sorted by key */
+  if (sortkeys) {
+    uint64_t *blockkeys = (uint64_t *) malloc((size_t)cni*cnj*cnk*2*sizeof(uint64_t));
+
+    blockorder = (int *) malloc((size_t)cni*cnj*cnk*sizeof(int));
+    for(k = 0, a = 0; k < cnk; k++)
+      for(j = 0; j < cnj; j++)
+	for(i = 0; i < cni; i++, a++) {
+	  blockkeys[2*a] = cubekey((uint64_t)(is+i) << maxLevel, (uint64_t)(js+j) << maxLevel,
+				   (uint64_t)(ks+k) << maxLevel, 0);
+	  blockkeys[2*a+1] = a;
+	}
+    qsort(blockkeys, cni*cnj*cnk, 2*sizeof(uint64_t), cmpblockkeys);
+    for(a = 0; a < cni*cnj*cnk; a++)
+      blockorder[a] = blockkeys[2*a+1];
+    free(blockkeys);
+  }
   
   /* init ADIOS */
 #ifdef HAS_ADIOS
-  adiosamr_init(&adiosamr_nfo, adios_method, adios_groupname, comm, rank, nprocs, nt);
+  adiosamr_init(&adiosamr_nfo, adios_method, adios_groupname, out.iocomm, iorank, nprocs, nt,
+		maxLevel, deltax, deltay, deltaz, geometry, output);
   adiosamr_addxvar(&adiosamr_nfo, "data");
+  out.adiosamr_nfo = &adiosamr_nfo;
+  sharedfiles = 1;
 #endif
 
 #ifdef HAS_HDF5
   if(hdf5out) {
-    hdf5_init(&hdf5amr_nfo, hdf5_groupname, comm, rank, nprocs, nt);
+    hdf5_init(&hdf5amr_nfo, hdf5_groupname, out.iocomm, iorank, nprocs, nt,
+	      maxLevel, deltax, deltay, deltaz, geometry, output);
     hdf5_addxvar(&hdf5amr_nfo, "data");
   }
+  out.hdf5amr_nfo = &hdf5amr_nfo;
+  out.hdf5out = hdf5out;
+  sharedfiles = sharedfiles || hdf5out;
 #endif
 
+  /* Stage the output for a background drain */
+  bbuf_init(&bb, comm, stagedir, drainthreads, sharedfiles);
+  out.bb = &bb;
+
   if (debug) {
     printf("(cni=%d, cnj=%d, cnk=%d) \n", cni, cnj, cnk);
   }
   
   for(t = 0, tt = tstart; t < nt; t++, tt++) {
-    size_t ii;     /* data index */
+    int regridstep = regrid && t > 0;
+
+    /* Keep the last step's cubes to regrid from */
+    if (regridstep) {
+      oldkeys = (uint64_t *) realloc(oldkeys, (cubedata.ncubes ? cubedata.ncubes : 1)*sizeof(uint64_t));
+      memcpy(oldkeys, cubedata.keys, cubedata.ncubes*sizeof(uint64_t));
+      noldcubes = cubedata.ncubes;
+    }
     
-    cubedata.npoints = 0;
-    cubedata.ncubes = 0;
+    cubesreset(&cubedata);
 
     
     if (debug) {
@@ -209,27 +577,19 @@ int main(int argc, char **argv) {
 
     timer_tick(&computetime, comm, 1);
    
-    z = zs;
-    for(k = 0, ii = 0; k < cnk; k++) {
-      y = ys;
-      for(j = 0; j < cnj; j++) {
-	x = xs;
-	for(i = 0; i < cni; i++, ii++) {
-
-	  /* calculate block_id */
-	  block_id = ii;
-
-	  if (debug) {
-	    printf("Start from main Block_id=%d\n", block_id+1);
-	  }
-	  refine(&cubedata, tt, (block_id+1), threshold, 0, x, y, z, deltax, deltay, deltaz, simpnoise, maxLevel);
-	
-	  x += deltax;
-	}
-	y += deltay;
-      }
-      z += deltaz;
-    }	
+    if (regridstep) {
+      cubesregrid(&cubedata, &octStack, noldcubes, oldkeys, tt, threshold, deltax, deltay, deltaz,
+		  simpnoise, maxLevel);
+    } else {
+#ifdef HAS_OPENMP
+      refineblocks(&refinepool, &cubedata, tt, threshold, blockorder, cni, cnj, cnk, is, js, ks,
+		   xs, ys, zs, deltax, deltay, deltaz, simpnoise, maxLevel);
+#else
+      refinebase(&cubedata, &octStack, tt, threshold, blockorder, cni, cnj, cnk, is, js, ks,
+		 xs, ys, zs, deltax, deltay, deltaz, simpnoise, maxLevel, debug);
+#endif
+      memset(cubedata.changed, 1, cubedata.ncubes);
+    }
 
     timer_tock(&computetime);
     
@@ -237,42 +597,77 @@ int main(int argc, char **argv) {
     if (debug)  {
       cubeprint(&cubedata);
     }
+    if (dedup)
+      cubesprintstats(&cubedata, comm, rank);
+    if (regridstep)
+      printchangedstats(&cubedata, comm, rank);
+
+    /* Refine the base blocks again too, and check the regrid gave the same */
+    if (regridcheck && regridstep) {
+      cubesreset(&checkcubes);
+#ifdef HAS_OPENMP
+      refineblocks(&refinepool, &checkcubes, tt, threshold, blockorder, cni, cnj, cnk, is, js, ks,
+		   xs, ys, zs, deltax, deltay, deltaz, simpnoise, maxLevel);
+#else
+      refinebase(&checkcubes, &octStack, tt, threshold, blockorder, cni, cnj, cnk, is, js, ks,
+		 xs, ys, zs, deltax, deltay, deltaz, simpnoise, maxLevel, 0);
+#endif
+      checkregrid(&cubedata, &checkcubes, maxLevel+1, comm, rank);
+    }
 
+    if (balance) {
+      printcubestats(cubedata.ncubes, comm, rank, "      Before balance");
+      timer_tick(&balancetime, comm, 1);
+      balancecubes(&balancedata, &cubedata, deltax, deltay, deltaz);
+      timer_tock(&balancetime);
+      printcubestats(cubedata.ncubes, comm, rank, "      After balance");
+    }
 
-#ifdef HAS_VTKOUT 
-    if(vtkout) {
-      if(rank == 0) {
-	printf("      Writing VTK ...\n");   fflush(stdout);
-      }
-      writevtk("amr", comm, rank, nprocs, tt, cubedata.npoints, cubedata.ncubes,
-	       cubedata.points, cubedata.data, "data", debug);
+    /* Write each level contiguously, coarsest first */
+    if (output & OUTPUT_BYLEVEL)
+      cubesbylevel(&cubedata);
+    cubeslevelcounts(&cubedata, levelcounts);
+    if (output)
+      printlevelstats(levelcounts, maxLevel+1, comm, rank);
+
+    /* The patches the last output may still be writing are the other buffer */
+    if (patches) {
+      timer_tick(&patchtime, comm, 1);
+      patchesbuild(&patchdata[curpatch], &cubedata, tt, deltax, deltay, deltaz, simpnoise);
+      timer_tock(&patchtime);
+      patchesprintstats(&patchdata[curpatch], &cubedata, comm, rank);
     }
-#endif
 
+    /* Snapshot what the last output is done with, and hand it off */
     timer_tick(&outtime, comm, 1);
-    
-#ifdef HAS_ADIOS
-      if(rank == 0) {
-	printf("      Writing ADIOS ...\n");   fflush(stdout);
-      }
-    adiosamr_write(&adiosamr_nfo, tt, cubedata.npoints, cubedata.points, &cubedata.data);
-#endif
-
-#ifdef HAS_HDF5
-    if(hdf5out) {
-      if(rank == 0) {
-	printf("      Writing HDF5 ...\n");   fflush(stdout);
-      }
-      hdf5_write(&hdf5amr_nfo, tt, cubedata.npoints, cubedata.points, &cubedata.data);
+    asyncout_wait(&aout);
+    out.tt = tt;
+    if (aout.enabled) {
+      cubescopy(&outcubes, &cubedata);
+      memcpy(out.levelcounts, levelcounts, (maxLevel+1)*sizeof(uint64_t));
     }
-#endif
-
-    
+    if (patches) {
+      out.patches = &patchdata[curpatch];
+      if (aout.enabled)
+	curpatch = !curpatch;
+    }
+    asyncout_post(&aout, writeout, &out);
     timer_tock(&outtime);
-    timer_collectprintstats(computetime, comm, 0, "   Compute");
-    timer_collectprintstats(outtime, comm, 0, "   Output");
+    timer_collectprintstats(computetime, comm, 0, regridstep ? "   Regrid" : "   Compute");
+    if (balance)
+      timer_collectprintstats(balancetime, comm, 0, "   Balance");
+    if (patches)
+      timer_collectprintstats(patchtime, comm, 0, "   Patches");
+    asyncout_printstats(&aout, outtime, comm);
+    bbuf_printstats(&bb);
   }
 
+  /* The last time step's output has nothing to hide behind */
+  asyncout_finalize(&aout);
+  if (aout.enabled)
+    timer_collectprintstats(aout.waittime, comm, 0, "   OutputDrain");
+  bbuf_finalize(&bb);
+
    
   if (debug) 
     printf("Finalizing:rank %d \n", rank);
@@ -290,6 +685,27 @@ int main(int argc, char **argv) {
 
   open_simplex_noise_free(simpnoise);
   cubesfree(&cubedata);
+  if (regridcheck)
+    cubesfree(&checkcubes);
+  stack_delete(&octStack);
+#ifdef HAS_OPENMP
+  refinepoolfree(&refinepool);
+#endif
+  free(oldkeys);
+  free(levelcounts);
+  if (patches) {
+    patchesfree(&patchdata[0]);
+    if (aout.enabled)
+      patchesfree(&patchdata[1]);
+  }
+  if (aout.enabled) {
+    MPI_Comm_free(&out.iocomm);
+    cubesfree(&outcubes);
+    free(out.levelcounts);
+  }
+  if (balance)
+    balancefree(&balancedata);
+  free(blockorder);
   MPI_Finalize();
 
   return 0;
@@ -315,16 +731,47 @@ void print_usage(int rank, const char *errstr)
 	  "      NI, NJ, NK : Number of grid points along the I,J,K axes respectively\n\n"
 	  "  Optional:\n"
 	  "    --debug: Turns on debugging statements \n"
+	  "    --dedup: Share points between neighboring cubes; writes unique points\n"
+	  "      and 8 point indices per cube, and evaluates noise once per point\n"
+	  "    --sortkeys: Refine blocks in octree key (Morton) order so cubes are\n"
+	  "      written sorted by key\n"
+#if defined(HAS_HDF5) || defined(HAS_ADIOS)
+	  "    --geometry G : Cube geometry written by HDF5 and ADIOS; Default: compact\n"
+	  "      compact : octree key per cube (lowest corner and level)\n"
+	  "      explicit : also points and hexahedron connectivity, and XDMF for HDF5;\n"
+	  "        always with --dedup, whose points need the connectivity\n"
+#endif
+	  "    --output O : Cubes to write; Default: leaves\n"
+	  "      leaves : the leaves of the octree only\n"
+	  "      all : every octree node, each split cube just before its children\n"
+	  "    --bylevel: Write the cubes of each level contiguously, coarsest first; HDF5\n"
+	  "      groups each level over all ranks.  Per-level counts are written either way\n"
+	  "    --regrid: After the first step, regrid from the last step's cubes instead of\n"
+	  "      refining the base blocks again: cubes split and coarsen as needed, to the\n"
+	  "      same cubes; changed cubes are flagged in the HDF5/ADIOS output\n"
+	  "    --regridcheck: --regrid, and refine the base blocks again too each step to\n"
+	  "      check that the cubes per level are the same; aborts if not\n"
+	  "    --balance: Repartition cubes each step along the Morton curve, so each rank\n"
+	  "      has and writes an equal share\n"
+	  "    --patches: Cluster cubes into rectangular patches per level (Berger-Rigoutsos)\n"
+	  "      and sample the field on the patch nodes; HDF5 output writes the patches\n"
+	  "    --patcheff E : Minimum fraction of patch cells that are cubes; valid values\n"
+	  "      are > 0 and <= 1; Default: 0.7\n"
 	  "    --threshold T : Mask theshold; valid values are floats between -1.0 and 1.0 \n"
 	  "      T : threshold value; Default: 0.0\n"
 	  "    --levels L : Maximum levels of refinement; valid values are >= 0 \n"
 	  "      L : max refinmentment levels value; Default: 8\n"
 	  "    --tsteps NT : Number of time steps; valid values are > 0;  Default:  50)\n"
 	  "    --tstart TS : Starting time step; valid values are > 0;  Default: 0\n"
+	  "    --async : Write each time step's output in a background thread while the\n"
+	  "      next one computes\n"
+	  "    --stagedir DIR : Write the output to DIR, such as node-local NVMe, and drain\n"
+	  "      it to the current directory in background threads\n"
+	  "    --drainthreads N : Threads draining the stage of each node; Default: 1\n"
 	  );
 
 #ifdef HAS_VTKOUT
-    fprintf(stderr, "    --vtkout : Enable VTK output.\n");
+    fprintf(stderr, "    --vtkout : Enable VTK output; a binary .vtu piece per rank and a .pvtu index.\n");
 #endif
     
   /*## End of Output Module Usage Strings ##*/
@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) DoD HPCMP PETTT.  All rights reserved.
+ * See LICENSE file for details.
+ */
+
+/* Space filling curve repartitioning of the cubes.  Ranks are ordered by the
+ * Morton key of their domain's lowest corner, and each rank sorts its cubes
+ * by key.  An exclusive scan of the cube counts gives each cube its place in
+ * that order (rank, then key), which is cut into equal contiguous pieces, one
+ * per rank, and the cubes (key, corner values and changed flag) move there
+ * with MPI_Alltoallv.  The order is the Morton curve only when the rank domains do
+ * not interleave on it, as with power of 2 tasks per axis; otherwise it is
+ * still a contiguous cut of each rank's sorted keys. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "cubes.h"
+#include "balance.h"
+
+/* Compare (key, index) pairs by key */
+static int cmpkeys(const void *a, const void *b) {
+  uint64_t ka = *(const uint64_t *)a, kb = *(const uint64_t *)b;
+  return (ka > kb) - (ka < kb);
+}
+
+void balanceinit(balanceInfo *nfo, MPI_Comm comm, uint64_t originkey, uint64_t maxcubes) {
+  int rank, nprocs, i, pos;
+  uint64_t *origins;
+
+  MPI_Comm_rank(comm, &rank);
+  MPI_Comm_size(comm, &nprocs);
+
+  /* Position of this rank by the key of its domain's lowest corner */
+  origins = (uint64_t *) malloc(nprocs*sizeof(uint64_t));
+  MPI_Allgather(&originkey, 1, MPI_UNSIGNED_LONG_LONG, origins, 1, MPI_UNSIGNED_LONG_LONG, comm);
+  for (pos = 0, i = 0; i < nprocs; i++)
+    if (origins[i] < originkey || (origins[i] == originkey && i < rank))
+      pos++;
+  free(origins);
+
+  MPI_Comm_split(comm, 0, pos, &nfo->comm);
+  MPI_Comm_rank(nfo->comm, &nfo->rank);
+  nfo->nprocs = nprocs;
+
+  nfo->maxcubes = maxcubes;
+  nfo->order = (uint64_t *) malloc(maxcubes*2*sizeof(uint64_t));
+  nfo->sendkeys = (uint64_t *) malloc(maxcubes*sizeof(uint64_t));
+  nfo->recvkeys = (uint64_t *) malloc(maxcubes*sizeof(uint64_t));
+  nfo->sendvals = (float *) malloc(maxcubes*8*sizeof(float));
+  nfo->recvvals = (float *) malloc(maxcubes*8*sizeof(float));
+  nfo->sendchanged = (unsigned char *) malloc(maxcubes);
+  nfo->recvchanged = (unsigned char *) malloc(maxcubes);
+  nfo->sendcounts = (int *) malloc(nprocs*sizeof(int));
+  nfo->senddispls = (int *) malloc(nprocs*sizeof(int));
+  nfo->recvcounts = (int *) malloc(nprocs*sizeof(int));
+  nfo->recvdispls = (int *) malloc(nprocs*sizeof(int));
+}
+
+/* Make room for at least n cubes, keeping the contents */
+static void balancegrow(balanceInfo *nfo, uint64_t n) {
+  if (n <= nfo->maxcubes)
+    return;
+  nfo->maxcubes = n + n/4;
+  nfo->order = (uint64_t *) realloc(nfo->order, nfo->maxcubes*2*sizeof(uint64_t));
+  nfo->sendkeys = (uint64_t *) realloc(nfo->sendkeys, nfo->maxcubes*sizeof(uint64_t));
+  nfo->recvkeys = (uint64_t *) realloc(nfo->recvkeys, nfo->maxcubes*sizeof(uint64_t));
+  nfo->sendvals = (float *) realloc(nfo->sendvals, nfo->maxcubes*8*sizeof(float));
+  nfo->recvvals = (float *) realloc(nfo->recvvals, nfo->maxcubes*8*sizeof(float));
+  nfo->sendchanged = (unsigned char *) realloc(nfo->sendchanged, nfo->maxcubes);
+  nfo->recvchanged = (unsigned char *) realloc(nfo->recvchanged, nfo->maxcubes);
+  if (!nfo->order || !nfo->sendkeys || !nfo->recvkeys || !nfo->sendvals || !nfo->recvvals ||
+      !nfo->sendchanged || !nfo->recvchanged) {
+    printf("ERROR: Could not grow balance buffers to %llu cubes\n",
+	   (unsigned long long)nfo->maxcubes);
+    MPI_Abort(nfo->comm, 1);
+  }
+}
+
+void balancefree(balanceInfo *nfo) {
+  MPI_Comm_free(&nfo->comm);
+  free(nfo->order);
+  free(nfo->sendkeys);
+  free(nfo->recvkeys);
+  free(nfo->sendvals);
+  free(nfo->recvvals);
+  free(nfo->sendchanged);
+  free(nfo->recvchanged);
+  free(nfo->sendcounts);
+  free(nfo->senddispls);
+  free(nfo->recvcounts);
+  free(nfo->recvdispls);
+}
+
+/* Give every rank of nfo->comm an equal, contiguous piece of the cubes in
+ * (rank, key) order */
+void balancecubes(balanceInfo *nfo, cubeInfo *cubes, float deltax, float deltay, float deltaz) {
+  uint64_t c, n = cubes->ncubes;
+  uint64_t offset = 0, total = 0, nrecv;
+  int p, dest;
+
+  /* Sort the local cubes by key */
+  balancegrow(nfo, n);
+  for (c = 0; c < n; c++) {
+    nfo->order[2*c] = cubes->keys[c];
+    nfo->order[2*c+1] = c;
+  }
+  qsort(nfo->order, n, 2*sizeof(uint64_t), cmpkeys);
+
+  /* Place of the first cube in (rank, key) order */
+  MPI_Exscan(&n, &offset, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, nfo->comm);
+  if (nfo->rank == 0)
+    offset = 0;
+  MPI_Allreduce(&n, &total, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, nfo->comm);
+
+  /* Pack in key order; the cube at place g goes to rank g*nprocs/total */
+  memset(nfo->sendcounts, 0, nfo->nprocs*sizeof(int));
+  for (c = 0; c < n; c++) {
+    uint64_t src = nfo->order[2*c+1];
+
+    dest = (int)((offset + c) * nfo->nprocs / total);
+    nfo->sendcounts[dest]++;
+    nfo->sendkeys[c] = cubes->keys[src];
+    nfo->sendchanged[c] = cubes->changed[src];
+    cubevalues(cubes, src, nfo->sendvals + c*8);
+  }
+  MPI_Alltoall(nfo->sendcounts, 1, MPI_INT, nfo->recvcounts, 1, MPI_INT, nfo->comm);
+
+  for (nrecv = 0, p = 0; p < nfo->nprocs; p++) {
+    nfo->senddispls[p] = p ? nfo->senddispls[p-1] + nfo->sendcounts[p-1] : 0;
+    nfo->recvdispls[p] = p ? nfo->recvdispls[p-1] + nfo->recvcounts[p-1] : 0;
+    nrecv += nfo->recvcounts[p];
+  }
+  balancegrow(nfo, nrecv);
+  MPI_Alltoallv(nfo->sendkeys, nfo->sendcounts, nfo->senddispls, MPI_UNSIGNED_LONG_LONG,
+		nfo->recvkeys, nfo->recvcounts, nfo->recvdispls, MPI_UNSIGNED_LONG_LONG, nfo->comm);
+  MPI_Alltoallv(nfo->sendchanged, nfo->sendcounts, nfo->senddispls, MPI_UNSIGNED_CHAR,
+		nfo->recvchanged, nfo->recvcounts, nfo->recvdispls, MPI_UNSIGNED_CHAR, nfo->comm);
+
+  /* Now counts of 8 corner values */
+  for (p = 0; p < nfo->nprocs; p++) {
+    nfo->sendcounts[p] *= 8;
+    nfo->senddispls[p] *= 8;
+    nfo->recvcounts[p] *= 8;
+    nfo->recvdispls[p] *= 8;
+  }
+  MPI_Alltoallv(nfo->sendvals, nfo->sendcounts, nfo->senddispls, MPI_FLOAT,
+		nfo->recvvals, nfo->recvcounts, nfo->recvdispls, MPI_FLOAT, nfo->comm);
+
+  /* The received cubes are this rank's cut of the (rank, key) order: by
+   * source rank, and sorted by key within each */
+  cubesrebuild(cubes, nrecv, nfo->recvkeys, nfo->recvvals, nfo->recvchanged,
+	       deltax, deltay, deltaz);
+}
@@ -0,0 +1,31 @@
+/*
+ * Copyright (c) DoD HPCMP PETTT.  All rights reserved.
+ * See LICENSE file for details.
+ */
+
+#include <stdint.h>
+#include <mpi.h>
+
+typedef struct balanceInfo {
+  MPI_Comm comm;         /* Ranks renumbered by domain origin key */
+  int rank;
+  int nprocs;
+  uint64_t maxcubes;     /* Cubes the buffers hold; grow as needed */
+  uint64_t *order;       /* Scratch: (key, cube) pairs to sort */
+  uint64_t *sendkeys;
+  uint64_t *recvkeys;
+  float *sendvals;       /* 8 corner values per cube */
+  float *recvvals;
+  unsigned char *sendchanged;  /* Regrid flags, kept across the move */
+  unsigned char *recvchanged;
+  int *sendcounts;
+  int *senddispls;
+  int *recvcounts;
+  int *recvdispls;
+} balanceInfo;
+
+void balanceinit(balanceInfo *nfo, MPI_Comm comm, uint64_t originkey, uint64_t maxcubes);
+
+void balancefree(balanceInfo *nfo);
+
+void balancecubes(balanceInfo *nfo, cubeInfo *cubes, float deltax, float deltay, float deltaz);
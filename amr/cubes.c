@@ -5,17 +5,29 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include "open-simplex-noise.h"
 #include "cubes.h"
 
-void cubesinit(cubeInfo *nfo, int task, int levels, int debug) {
+static const double noisespacefreq = 10;    /* Spatial frequency of noise */
+static const double noisetimefreq = 0.25;    /* Temporal frequency of noise */
+
+void cubesinit(cubeInfo *nfo, int task, int levels, int dedup, int debug) {
   int maxpoints=0;
+  int maxcubes=0;
 
   maxpoints = pow(8, levels+1);
+  maxcubes = pow(8, levels);
+  nfo->maxcubes = (uint64_t)task*maxcubes;
   nfo->ncubes = 0;
   nfo->npoints = 0;
+  nfo->nnodes = 0;
+  nfo->nnoise = 0;
   nfo->debug = debug;
+  nfo->dedup = dedup;
+  nfo->maxlevel = levels;
+  nfo->allnodes = 0;
 
   if (nfo->debug) {
     printf("Init cubes maxpoints=%d task=%d +++++++++++++++\n", maxpoints, task);
@@ -24,7 +36,21 @@ void cubesinit(cubeInfo *nfo, int task, int levels, int debug) {
   /* Allocate list for all possible cubes and points */
   nfo->points = (float *) malloc((size_t)task*maxpoints*3*sizeof(float) );
   nfo->data = (float *) malloc((size_t)task*maxpoints*sizeof(float) );
-
+  nfo->keys = (uint64_t *) malloc((size_t)task*maxcubes*sizeof(uint64_t) );
+  nfo->changed = (unsigned char *) malloc((size_t)task*maxcubes);
+
+  /* Shared vertices need connectivity and a hash of the lattice points */
+  nfo->conn = NULL;
+  nfo->vhash.size = 0;
+  nfo->vhash.count = 0;
+  nfo->vhash.entries = NULL;
+  if (nfo->dedup) {
+    nfo->conn = (uint64_t *) malloc((size_t)task*maxpoints*sizeof(uint64_t) );
+    nfo->vhash.size = 1024;
+    while (nfo->vhash.size < (uint64_t)task*64)
+      nfo->vhash.size <<= 1;
+    nfo->vhash.entries = (vertexEntry *) calloc(nfo->vhash.size, sizeof(vertexEntry));
+  }
 }
 
 void cubesfree(cubeInfo *nfo) {
@@ -33,46 +59,233 @@ void cubesfree(cubeInfo *nfo) {
   nfo->npoints = 0;
   free(nfo->points);
   free(nfo->data);
+  free(nfo->keys);
+  free(nfo->changed);
+  free(nfo->conn);
+  free(nfo->vhash.entries);
   nfo->points = NULL;
   nfo->data = NULL;
+  nfo->keys = NULL;
+  nfo->changed = NULL;
+  nfo->conn = NULL;
+  nfo->vhash.entries = NULL;
+  nfo->vhash.size = 0;
+  nfo->vhash.count = 0;
+}
+
+/* Make room for at least ncubes cubes (and their points), keeping the contents */
+void cubesgrow(cubeInfo *nfo, uint64_t ncubes) {
+  uint64_t maxcubes = nfo->maxcubes ? nfo->maxcubes : 1;
+
+  if (ncubes <= nfo->maxcubes)
+    return;
+  while (maxcubes < ncubes)
+    maxcubes *= 2;
+
+  nfo->points = (float *) realloc(nfo->points, maxcubes*8*3*sizeof(float));
+  nfo->data = (float *) realloc(nfo->data, maxcubes*8*sizeof(float));
+  nfo->keys = (uint64_t *) realloc(nfo->keys, maxcubes*sizeof(uint64_t));
+  nfo->changed = (unsigned char *) realloc(nfo->changed, maxcubes);
+  if (nfo->dedup)
+    nfo->conn = (uint64_t *) realloc(nfo->conn, maxcubes*8*sizeof(uint64_t));
+  if (!nfo->points || !nfo->data || !nfo->keys || !nfo->changed || (nfo->dedup && !nfo->conn)) {
+    printf("ERROR: Could not grow cubes to %llu\n", (unsigned long long)maxcubes);
+    exit(1);
+  }
+  nfo->maxcubes = maxcubes;
+}
+
+/* Copy the cubes and their points and values to dst, which starts zeroed or from
+ * cubesinit; dst gets no lattice hash, it is only for writing */
+void cubescopy(cubeInfo *dst, cubeInfo *src) {
+  dst->debug = src->debug;
+  dst->dedup = src->dedup;
+  dst->maxlevel = src->maxlevel;
+  dst->allnodes = src->allnodes;
+  cubesgrow(dst, src->ncubes ? src->ncubes : 1);
+  dst->ncubes = src->ncubes;
+  dst->npoints = src->npoints;
+  dst->nnodes = src->nnodes;
+  dst->nnoise = src->nnoise;
+  memcpy(dst->points, src->points, src->npoints*3*sizeof(float));
+  memcpy(dst->data, src->data, src->npoints*sizeof(float));
+  memcpy(dst->keys, src->keys, src->ncubes*sizeof(uint64_t));
+  memcpy(dst->changed, src->changed, src->ncubes);
+  if (src->dedup)
+    memcpy(dst->conn, src->conn, src->ncubes*8*sizeof(uint64_t));
+}
+
+/* Empty the cubes for a new time step; noise memoized last step is stale */
+void cubesreset(cubeInfo *nfo) {
+  nfo->ncubes = 0;
+  nfo->npoints = 0;
+  nfo->nnodes = 0;
+  nfo->nnoise = 0;
+  if (nfo->dedup) {
+    memset(nfo->vhash.entries, 0, nfo->vhash.size*sizeof(vertexEntry));
+    nfo->vhash.count = 0;
+  }
 }
 
-void refine(cubeInfo *nfo, int t, int rpId, float thres, int level_start, float x_start, float y_start, float z_start, float dx_start, float dy_start, float dz_start, struct osn_context *osn, int maxLevel) {
-  double noisespacefreq = 10;    /* Spatial frequency of noise */
-  double noisetimefreq = 0.25;    /* Temporal frequency of noise */
+/* The noise field the cubes sample, at a point and time step */
+float cubenoise(struct osn_context *osn, float x, float y, float z, int t) {
+  return (float)open_simplex_noise4(osn, x*noisespacefreq, y*noisespacefreq, z*noisespacefreq,
+				    t*noisetimefreq);
+}
+
+/* Spread the low 21 bits of v out to every third bit */
+static uint64_t spread3(uint64_t v) {
+  v &= 0x1fffff;
+  v = (v | (v << 32)) & 0x001f00000000ffffULL;
+  v = (v | (v << 16)) & 0x001f0000ff0000ffULL;
+  v = (v | (v << 8))  & 0x100f00f00f00f00fULL;
+  v = (v | (v << 4))  & 0x10c30c30c30c30c3ULL;
+  v = (v | (v << 2))  & 0x1249249249249249ULL;
+  return v;
+}
+
+/* Gather every third bit of v back into the low 21 bits */
+static uint64_t compact3(uint64_t v) {
+  v &= 0x1249249249249249ULL;
+  v = (v | (v >> 2))  & 0x10c30c30c30c30c3ULL;
+  v = (v | (v >> 4))  & 0x100f00f00f00f00fULL;
+  v = (v | (v >> 8))  & 0x001f0000ff0000ffULL;
+  v = (v | (v >> 16)) & 0x001f00000000ffffULL;
+  v = (v | (v >> 32)) & 0x1fffff;
+  return v;
+}
+
+/* Octree key of the cube at level with its lowest corner at finest cell (ai,aj,ak) */
+uint64_t cubekey(uint64_t ai, uint64_t aj, uint64_t ak, int level) {
+  uint64_t morton = spread3(ai) | (spread3(aj) << 1) | (spread3(ak) << 2);
+  return (morton << KEYLEVELBITS) | (uint64_t)level;
+}
+
+void cubekeydecode(uint64_t key, uint64_t *ai, uint64_t *aj, uint64_t *ak, int *level) {
+  uint64_t morton = key >> KEYLEVELBITS;
+  *ai = compact3(morton);
+  *aj = compact3(morton >> 1);
+  *ak = compact3(morton >> 2);
+  *level = (int)(key & (((uint64_t)1 << KEYLEVELBITS) - 1));
+}
+
+/* Hash a lattice key: 4x4x4 bricks of the lattice keep their Morton order, so
+ * neighboring points share cache lines, and bricks scatter (splitmix64) */
+static uint64_t vhash_mix(uint64_t key) {
+  uint64_t morton, brick;
+
+  key -= 1;
+  morton = spread3(key) | (spread3(key >> 21) << 1) | (spread3(key >> 42) << 2);
+  brick = morton >> 6;
+  brick ^= brick >> 30;
+  brick *= 0xbf58476d1ce4e5b9ULL;
+  brick ^= brick >> 27;
+  brick *= 0x94d049bb133111ebULL;
+  brick ^= brick >> 31;
+  return (brick << 6) | (morton & 63);
+}
+
+/* Double the number of slots and reinsert all entries */
+static void vhash_grow(vertexHash *h) {
+  vertexEntry *old = h->entries;
+  uint64_t oldsize = h->size;
+  uint64_t i, slot;
+
+  h->size <<= 1;
+  h->entries = (vertexEntry *) calloc(h->size, sizeof(vertexEntry));
+  if (!h->entries) {
+    printf("ERROR: Could not grow vertex hash to %llu entries\n", (unsigned long long)h->size);
+    exit(1);
+  }
+  for (i = 0; i < oldsize; i++) {
+    if (!old[i].key)
+      continue;
+    slot = vhash_mix(old[i].key) & (h->size-1);
+    while (h->entries[slot].key)
+      slot = (slot+1) & (h->size-1);
+    h->entries[slot] = old[i];
+  }
+  free(old);
+}
+
+/* Find a lattice point in the hash, adding it if it is new
+ *    returns the entry, only valid until the next lookup; a new entry has no
+ *    point index and no value yet */
+static vertexEntry *vhash_lookup(vertexHash *h, uint64_t li, uint64_t lj, uint64_t lk, int *isnew) {
+  uint64_t key = ((lk << 42) | (lj << 21) | li) + 1;
+  uint64_t slot;
+
+  if ((h->count+1)*2 > h->size)    /* Keep the load factor under 1/2 */
+    vhash_grow(h);
+
+  slot = vhash_mix(key) & (h->size-1);
+  while (h->entries[slot].key && h->entries[slot].key != key)
+    slot = (slot+1) & (h->size-1);
+
+  *isnew = !h->entries[slot].key;
+  if (*isnew) {
+    h->entries[slot].key = key;
+    h->entries[slot].index = NOVERTEX;
+    h->count++;
+  }
+  return &h->entries[slot];
+}
+
+/* Find the noise at a lattice point, evaluating and memoizing it if it is new
+ *    returns the hash entry, only valid until the next lookup */
+static vertexEntry *latticepoint(cubeInfo *nfo, uint64_t li, uint64_t lj, uint64_t lk,
+				 float lsx, float lsy, float lsz, int t, struct osn_context *osn) {
+  int isnew;
+  vertexEntry *vtx = vhash_lookup(&nfo->vhash, li, lj, lk, &isnew);
+
+  if (isnew) {
+    vtx->value = (float)open_simplex_noise4(osn, li*lsx*noisespacefreq,
+					    lj*lsy*noisespacefreq, lk*lsz*noisespacefreq, t*noisetimefreq);
+    nfo->nnoise++;
+  }
+  return vtx;
+}
+
+void refine(cubeInfo *nfo, stack *octStack, int t, int rpId, float thres, int level_start, int i_start, int j_start, int k_start, float x_start, float y_start, float z_start, float dx_start, float dy_start, float dz_start, struct osn_context *osn, int maxLevel) {
   float x_center, y_center, z_center, center_val;
   float xpts[8], ypts[8], zpts[8];
   float curdata[8];
   int i;
   int split;
-  int refinePathID = 0;
-  int new_refinePathID = 0;
+  uint64_t key;
   int inside;
-  stack octStack;
   float x, y, z, dx, dy, dz;
   int level;
-  int stacksize;
+  uint64_t li, lj, lk;          /* Lattice coordinates of cube corner */
+  uint64_t lw, lw_start;        /* Lattice width of cube */
+  float lsx, lsy, lsz;          /* Lattice spacing */
+  vertexEntry *vtx;
 
 
   if (nfo->debug)
       printf("Start start initial refinement on Block = %d\n", rpId);
   
-  stacksize = 8 * (maxLevel+1);  
-  stack_new(&octStack, stacksize, nfo->debug);
-  
-  stack_push(&octStack, x_start, y_start, z_start, dx_start, dy_start, dz_start, level_start,  rpId);
+  /* The lattice is half the finest cell, so that cube centers are on it too */
+  lw_start = (uint64_t)1 << (maxLevel+1-level_start);
+  lsx = dx_start / lw_start;
+  lsy = dy_start / lw_start;
+  lsz = dz_start / lw_start;
+
+  stack_push(octStack, x_start, y_start, z_start, dx_start, dy_start, dz_start, level_start,
+	     i_start*lw_start, j_start*lw_start, k_start*lw_start);
  
-  while (!stack_isempty(&octStack)){
+  while (!stack_isempty(octStack)){
     split = 0;
     inside = 0;
     
     /* get next cube to test */
-    stack_pop(&octStack, &x, &y, &z, &dx, &dy, &dz, &level,  &refinePathID);
-
-    /* refinePathID = rpId; */
+    stack_pop(octStack, &x, &y, &z, &dx, &dy, &dz, &level, &li, &lj, &lk);
+    lw = (uint64_t)1 << (maxLevel+1-level);
+    key = cubekey(li >> 1, lj >> 1, lk >> 1, level);
+    nfo->nnodes++;
 
     if (nfo->debug)
-      printf("Block refinePathID = %d\n", refinePathID);
+      printf("Block key = %016llx\n", (unsigned long long)key);
   
     
     /* given a unit cube (8 points) */
@@ -106,8 +319,15 @@ void refine(cubeInfo *nfo, int t, int rpId, float thres, int level_start, float
     x_center = x + dx/2;
     y_center = y + dy/2;
     z_center = z + dz/2;
-    center_val = (float)open_simplex_noise4(osn, x_center*noisespacefreq,
-					    y_center*noisespacefreq, z_center*noisespacefreq, t*noisetimefreq);
+    if (nfo->dedup) {
+      /* The center is a corner of the children if this cube splits */
+      vtx = latticepoint(nfo, li+lw/2, lj+lw/2, lk+lw/2, lsx, lsy, lsz, t, osn);
+      center_val = vtx->value;
+    } else {
+      center_val = (float)open_simplex_noise4(osn, x_center*noisespacefreq,
+					      y_center*noisespacefreq, z_center*noisespacefreq, t*noisetimefreq);
+      nfo->nnoise++;
+    }
 
     if (center_val > thres)
       inside = 1;
@@ -118,6 +338,78 @@ void refine(cubeInfo *nfo, int t, int rpId, float thres, int level_start, float
     if (nfo->debug)
       printf("Block_Center: (%f %f, %f)=%f thres=%f  level=%d  inside=%d  split=%d\n", x_center, y_center, z_center, center_val, thres, level, inside, split);
     
+    /* Keep leaves, and with allnodes split cubes too, before their children */
+    if (!split || nfo->allnodes) {
+      if (nfo->dedup) {
+	uint64_t *cubeconn;
+
+	if (nfo->ncubes == nfo->maxcubes)
+	  cubesgrow(nfo, nfo->ncubes+1);
+	cubeconn = nfo->conn + nfo->ncubes*8;
+	nfo->keys[nfo->ncubes] = key;
+	nfo->ncubes++;
+
+	/* - look up corners on the lattice; only new ones get a point */
+	for (i=0; i<8; i++) {
+	  uint64_t ci = li + (i & 1)*lw;
+	  uint64_t cj = lj + ((i>>1) & 1)*lw;
+	  uint64_t ck = lk + ((i>>2) & 1)*lw;
+
+	  vtx = latticepoint(nfo, ci, cj, ck, lsx, lsy, lsz, t, osn);
+	  if (vtx->index == NOVERTEX) {
+	    uint64_t npoints3 = nfo->npoints * 3;
+
+	    vtx->index = nfo->npoints;
+	    nfo->data[nfo->npoints] = vtx->value;
+	    nfo->points[npoints3]   = ci*lsx;
+	    nfo->points[npoints3+1] = cj*lsy;
+	    nfo->points[npoints3+2] = ck*lsz;
+	    nfo->npoints++;
+	  }
+	  cubeconn[i] = vtx->index;
+
+	  if (nfo->debug)
+	    printf("Cube_Point_%d: (%f %f, %f) = %f  index=%llu\n", i, ci*lsx, cj*lsy, ck*lsz, vtx->value,
+		   (unsigned long long)cubeconn[i]);
+	}
+
+	if (nfo->debug)
+	  printf("CubeID %llu, key %016llx connot be Refined ... refinement level=%d  npoints=%llu +++++++++++++++\n",
+		 (unsigned long long)nfo->ncubes, (unsigned long long)key, level,
+		 (unsigned long long)nfo->npoints);
+      }
+      else {
+	if (nfo->ncubes == nfo->maxcubes)
+	  cubesgrow(nfo, nfo->ncubes+1);
+	nfo->keys[nfo->ncubes] = key;
+	nfo->ncubes++;
+      
+	/* - calulate value using open_simplex_noise4 */
+	for (i=0; i<8; i++) {
+	  uint64_t npoints3 = nfo->npoints * 3;
+	
+	  nfo->data[nfo->npoints] =  curdata[i] = (float)open_simplex_noise4(osn, xpts[i]*noisespacefreq,
+									     ypts[i]*noisespacefreq, zpts[i]*noisespacefreq, t*noisetimefreq);
+	  nfo->nnoise++;
+	
+	  nfo->points[npoints3]   = xpts[i];
+	  nfo->points[npoints3+1] = ypts[i];
+	  nfo->points[npoints3+2] = zpts[i];
+	
+	  if (nfo->debug)
+	    printf("Cube_Point_%d: (%f %f, %f) = %f \n", i,nfo->points[npoints3],nfo->points[npoints3+1] , nfo->points[npoints3+2] , nfo->data[nfo->npoints] );
+
+	  nfo->npoints++;
+	}
+
+	if (nfo->debug)
+	  printf("CubeID %llu, key %016llx connot be Refined ... refinement level=%d  npoints=%llu +++++++++++++++\n",
+		 (unsigned long long)nfo->ncubes, (unsigned long long)key, level,
+		 (unsigned long long)nfo->npoints);
+    
+      }
+    }
+
     /*   Refine if criteria satisfied */
     if (split) {
       xpts[0] = x;
@@ -147,46 +439,246 @@ void refine(cubeInfo *nfo, int t, int rpId, float thres, int level_start, float
 
       level++;
       for (i=0; i<8; i++) {
-	new_refinePathID = (refinePathID *10)+ (i+1);
-	  
-	if (nfo->debug)
-	  printf("Refine on cell %d: (%f %f, %f) ... refinePathID=%d\n", i+1, xpts[i], ypts[i], zpts[i], new_refinePathID);
+	int c = 7-i;    /* Child pushed; its corner offsets are the bits of c */
 
-	stack_push(&octStack, xpts[7-i], ypts[7-i], zpts[7-i], dx/2.0, dy/2.0, dz/2.0, level, new_refinePathID);
-      }
-    }
-    else {
-      nfo->ncubes++;
-      
-      /* - calulate value using open_simplex_noise4 */
-      for (i=0; i<8; i++) {
-	uint64_t npoints3 = nfo->npoints * 3;
-	
-	nfo->data[nfo->npoints] =  curdata[i] = (float)open_simplex_noise4(osn, xpts[i]*noisespacefreq,
-									   ypts[i]*noisespacefreq, zpts[i]*noisespacefreq, t*noisetimefreq);
-	
-	nfo->points[npoints3]   = xpts[i];
-	nfo->points[npoints3+1] = ypts[i];
-	nfo->points[npoints3+2] = zpts[i];
-	
 	if (nfo->debug)
-	  printf("Cube_Point_%d: (%f %f, %f) = %f \n", i,nfo->points[npoints3],nfo->points[npoints3+1] , nfo->points[npoints3+2] , nfo->data[nfo->npoints] );
+	  printf("Refine on cell %d: (%f %f, %f)\n", i+1, xpts[i], ypts[i], zpts[i]);
 
-	nfo->npoints++;
+	stack_push(octStack, xpts[c], ypts[c], zpts[c], dx/2.0, dy/2.0, dz/2.0, level,
+		   li + (c & 1)*lw/2, lj + ((c>>1) & 1)*lw/2, lk + ((c>>2) & 1)*lw/2);
       }
-
-      if (nfo->debug)
-	printf("CubeID %llu, refinePathID %d connot be Refined ... refinement level=%d  npoints=%llu +++++++++++++++\n", nfo->ncubes, refinePathID, level, nfo->npoints);
-    
     }
   }
   
   if (nfo->debug)
     printf("Ended refinement on initial Block = %d\n", rpId);
 
-  stack_delete(&octStack);
+}
+
+/* Replace the cubes with ncubes given by key, the values at their 8
+ * corners (in cube point order) and their changed flags, or NULL if all are
+ * new, e.g. after moving cubes between ranks.  Corners are shared again if
+ * dedup is on. */
+void cubesrebuild(cubeInfo *nfo, uint64_t ncubes, uint64_t *keys, float *values,
+		  unsigned char *changed, float deltax, float deltay, float deltaz) {
+  uint64_t c, ai, aj, ak, lw;
+  float lsx, lsy, lsz;
+  int i, level, isnew;
+  vertexEntry *vtx;
+
+  /* Corners on the dedup lattice, half the finest cell */
+  lsx = deltax / ((uint64_t)1 << (nfo->maxlevel+1));
+  lsy = deltay / ((uint64_t)1 << (nfo->maxlevel+1));
+  lsz = deltaz / ((uint64_t)1 << (nfo->maxlevel+1));
+
+  nfo->ncubes = 0;
+  nfo->npoints = 0;
+  cubesgrow(nfo, ncubes);
+  if (nfo->dedup) {
+    memset(nfo->vhash.entries, 0, nfo->vhash.size*sizeof(vertexEntry));
+    nfo->vhash.count = 0;
+  }
+
+  for (c = 0; c < ncubes; c++) {
+    cubekeydecode(keys[c], &ai, &aj, &ak, &level);
+    lw = (uint64_t)1 << (nfo->maxlevel+1-level);
+    nfo->keys[c] = keys[c];
+    nfo->changed[c] = changed ? changed[c] : 1;
+
+    for (i=0; i<8; i++) {
+      uint64_t ci = 2*ai + (i & 1)*lw;
+      uint64_t cj = 2*aj + ((i>>1) & 1)*lw;
+      uint64_t ck = 2*ak + ((i>>2) & 1)*lw;
+
+      if (nfo->dedup) {
+	vtx = vhash_lookup(&nfo->vhash, ci, cj, ck, &isnew);
+	if (isnew)
+	  vtx->value = values[c*8+i];
+	if (vtx->index != NOVERTEX) {
+	  nfo->conn[c*8+i] = vtx->index;
+	  continue;
+	}
+	vtx->index = nfo->npoints;
+	nfo->conn[c*8+i] = nfo->npoints;
+      }
+      nfo->data[nfo->npoints] = values[c*8+i];
+      nfo->points[nfo->npoints*3]   = ci*lsx;
+      nfo->points[nfo->npoints*3+1] = cj*lsy;
+      nfo->points[nfo->npoints*3+2] = ck*lsz;
+      nfo->npoints++;
+    }
+  }
+  nfo->ncubes = ncubes;
+}
 
+/* Refine the cube with key from its lowest corner and level */
+static void refinekey(cubeInfo *nfo, stack *octStack, uint64_t key, int t, float thres,
+		      float deltax, float deltay, float deltaz, struct osn_context *osn, int maxLevel) {
+  uint64_t ai, aj, ak;
+  int level, i, j, k;
+  float dx, dy, dz;
+
+  cubekeydecode(key, &ai, &aj, &ak, &level);
+  i = (int)(ai >> (maxLevel - level));
+  j = (int)(aj >> (maxLevel - level));
+  k = (int)(ak >> (maxLevel - level));
+  dx = deltax / (1 << level);
+  dy = deltay / (1 << level);
+  dz = deltaz / (1 << level);
+  refine(nfo, octStack, t, 0, thres, level, i, j, k, i*dx, j*dy, k*dz, dx, dy, dz, osn, maxLevel);
+}
 
+/* Noise at lattice point (li, lj, lk), memoized if dedup is on */
+static float latticevalue(cubeInfo *nfo, uint64_t li, uint64_t lj, uint64_t lk,
+			  float lsx, float lsy, float lsz, int t, struct osn_context *osn) {
+  if (nfo->dedup)
+    return latticepoint(nfo, li, lj, lk, lsx, lsy, lsz, t, osn)->value;
+  nfo->nnoise++;
+  return cubenoise(osn, li*lsx, lj*lsy, lk*lsz, t);
+}
+
+/* Regrid incrementally from the cubes of the last step, oldkeys, to the cubes
+ * refining the base blocks again at time t would give.  A cube is a leaf when
+ * the centers of all its ancestors are inside and its own is not (or it is at
+ * maxLevel).  So the ancestors of each old cube are tested coarsest first: the
+ * first one no longer inside becomes a leaf in place of all the old cubes in
+ * it, and is kept by the rank with the old cube at its lowest corner.  If all
+ * are inside, the old cube is refined from itself, kept or split as deep as
+ * needed.  Cubes that are not an old cube kept as is are flagged in changed.
+ * The cubes must be empty; oldkeys may be in any order and over any ranks,
+ * though ancestors are tested once only for old cubes in Z order. */
+void cubesregrid(cubeInfo *nfo, stack *octStack, uint64_t noldcubes, uint64_t *oldkeys, int t,
+		 float thres, float deltax, float deltay, float deltaz, struct osn_context *osn, int maxLevel) {
+  uint64_t lastkey[1 << KEYLEVELBITS];         /* Ancestor tested last at each level */
+  unsigned char lastinside[1 << KEYLEVELBITS];  /* and whether its center is inside */
+  uint64_t c, ai, aj, ak, pi = 0, pj = 0, pk = 0, pw, key = 0, start;
+  int level, l;
+  float lsx, lsy, lsz;
+
+  lsx = deltax / ((uint64_t)1 << (maxLevel+1));
+  lsy = deltay / ((uint64_t)1 << (maxLevel+1));
+  lsz = deltaz / ((uint64_t)1 << (maxLevel+1));
+  for (l = 0; l <= maxLevel; l++)
+    lastkey[l] = UINT64_MAX;
+
+  for (c = 0; c < noldcubes; c++) {
+    cubekeydecode(oldkeys[c], &ai, &aj, &ak, &level);
+
+    /* The coarsest ancestor that does not split any more, if any */
+    for (l = 0; l < level; l++) {
+      pw = (uint64_t)1 << (maxLevel - l);    /* Its width, finest cells */
+      pi = ai & ~(pw-1);
+      pj = aj & ~(pw-1);
+      pk = ak & ~(pw-1);
+      key = cubekey(pi, pj, pk, l);
+      if (key != lastkey[l]) {
+	/* Its center is a lattice point, at half finest cells */
+	lastkey[l] = key;
+	lastinside[l] = latticevalue(nfo, 2*pi+pw, 2*pj+pw, 2*pk+pw, lsx, lsy, lsz, t, osn) > thres;
+      }
+      if (!lastinside[l])
+	break;
+    }
+
+    start = nfo->ncubes;
+    if (l < level) {
+      if (pi == ai && pj == aj && pk == ak)
+	refinekey(nfo, octStack, key, t, thres, deltax, deltay, deltaz, osn, maxLevel);
+    } else {
+      refinekey(nfo, octStack, oldkeys[c], t, thres, deltax, deltay, deltaz, osn, maxLevel);
+    }
+    memset(nfo->changed + start, l < level || nfo->ncubes - start != 1, nfo->ncubes - start);
+  }
+}
+
+/* Values at the 8 corners of cube c, in cube point order */
+void cubevalues(cubeInfo *nfo, uint64_t c, float *values) {
+  int i;
+
+  for (i=0; i<8; i++)
+    values[i] = nfo->dedup ? nfo->data[nfo->conn[c*8+i]] : nfo->data[c*8+i];
+}
+
+/* Number of cubes at each level, 0 to maxlevel */
+void cubeslevelcounts(cubeInfo *nfo, uint64_t *counts) {
+  uint64_t c;
+
+  memset(counts, 0, (nfo->maxlevel+1)*sizeof(uint64_t));
+  for (c = 0; c < nfo->ncubes; c++)
+    counts[nfo->keys[c] & (((uint64_t)1 << KEYLEVELBITS) - 1)]++;
+}
+
+/* Reorder the cubes so each level is contiguous, coarsest first, keeping
+ * their order within a level (a stable counting sort).  Shared points stay
+ * where they are; otherwise each cube's 8 points move with it. */
+void cubesbylevel(cubeInfo *nfo) {
+  uint64_t c, d, *dest, *keys, *conn = NULL;
+  unsigned char *changed;
+  float *points = NULL, *data = NULL;
+  int l;
+
+  dest = (uint64_t *) malloc((nfo->maxlevel+1)*sizeof(uint64_t));
+  cubeslevelcounts(nfo, dest);
+  for (d = 0, l = 0; l <= nfo->maxlevel; l++) {
+    c = dest[l];
+    dest[l] = d;
+    d += c;
+  }
+
+  keys = (uint64_t *) malloc(nfo->maxcubes*sizeof(uint64_t));
+  changed = (unsigned char *) malloc(nfo->maxcubes);
+  if (nfo->dedup) {
+    conn = (uint64_t *) malloc(nfo->maxcubes*8*sizeof(uint64_t));
+  } else {
+    points = (float *) malloc(nfo->maxcubes*8*3*sizeof(float));
+    data = (float *) malloc(nfo->maxcubes*8*sizeof(float));
+  }
+  if (!keys || !changed || (nfo->dedup ? !conn : !points || !data)) {
+    printf("ERROR: Could not allocate %llu cubes to sort by level\n", (unsigned long long)nfo->maxcubes);
+    exit(1);
+  }
+
+  for (c = 0; c < nfo->ncubes; c++) {
+    d = dest[nfo->keys[c] & (((uint64_t)1 << KEYLEVELBITS) - 1)]++;
+    keys[d] = nfo->keys[c];
+    changed[d] = nfo->changed[c];
+    if (nfo->dedup) {
+      memcpy(conn + d*8, nfo->conn + c*8, 8*sizeof(uint64_t));
+    } else {
+      memcpy(points + d*24, nfo->points + c*24, 24*sizeof(float));
+      memcpy(data + d*8, nfo->data + c*8, 8*sizeof(float));
+    }
+  }
+
+  free(nfo->keys);
+  free(nfo->changed);
+  nfo->keys = keys;
+  nfo->changed = changed;
+  if (nfo->dedup) {
+    free(nfo->conn);
+    nfo->conn = conn;
+  } else {
+    free(nfo->points);
+    free(nfo->data);
+    nfo->points = points;
+    nfo->data = data;
+  }
+  free(dest);
+}
+
+/* Connectivity of ncubes in hexahedron order (VTK/XDMF), from cube point
+ * (voxel) order, offset by pointstart; without conn each cube has its own 8
+ * points.  Returns a new array. */
+uint64_t *cubeshexconn(uint64_t ncubes, uint64_t *conn, uint64_t pointstart) {
+  static const int hexorder[8] = {0, 1, 3, 2, 4, 5, 7, 6};
+  uint64_t c, *hconn;
+  int i;
+
+  hconn = (uint64_t *) malloc((ncubes ? ncubes : 1)*8*sizeof(uint64_t));
+  for (c = 0; c < ncubes; c++)
+    for (i = 0; i < 8; i++)
+      hconn[c*8+i] = pointstart + (conn ? conn[c*8+hexorder[i]] : c*8+hexorder[i]);
+  return hconn;
 }
 
 void cubeprint(cubeInfo *nfo) {
@@ -199,6 +691,29 @@ void cubeprint(cubeInfo *nfo) {
   
 }
 
+/* Print totals over all ranks, and what sharing vertices saved */
+void cubesprintstats(cubeInfo *nfo, MPI_Comm comm, int rank) {
+  uint64_t counts[4], totals[4];
+
+  counts[0] = nfo->ncubes;
+  counts[1] = nfo->npoints;
+  counts[2] = nfo->nnodes;
+  counts[3] = nfo->nnoise;
+  MPI_Reduce(counts, totals, 4, MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, comm);
+
+  if (rank == 0) {
+    /* Without sharing: 8 points per cube, plus a center per octree node */
+    uint64_t allpoints = totals[0]*8;
+    uint64_t allnoise = totals[2] + totals[0]*8;
+
+    printf("      Cubes = %llu, Points = %llu (%llu unshared), Duplication factor = %.2f\n",
+	   (unsigned long long)totals[0], (unsigned long long)totals[1], (unsigned long long)allpoints,
+	   totals[1] ? (double)allpoints/totals[1] : 0.);
+    printf("      Noise evaluations = %llu (%llu unmemoized), Savings factor = %.2f\n",
+	   (unsigned long long)totals[3], (unsigned long long)allnoise, totals[3] ? (double)allnoise/totals[3] : 0.);
+  }
+}
+
 /* create a new stack */
 void stack_new(stack *s, int maxsize, int debug) {
   cubeItem *newcubes;
@@ -255,7 +770,8 @@ void stack_delete(stack *s) {
 }
 
 /* pushes ne element onto stack */
-void stack_push(stack *s,  float xval, float yval, float zval, float deltax, float deltay, float deltaz, int level, int r_id) {
+void stack_push(stack *s,  float xval, float yval, float zval, float deltax, float deltay, float deltaz, int level,
+		uint64_t li, uint64_t lj, uint64_t lk) {
 
   cubeItem newCube;
  
@@ -264,7 +780,6 @@ void stack_push(stack *s,  float xval, float yval, float zval, float deltax, flo
     exit(1);
   }
 
-  newCube.r_id = r_id;
   newCube.level = level;
   newCube.x = xval;
   newCube.y = yval;
@@ -272,6 +787,9 @@ void stack_push(stack *s,  float xval, float yval, float zval, float deltax, flo
   newCube.dx = deltax;
   newCube.dy = deltay;
   newCube.dz = deltaz;
+  newCube.li = li;
+  newCube.lj = lj;
+  newCube.lk = lk;
 
   s->top++;
   s->size++;
@@ -284,7 +802,8 @@ void stack_push(stack *s,  float xval, float yval, float zval, float deltax, flo
 }
 
 /* removes top element from stack,  */
-void stack_pop(stack *s, float *xval, float *yval, float *zval, float *deltax, float *deltay, float *deltaz, int *level, int *r_id) {
+void stack_pop(stack *s, float *xval, float *yval, float *zval, float *deltax, float *deltay, float *deltaz, int *level,
+	       uint64_t *li, uint64_t *lj, uint64_t *lk) {
   
   if (stack_isempty(s))  {
     printf("ERROR: Stack EMPTY ... Could not pop cube data off stack ...\n");
@@ -293,7 +812,6 @@ void stack_pop(stack *s, float *xval, float *yval, float *zval, float *deltax, f
 
   
   /* update data */
-  *r_id =  s->cubes[s->top].r_id;
   *level = s->cubes[s->top].level;
   *xval = s->cubes[s->top].x;
   *yval = s->cubes[s->top].y;
@@ -301,6 +819,9 @@ void stack_pop(stack *s, float *xval, float *yval, float *zval, float *deltax, f
   *deltax = s->cubes[s->top].dx;
   *deltay = s->cubes[s->top].dy;
   *deltaz = s->cubes[s->top].dz;
+  *li = s->cubes[s->top].li;
+  *lj = s->cubes[s->top].lj;
+  *lk = s->cubes[s->top].lk;
   
   if (s->debug) {
     printf("Popped Cube LRcorner position (%f %f, %f) stack_size=%d\n",  s->cubes[s->top].x, s->cubes[s->top].y, s->cubes[s->top].z, s->size);
@@ -3,19 +3,68 @@
  * See LICENSE file for details.
  */
 
+#include <stdint.h>
+#include <mpi.h>
+
+struct osn_context;
+
+/* Cube keys: Morton interleaved anchor (lowest corner) coordinates, in cells of
+ * the finest level, above the refinement level.  Sorting keys sorts the cubes
+ * along a Z curve, with a parent just before its first child. */
+#define KEYLEVELBITS 5
+#define KEYAXISBITS 19
+
+/* Cube geometry written by the HDF5 and ADIOS backends: keys only, or also
+ * points and hexahedron connectivity, which shared (dedup) points need */
+#define GEOM_COMPACT 0
+#define GEOM_EXPLICIT 1
+
+/* Cubes written: leaves only or all octree nodes, and each level contiguous */
+#define OUTPUT_ALLNODES 1
+#define OUTPUT_BYLEVEL 2
+
+/* Marks a hashed lattice point that only has a memoized noise value */
+#define NOVERTEX UINT64_MAX
+
+/* An entry in the lattice hash (a noise value and maybe a point index) */
+typedef struct vertexEntry {
+  uint64_t key;          /* Packed lattice coordinates + 1; 0 is an empty slot */
+  uint64_t index;        /* Index into points/data, or NOVERTEX */
+  float value;           /* Memoized noise value */
+} vertexEntry;
+
+/* Open addressing hash of lattice points, keyed by integer lattice coordinates */
+typedef struct vertexHash {
+  uint64_t size;         /* Number of slots; always a power of 2 */
+  uint64_t count;        /* Number of used slots */
+  vertexEntry *entries;
+} vertexHash;
+
 typedef struct cubeInfo {
   int debug;
+  int dedup;             /* Share vertices between neighboring cubes */
+  int maxlevel;          /* Maximum refinement level */
+  int allnodes;          /* Keep split (interior) cubes too, before their children */
+  uint64_t maxcubes;     /* Cubes allocated for; points for 8 each */
   uint64_t ncubes;       /* Number of cubes */
   uint64_t npoints;      /* Number of cube points */
+  uint64_t nnodes;       /* Number of octree nodes tested (cube centers) */
+  uint64_t nnoise;       /* Number of noise evaluations */
   float *points;         /* Points of cube */
   float *data;           /* Values on points */
+  uint64_t *keys;        /* Octree key of each cube */
+  unsigned char *changed; /* Cube is new since the last step; regrid only */
+  uint64_t *conn;        /* Hex connectivity, 8 points per cube; dedup only */
+  vertexHash vhash;      /* Lattice points seen this time step; dedup only */
 }cubeInfo;
 
 
 /* holds an entry in the stack (in this case cube information) */
 typedef struct cubeItem {
-  int r_id;
   int level;
+  uint64_t li;           /* Lattice coordinates of corner, half finest cells */
+  uint64_t lj;
+  uint64_t lk;
   float x;
   float y;
   float z;
@@ -34,15 +83,44 @@ typedef struct {
 } stack;
 
 
-void cubesinit(cubeInfo *nfo, int task, int levels, int debug);
+void cubesinit(cubeInfo *nfo, int task, int levels, int dedup, int debug);
 
 void cubesfree(cubeInfo *nfo);
 
-void refine(cubeInfo *nfo, int t, int rpId, float thres, int level_start, float x_start, float y_start,
-	    float z_start, float dx_start, float dy_start, float dz_start, struct osn_context *osn, int maxLevel);
+void cubesreset(cubeInfo *nfo);
+
+void cubesgrow(cubeInfo *nfo, uint64_t ncubes);
+
+void cubescopy(cubeInfo *dst, cubeInfo *src);
+
+void refine(cubeInfo *nfo, stack *octStack, int t, int rpId, float thres, int level_start, int i_start, int j_start,
+	    int k_start, float x_start, float y_start, float z_start, float dx_start, float dy_start,
+	    float dz_start, struct osn_context *osn, int maxLevel);
+
+float cubenoise(struct osn_context *osn, float x, float y, float z, int t);
+
+uint64_t cubekey(uint64_t ai, uint64_t aj, uint64_t ak, int level);
+
+void cubekeydecode(uint64_t key, uint64_t *ai, uint64_t *aj, uint64_t *ak, int *level);
+
+void cubesrebuild(cubeInfo *nfo, uint64_t ncubes, uint64_t *keys, float *values,
+		  unsigned char *changed, float deltax, float deltay, float deltaz);
+
+void cubevalues(cubeInfo *nfo, uint64_t c, float *values);
+
+void cubeslevelcounts(cubeInfo *nfo, uint64_t *counts);
+
+void cubesbylevel(cubeInfo *nfo);
+
+uint64_t *cubeshexconn(uint64_t ncubes, uint64_t *conn, uint64_t pointstart);
+
+void cubesregrid(cubeInfo *nfo, stack *octStack, uint64_t noldcubes, uint64_t *oldkeys, int t,
+		 float thres, float deltax, float deltay, float deltaz, struct osn_context *osn, int maxLevel);
 
 void cubeprint(cubeInfo *nfo);
 
+void cubesprintstats(cubeInfo *nfo, MPI_Comm comm, int rank);
+
 void stack_new(stack *astack, int maxsize, int debug);
 
 int stack_isempty(stack *s);
@@ -51,7 +129,9 @@ int stack_isfull(stack *s);
 
 void stack_delete(stack *s);
 
-void stack_push(stack *s,  float xval, float yval, float zval, float deltax, float deltay, float deltaz, int level, int r_id);
+void stack_push(stack *s,  float xval, float yval, float zval, float deltax, float deltay, float deltaz, int level,
+		uint64_t li, uint64_t lj, uint64_t lk);
 
-void stack_pop(stack *s, float *xval, float *yval, float *zval, float *deltax, float *deltay, float *deltaz, int *level, int * r_id);
+void stack_pop(stack *s, float *xval, float *yval, float *zval, float *deltax, float *deltay, float *deltaz, int *level,
+	       uint64_t *li, uint64_t *lj, uint64_t *lk);
 
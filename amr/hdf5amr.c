@@ -6,18 +6,27 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "hdf5.h"
+#include "cubes.h"
+#include "patches.h"
 #include "hdf5amr.h"
 
 static const int fnstrmax = 4095;
 
 void hdf5_init(struct hdf5amrinfo *nfo, char *name,
-		   MPI_Comm comm, int rank, int nprocs, int tsteps) {
+		   MPI_Comm comm, int rank, int nprocs, int tsteps,
+		   int maxlevel, float deltax, float deltay, float deltaz, int geometry, int output) {
   /* Set up struct, haven't decided if using all of these yet */
   nfo->name = name;
+  nfo->geometry = geometry;
+  nfo->output = output;
   nfo->comm = comm;
   nfo->rank = rank;
   nfo->nprocs = nprocs;
   nfo->tsteps = tsteps;
+  nfo->maxlevel = maxlevel;
+  nfo->deltas[0] = deltax;
+  nfo->deltas[1] = deltay;
+  nfo->deltas[2] = deltaz;
     
   nfo->numxvars = 0;
   nfo->maxxvars = 1000;
@@ -32,10 +41,76 @@ void hdf5_addxvar(struct hdf5amrinfo *nfo, char *varname) {
   nfo->numxvars++;
 }
 
-void hdf5_write(struct hdf5amrinfo *nfo, int tstep, uint64_t cnpoints, float *points, float **xvals) {
+/* Describe the explicit geometry and the variables of an HDF5 file in XDMF */
+static void writexdmf(struct hdf5amrinfo *nfo, char *dir, int tstep, char *h5name,
+		      uint64_t totalpoints, uint64_t totalcubes) {
   char fname[fnstrmax+1];
   int timedigits = 4;
-  uint64_t i, totalpoints, *npts_all;
+  FILE *f;
+  int i;
+
+  snprintf(fname, fnstrmax, "%s/%s.%0*d.xmf", dir, nfo->name, timedigits, tstep);
+  if( ! (f = fopen(fname, "w")) ) {
+    fprintf(stderr, "writehdf5 error: could not create %s \n", fname);
+    MPI_Abort(nfo->comm, 1);
+  }
+  fprintf(f, "<?xml version=\"1.0\" ?>\n"
+	  "<!DOCTYPE Xdmf SYSTEM \"Xdmf.dtd\" []>\n"
+	  "<Xdmf Version=\"2.0\">\n"
+	  " <Domain>\n"
+	  "  <Grid Name=\"%s\" GridType=\"Uniform\">\n"
+	  "   <Time Value=\"%d\"/>\n", nfo->name, tstep);
+  fprintf(f, "   <Topology TopologyType=\"Hexahedron\" NumberOfElements=\"%llu\">\n"
+	  "    <DataItem Dimensions=\"%llu 8\" NumberType=\"UInt\" Precision=\"8\" Format=\"HDF\">%s:/conn</DataItem>\n"
+	  "   </Topology>\n", (unsigned long long)totalcubes, (unsigned long long)totalcubes, h5name);
+  fprintf(f, "   <Geometry GeometryType=\"XYZ\">\n"
+	  "    <DataItem Dimensions=\"%llu 3\" NumberType=\"Float\" Precision=\"4\" Format=\"HDF\">%s:/points</DataItem>\n"
+	  "   </Geometry>\n", (unsigned long long)totalpoints, h5name);
+  for(i = 0; i < nfo->numxvars; i++) {
+    fprintf(f, "   <Attribute Name=\"%s\" AttributeType=\"Scalar\" Center=\"Node\">\n"
+	    "    <DataItem Dimensions=\"%llu\" NumberType=\"Float\" Precision=\"4\" Format=\"HDF\">%s:/%s</DataItem>\n"
+	    "   </Attribute>\n", nfo->xvarnames[i], (unsigned long long)totalpoints, h5name,
+	    nfo->xvarnames[i]);
+  }
+  fprintf(f, "  </Grid>\n </Domain>\n</Xdmf>\n");
+  fclose(f);
+}
+
+/* Select this rank's cubes in filespace, rows rows of ncols per cube: one run
+ * from cubestart, or by level, a run from levelstarts[l] for each level */
+static void selectcubes(hid_t filespace, hsize_t ncols, hsize_t rows, hsize_t cubestart,
+			hsize_t cncubes, int nlevels, uint64_t *levelstarts, uint64_t *levelcounts) {
+  hsize_t start[2], count[2];
+  H5S_seloper_t op = H5S_SELECT_SET;
+  int l;
+
+  start[1] = 0;
+  count[1] = ncols;
+  if(!levelstarts) {
+    start[0] = rows*cubestart;
+    count[0] = rows*cncubes;
+    H5Sselect_hyperslab(filespace, H5S_SELECT_SET, start, NULL, count, NULL );
+    return;
+  }
+  H5Sselect_none(filespace);
+  for(l = 0; l < nlevels; l++) {
+    if(levelcounts[l] == 0)
+      continue;
+    start[0] = rows*levelstarts[l];
+    count[0] = rows*levelcounts[l];
+    H5Sselect_hyperslab(filespace, op, start, NULL, count, NULL );
+    op = H5S_SELECT_OR;
+  }
+}
+
+void hdf5_write(struct hdf5amrinfo *nfo, char *dir, int tstep, uint64_t cnpoints,
+		float *points, uint64_t cncubes, uint64_t *keys, uint64_t *conn,
+		unsigned char *changed, uint64_t *levelcounts, float **xvals) {
+  char fname[fnstrmax+1];
+  char rel_fname[fnstrmax+1];
+  int timedigits = 4;
+  uint64_t c, i, totalpoints, *npts_all;
+  uint64_t totalcubes, *ncubes_all;
   
   hid_t file_id;
   hid_t plist_id;
@@ -43,24 +118,59 @@ void hdf5_write(struct hdf5amrinfo *nfo, int tstep, uint64_t cnpoints, float *po
   hid_t filespace;
   hid_t attr_id;
   hid_t did;
-  hsize_t start[1], count[1];
-  hsize_t dims[1];
+  hsize_t start[2], count[2];
+  hsize_t dims[2];
   herr_t err;
   MPI_Info info = MPI_INFO_NULL;
   uint64_t attr_data[2];
+  int keybits[3];
+  uint64_t pointstart, *hconn;
+  int l, nlevels = nfo->maxlevel+1;
+  int outflags[2], pointsbylevel;
+  uint64_t cubestart, *levels_all, *leveltotals, *levelstarts = NULL;
 
   npts_all = (uint64_t *) malloc(nfo->nprocs * sizeof(uint64_t));
+  ncubes_all = (uint64_t *) malloc(nfo->nprocs * sizeof(uint64_t));
 
   MPI_Allgather(&cnpoints, 1, MPI_UNSIGNED_LONG_LONG,
                 npts_all, 1, MPI_UNSIGNED_LONG_LONG, nfo->comm);
+  MPI_Allgather(&cncubes, 1, MPI_UNSIGNED_LONG_LONG,
+                ncubes_all, 1, MPI_UNSIGNED_LONG_LONG, nfo->comm);
+
+  /* Cubes of each level on each rank; by level, all ranks' cubes of a level
+   * are contiguous, and this rank's start after those of lower ranks */
+  levels_all = (uint64_t *) malloc(nfo->nprocs*nlevels * sizeof(uint64_t));
+  leveltotals = (uint64_t *) calloc(nlevels, sizeof(uint64_t));
+  MPI_Allgather(levelcounts, nlevels, MPI_UNSIGNED_LONG_LONG,
+                levels_all, nlevels, MPI_UNSIGNED_LONG_LONG, nfo->comm);
+  for(i = 0; i < nfo->nprocs; ++i)
+    for(l = 0; l < nlevels; l++)
+      leveltotals[l] += levels_all[i*nlevels + l];
+  if(nfo->output & OUTPUT_BYLEVEL) {
+    levelstarts = (uint64_t *) malloc(nlevels * sizeof(uint64_t));
+    for(cubestart = 0, l = 0; l < nlevels; l++) {
+      levelstarts[l] = cubestart;
+      for(i = 0; i < nfo->rank; ++i)
+	levelstarts[l] += levels_all[i*nlevels + l];
+      cubestart += leveltotals[l];
+    }
+  }
+
+  /* By level, each cube's own 8 points go with it, so cube c has points 8c
+   * to 8c+7 in every layout; shared points stay in rank order, and conn
+   * gives the global index of each corner */
+  pointsbylevel = levelstarts && !conn;
 
   /* Set filename */
-  snprintf(fname, fnstrmax, "%s.%0*d.h5", nfo->name, timedigits, tstep);
+  snprintf(fname, fnstrmax, "%s/%s.%0*d.h5", dir, nfo->name, timedigits, tstep);
+  snprintf(rel_fname, fnstrmax, "%s.%0*d.h5", nfo->name, timedigits, tstep);
 
   if(nfo->rank == 0) {
 
     for(totalpoints = 0, i = 0; i < nfo->nprocs; ++i)
       totalpoints += npts_all[i];
+    for(totalcubes = 0, i = 0; i < nfo->nprocs; ++i)
+      totalcubes += ncubes_all[i];
 
     if( (file_id = H5Fcreate(fname, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT)) < 0) {
 	fprintf(stderr, "writehdf5 error: could not create %s \n", fname);
@@ -80,6 +190,38 @@ void hdf5_write(struct hdf5amrinfo *nfo, int tstep, uint64_t cnpoints, float *po
     }
     /* Close filespace. */
     H5Sclose(filespace);
+
+    /* Octree key per cube, so readers can rebuild the tree */
+    dims[0] = totalcubes;
+    filespace = H5Screate_simple(1, dims, NULL);
+    did = H5Dcreate(file_id, "keys", H5T_NATIVE_ULLONG, filespace, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+    H5Dclose(did);
+
+    /* Flags of cubes that changed since the last step, for delta updates */
+    if(changed) {
+      did = H5Dcreate(file_id, "changed", H5T_NATIVE_UCHAR, filespace, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+      H5Dclose(did);
+    }
+    H5Sclose(filespace);
+
+    /* Explicit geometry: points, and hexahedra of 8 point indices */
+    if(nfo->geometry == GEOM_EXPLICIT) {
+      dims[0] = totalpoints;
+      dims[1] = 3;
+      filespace = H5Screate_simple(2, dims, NULL);
+      did = H5Dcreate(file_id, "points", H5T_NATIVE_FLOAT, filespace, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+      H5Dclose(did);
+      H5Sclose(filespace);
+
+      dims[0] = totalcubes;
+      dims[1] = 8;
+      filespace = H5Screate_simple(2, dims, NULL);
+      did = H5Dcreate(file_id, "conn", H5T_NATIVE_ULLONG, filespace, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+      H5Dclose(did);
+      H5Sclose(filespace);
+
+      writexdmf(nfo, dir, tstep, rel_fname, totalpoints, totalcubes);
+    }
     
     dims[0] = nfo->nprocs; 
     filespace = H5Screate_simple(1, dims, NULL);
@@ -88,6 +230,21 @@ void hdf5_write(struct hdf5amrinfo *nfo, int tstep, uint64_t cnpoints, float *po
 
     err = H5Dwrite(did, H5T_NATIVE_ULLONG, H5S_ALL, H5S_ALL, H5P_DEFAULT, npts_all);
 
+    H5Dclose(did);
+
+    did = H5Dcreate(file_id, "cncubes", H5T_NATIVE_ULLONG, filespace, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+
+    err = H5Dwrite(did, H5T_NATIVE_ULLONG, H5S_ALL, H5S_ALL, H5P_DEFAULT, ncubes_all);
+
+    H5Dclose(did);
+    H5Sclose(filespace);
+
+    /* Cubes of each level on each rank */
+    dims[0] = nfo->nprocs;
+    dims[1] = nlevels;
+    filespace = H5Screate_simple(2, dims, NULL);
+    did = H5Dcreate(file_id, "cnlevelcubes", H5T_NATIVE_ULLONG, filespace, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+    err = H5Dwrite(did, H5T_NATIVE_ULLONG, H5S_ALL, H5S_ALL, H5P_DEFAULT, levels_all);
     H5Dclose(did);
     H5Sclose(filespace);
 
@@ -113,6 +270,44 @@ void hdf5_write(struct hdf5amrinfo *nfo, int tstep, uint64_t cnpoints, float *po
     /* Close the dataspace. */
     err = H5Sclose(filespace);
 
+    /* Key layout: the Morton code of the lowest corner, in cells of width
+     * deltas/2^maxlevel, is shifted above levelbits holding the level */
+    keybits[0] = nfo->maxlevel;
+    keybits[1] = KEYLEVELBITS;
+    keybits[2] = KEYAXISBITS;
+    dims[0] = 3;
+    filespace = H5Screate_simple(1, dims, NULL);
+    attr_id = H5Acreate2 (file_id, "maxlevel, levelbits, axisbits", H5T_NATIVE_INT, filespace,
+			  H5P_DEFAULT, H5P_DEFAULT);
+    err = H5Awrite(attr_id, H5T_NATIVE_INT, keybits);
+    err = H5Aclose(attr_id);
+    attr_id = H5Acreate2 (file_id, "deltas", H5T_NATIVE_FLOAT, filespace,
+			  H5P_DEFAULT, H5P_DEFAULT);
+    err = H5Awrite(attr_id, H5T_NATIVE_FLOAT, nfo->deltas);
+    err = H5Aclose(attr_id);
+    err = H5Sclose(filespace);
+
+    /* Which cubes were written, and how: with allnodes every octree node, with
+     * bylevel all cubes of level 0, then of level 1, ..., with their points
+     * unless they share them */
+    outflags[0] = (nfo->output & OUTPUT_ALLNODES) != 0;
+    outflags[1] = (nfo->output & OUTPUT_BYLEVEL) != 0;
+    dims[0] = 2;
+    filespace = H5Screate_simple(1, dims, NULL);
+    attr_id = H5Acreate2 (file_id, "allnodes, bylevel", H5T_NATIVE_INT, filespace,
+			  H5P_DEFAULT, H5P_DEFAULT);
+    err = H5Awrite(attr_id, H5T_NATIVE_INT, outflags);
+    err = H5Aclose(attr_id);
+    err = H5Sclose(filespace);
+
+    dims[0] = nlevels;
+    filespace = H5Screate_simple(1, dims, NULL);
+    attr_id = H5Acreate2 (file_id, "levelcounts", H5T_NATIVE_ULLONG, filespace,
+			  H5P_DEFAULT, H5P_DEFAULT);
+    err = H5Awrite(attr_id, H5T_NATIVE_ULLONG, leveltotals);
+    err = H5Aclose(attr_id);
+    err = H5Sclose(filespace);
+
     /* Close the file */
     H5Fclose(file_id);
 
@@ -130,10 +325,11 @@ void hdf5_write(struct hdf5amrinfo *nfo, int tstep, uint64_t cnpoints, float *po
 
   H5Pset_libver_bounds(plist_id, H5F_LIBVER_LATEST, H5F_LIBVER_LATEST);
 
-  if(H5Pset_fapl_mpio(plist_id, MPI_COMM_WORLD, info) < 0) {
+  if(H5Pset_fapl_mpio(plist_id, nfo->comm, info) < 0) {
     printf("hdf5 error: Could not create property list \n");
     MPI_Abort(nfo->comm, 1);
   }
+  MPI_Info_free(&info);
   
   MPI_Barrier(nfo->comm);
   if( (file_id = H5Fopen(fname, H5F_ACC_RDWR, plist_id)) < 0) {
@@ -148,6 +344,10 @@ void hdf5_write(struct hdf5amrinfo *nfo, int tstep, uint64_t cnpoints, float *po
   for(start[0] = 0, i = 0; i < nfo->rank; ++i) {
     start[0] += (hsize_t)npts_all[i];
   }
+  pointstart = start[0];
+  for(cubestart = 0, i = 0; i < nfo->rank; ++i) {
+    cubestart += ncubes_all[i];
+  }
 
   count[0] = (hsize_t)(cnpoints);
 
@@ -168,7 +368,10 @@ void hdf5_write(struct hdf5amrinfo *nfo, int tstep, uint64_t cnpoints, float *po
 
     /* Select hyperslab in the file.*/
     filespace = H5Dget_space(did);
-    H5Sselect_hyperslab(filespace, H5S_SELECT_SET, start, NULL, count, NULL );
+    if(pointsbylevel)
+      selectcubes(filespace, 1, 8, cubestart, cncubes, nlevels, levelstarts, levelcounts);
+    else
+      H5Sselect_hyperslab(filespace, H5S_SELECT_SET, start, NULL, count, NULL );
 
     err = H5Dwrite(did, H5T_NATIVE_FLOAT, memspace, filespace, plist_id, xvals[i]);
 
@@ -182,6 +385,81 @@ void hdf5_write(struct hdf5amrinfo *nfo, int tstep, uint64_t cnpoints, float *po
 
   if(H5Sclose(memspace)  != 0)
     printf("hdf5 error: Could not close memory space \n");
+
+  /* Write keys, offset by the cubes on lower ranks, or level by level */
+  count[0] = (hsize_t)(cncubes);
+  memspace = H5Screate_simple(1, count, NULL);
+
+  did = H5Dopen(file_id, "keys", H5P_DEFAULT);
+  filespace = H5Dget_space(did);
+  selectcubes(filespace, 1, 1, cubestart, cncubes, nlevels, levelstarts, levelcounts);
+  err = H5Dwrite(did, H5T_NATIVE_ULLONG, memspace, filespace, plist_id, keys);
+  if( err < 0) {
+    fprintf(stderr, "hdf5 error: could not write datset keys \n");
+    MPI_Abort(nfo->comm, 1);
+  }
+  H5Sclose(filespace);
+  H5Dclose(did);
+
+  if(changed) {
+    did = H5Dopen(file_id, "changed", H5P_DEFAULT);
+    filespace = H5Dget_space(did);
+    selectcubes(filespace, 1, 1, cubestart, cncubes, nlevels, levelstarts, levelcounts);
+    err = H5Dwrite(did, H5T_NATIVE_UCHAR, memspace, filespace, plist_id, changed);
+    if( err < 0) {
+      fprintf(stderr, "hdf5 error: could not write datset changed \n");
+      MPI_Abort(nfo->comm, 1);
+    }
+    H5Sclose(filespace);
+    H5Dclose(did);
+  }
+
+  if(H5Sclose(memspace)  != 0)
+    printf("hdf5 error: Could not close memory space \n");
+
+  if(nfo->geometry == GEOM_EXPLICIT) {
+    /* Connectivity, to global point indices */
+    hconn = cubeshexconn(cncubes, conn, pointsbylevel ? 0 : pointstart);
+    if(pointsbylevel)
+      for(c = 0, l = 0; l < nlevels; c += levelcounts[l], l++)
+	for(i = c*8; i < (c + levelcounts[l])*8; i++)
+	  hconn[i] += (levelstarts[l] - c)*8;
+    count[1] = 8;
+    memspace = H5Screate_simple(2, count, NULL);
+    did = H5Dopen(file_id, "conn", H5P_DEFAULT);
+    filespace = H5Dget_space(did);
+    selectcubes(filespace, 8, 1, cubestart, cncubes, nlevels, levelstarts, levelcounts);
+    err = H5Dwrite(did, H5T_NATIVE_ULLONG, memspace, filespace, plist_id, hconn);
+    if( err < 0) {
+      fprintf(stderr, "hdf5 error: could not write datset conn \n");
+      MPI_Abort(nfo->comm, 1);
+    }
+    H5Sclose(filespace);
+    H5Dclose(did);
+    H5Sclose(memspace);
+    free(hconn);
+
+    /* Points */
+    start[0] = pointstart;
+    start[1] = 0;
+    count[0] = (hsize_t)(cnpoints);
+    count[1] = 3;
+    memspace = H5Screate_simple(2, count, NULL);
+    did = H5Dopen(file_id, "points", H5P_DEFAULT);
+    filespace = H5Dget_space(did);
+    if(pointsbylevel)
+      selectcubes(filespace, 3, 8, cubestart, cncubes, nlevels, levelstarts, levelcounts);
+    else
+      H5Sselect_hyperslab(filespace, H5S_SELECT_SET, start, NULL, count, NULL );
+    err = H5Dwrite(did, H5T_NATIVE_FLOAT, memspace, filespace, plist_id, points);
+    if( err < 0) {
+      fprintf(stderr, "hdf5 error: could not write datset points \n");
+      MPI_Abort(nfo->comm, 1);
+    }
+    H5Sclose(filespace);
+    H5Dclose(did);
+    H5Sclose(memspace);
+  }
   
   if(H5Pclose(plist_id) < 0)
     printf("hdf5 error: Could not close property list \n");
@@ -190,7 +468,223 @@ void hdf5_write(struct hdf5amrinfo *nfo, int tstep, uint64_t cnpoints, float *po
     printf("hdf5 error: Could not close HDF5 file \n");
 
   free(npts_all);
+  free(ncubes_all);
+  free(levels_all);
+  free(leveltotals);
+  free(levelstarts);
+
+}
+
+/* Write patches as a group per level, Chombo style: "boxes" holds the
+ * inclusive cell range (lo i,j,k, hi i,j,k) of each box in that level's cell
+ * indices, the field holds the node values of all boxes, i fastest, and
+ * "offsets" the start of each box in it. */
+void hdf5_writepatches(struct hdf5amrinfo *nfo, char *dir, int tstep, patchInfo *patches) {
+  char fname[fnstrmax+1];
+  char gname[64];
+  int timedigits = 4;
+  int l, b, nlevels = patches->maxlevel+1;
+  uint64_t i, *counts, *counts_all, *totals, *offsets;
+  uint64_t boxstart, pointstart;
+  
+  hid_t file_id;
+  hid_t group_id;
+  hid_t plist_id;
+  hid_t memspace;
+  hid_t filespace;
+  hid_t attr_id;
+  hid_t did;
+  hsize_t start[2], count[2];
+  hsize_t dims[2];
+  herr_t err;
+  MPI_Info info = MPI_INFO_NULL;
+  uint64_t attr_data[2];
+  float dx[3];
+  const char *dataname = nfo->numxvars ? nfo->xvarnames[0] : "data";
+
+  /* Boxes and points of every level on every rank */
+  counts = (uint64_t *) malloc(2*nlevels * sizeof(uint64_t));
+  counts_all = (uint64_t *) malloc(2*nlevels*nfo->nprocs * sizeof(uint64_t));
+  totals = (uint64_t *) calloc(2*nlevels, sizeof(uint64_t));
+  for(l = 0; l < nlevels; l++) {
+    counts[2*l] = patches->levels[l].nboxes;
+    counts[2*l+1] = patches->levels[l].npoints;
+  }
+  MPI_Allgather(counts, 2*nlevels, MPI_UNSIGNED_LONG_LONG,
+                counts_all, 2*nlevels, MPI_UNSIGNED_LONG_LONG, nfo->comm);
+  for(i = 0; i < nfo->nprocs; ++i)
+    for(l = 0; l < 2*nlevels; l++)
+      totals[l] += counts_all[i*2*nlevels + l];
+
+  /* Set filename */
+  snprintf(fname, fnstrmax, "%s/%s.%0*d.h5", dir, nfo->name, timedigits, tstep);
+
+  if(nfo->rank == 0) {
+
+    if( (file_id = H5Fcreate(fname, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT)) < 0) {
+	fprintf(stderr, "writehdf5 error: could not create %s \n", fname);
+	MPI_Abort(nfo->comm, 1);
+      }
+
+    for(l = 0; l < nlevels; l++) {
+      snprintf(gname, sizeof(gname), "level_%d", l);
+      group_id = H5Gcreate(file_id, gname, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+
+      dims[0] = totals[2*l];
+      dims[1] = 6;
+      filespace = H5Screate_simple(2, dims, NULL);
+      did = H5Dcreate(group_id, "boxes", H5T_NATIVE_INT, filespace, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+      H5Dclose(did);
+      H5Sclose(filespace);
+
+      filespace = H5Screate_simple(1, dims, NULL);
+      did = H5Dcreate(group_id, "offsets", H5T_NATIVE_ULLONG, filespace, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+      H5Dclose(did);
+      H5Sclose(filespace);
+
+      dims[0] = totals[2*l+1];
+      filespace = H5Screate_simple(1, dims, NULL);
+      did = H5Dcreate(group_id, dataname, H5T_NATIVE_FLOAT, filespace, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+      H5Dclose(did);
+      H5Sclose(filespace);
+
+      /* Cell size of the level */
+      dx[0] = nfo->deltas[0] / (1 << l);
+      dx[1] = nfo->deltas[1] / (1 << l);
+      dx[2] = nfo->deltas[2] / (1 << l);
+      dims[0] = 3;
+      filespace = H5Screate_simple(1, dims, NULL);
+      attr_id = H5Acreate2 (group_id, "dx", H5T_NATIVE_FLOAT, filespace, H5P_DEFAULT, H5P_DEFAULT);
+      err = H5Awrite(attr_id, H5T_NATIVE_FLOAT, dx);
+      err = H5Aclose(attr_id);
+      err = H5Sclose(filespace);
+
+      H5Gclose(group_id);
+    }
+
+    /** WRITE ATTRIBUTE INFORMATION **/
+
+    attr_data[0] = tstep;
+    attr_data[1] = nlevels;
+    dims[0] = 2;
+    filespace = H5Screate_simple(1, dims, NULL);
+    attr_id = H5Acreate2 (file_id, "tstep, num_levels", H5T_NATIVE_ULLONG, filespace, 
+			  H5P_DEFAULT, H5P_DEFAULT);
+    err = H5Awrite(attr_id, H5T_NATIVE_ULLONG, attr_data);
+    err = H5Aclose(attr_id);
+    err = H5Sclose(filespace);
+
+    H5Fclose(file_id);
+  }
+
+  /* Set up MPI info */
+  MPI_Info_create(&info);
+  MPI_Info_set(info, "striping_factor", "1");
+
+  /* Set up file access property list with parallel I/O access */
+  if( (plist_id = H5Pcreate(H5P_FILE_ACCESS)) < 0) {
+    printf("hdf5 error: Could not create property list \n");
+    MPI_Abort(nfo->comm, 1);
+  }
+
+  H5Pset_libver_bounds(plist_id, H5F_LIBVER_LATEST, H5F_LIBVER_LATEST);
+
+  if(H5Pset_fapl_mpio(plist_id, nfo->comm, info) < 0) {
+    printf("hdf5 error: Could not create property list \n");
+    MPI_Abort(nfo->comm, 1);
+  }
+  MPI_Info_free(&info);
+  
+  MPI_Barrier(nfo->comm);
+  if( (file_id = H5Fopen(fname, H5F_ACC_RDWR, plist_id)) < 0) {
+    fprintf(stderr, "writehdf5p error: could not open %s \n", fname);
+    MPI_Abort(nfo->comm, 1);
+  }
+      
+  if(H5Pclose(plist_id) < 0) {
+    printf("hdf5 error: Could not close property list \n");
+    MPI_Abort(nfo->comm, 1);
+  }
+
+  /* Create property list for collective dataset write. */
+  plist_id = H5Pcreate(H5P_DATASET_XFER);
+  H5Pset_dxpl_mpio(plist_id, H5FD_MPIO_COLLECTIVE);
+
+  for(l = 0; l < nlevels; l++) {
+    patchLevel *lev = &patches->levels[l];
+
+    for(boxstart = 0, pointstart = 0, i = 0; i < nfo->rank; ++i) {
+      boxstart += counts_all[i*2*nlevels + 2*l];
+      pointstart += counts_all[i*2*nlevels + 2*l+1];
+    }
+
+    snprintf(gname, sizeof(gname), "level_%d", l);
+    group_id = H5Gopen(file_id, gname, H5P_DEFAULT);
+
+    /* Boxes */
+    start[0] = boxstart;
+    start[1] = 0;
+    count[0] = lev->nboxes;
+    count[1] = 6;
+    memspace = H5Screate_simple(2, count, NULL);
+    did = H5Dopen(group_id, "boxes", H5P_DEFAULT);
+    filespace = H5Dget_space(did);
+    H5Sselect_hyperslab(filespace, H5S_SELECT_SET, start, NULL, count, NULL );
+    err = H5Dwrite(did, H5T_NATIVE_INT, memspace, filespace, plist_id, lev->boxes);
+    if( err < 0) {
+      fprintf(stderr, "hdf5 error: could not write datset %s/boxes \n", gname);
+      MPI_Abort(nfo->comm, 1);
+    }
+    H5Sclose(filespace);
+    H5Dclose(did);
+    H5Sclose(memspace);
+
+    /* Offsets, into the data of all ranks */
+    offsets = (uint64_t *) malloc((lev->nboxes+1) * sizeof(uint64_t));
+    for(b = 0; b < lev->nboxes; b++)
+      offsets[b] = pointstart + lev->offsets[b];
+    memspace = H5Screate_simple(1, count, NULL);
+    did = H5Dopen(group_id, "offsets", H5P_DEFAULT);
+    filespace = H5Dget_space(did);
+    H5Sselect_hyperslab(filespace, H5S_SELECT_SET, start, NULL, count, NULL );
+    err = H5Dwrite(did, H5T_NATIVE_ULLONG, memspace, filespace, plist_id, offsets);
+    if( err < 0) {
+      fprintf(stderr, "hdf5 error: could not write datset %s/offsets \n", gname);
+      MPI_Abort(nfo->comm, 1);
+    }
+    H5Sclose(filespace);
+    H5Dclose(did);
+    H5Sclose(memspace);
+    free(offsets);
+
+    /* Node values */
+    start[0] = pointstart;
+    count[0] = lev->npoints;
+    memspace = H5Screate_simple(1, count, NULL);
+    did = H5Dopen(group_id, dataname, H5P_DEFAULT);
+    filespace = H5Dget_space(did);
+    H5Sselect_hyperslab(filespace, H5S_SELECT_SET, start, NULL, count, NULL );
+    err = H5Dwrite(did, H5T_NATIVE_FLOAT, memspace, filespace, plist_id, lev->data);
+    if( err < 0) {
+      fprintf(stderr, "hdf5 error: could not write datset %s/%s \n", gname, dataname);
+      MPI_Abort(nfo->comm, 1);
+    }
+    H5Sclose(filespace);
+    H5Dclose(did);
+    H5Sclose(memspace);
+
+    H5Gclose(group_id);
+  }
+
+  if(H5Pclose(plist_id) < 0)
+    printf("hdf5 error: Could not close property list \n");
+
+  if(H5Fclose(file_id) != 0)
+    printf("hdf5 error: Could not close HDF5 file \n");
 
+  free(counts);
+  free(counts_all);
+  free(totals);
 }
 
 void hdf5_finalize(struct hdf5amrinfo *nfo) {
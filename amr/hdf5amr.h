@@ -11,6 +11,11 @@ struct hdf5amrinfo {
   int rank;
   int nprocs;
   int tsteps;
+
+  int geometry;          /* GEOM_COMPACT or GEOM_EXPLICIT */
+  int output;            /* OUTPUT_ALLNODES and OUTPUT_BYLEVEL flags */
+  int maxlevel;          /* Needed with deltas to decode cube keys */
+  float deltas[3];
   
   int numxvars;
   int maxxvars;
@@ -20,9 +25,14 @@ struct hdf5amrinfo {
 
 void hdf5_addxvar(struct hdf5amrinfo *nfo, char *varname);
 
-void hdf5_write(struct hdf5amrinfo *nfo, int tstep, uint64_t cnpoints, float *points, float **xvals);
+void hdf5_write(struct hdf5amrinfo *nfo, char *dir, int tstep, uint64_t cnpoints,
+		float *points, uint64_t cncubes, uint64_t *keys, uint64_t *conn,
+		unsigned char *changed, uint64_t *levelcounts, float **xvals);
+
+void hdf5_writepatches(struct hdf5amrinfo *nfo, char *dir, int tstep, patchInfo *patches);
 
 void hdf5_finalize(struct hdf5amrinfo *nfo);
 
 void hdf5_init(struct hdf5amrinfo *nfo, char *name,
-	       MPI_Comm comm, int rank, int nprocs, int tsteps);
+	       MPI_Comm comm, int rank, int nprocs, int tsteps,
+	       int maxlevel, float deltax, float deltay, float deltaz, int geometry, int output);
@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) DoD HPCMP PETTT.  All rights reserved.
+ * See LICENSE file for details.
+ */
+
+/* Thread parallel refinement of the base blocks.  Threads take blocks
+ * dynamically, one at a time, and refine them into their own growable cube
+ * buffers with their own stacks, both kept between time steps.  A prefix sum
+ * of the cubes of each block then places every block where the serial loop
+ * would have, and each thread copies its blocks there.  Shared points are
+ * merged by rehashing the corners of all cubes. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <omp.h>
+#include "cubes.h"
+#include "parrefine.h"
+
+void refinepoolinit(refinePool *pool, int nblocks, int maxlevel, int dedup, int debug) {
+  int i;
+
+  pool->nthreads = omp_get_max_threads();
+  pool->nblocks = nblocks;
+  pool->bufs = (cubeInfo *) malloc(pool->nthreads*sizeof(cubeInfo));
+  pool->stacks = (stack *) malloc(pool->nthreads*sizeof(stack));
+  for (i = 0; i < pool->nthreads; i++) {
+    cubesinit(&pool->bufs[i], 0, maxlevel, dedup, debug);
+    cubesgrow(&pool->bufs[i], 4096);
+    stack_new(&pool->stacks[i], 8*(maxlevel+1), debug);
+  }
+  pool->blockthread = (int *) malloc(nblocks*sizeof(int));
+  pool->blockstart = (uint64_t *) malloc(nblocks*sizeof(uint64_t));
+  pool->blockcubes = (uint64_t *) malloc(nblocks*sizeof(uint64_t));
+  pool->blockoffset = (uint64_t *) malloc(nblocks*sizeof(uint64_t));
+  pool->values = NULL;
+  pool->maxvalues = 0;
+}
+
+void refinepoolfree(refinePool *pool) {
+  int i;
+
+  for (i = 0; i < pool->nthreads; i++) {
+    cubesfree(&pool->bufs[i]);
+    stack_delete(&pool->stacks[i]);
+  }
+  free(pool->bufs);
+  free(pool->stacks);
+  free(pool->blockthread);
+  free(pool->blockstart);
+  free(pool->blockcubes);
+  free(pool->blockoffset);
+  free(pool->values);
+}
+
+/* Refine all base blocks into cubes, in blockorder if given */
+void refineblocks(refinePool *pool, cubeInfo *cubes, int t, float thres, int *blockorder,
+		  int cni, int cnj, int cnk, int is, int js, int ks, float xs, float ys, float zs,
+		  float deltax, float deltay, float deltaz, struct osn_context *osn, int maxLevel) {
+  uint64_t total = 0, nnodes = 0, nnoise = 0;
+
+#pragma omp parallel
+  {
+    int tid = omp_get_thread_num();
+    cubeInfo *buf = &pool->bufs[tid];
+    int n, b, i, j, k;
+
+    cubesreset(buf);
+    buf->allnodes = cubes->allnodes;
+
+#pragma omp for schedule(dynamic, 1)
+    for (n = 0; n < pool->nblocks; n++) {
+      b = blockorder ? blockorder[n] : n;
+      i = b % cni;
+      j = (b / cni) % cnj;
+      k = b / (cni*cnj);
+
+      pool->blockthread[n] = tid;
+      pool->blockstart[n] = buf->ncubes;
+      refine(buf, &pool->stacks[tid], t, b+1, thres, 0, is+i, js+j, ks+k,
+	     xs + i*deltax, ys + j*deltay, zs + k*deltaz, deltax, deltay, deltaz, osn, maxLevel);
+      pool->blockcubes[n] = buf->ncubes - pool->blockstart[n];
+    }
+
+#pragma omp single
+    {
+      for (n = 0; n < pool->nblocks; n++) {
+	pool->blockoffset[n] = total;
+	total += pool->blockcubes[n];
+      }
+      cubesgrow(cubes, total);
+      if (cubes->dedup && pool->maxvalues < total*8) {
+	free(pool->values);
+	pool->maxvalues = total*8;
+	pool->values = (float *) malloc(pool->maxvalues*sizeof(float));
+      }
+    }
+
+    /* Each thread copies its own blocks */
+    for (n = 0; n < pool->nblocks; n++) {
+      uint64_t c, src = pool->blockstart[n], dst = pool->blockoffset[n];
+      uint64_t nc = pool->blockcubes[n];
+
+      if (pool->blockthread[n] != tid)
+	continue;
+      memcpy(cubes->keys + dst, buf->keys + src, nc*sizeof(uint64_t));
+      if (cubes->dedup) {
+	for (c = 0; c < nc; c++)
+	  cubevalues(buf, src+c, pool->values + (dst+c)*8);
+      } else {
+	memcpy(cubes->points + dst*24, buf->points + src*24, nc*24*sizeof(float));
+	memcpy(cubes->data + dst*8, buf->data + src*8, nc*8*sizeof(float));
+      }
+    }
+
+#pragma omp atomic
+    nnodes += buf->nnodes;
+#pragma omp atomic
+    nnoise += buf->nnoise;
+  }
+
+  if (cubes->dedup) {
+    cubesrebuild(cubes, total, cubes->keys, pool->values, NULL, deltax, deltay, deltaz);
+  } else {
+    cubes->ncubes = total;
+    cubes->npoints = total*8;
+  }
+  cubes->nnodes = nnodes;
+  cubes->nnoise = nnoise;
+}
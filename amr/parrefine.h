@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) DoD HPCMP PETTT.  All rights reserved.
+ * See LICENSE file for details.
+ */
+
+/* Buffers of the threads refining base blocks, kept between time steps */
+typedef struct refinePool {
+  int nthreads;
+  int nblocks;
+  cubeInfo *bufs;         /* Cubes of each thread; grow as needed */
+  stack *stacks;          /* Refinement stack of each thread */
+  int *blockthread;       /* Thread that refined each block */
+  uint64_t *blockstart;   /* First cube of each block in its thread's buffer */
+  uint64_t *blockcubes;   /* Cubes of each block */
+  uint64_t *blockoffset;  /* First cube of each block in the merged cubes */
+  float *values;          /* Corner values to merge shared points */
+  uint64_t maxvalues;
+} refinePool;
+
+void refinepoolinit(refinePool *pool, int nblocks, int maxlevel, int dedup, int debug);
+
+void refinepoolfree(refinePool *pool);
+
+void refineblocks(refinePool *pool, cubeInfo *cubes, int t, float thres, int *blockorder,
+		  int cni, int cnj, int cnk, int is, int js, int ks, float xs, float ys, float zs,
+		  float deltax, float deltay, float deltaz, struct osn_context *osn, int maxLevel);
@@ -0,0 +1,282 @@
+/*
+ * Copyright (c) DoD HPCMP PETTT.  All rights reserved.
+ * See LICENSE file for details.
+ */
+
+/* Block-structured output: the leaf cubes of each level are clustered into
+ * rectangular patches with the Berger-Rigoutsos algorithm (signatures, holes
+ * and inflection points), and the field is sampled on every node of every
+ * patch, like a Chombo or AMReX level.  Each rank clusters its own cubes. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "open-simplex-noise.h"
+#include "cubes.h"
+#include "patches.h"
+
+void patchesinit(patchInfo *nfo, int maxlevel, float efficiency, int debug) {
+  int l;
+
+  nfo->debug = debug;
+  nfo->maxlevel = maxlevel;
+  nfo->efficiency = efficiency;
+  nfo->tags = NULL;
+  nfo->maxtags = 0;
+  nfo->levels = (patchLevel *) calloc(maxlevel+1, sizeof(patchLevel));
+  for (l = 0; l <= maxlevel; l++) {
+    nfo->levels[l].maxboxes = 64;
+    nfo->levels[l].boxes = (patchBox *) malloc(64*sizeof(patchBox));
+    nfo->levels[l].offsets = (uint64_t *) malloc(64*sizeof(uint64_t));
+  }
+}
+
+void patchesfree(patchInfo *nfo) {
+  int l;
+
+  for (l = 0; l <= nfo->maxlevel; l++) {
+    free(nfo->levels[l].boxes);
+    free(nfo->levels[l].offsets);
+    free(nfo->levels[l].data);
+  }
+  free(nfo->levels);
+  free(nfo->tags);
+  nfo->levels = NULL;
+  nfo->tags = NULL;
+  nfo->maxtags = 0;
+}
+
+static void addbox(patchLevel *lev, int *lo, int *hi) {
+  int a;
+
+  if (lev->nboxes == lev->maxboxes) {
+    lev->maxboxes *= 2;
+    lev->boxes = (patchBox *) realloc(lev->boxes, lev->maxboxes*sizeof(patchBox));
+    lev->offsets = (uint64_t *) realloc(lev->offsets, lev->maxboxes*sizeof(uint64_t));
+    if (!lev->boxes || !lev->offsets) {
+      printf("ERROR: Could not grow patch list to %d boxes\n", lev->maxboxes);
+      exit(1);
+    }
+  }
+  for (a = 0; a < 3; a++) {
+    lev->boxes[lev->nboxes].lo[a] = lo[a];
+    lev->boxes[lev->nboxes].hi[a] = hi[a];
+  }
+  lev->nboxes++;
+}
+
+/* Move the tags with coordinate a below cut to the front; returns how many */
+static uint64_t partition(int *tags, uint64_t n, int a, int cut) {
+  uint64_t i = 0, j = n;
+  int tmp[3];
+
+  while (i < j) {
+    if (tags[3*i+a] < cut) {
+      i++;
+    } else {
+      j--;
+      memcpy(tmp, tags+3*i, sizeof(tmp));
+      memcpy(tags+3*i, tags+3*j, sizeof(tmp));
+      memcpy(tags+3*j, tmp, sizeof(tmp));
+    }
+  }
+  return i;
+}
+
+/* Cover the n tagged cells with boxes of at least the target efficiency */
+static void cluster(patchInfo *nfo, patchLevel *lev, int *tags, uint64_t n) {
+  int lo[3], hi[3], len[3];
+  uint64_t *sig[3];
+  uint64_t i, vol, nleft;
+  int a, c, mid, dist;
+  int splitaxis = -1, cut = 0, bestdist = 0;
+  int64_t lap0, lap1, strength, beststrength = 0;
+
+  /* Shrink to the bounding box of the tags */
+  for (a = 0; a < 3; a++) {
+    lo[a] = hi[a] = tags[a];
+  }
+  for (i = 1; i < n; i++)
+    for (a = 0; a < 3; a++) {
+      if (tags[3*i+a] < lo[a])  lo[a] = tags[3*i+a];
+      if (tags[3*i+a] > hi[a])  hi[a] = tags[3*i+a];
+    }
+  for (vol = 1, a = 0; a < 3; a++) {
+    len[a] = hi[a] - lo[a] + 1;
+    vol *= len[a];
+  }
+  if (n >= nfo->efficiency*vol) {
+    addbox(lev, lo, hi);
+    return;
+  }
+
+  /* Signatures: the number of tags in each plane along each axis */
+  for (a = 0; a < 3; a++)
+    sig[a] = (uint64_t *) calloc(len[a], sizeof(uint64_t));
+  for (i = 0; i < n; i++)
+    for (a = 0; a < 3; a++)
+      sig[a][tags[3*i+a]-lo[a]]++;
+
+  /* Split at a hole, the one nearest the middle of the longest axis */
+  for (a = 0; a < 3; a++) {
+    mid = len[a]/2;
+    for (c = 1; c < len[a]-1; c++) {
+      dist = abs(c - mid);
+      if (!sig[a][c] && (splitaxis < 0 || len[a] > len[splitaxis] ||
+			 (len[a] == len[splitaxis] && dist < bestdist))) {
+	splitaxis = a;
+	cut = c;
+	bestdist = dist;
+      }
+    }
+  }
+
+  /* Otherwise at the strongest inflection, where the Laplacian of a
+   * signature changes sign */
+  if (splitaxis < 0) {
+    for (a = 0; a < 3; a++) {
+      mid = len[a]/2;
+      for (c = 2; c < len[a]-1; c++) {
+	lap0 = (int64_t)sig[a][c-2] - 2*(int64_t)sig[a][c-1] + (int64_t)sig[a][c];
+	lap1 = (int64_t)sig[a][c-1] - 2*(int64_t)sig[a][c] + (int64_t)sig[a][c+1];
+	if ((lap0 < 0) == (lap1 < 0))
+	  continue;
+	strength = lap1 > lap0 ? lap1 - lap0 : lap0 - lap1;
+	dist = abs(c - mid);
+	if (strength > beststrength || (strength == beststrength && dist < bestdist)) {
+	  splitaxis = a;
+	  cut = c;
+	  beststrength = strength;
+	  bestdist = dist;
+	}
+      }
+    }
+  }
+
+  /* Otherwise bisect the longest axis */
+  if (splitaxis < 0) {
+    splitaxis = 0;
+    for (a = 1; a < 3; a++)
+      if (len[a] > len[splitaxis])
+	splitaxis = a;
+    cut = len[splitaxis]/2;
+  }
+
+  for (a = 0; a < 3; a++)
+    free(sig[a]);
+
+  if (nfo->debug)
+    printf("Patch split (%d %d %d)-(%d %d %d) on axis %d at %d: %llu tags in %llu cells\n",
+	   lo[0], lo[1], lo[2], hi[0], hi[1], hi[2], splitaxis, lo[splitaxis]+cut,
+	   (unsigned long long)n, (unsigned long long)vol);
+
+  nleft = partition(tags, n, splitaxis, lo[splitaxis]+cut);
+  cluster(nfo, lev, tags, nleft);
+  cluster(nfo, lev, tags+3*nleft, n-nleft);
+}
+
+void patchesbuild(patchInfo *nfo, cubeInfo *cubes, int t, float deltax, float deltay, float deltaz,
+		  struct osn_context *osn) {
+  uint64_t start[32], fill[32];    /* Tags of each level; levels fit in KEYLEVELBITS */
+  uint64_t i, ai, aj, ak;
+  int l, b, ii, jj, kk, level;
+  patchLevel *lev;
+
+  if (nfo->maxtags < cubes->ncubes) {
+    free(nfo->tags);
+    nfo->maxtags = cubes->ncubes;
+    nfo->tags = (int *) malloc(nfo->maxtags*3*sizeof(int));
+  }
+
+  /* Bucket the cubes by level, as cells of that level */
+  for (l = 0; l <= nfo->maxlevel; l++) {
+    nfo->levels[l].ntagged = 0;
+    nfo->levels[l].nboxes = 0;
+    nfo->levels[l].ncells = 0;
+    nfo->levels[l].npoints = 0;
+  }
+  for (i = 0; i < cubes->ncubes; i++) {
+    level = (int)(cubes->keys[i] & (((uint64_t)1 << KEYLEVELBITS) - 1));
+    nfo->levels[level].ntagged++;
+  }
+  for (start[0] = 0, l = 1; l <= nfo->maxlevel; l++)
+    start[l] = start[l-1] + nfo->levels[l-1].ntagged;
+  memcpy(fill, start, (nfo->maxlevel+1)*sizeof(uint64_t));
+  for (i = 0; i < cubes->ncubes; i++) {
+    int *tag;
+
+    cubekeydecode(cubes->keys[i], &ai, &aj, &ak, &level);
+    tag = nfo->tags + 3*fill[level]++;
+    tag[0] = (int)(ai >> (nfo->maxlevel - level));
+    tag[1] = (int)(aj >> (nfo->maxlevel - level));
+    tag[2] = (int)(ak >> (nfo->maxlevel - level));
+  }
+
+  for (l = 0; l <= nfo->maxlevel; l++) {
+    float dx = deltax / (1 << l), dy = deltay / (1 << l), dz = deltaz / (1 << l);
+
+    lev = &nfo->levels[l];
+    if (lev->ntagged)
+      cluster(nfo, lev, nfo->tags + 3*start[l], lev->ntagged);
+
+    /* Sample the field on the nodes of every box */
+    for (b = 0; b < lev->nboxes; b++) {
+      patchBox *box = &lev->boxes[b];
+      uint64_t nodes = (uint64_t)(box->hi[0]-box->lo[0]+2) * (box->hi[1]-box->lo[1]+2) *
+	(box->hi[2]-box->lo[2]+2);
+      float *val;
+
+      lev->ncells += (uint64_t)(box->hi[0]-box->lo[0]+1) * (box->hi[1]-box->lo[1]+1) *
+	(box->hi[2]-box->lo[2]+1);
+      lev->offsets[b] = lev->npoints;
+      if (lev->npoints + nodes > lev->maxpoints) {
+	lev->maxpoints = 2*(lev->npoints + nodes);
+	lev->data = (float *) realloc(lev->data, lev->maxpoints*sizeof(float));
+	if (!lev->data) {
+	  printf("ERROR: Could not grow level %d patch data to %llu points\n", l,
+		 (unsigned long long)lev->maxpoints);
+	  exit(1);
+	}
+      }
+      val = lev->data + lev->npoints;
+      for (kk = box->lo[2]; kk <= box->hi[2]+1; kk++)
+	for (jj = box->lo[1]; jj <= box->hi[1]+1; jj++)
+	  for (ii = box->lo[0]; ii <= box->hi[0]+1; ii++)
+	    *val++ = cubenoise(osn, ii*dx, jj*dy, kk*dz, t);
+      lev->npoints += nodes;
+    }
+  }
+}
+
+/* Print patch counts and sizes over all ranks, next to the cube output size */
+void patchesprintstats(patchInfo *nfo, cubeInfo *cubes, MPI_Comm comm, int rank) {
+  int l, ncounts = 3*(nfo->maxlevel+1) + 2;
+  uint64_t *counts, *totals;
+
+  counts = (uint64_t *) malloc(ncounts*sizeof(uint64_t));
+  totals = (uint64_t *) malloc(ncounts*sizeof(uint64_t));
+  counts[0] = cubes->npoints;
+  counts[1] = 0;
+  for (l = 0; l <= nfo->maxlevel; l++) {
+    counts[2+3*l]   = nfo->levels[l].nboxes;
+    counts[2+3*l+1] = nfo->levels[l].ntagged;
+    counts[2+3*l+2] = nfo->levels[l].ncells;
+    counts[1] += nfo->levels[l].npoints;
+  }
+  MPI_Reduce(counts, totals, ncounts, MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, comm);
+
+  if (rank == 0) {
+    for (l = 0; l <= nfo->maxlevel; l++) {
+      uint64_t *lt = totals + 2 + 3*l;
+
+      if (!lt[0])
+	continue;
+      printf("      Level %d: Patches = %llu, Leaf cubes = %llu, Patch cells = %llu, Efficiency = %.2f\n",
+	     l, (unsigned long long)lt[0], (unsigned long long)lt[1], (unsigned long long)lt[2], (double)lt[1]/lt[2]);
+    }
+    printf("      Patch points = %llu, Cube points = %llu, Size ratio = %.2f\n",
+	   (unsigned long long)totals[1], (unsigned long long)totals[0], totals[0] ? (double)totals[1]/totals[0] : 0.);
+  }
+  free(counts);
+  free(totals);
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) DoD HPCMP PETTT.  All rights reserved.
+ * See LICENSE file for details.
+ */
+
+#include <stdint.h>
+#include <mpi.h>
+
+/* A patch: an inclusive range of cells on one level, in global cell indices
+ * of that level (a base cell is 2^level cells wide) */
+typedef struct patchBox {
+  int lo[3];
+  int hi[3];
+} patchBox;
+
+/* The patches of one level and the node values on them */
+typedef struct patchLevel {
+  int nboxes;
+  int maxboxes;
+  patchBox *boxes;
+  uint64_t *offsets;     /* Start of each box in data */
+  uint64_t ntagged;      /* Leaf cubes on this level */
+  uint64_t ncells;       /* Cells covered by boxes */
+  uint64_t npoints;      /* Nodes of all boxes: size of data */
+  uint64_t maxpoints;
+  float *data;           /* Node values, box by box, i fastest */
+} patchLevel;
+
+typedef struct patchInfo {
+  int debug;
+  int maxlevel;
+  float efficiency;      /* Minimum fraction of box cells that are leaves */
+  patchLevel *levels;    /* maxlevel+1 levels */
+  int *tags;             /* Scratch: tagged cells of a level, 3 ints each */
+  uint64_t maxtags;
+} patchInfo;
+
+void patchesinit(patchInfo *nfo, int maxlevel, float efficiency, int debug);
+
+void patchesfree(patchInfo *nfo);
+
+void patchesbuild(patchInfo *nfo, cubeInfo *cubes, int t, float deltax, float deltay, float deltaz,
+		  struct osn_context *osn);
+
+void patchesprintstats(patchInfo *nfo, cubeInfo *cubes, MPI_Comm comm, int rank);
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) DoD HPCMP PETTT.  All rights reserved.  
+ * Copyright (c) DoD HPCMP PETTT.  All rights reserved.
  * See LICENSE file for details.
  */
 
@@ -11,155 +11,179 @@
 #include <stdint.h>
 #include <mpi.h>
 
+#include "pdirs.h"
 #include "vtkout.h"
 
 static const int fnstrmax = 4095;
 static const int cubeVertices = 8;
 static const int vertexDims= 3;
-static const int cubeVertexDims = cubeVertices * vertexDims;
+static const int maxchunk = 1 << 28;    /* Most elements per MPI_File_write */
+
+/* Write an appended data array: its byte count, then the data, in pieces
+ * small enough for the int counts of MPI */
+static void writearray(MPI_File mf, void *buf, uint64_t n, MPI_Datatype type, int size) {
+  MPI_Status mstat;
+  uint64_t nbytes = n*size;
+  char *p = (char *) buf;
+
+  MPI_File_write(mf, &nbytes, 1, MPI_UNSIGNED_LONG_LONG, &mstat);
+  while (n > 0) {
+    int count = n > maxchunk ? maxchunk : (int)n;
+
+    MPI_File_write(mf, p, count, type, &mstat);
+    p += (uint64_t)count*size;
+    n -= count;
+  }
+}
 
-void writevtk(char *name, MPI_Comm comm, int rank, int nprocs, int tstep,
-	      uint64_t npoints, uint64_t ncubes, float *points, float *xvals, char *xname, int debug) {
+void writepvtu(char *dir, int nodelocal, char *name, MPI_Comm comm, int rank, int nprocs,
+	       int tstep, uint64_t npoints, uint64_t ncubes, float *points, uint64_t *conn, float *xvals, char *xname, int debug) {
 
+  char dirname[fnstrmax+1];
   char fname[fnstrmax+1];
+  char line[fnstrmax+1];
+  int rankdigits = nprocs > 1 ? (int)(log10(nprocs-1)+1.5) : 1;
   int timedigits = 4;
+  char typestr[] = "Float32";
+  char endianstr[] = "LittleEndian";
   FILE *f;
-  int  i;
-  uint64_t allcubes;        /* total cube count: sum over all ranks */
-  uint64_t *rncubes=NULL;   /* cube count for currrent rank */
-  
-  int nallpoints=0;
-  int  nallxvals=0;
-  float *allpoints=NULL;
-  float *allxvals=NULL;
-
-  int cpointcnts;
-  int cpointoffsets;
-  int *pointcnts=NULL;
-  int *pointoffsets=NULL;
-  
-  int cxvalcnts;
-  int cxvaloffsets;
-  int *xvalcnts=NULL;
-  int *xvaloffsets=NULL;
+  MPI_File mf;
+  MPI_Status mstat;
+  MPI_Info info = MPI_INFO_NULL;
+  uint64_t *rncubes=NULL;   /* cube count of each rank */
+  int r, ret;
 
   if (debug) {
-    printf("Debug 0.0 (rank=%d): Entered writevtk routine\n", rank);
-  }
-  
-  pointcnts = (int *) malloc(nprocs*sizeof(int));
-  pointoffsets = (int *) malloc(nprocs*sizeof(int));
-  xvalcnts = (int *) malloc(nprocs*sizeof(int));
-  xvaloffsets = (int *) malloc(nprocs*sizeof(int));
-
-  if(rank == 0) {
-    rncubes = (uint64_t *) malloc(nprocs*sizeof(uint64_t));
+    printf("Debug 0.0 (rank=%d): Entered writepvtu routine\n", rank);
   }
 
-  MPI_Gather(&ncubes, 1, MPI_UNSIGNED_LONG_LONG, rncubes, 1, MPI_LONG_LONG, 0, comm);
-  
-  cpointcnts = ncubes * cubeVertexDims;
-  MPI_Allgather(&cpointcnts, 1, MPI_INT, pointcnts, 1, MPI_INT, comm);
+  /* Make directory for timestep */
+  snprintf(dirname, fnstrmax, "%s/%s.%s.%0*d.d", dir, name, xname, timedigits, tstep);
+  mkdir1task(dirname, comm, nodelocal);
 
-  cxvalcnts = ncubes * cubeVertices;
-  MPI_Allgather(&cxvalcnts, 1, MPI_INT, xvalcnts, 1, MPI_INT, comm);
+  /* Gather cube counts, to leave out ranks without cubes */
+  if(rank == 0)
+    rncubes = (uint64_t *) malloc(nprocs*sizeof(uint64_t));
+  MPI_Gather(&ncubes, 1, MPI_UNSIGNED_LONG_LONG, rncubes, 1, MPI_UNSIGNED_LONG_LONG, 0, comm);
 
-  cpointoffsets = 0;
-  cxvaloffsets = 0;
-  for(i = 1; i < rank+1; i++) {
-    cpointoffsets += pointcnts[i-1];
-    cxvaloffsets += xvalcnts[i-1];
-  }
- 
-  MPI_Allgather(&cpointoffsets, 1, MPI_INT, pointoffsets, 1, MPI_INT, comm);
-  MPI_Allgather(&cxvaloffsets, 1, MPI_INT, xvaloffsets, 1, MPI_INT, comm);
-  
+  /* Create pvtu file */
   if(rank == 0) {
-    allcubes=0;
-    for(i = 0; i < nprocs; i++) {
-      allcubes += rncubes[i];
-    }
-    nallpoints = allcubes*cubeVertexDims;
-    nallxvals  = allcubes*cubeVertices;
-    
-    allpoints = (float *) malloc(nallpoints*sizeof(float));
-    allxvals = (float *) malloc(nallxvals*sizeof(float));
-    
-    for(i = 0; i <allcubes*cubeVertexDims; i++) {
-      allpoints[i] = 0;
-    }
-    
-    for(i = 0; i <allcubes*cubeVertices; i++) {
-      allxvals[i] = 0;
+    snprintf(fname, fnstrmax, "%s/%s.%s.%0*d.pvtu", dir, name, xname, timedigits, tstep);
+    if( ! (f = fopen(fname, "w")) ) {
+      fprintf(stderr, "writepvtu error: Could not create .pvtu file.\n");
+      MPI_Abort(comm, 1);
     }
-
-    if (debug) {
-      printf("Debug 1.0 (rank=%d): nallpoints=%d  nallxvals=%d  allcubes:%llu\n", rank, nallpoints, nallxvals, allcubes);
-      for(i = 0; i < nprocs; i++) {
-	printf("Debug 2.0 (rank=%d): rncubes:%llu timestep=%d\n", i, rncubes[i], tstep);
+    fprintf(f, "<?xml version=\"1.0\"?>\n"
+	    "<VTKFile type=\"PUnstructuredGrid\" version=\"1.0\" byte_order=\"%s\" "
+	    "header_type=\"UInt64\">\n", endianstr);
+    fprintf(f, "  <PUnstructuredGrid GhostLevel=\"0\">\n");
+    fprintf(f, "    <PPointData Scalars=\"%s\">\n"
+	    "      <PDataArray type=\"%s\" Name=\"%s\" NumberOfComponents=\"1\"/>\n"
+	    "    </PPointData>\n", xname, typestr, xname);
+    fprintf(f, "    <PPoints>\n"
+	    "      <PDataArray type=\"%s\" Name=\"Points\" NumberOfComponents=\"3\"/>\n"
+	    "    </PPoints>\n", typestr);
+    for(r = 0; r < nprocs; ++r) {
+      if(rncubes[r] > 0) {
+	snprintf(fname, fnstrmax, "%s.%s.%0*d.d/%0*d.vtu", name, xname, timedigits,
+		 tstep, rankdigits, r);
+	fprintf(f, "    <Piece Source=\"%s\"/>\n", fname);
       }
     }
-  }
+    fprintf(f, "  </PUnstructuredGrid>\n</VTKFile>\n");
+    fclose(f);
+    free(rncubes);
+  } /* end rank==0 */
 
-  if (debug) {
-    for(i = 0; i < nprocs; i++) {
-      printf("Debug 3.0 (rank=%d): i=%d  pointcnts=%d pointoffsets=%d\n", rank, i, pointcnts[i], pointoffsets[i]);
-    }
-  }
-    
-  MPI_Gatherv(points, pointcnts[rank], MPI_FLOAT, allpoints, pointcnts, pointoffsets, MPI_FLOAT, 0, comm);
-  MPI_Gatherv(xvals, xvalcnts[rank], MPI_FLOAT, allxvals, xvalcnts, xvaloffsets, MPI_FLOAT, 0, comm);
+  chkdir1task(dirname, comm);
 
-  /* Create VTK file */
-  if(rank == 0) {
-  
-    snprintf(fname, fnstrmax, "%s.%s.%0*d.vtk", name, xname, timedigits, tstep);
+  /* Set up MPI info */
+  MPI_Info_create(&info);
+  MPI_Info_set(info, "striping_factor", "1");
 
-    if( ! (f = fopen(fname, "w")) ) {
-      fprintf(stderr, "writepvtp error: Could not create .vtk file.\n");
-      MPI_Abort(comm, 1);
-    }
-    
-    fprintf(f, "# vtk DataFile Version 2.0\n");
-    fprintf(f, "vtk output\n");
-    fprintf(f, "ASCII\n");
-    fprintf(f, "DATASET UNSTRUCTURED_GRID\n");
-    fprintf(f, "POINTS %llu float\n", allcubes*cubeVertices);
-    for(i = 0; i <allcubes*cubeVertexDims ; i+=vertexDims) {
-      fprintf(f, "%f %f %f\n", allpoints[i], allpoints[i+1], allpoints[i+2]);
-    }
-    
-    fprintf(f, "\nCELLS %llu %llu\n", allcubes, (allcubes*cubeVertices) + allcubes);
-    for(i = 0; i <allcubes*cubeVertices ; i+=cubeVertices) {
-      fprintf(f, "8 %d %d %d %d %d %d %d %d\n", i, i+1, i+2, i+3, i+4, i+5, i+6, i+7);
-    }
+  /* Write this rank's .vtu piece, if it has cubes */
+  if(ncubes > 0) {
+    uint64_t i, offsets = 0;   /* Offsets into the binary portion for each field */
+    uint64_t *temparr;
+    unsigned char *types;
 
-    fprintf(f, "\nCELL_TYPES %llu\n", allcubes);
-    for(i = 0; i <allcubes ; i++) {
-      fprintf(f, "11\n");
+    snprintf(fname, fnstrmax, "%s/%s.%s.%0*d.d/%0*d.vtu", dir, name, xname, timedigits,
+	     tstep, rankdigits, rank);
+    ret = MPI_File_open(MPI_COMM_SELF, fname, MPI_MODE_WRONLY | MPI_MODE_CREATE,
+			info, &mf);
+    if(ret) {
+      fprintf(stderr, "writepvtu error: could not open %s\n", fname);
+      MPI_Abort(comm, 1);
     }
-
-    fprintf(f, "\nPOINT_DATA %llu\n", allcubes*cubeVertices);
-    fprintf(f, "SCALARS %s float 1\n", xname);
-    fprintf(f, "LOOKUP_TABLE default\n");
-    for(i = 0; i <allcubes*cubeVertices ; i+=cubeVertices) {
-      fprintf(f, "%f %f %f %f %f %f %f %f\n", allxvals[i], allxvals[i+1], allxvals[i+2], allxvals[i+3], allxvals[i+4], allxvals[i+5], allxvals[i+6], allxvals[i+7]);
+    MPI_File_set_size(mf, 0);
+
+    snprintf(line, fnstrmax, "<?xml version=\"1.0\"?>\n"
+	     "<VTKFile type=\"UnstructuredGrid\" version=\"1.0\" byte_order=\"%s\" "
+	     "header_type=\"UInt64\">\n"
+	     "  <UnstructuredGrid>\n"
+	     "    <Piece NumberOfPoints=\"%llu\" NumberOfCells=\"%llu\">\n", endianstr,
+	     (unsigned long long)npoints, (unsigned long long)ncubes);
+    MPI_File_write(mf, line, strlen(line), MPI_CHAR, &mstat);
+    snprintf(line, fnstrmax, "      <PointData Scalars=\"%s\">\n"
+	     "        <DataArray type=\"%s\" Name=\"%s\" NumberOfComponents=\"1\" "
+	     "format=\"appended\" offset=\"0\"/>\n"
+	     "      </PointData>\n", xname, typestr, xname);
+    MPI_File_write(mf, line, strlen(line), MPI_CHAR, &mstat);
+    offsets += npoints*sizeof(float)+sizeof(uint64_t);   /* Add size of xdata array */
+    snprintf(line, fnstrmax, "      <Points>\n"
+	     "        <DataArray type=\"%s\" Name=\"Points\" NumberOfComponents=\"3\" "
+	     "format=\"appended\" offset=\"%llu\"/>\n"
+	     "      </Points>\n", typestr, (unsigned long long)offsets);
+    MPI_File_write(mf, line, strlen(line), MPI_CHAR, &mstat);
+    offsets += npoints*vertexDims*sizeof(float)+sizeof(uint64_t);   /* Add size of points */
+    snprintf(line, fnstrmax, "      <Cells>\n"
+	     "        <DataArray type=\"UInt64\" Name=\"connectivity\" "
+	     "format=\"appended\" offset=\"%llu\"/>\n", (unsigned long long)offsets);
+    MPI_File_write(mf, line, strlen(line), MPI_CHAR, &mstat);
+    offsets += ncubes*cubeVertices*sizeof(uint64_t)+sizeof(uint64_t);   /* Add size of connections */
+    snprintf(line, fnstrmax, "        <DataArray type=\"UInt64\" Name=\"offsets\" "
+	     "format=\"appended\" offset=\"%llu\"/>\n", (unsigned long long)offsets);
+    MPI_File_write(mf, line, strlen(line), MPI_CHAR, &mstat);
+    offsets += ncubes*sizeof(uint64_t)+sizeof(uint64_t);   /* Add size of cell offsets */
+    snprintf(line, fnstrmax, "        <DataArray type=\"UInt8\" Name=\"types\" "
+	     "format=\"appended\" offset=\"%llu\"/>\n"
+	     "      </Cells>\n    </Piece>\n  </UnstructuredGrid>\n"
+	     "  <AppendedData encoding=\"raw\">\n"
+	     "   _", (unsigned long long)offsets);
+    MPI_File_write(mf, line, strlen(line), MPI_CHAR, &mstat);
+
+    /* xvals, then points */
+    writearray(mf, xvals, npoints, MPI_FLOAT, sizeof(float));
+    writearray(mf, points, npoints*vertexDims, MPI_FLOAT, sizeof(float));
+
+    /* Connections: shared points have them, otherwise each cube has its own 8 */
+    if(conn) {
+      writearray(mf, conn, ncubes*cubeVertices, MPI_UNSIGNED_LONG_LONG, sizeof(uint64_t));
+      temparr = (uint64_t *) malloc(ncubes*sizeof(uint64_t));
+    } else {
+      temparr = (uint64_t *) malloc(ncubes*cubeVertices*sizeof(uint64_t));
+      for(i = 0; i < ncubes*cubeVertices; i++)
+	temparr[i] = i;
+      writearray(mf, temparr, ncubes*cubeVertices, MPI_UNSIGNED_LONG_LONG, sizeof(uint64_t));
     }
+    /* Cell offsets & types; the cube points are in voxel order */
+    for(i = 0; i < ncubes; i++)
+      temparr[i] = (i+1)*cubeVertices;
+    writearray(mf, temparr, ncubes, MPI_UNSIGNED_LONG_LONG, sizeof(uint64_t));
+    free(temparr);
+    types = (unsigned char *) malloc(ncubes);
+    memset(types, 11, ncubes);   /* VTK_VOXEL */
+    writearray(mf, types, ncubes, MPI_UNSIGNED_CHAR, 1);
+    free(types);
+
+    /* Finish and close */
+    snprintf(line, fnstrmax, "\n  </AppendedData>\n</VTKFile>\n");
+    MPI_File_write(mf, line, strlen(line), MPI_CHAR, &mstat);
+    MPI_File_close(&mf);
+  }
+  MPI_Info_free(&info);
 
-    fclose(f);
-    free(rncubes);
-    free(allpoints);
-    free(allxvals);
-     
-  } /* end rank==0 */
-  
-  free(pointcnts);
-  free(pointoffsets);
-  free(xvalcnts);
-  free(xvaloffsets);
-  
   if (debug) {
-    printf("Debug 11 (rank=%d): Exiting  writevtk routine\n", rank);
+    printf("Debug 11 (rank=%d): Exiting  writepvtu routine\n", rank);
   }
-  
 }
@@ -4,5 +4,7 @@
  */
 
 
-void writevtk(char *name, MPI_Comm comm, int rank, int nprocs, int tstep,
-              uint64_t npoints, uint64_t ncubes, float *points, float *xvals, char *xname, int debug);
+/* The files go in directory dir, and nodelocal says this rank creates the
+ * step's directory for its node, as from bbuf_dir and bbuf_mkdirs */
+void writepvtu(char *dir, int nodelocal, char *name, MPI_Comm comm, int rank, int nprocs,
+               int tstep, uint64_t npoints, uint64_t ncubes, float *points, uint64_t *conn, float *xvals, char *xname, int debug);
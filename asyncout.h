@@ -0,0 +1,166 @@
+/*
+ * Asynchronous output: a background thread writes a time step's output
+ * while the next time step computes
+ *
+ * The caller snapshots the buffers the output reads before handing it
+ * off, and the writers use their own duplicate of the communicator, so
+ * their collectives do not mix with the compute's.  Needs MPI initialized
+ * with MPI_Init_thread and MPI_THREAD_MULTIPLE; without it, the output
+ * runs in the caller.
+ *
+ * Copyright (c) DoD HPCMP PETTT.  All rights reserved.
+ * See LICENSE file for details.
+ */
+
+#include <stdio.h>
+#include <pthread.h>
+#include <mpi.h>
+
+struct asyncout {
+    int enabled;           /* Output runs in the background thread */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    void (*func)(void *);  /* Output handed off and not done, NULL if none */
+    void *arg;
+    int quit;
+    double writetime;      /* Seconds the last output took in the thread */
+    double waittime;       /* Seconds the caller last waited for it */
+};
+
+static void *asyncout_main(void *arg)
+{
+    struct asyncout *ao = (struct asyncout *)arg;
+    double t;
+
+    pthread_mutex_lock(&ao->lock);
+    for(;;) {
+        while(!ao->func && !ao->quit)
+            pthread_cond_wait(&ao->cond, &ao->lock);
+        if(!ao->func)
+            break;
+        pthread_mutex_unlock(&ao->lock);
+        t = MPI_Wtime();
+        ao->func(ao->arg);
+        t = MPI_Wtime() - t;
+        pthread_mutex_lock(&ao->lock);
+        ao->writetime = t;
+        ao->func = NULL;
+        pthread_cond_broadcast(&ao->cond);
+    }
+    pthread_mutex_unlock(&ao->lock);
+    return NULL;
+}
+
+/* Initialize asynchronous output
+ *    ao: pointer to asyncout to initialize
+ *    comm: communicator of the ranks, to agree on and report the mode
+ *    enable: flag, 0=output runs in the caller, 1=in a background thread
+ * note: enable must be the same on all ranks */
+
+void asyncout_init(struct asyncout *ao, MPI_Comm comm, int enable)
+{
+    int provided, rank;
+
+    ao->func = NULL;
+    ao->arg = NULL;
+    ao->quit = 0;
+    ao->writetime = ao->waittime = 0.;
+    ao->enabled = 0;
+    if(!enable)
+        return;
+
+    MPI_Comm_rank(comm, &rank);
+    MPI_Query_thread(&provided);
+    if(provided < MPI_THREAD_MULTIPLE) {
+        if(rank == 0)
+            fprintf(stderr, "asyncout: MPI lacks MPI_THREAD_MULTIPLE; writing synchronously\n");
+        return;
+    }
+    pthread_mutex_init(&ao->lock, NULL);
+    pthread_cond_init(&ao->cond, NULL);
+    if(pthread_create(&ao->thread, NULL, asyncout_main, ao)) {
+        fprintf(stderr, "asyncout ERROR : could not create the output thread\n");
+        MPI_Abort(comm, 1);
+    }
+    ao->enabled = 1;
+}
+
+/* Wait until the output handed off last is written; records waittime */
+
+void asyncout_wait(struct asyncout *ao)
+{
+    double t = MPI_Wtime();
+
+    if(ao->enabled) {
+        pthread_mutex_lock(&ao->lock);
+        while(ao->func)
+            pthread_cond_wait(&ao->cond, &ao->lock);
+        pthread_mutex_unlock(&ao->lock);
+    }
+    ao->waittime = MPI_Wtime() - t;
+}
+
+/* Hand off output to the thread, or run it now if not enabled
+ *    func: writes the output of arg
+ * note: call asyncout_wait first; arg and what it points to must not
+ *       change until the next asyncout_wait */
+
+void asyncout_post(struct asyncout *ao, void (*func)(void *), void *arg)
+{
+    double t;
+
+    if(!ao->enabled) {
+        t = MPI_Wtime();
+        func(arg);
+        ao->writetime = MPI_Wtime() - t;
+        return;
+    }
+    pthread_mutex_lock(&ao->lock);
+    ao->func = func;
+    ao->arg = arg;
+    pthread_cond_broadcast(&ao->cond);
+    pthread_mutex_unlock(&ao->lock);
+}
+
+/* Seconds of the last output written that overlapped the caller's work,
+ * valid after asyncout_wait: its write time less the wait for it */
+
+double asyncout_hidden(struct asyncout *ao)
+{
+    if(!ao->enabled || ao->writetime < ao->waittime)
+        return 0.;
+    return ao->writetime - ao->waittime;
+}
+
+/* Wait for the output and stop the thread; records waittime */
+
+void asyncout_finalize(struct asyncout *ao)
+{
+    asyncout_wait(ao);
+    if(!ao->enabled)
+        return;
+    pthread_mutex_lock(&ao->lock);
+    ao->quit = 1;
+    pthread_cond_broadcast(&ao->cond);
+    pthread_mutex_unlock(&ao->lock);
+    pthread_join(ao->thread, NULL);
+    pthread_mutex_destroy(&ao->lock);
+    pthread_cond_destroy(&ao->cond);
+}
+
+/* Print the visible and hidden time of the output of a time step, with
+ * timer.h's timer_collectprintstats
+ *    visible: seconds the caller spent on output this step, the wait for
+ *             the last output, the snapshot, and any output run in place
+ *    comm: communicator for collecting stats
+ * note: the hidden time is of the output handed off the time step before */
+
+void asyncout_printstats(struct asyncout *ao, double visible, MPI_Comm comm)
+{
+    timer_collectprintstats(visible, comm, 0, "   Output");
+    if(ao->enabled) {
+        timer_collectprintstats(ao->waittime, comm, 0, "   OutputWait");
+        timer_collectprintstats(asyncout_hidden(ao), comm, 0, "   OutputHidden");
+    }
+}
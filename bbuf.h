@@ -0,0 +1,488 @@
+/*
+ * Burst buffer staging: output is written to a fast stage directory, such
+ * as node-local NVMe, and helper threads drain it to the run directory
+ * while the application goes on
+ *
+ * Each output between bbuf_begin and bbuf_end is written in a directory of
+ * its own in the stage, which bbuf_dir gives the writers to put their
+ * usual names under, and the drain moves whole outputs.  The stage is drained by the first rank
+ * of the ranks that see the same stage directory: each node's if it is
+ * node-local, or rank 0 if all ranks see it.  Include timer.h first.
+ *
+ * Copyright (c) DoD HPCMP PETTT.  All rights reserved.
+ * See LICENSE file for details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <mpi.h>
+
+/* The files of one output in the stage */
+struct bbufbatch {
+    char *dir;             /* Its directory in the stage */
+    int nfiles, maxfiles;
+    char **files;          /* Paths relative to dir */
+    int ndirs, maxdirs;
+    char **dirs;           /* Subdirectories relative to dir, parents first */
+    int next;              /* Next file for a drain thread to take */
+    int ndone;             /* Files drained */
+    double start;          /* When it was handed to the drain */
+    struct bbufbatch *nxt;
+};
+
+struct bbuf {
+    int enabled;
+    char *stage;           /* This run's directory in the stage */
+    char *dest;            /* Where the output goes, the run directory */
+    MPI_Comm groupcomm;    /* Ranks that see the same stage directory */
+    int drainer;           /* This rank drains it */
+    int nodelocal;         /* The stage is node-local */
+    MPI_Comm draincomm;    /* The drainers, for stats; MPI_COMM_NULL if not one */
+    int seq;               /* Outputs staged */
+    char *batchdir;        /* Stage directory of the output being written */
+    int nthreads;
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;   /* A batch handed off or drained, or quit */
+    struct bbufbatch *head, *tail;   /* Batches not drained yet, oldest first */
+    int quit;
+    int nbatches;          /* Batches drained */
+    uint64_t bytes;        /* Bytes drained */
+    double lastdrain;      /* Seconds from handoff to drained of the last batch */
+    double sumdrain, maxdrain;
+    double waittime;       /* Seconds bbuf_finalize waited for the drain */
+};
+
+static const size_t bbuf_bufsize = 4 << 20;   /* Copy buffer of a drain thread */
+
+/* Seconds, from a clock the drain threads can read without MPI */
+
+static double bbuf_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+/* Create a directory and any missing parents, like mkdir -p; returns 0, or
+ * -1 with errno set; a directory that exists is no error */
+
+static int bbuf_mkdirp(const char *dirname)
+{
+    char path[4096];
+    char *p;
+    size_t len = strlen(dirname);
+
+    if(len >= sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(path, dirname, len+1);
+    for(p = path+1; *p; p++) {
+        if(*p == '/') {
+            *p = '\0';
+            if(mkdir(path, 0777) && errno != EEXIST)
+                return -1;
+            *p = '/';
+        }
+    }
+    if(mkdir(path, 0777) && errno != EEXIST)
+        return -1;
+    return 0;
+}
+
+static char *bbuf_path(const char *dir, const char *rel)
+{
+    size_t n = strlen(dir) + strlen(rel) + 2;
+    char *p = (char *) malloc(n);
+
+    snprintf(p, n, "%s/%s", dir, rel);
+    return p;
+}
+
+static void bbuf_add(char ***list, int *n, int *max, char *s)
+{
+    if(*n == *max) {
+        *max = *max ? 2 * *max : 16;
+        *list = (char **) realloc(*list, *max * sizeof(char *));
+    }
+    (*list)[(*n)++] = s;
+}
+
+/* List the files and subdirectories of a batch under rel, "" for all */
+
+static void bbuf_walk(struct bbufbatch *b, const char *rel)
+{
+    char *path = *rel ? bbuf_path(b->dir, rel) : strdup(b->dir);
+    DIR *d = opendir(path);
+    struct dirent *e;
+    struct stat sb;
+
+    if(!d) {
+        fprintf(stderr, "bbuf error: could not open %s\n", path);
+        exit(1);
+    }
+    while((e = readdir(d))) {
+        char *r, *full;
+        if(!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
+            continue;
+        r = *rel ? bbuf_path(rel, e->d_name) : strdup(e->d_name);
+        full = bbuf_path(b->dir, r);
+        if(!lstat(full, &sb) && S_ISDIR(sb.st_mode)) {
+            bbuf_add(&b->dirs, &b->ndirs, &b->maxdirs, r);
+            bbuf_walk(b, r);
+        } else {
+            bbuf_add(&b->files, &b->nfiles, &b->maxfiles, r);
+        }
+        free(full);
+    }
+    closedir(d);
+    free(path);
+}
+
+/* Copy src to dst through buf; returns bytes copied, or -1 */
+
+static int64_t bbuf_copy(const char *src, const char *dst, char *buf)
+{
+    int in, out;
+    int64_t total = 0;
+    ssize_t n, w, off;
+
+    if((in = open(src, O_RDONLY)) < 0)
+        return -1;
+    if((out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+        close(in);
+        return -1;
+    }
+    while((n = read(in, buf, bbuf_bufsize)) > 0) {
+        for(off = 0; off < n; off += w) {
+            if((w = write(out, buf + off, n - off)) < 0) {
+                total = -1;
+                break;
+            }
+        }
+        if(total < 0)
+            break;
+        total += n;
+    }
+    if(n < 0)
+        total = -1;
+    close(in);
+    if(close(out))
+        total = -1;
+    return total;
+}
+
+/* A batch is drained: remove its stage directories and take it off the
+ * list; with the lock held */
+
+static void bbuf_done(struct bbuf *bb, struct bbufbatch *b)
+{
+    struct bbufbatch **p;
+    double t = bbuf_now() - b->start;
+    int i;
+
+    for(i = b->ndirs-1; i >= 0; i--) {
+        char *path = bbuf_path(b->dir, b->dirs[i]);
+        rmdir(path);
+        free(path);
+        free(b->dirs[i]);
+    }
+    rmdir(b->dir);
+    for(p = &bb->head; *p != b; p = &(*p)->nxt)
+        ;
+    *p = b->nxt;
+    if(bb->tail == b) {
+        for(bb->tail = bb->head; bb->tail && bb->tail->nxt; bb->tail = bb->tail->nxt)
+            ;
+    }
+    bb->nbatches++;
+    bb->lastdrain = t;
+    bb->sumdrain += t;
+    if(t > bb->maxdrain)
+        bb->maxdrain = t;
+    free(b->files);
+    free(b->dirs);
+    free(b->dir);
+    free(b);
+    pthread_cond_broadcast(&bb->cond);
+}
+
+static void *bbuf_main(void *arg)
+{
+    struct bbuf *bb = (struct bbuf *)arg;
+    char *buf = (char *) malloc(bbuf_bufsize);
+    struct bbufbatch *b;
+
+    pthread_mutex_lock(&bb->lock);
+    for(;;) {
+        char *src, *dst, *slash;
+        int64_t n;
+        int f;
+
+        /* The oldest batch with a file no thread has taken */
+        for(b = bb->head; b && b->next == b->nfiles; b = b->nxt)
+            ;
+        if(!b) {
+            if(bb->quit)
+                break;
+            pthread_cond_wait(&bb->cond, &bb->lock);
+            continue;
+        }
+        f = b->next++;
+        pthread_mutex_unlock(&bb->lock);
+
+        src = bbuf_path(b->dir, b->files[f]);
+        dst = bbuf_path(bb->dest, b->files[f]);
+        slash = strrchr(dst, '/');
+        *slash = '\0';
+        if(bbuf_mkdirp(dst)) {
+            fprintf(stderr, "bbuf error: could not create %s\n", dst);
+            exit(1);
+        }
+        *slash = '/';
+        if((n = bbuf_copy(src, dst, buf)) < 0) {
+            fprintf(stderr, "bbuf error: could not drain %s to %s\n", src, dst);
+            exit(1);
+        }
+        unlink(src);
+        free(src);
+        free(dst);
+
+        pthread_mutex_lock(&bb->lock);
+        free(b->files[f]);
+        bb->bytes += n;
+        if(++b->ndone == b->nfiles)
+            bbuf_done(bb, b);
+    }
+    pthread_mutex_unlock(&bb->lock);
+    free(buf);
+    return NULL;
+}
+
+/* Initialize staging
+ *    bb: pointer to bbuf to initialize
+ *    comm: communicator of the ranks that write
+ *    stagedir: stage directory, NULL to write in place
+ *    nthreads: drain threads of each draining rank
+ *    sharedfiles: flag, some output is one file written from several nodes,
+ *                 which needs a stage directory all ranks see
+ * note: the run directory, where the output is drained to, is the current
+ *       directory; all ranks must call it */
+
+void bbuf_init(struct bbuf *bb, MPI_Comm comm, char *stagedir, int nthreads, int sharedfiles)
+{
+    char cwd[4096];
+    int rank, grouprank, allsee, ngroups, pid, t;
+    size_t n;
+    struct stat sb;
+
+    bb->enabled = 0;
+    if(!stagedir)
+        return;
+
+    MPI_Comm_rank(comm, &rank);
+    if(!getcwd(cwd, sizeof(cwd))) {
+        fprintf(stderr, "bbuf error: could not get the current directory\n");
+        MPI_Abort(comm, 1);
+    }
+    bb->dest = strdup(cwd);
+
+    /* This run's stage directory */
+    pid = (int)getpid();
+    MPI_Bcast(&pid, 1, MPI_INT, 0, comm);
+    n = strlen(cwd) + strlen(stagedir) + 32;
+    bb->stage = (char *) malloc(n);
+    if(stagedir[0] == '/')
+        snprintf(bb->stage, n, "%s/miniio.%d", stagedir, pid);
+    else
+        snprintf(bb->stage, n, "%s/%s/miniio.%d", cwd, stagedir, pid);
+
+    /* Ranks that see rank 0's stage directory share it; otherwise it is node-local */
+    if(rank == 0 && bbuf_mkdirp(bb->stage)) {
+        fprintf(stderr, "bbuf error: could not create %s\n", bb->stage);
+        MPI_Abort(comm, 1);
+    }
+    MPI_Barrier(comm);
+    allsee = !stat(bb->stage, &sb);
+    MPI_Allreduce(MPI_IN_PLACE, &allsee, 1, MPI_INT, MPI_MIN, comm);
+    if(allsee)
+        MPI_Comm_dup(comm, &bb->groupcomm);
+    else
+        MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &bb->groupcomm);
+    MPI_Comm_rank(bb->groupcomm, &grouprank);
+    bb->drainer = grouprank == 0;
+    bb->nodelocal = !allsee;
+    ngroups = bb->drainer;
+    MPI_Allreduce(MPI_IN_PLACE, &ngroups, 1, MPI_INT, MPI_SUM, comm);
+    if(sharedfiles && ngroups > 1) {
+        if(rank == 0)
+            fprintf(stderr, "bbuf error: %s is node-local, and the output writes files "
+                    "from several nodes;\n   use a stage directory all ranks see\n", stagedir);
+        MPI_Abort(comm, 1);
+    }
+    if(bb->drainer && bbuf_mkdirp(bb->stage)) {
+        fprintf(stderr, "bbuf error: could not create %s\n", bb->stage);
+        MPI_Abort(comm, 1);
+    }
+    MPI_Comm_split(comm, bb->drainer ? 0 : MPI_UNDEFINED, rank, &bb->draincomm);
+
+    bb->seq = 0;
+    bb->batchdir = (char *) malloc(strlen(bb->stage) + 32);
+    bb->head = bb->tail = NULL;
+    bb->quit = 0;
+    bb->nbatches = 0;
+    bb->bytes = 0;
+    bb->lastdrain = bb->sumdrain = bb->maxdrain = bb->waittime = 0.;
+    bb->nthreads = nthreads > 0 ? nthreads : 1;
+    bb->threads = NULL;
+    if(bb->drainer) {
+        pthread_mutex_init(&bb->lock, NULL);
+        pthread_cond_init(&bb->cond, NULL);
+        bb->threads = (pthread_t *) malloc(bb->nthreads*sizeof(pthread_t));
+        for(t = 0; t < bb->nthreads; t++) {
+            if(pthread_create(&bb->threads[t], NULL, bbuf_main, bb)) {
+                fprintf(stderr, "bbuf error: could not create a drain thread\n");
+                MPI_Abort(comm, 1);
+            }
+        }
+    }
+    if(rank == 0)
+        printf("Staging output in %s, %s, drained by %d rank(s) with %d thread(s) each\n",
+               bb->stage, ngroups > 1 ? "node-local" : "seen by all ranks", ngroups,
+               bb->nthreads);
+    bb->enabled = 1;
+}
+
+/* Start an output: the writers' files go to its own stage directory, bbuf_dir
+ * note: the ranks of the communicator bbuf_init had must call it */
+
+void bbuf_begin(struct bbuf *bb)
+{
+    if(!bb->enabled)
+        return;
+    snprintf(bb->batchdir, strlen(bb->stage) + 32, "%s/%d", bb->stage, bb->seq++);
+    if(bb->drainer && mkdir(bb->batchdir, 0777)) {
+        fprintf(stderr, "bbuf error: could not create %s\n", bb->batchdir);
+        MPI_Abort(bb->groupcomm, 1);
+    }
+    MPI_Barrier(bb->groupcomm);
+}
+
+/* Directory the writers put the output between bbuf_begin and bbuf_end
+ * under, "." without a stage */
+
+char *bbuf_dir(struct bbuf *bb)
+{
+    return bb->enabled ? bb->batchdir : ".";
+}
+
+/* Flag, this rank creates the output's directories for the ranks of its
+ * node, since the stage is node-local and rank 0's do not reach them; for
+ * pdirs.h's mkdir1task */
+
+int bbuf_mkdirs(struct bbuf *bb)
+{
+    return bb->enabled && bb->nodelocal && bb->drainer;
+}
+
+/* End an output: once the ranks sharing the stage are done, hand it to
+ * the drain */
+
+void bbuf_end(struct bbuf *bb)
+{
+    struct bbufbatch *b;
+
+    if(!bb->enabled)
+        return;
+    MPI_Barrier(bb->groupcomm);
+    if(!bb->drainer)
+        return;
+
+    b = (struct bbufbatch *) calloc(1, sizeof(struct bbufbatch));
+    b->dir = strdup(bb->batchdir);
+    bbuf_walk(b, "");
+    b->start = bbuf_now();
+    pthread_mutex_lock(&bb->lock);
+    if(bb->tail)
+        bb->tail->nxt = b;
+    else
+        bb->head = b;
+    bb->tail = b;
+    if(!b->nfiles)
+        bbuf_done(bb, b);
+    pthread_cond_broadcast(&bb->cond);
+    pthread_mutex_unlock(&bb->lock);
+}
+
+/* Print how long the last output drained took, from handoff to drained,
+ * with timer.h's timer_collectprintstats
+ * note: all ranks of the communicator bbuf_init had must call it */
+
+void bbuf_printstats(struct bbuf *bb)
+{
+    double t;
+
+    if(!bb->enabled || !bb->drainer)
+        return;
+    pthread_mutex_lock(&bb->lock);
+    t = bb->lastdrain;
+    pthread_mutex_unlock(&bb->lock);
+    timer_collectprintstats(t, bb->draincomm, 0, "   Drained");
+}
+
+/* Wait for the drain, stop the threads, and print the drain stats
+ * note: all ranks of the communicator bbuf_init had must call it */
+
+void bbuf_finalize(struct bbuf *bb)
+{
+    double t = bbuf_now();
+    double mean;
+    uint64_t bytes;
+    int rank, i;
+
+    if(!bb->enabled)
+        return;
+    if(bb->drainer) {
+        pthread_mutex_lock(&bb->lock);
+        while(bb->head)
+            pthread_cond_wait(&bb->cond, &bb->lock);
+        bb->quit = 1;
+        pthread_cond_broadcast(&bb->cond);
+        pthread_mutex_unlock(&bb->lock);
+        for(i = 0; i < bb->nthreads; i++)
+            pthread_join(bb->threads[i], NULL);
+        bb->waittime = bbuf_now() - t;
+        rmdir(bb->stage);
+
+        /* Drainers' stats: seconds from handoff to drained per output */
+        MPI_Comm_rank(bb->draincomm, &rank);
+        mean = bb->nbatches ? bb->sumdrain / bb->nbatches : 0.;
+        timer_collectprintstats(mean, bb->draincomm, 0, "   DrainMean");
+        timer_collectprintstats(bb->maxdrain, bb->draincomm, 0, "   DrainMax");
+        timer_collectprintstats(bb->waittime, bb->draincomm, 0, "   DrainWait");
+        MPI_Reduce(&bb->bytes, &bytes, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, bb->draincomm);
+        if(rank == 0)
+            printf("   Drained %d outputs, %.1f MB\n", bb->nbatches, bytes/1048576.);
+
+        pthread_mutex_destroy(&bb->lock);
+        pthread_cond_destroy(&bb->cond);
+        free(bb->threads);
+        MPI_Comm_free(&bb->draincomm);
+    }
+    MPI_Barrier(bb->groupcomm);
+    MPI_Comm_free(&bb->groupcomm);
+    free(bb->stage);
+    free(bb->dest);
+    free(bb->batchdir);
+}
@@ -5,16 +5,17 @@
  
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "adiosfull.h"
-#include "pdirs.h"
 
 static const int fnstrmax = 4095;
 
 void adiosfull_init(struct adiosfullinfo *nfo, char *method,
                char *name, MPI_Comm comm, int rank, int nprocs,
                int tsteps, int ni, int nj, int nk, int is, int cni, int js, int cnj,
-               int ks, int cnk, float deltax, float deltay, float deltaz)
+               int ks, int cnk, int mni, int mnj, int mnk,
+               float deltax, float deltay, float deltaz)
 {
     char dirname[fnstrmax+1];
 
@@ -37,6 +38,12 @@ void adiosfull_init(struct adiosfullinfo *nfo, char *method,
     nfo->cnj = cnj;
     nfo->ks = ks;
     nfo->cnk = cnk;
+    nfo->mni = mni;
+    nfo->mnj = mnj;
+    nfo->mnk = mnk;
+    nfo->pack = NULL;
+    if(mni != cni || mnj != cnj || mnk != cnk)
+        nfo->pack = (float *) malloc((size_t)cni*cnj*cnk*sizeof(float));
     nfo->deltax = deltax;
     nfo->deltay = deltay;
     nfo->deltaz = deltaz;
@@ -80,13 +87,13 @@ void adiosfull_addvar(struct adiosfullinfo *nfo, char *varname, float *data)
                      "ni,nj,nk", "is,js,ks");
 }
 
-void adiosfull_write(struct adiosfullinfo *nfo, int tstep)
+void adiosfull_write(struct adiosfullinfo *nfo, char *dir, int tstep)
 {
     char fname[fnstrmax+1];
     int timedigits = 4;
     uint64_t ijkelems, groupsize, totalsize;
     int64_t handle;
-    int ret, i;
+    int ret, i, j, k;
     int bufneeded;
 
     /* Set sizes */
@@ -109,7 +116,7 @@ void adiosfull_write(struct adiosfullinfo *nfo, int tstep)
     }
 
     /* Set filename */
-    snprintf(fname, fnstrmax, "%s_%0*d", nfo->name, timedigits, tstep);
+    snprintf(fname, fnstrmax, "%s/%s_%0*d", dir, nfo->name, timedigits, tstep);
 
     /* Open & Write */
     ret = adios_open(&handle, nfo->name, fname, "w", nfo->comm);
@@ -135,8 +142,19 @@ void adiosfull_write(struct adiosfullinfo *nfo, int tstep)
     adios_write(handle, "deltax", &nfo->deltax);
     adios_write(handle, "deltay", &nfo->deltay);
     adios_write(handle, "deltaz", &nfo->deltaz);
-    for(i = 0; i < nfo->nvars; i++)
-        adios_write(handle, nfo->varnames[i], nfo->datas[i]);
+    for(i = 0; i < nfo->nvars; i++) {
+        float *data = nfo->datas[i];
+        /* Leave out the ghosts, which the neighboring blocks write */
+        if(nfo->pack) {
+            float *p = nfo->pack;
+            for(k = 0; k < nfo->cnk; k++)
+                for(j = 0; j < nfo->cnj; j++, p += nfo->cni)
+                    memcpy(p, data + ((size_t)k*nfo->mnj + j)*nfo->mni,
+                           nfo->cni*sizeof(float));
+            data = nfo->pack;
+        }
+        adios_write(handle, nfo->varnames[i], data);
+    }
 
     adios_close(handle);
 }
@@ -145,6 +163,7 @@ void adiosfull_finalize(struct adiosfullinfo *nfo)
 {
     free(nfo->varnames);
     free(nfo->datas);
+    free(nfo->pack);
     adios_finalize(nfo->rank);
 }
 
@@ -14,6 +14,8 @@ struct adiosfullinfo {
     int tsteps;
     int ni, nj, nk;
     int is, cni, js, cnj, ks, cnk;
+    int mni, mnj, mnk;    /* Size of the blocks in memory, cni.. plus ghosts */
+    float *pack;          /* Owned points of a block with ghosts */
     float deltax, deltay, deltaz;
 
     int nvars;
@@ -29,11 +31,13 @@ struct adiosfullinfo {
 void adiosfull_init(struct adiosfullinfo *nfo, char *method,
                char *name, MPI_Comm comm, int rank, int nprocs,
                int tsteps, int ni, int nj, int nk, int is, int cni, int js, int cnj,
-               int ks, int cnk, float deltax, float deltay, float deltaz);
+               int ks, int cnk, int mni, int mnj, int mnk,
+               float deltax, float deltay, float deltaz);
 
 void adiosfull_addvar(struct adiosfullinfo *nfo, char *varname, float *data);
 
-void adiosfull_write(struct adiosfullinfo *nfo, int tstep);
+/* Writes the time step's file in directory dir */
+void adiosfull_write(struct adiosfullinfo *nfo, char *dir, int tstep);
 
 void adiosfull_finalize(struct adiosfullinfo *nfo);
 
@@ -50,8 +50,11 @@ void adiosiso_init(struct adiosisoinfo *nfo, char *method, char *name,
                      "cnpoints3", "npoints3", "cstart3");
     adios_define_var(nfo->gid, "norms", "", adios_real, 
                      "cnpoints3", "npoints3", "cstart3");
+    adios_define_var(nfo->gid, "ntriverts", "", adios_unsigned_long, "", "", "");
+    adios_define_var(nfo->gid, "cntriverts", "", adios_unsigned_long, "", "", "");
+    adios_define_var(nfo->gid, "ctristart", "", adios_unsigned_long, "", "", "");
     adios_define_var(nfo->gid, "connections", "", adios_unsigned_long, 
-                     "cnpoints", "npoints", "cstart");
+                     "cntriverts", "ntriverts", "ctristart");
 }    
 
 void adiosiso_addxvar(struct adiosisoinfo *nfo, char *varname)
@@ -63,8 +66,8 @@ void adiosiso_addxvar(struct adiosisoinfo *nfo, char *varname)
     adios_define_var(nfo->gid, varname, "", adios_real, "cnpoints", "npoints", "cstart");
 }
 
-void adiosiso_write(struct adiosisoinfo *nfo, int tstep, uint64_t ntris, float *points,
-        float *norms, float **xvals)
+void adiosiso_write(struct adiosisoinfo *nfo, char *dir, int tstep, uint64_t ntris,
+        uint64_t lnpoints, float *points, float *norms, float **xvals, uint64_t *tris)
 {
     char fname[fnstrmax+1];
     int timedigits = 4;
@@ -73,17 +76,20 @@ void adiosiso_write(struct adiosisoinfo *nfo, int tstep, uint64_t ntris, float *
     int ret;
     int bufneeded;
     uint64_t i, npoints, cnpoints, cstart, npoints3, cnpoints3, cstart3, *npts_all;
+    uint64_t ntriverts, cntriverts, ctristart;
     uint64_t *conns;
 
     /* Set local sizes */
-    cnpoints = ntris * 3;
+    cnpoints = lnpoints;
     cnpoints3 = cnpoints * 3;
+    cntriverts = ntris * 3;
     groupsize = sizeof(int) /*rank*/ + sizeof(int) /*tstep*/ +
                 sizeof(uint64_t)*3 /*npoints-cstart*/ +
                 sizeof(uint64_t)*3 /*npoints3-cstart3*/ +
+                sizeof(uint64_t)*3 /*ntriverts-ctristart*/ +
                 sizeof(float)*cnpoints3 /*coords*/ +
                 sizeof(float)*cnpoints3 /*norms*/ +
-                sizeof(uint64_t)*cnpoints /*connections*/ +
+                sizeof(uint64_t)*cntriverts /*connections*/ +
                 sizeof(float)*cnpoints*nfo->numxvars; /*xvars*/ 
 
     /* Allocate buffer large enough for all data to write, if not done already */
@@ -108,15 +114,25 @@ void adiosiso_write(struct adiosisoinfo *nfo, int tstep, uint64_t ntris, float *
         cstart += npts_all[i];
     npoints3 = npoints * 3;
     cstart3 = cstart *3;
+    MPI_Allgather(&cntriverts, 1, MPI_UNSIGNED_LONG_LONG,
+                  npts_all, 1, MPI_UNSIGNED_LONG_LONG, nfo->comm);
+    for(ntriverts = 0, i = 0; i < nfo->nprocs; ++i) 
+        ntriverts += npts_all[i];
+    for(ctristart = 0, i = 0; i < nfo->rank; ++i)
+        ctristart += npts_all[i];
     free(npts_all);
 
-    /* Create connections */
-    conns = (uint64_t *) malloc(cnpoints * sizeof(uint64_t));
-    for(i = 0; i < cnpoints; i++)
-        conns[i] = i;
+    /* Create connections, unless the triangles share points */
+    if(tris) {
+        conns = tris;
+    } else {
+        conns = (uint64_t *) malloc(cntriverts * sizeof(uint64_t));
+        for(i = 0; i < cntriverts; i++)
+            conns[i] = i;
+    }
 
     /* Set filename */
-    snprintf(fname, fnstrmax, "%s.%0*d.bp", nfo->name, timedigits, tstep);
+    snprintf(fname, fnstrmax, "%s/%s.%0*d.bp", dir, nfo->name, timedigits, tstep);
 
     /* Open & Write */
     ret = adios_open(&handle, nfo->name, fname, "w", nfo->comm);
@@ -136,6 +152,9 @@ void adiosiso_write(struct adiosisoinfo *nfo, int tstep, uint64_t ntris, float *
     adios_write(handle, "npoints3", &npoints3);
     adios_write(handle, "cnpoints3", &cnpoints3);
     adios_write(handle, "cstart3", &cstart3);
+    adios_write(handle, "ntriverts", &ntriverts);
+    adios_write(handle, "cntriverts", &cntriverts);
+    adios_write(handle, "ctristart", &ctristart);
     adios_write(handle, "coords", points);
     adios_write(handle, "norms", norms);
     adios_write(handle, "connections", conns);
@@ -143,7 +162,8 @@ void adiosiso_write(struct adiosisoinfo *nfo, int tstep, uint64_t ntris, float *
         adios_write(handle, nfo->xvarnames[i], xvals[i]);
 
     adios_close(handle);
-    free(conns);
+    if(!tris)
+        free(conns);
 }
 
 void adiosiso_finalize(struct adiosisoinfo *nfo)
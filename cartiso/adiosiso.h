@@ -30,8 +30,10 @@ void adiosiso_init(struct adiosisoinfo *nfo, char *method, char *name,
 
 void adiosiso_addxvar(struct adiosisoinfo *nfo, char *varname);
 
-void adiosiso_write(struct adiosisoinfo *nfo, int tstep, uint64_t ntris, float *points,
-        float *norms, float **xvals);
+/* Writes the time step's file in directory dir; tris holds 3 point indices
+ * per triangle, or is NULL when each triangle has its own 3 points */
+void adiosiso_write(struct adiosisoinfo *nfo, char *dir, int tstep, uint64_t ntris,
+        uint64_t npoints, float *points, float *norms, float **xvals, uint64_t *tris);
 
 void adiosiso_finalize(struct adiosisoinfo *nfo);
 
@@ -5,13 +5,18 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 #include <stdint.h>
 #include <math.h>
 #include <mpi.h>
 #include "sfc.h"
 #include "iso.h"
+#include "rebalance.h"
+#include "halo.h"
 #include "timer.h"
+#include "asyncout.h"
+#include "bbuf.h"
 #include "open-simplex-noise.h"
 
 /*## Add Output Modules' Includes Here ##*/
@@ -24,6 +29,11 @@
 #  include "pvtp.h"
 #endif
 
+#ifdef HAS_VTKZ
+#  include <float.h>
+#  include "vtkz.h"
+#endif
+
 #ifdef HAS_ADIOS
 #  include "adiosfull.h"
 #  include "adiosiso.h"
@@ -87,6 +97,37 @@ void print_usage(int rank, const char *errstr)
 "    --gaussmove : Mode that moves a Gaussian through the spatial domain of all tasks\n"
 "    --gaussresize : Mode that resizes a Gaussian from start to end sigma sizes\n"
 "    --backward : Reverses the direction and starting point of gaussmove mode\n"
+"    --curve NAME : Space filling curve through the tasks for gaussmove and\n"
+"                   centertask\n"
+"      NAME : serpentine, hilbert, or morton; Default: serpentine\n"
+"    --curveorder : Order the ranks of the isosurface output modules along the\n"
+"                   curve, which places their data in shared files in that order\n"
+"    --nogradcache : Compute the normals of every active cell's 8 points, without\n"
+"                    reusing those shared with neighboring cells\n"
+"    --indexed : Share points between triangles; writes unique points and 3 point\n"
+"                indices per triangle\n"
+"    --brick B : Cells along each edge of the bricks whose data ranges let the\n"
+"                isosurface skip cells it cannot pass through\n"
+"      B : brick size; 0 classifies every cell; Default: 8\n"
+"    --isovalues V1,V2,... : Extract an isosurface of each value, in one pass over\n"
+"                            the data; Default: 0.68\n"
+"    --xfields NX : Number of noise fields interpolated onto the isosurfaces, each\n"
+"                   at a multiple of the noise space frequency; Default: 1\n"
+"    --rebalance LIST : Move the isosurface triangles evenly over the ranks before\n"
+"                       the isosurface output modules in LIST write them\n"
+"      LIST : comma separated pvtp, hdf5p, adiosiso, or all; rebalanced output\n"
+"             has 3 points per triangle even if --indexed\n"
+"    --rebalanceto N : Number of ranks, evenly spaced, that receive the rebalanced\n"
+"                      triangles; Default: all ranks\n"
+"    --async : Write each time step's output in a background thread while the\n"
+"              next one computes; the full output then follows the isosurface\n"
+"    --stagedir DIR : Write the output to DIR, such as node-local NVMe, and drain it\n"
+"                     to the current directory in background threads\n"
+"    --drainthreads N : Threads draining the stage of each node; Default: 1\n"
+"    --aggregators M : Ranks, spread over the nodes, that gather and write the data\n"
+"                      of the shared files of --vtkshared; Default: 0, left to MPI-IO\n"
+"    --stripes S : Targets the shared files of --vtkshared are striped over, apart\n"
+"                  from --aggregators; Default: 1\n"
     );
 
     /*## Add Output Modules' Usage String ##*/
@@ -99,6 +140,22 @@ void print_usage(int rank, const char *errstr)
     fprintf(stderr, "    --pvtp : Enable PVTP isosurface output.\n");
 #endif
 
+#if defined(HAS_PVTI) || defined(HAS_PVTP)
+    fprintf(stderr, "    --vtkshared : Write PVTI & PVTP output as one .vti or .vtp per\n"
+                    "                  step, all pieces in one appended data section.\n");
+#endif
+
+#ifdef HAS_VTKZ
+    fprintf(stderr, "    --vtkcompress NAME : Compress PVTI & PVTP appended data in blocks.\n"
+                    "      NAME : none, zlib"
+#  ifdef HAS_LZ4
+                    ", or lz4"
+#  endif
+                    "; Default: none\n");
+    fprintf(stderr, "    --vtkcompresslevel L : zlib level 1-9, or LZ4 acceleration >= 1;"
+                    " Default: 1\n");
+#endif
+
 #ifdef HAS_HDF5
     fprintf(stderr, "    --hdf5i : Enable HDF5 full output.\n");
     fprintf(stderr, "    --hdf5p : Enable HDF5 isosurface output.\n");
@@ -106,6 +163,9 @@ void print_usage(int rank, const char *errstr)
                     "      valid values are CI <= NI, CJ <= NJ, CK <= NK\n");
     fprintf(stderr, "    --hdf5p_chunk CI : Integer percentage of triangles (CI); isosurface output.\n"
                     "      valid values are 0 < CI <= 100 \n");
+    fprintf(stderr, "    --hdf5collmeta : Read and write HDF5 metadata collectively.\n");
+    fprintf(stderr, "    --hdf5mdc MB : Initial size of the HDF5 metadata cache, in MiB.\n");
+    fprintf(stderr, "    --hdf5align T A : Align HDF5 objects of at least T bytes to A bytes.\n");
 #endif
     /*## End of Output Module Usage Strings ##*/
 }
@@ -137,6 +197,393 @@ void print_stats(MPI_Comm comm, int rank, int nprocs, uint64_t ntris)
         free(rntris);
     }
 }
+#ifdef HAS_VTKZ
+/* Print how well compressing the output paid: the compression ratio, and
+ * the MB/s of the ranks with data, compressing and writing (over secs) */
+
+void print_zstats(MPI_Comm comm, int rank, double secs)
+{
+    struct vtkzstats st;
+    uint64_t bytes[2], totbytes[2];
+    double rates[2], minrates[2], maxrates[2], sumrates[2];
+    int hasdata, nhasdata;
+
+    vtkz_getstats(&st, 1);
+    bytes[0] = st.rawbytes;
+    bytes[1] = st.zbytes;
+    hasdata = st.rawbytes > 0;
+    rates[0] = hasdata && st.ztime > 0. ? st.rawbytes/1e6/st.ztime : 0.;
+    rates[1] = hasdata && secs > 0. ? st.rawbytes/1e6/secs : 0.;
+    MPI_Reduce(bytes, totbytes, 2, MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, comm);
+    MPI_Reduce(rates, sumrates, 2, MPI_DOUBLE, MPI_SUM, 0, comm);
+    MPI_Reduce(&hasdata, &nhasdata, 1, MPI_INT, MPI_SUM, 0, comm);
+    if(!hasdata)
+        rates[0] = rates[1] = DBL_MAX;
+    MPI_Reduce(rates, minrates, 2, MPI_DOUBLE, MPI_MIN, 0, comm);
+    if(!hasdata)
+        rates[0] = rates[1] = 0.;
+    MPI_Reduce(rates, maxrates, 2, MPI_DOUBLE, MPI_MAX, 0, comm);
+    if(rank == 0 && nhasdata > 0) {
+        printf("      Compression ratio = %.2f (%.0f of %.0f bytes)\n",
+               totbytes[1] ? (double)totbytes[0]/totbytes[1] : 0.,
+               (double)totbytes[1], (double)totbytes[0]);
+        printf("      Compress MB/s per rank mean = %.1f, min = %.1f, max = %.1f\n",
+               sumrates[0]/nhasdata, minrates[0], maxrates[0]);
+        printf("      Effective output MB/s per rank mean = %.1f, min = %.1f, max = %.1f\n",
+               sumrates[1]/nhasdata, minrates[1], maxrates[1]);
+    }
+}
+#endif
+
+/* Whether an isosurface output module is in a --rebalance list */
+
+int rebalfor(const char *list, const char *name)
+{
+    size_t len = strlen(name);
+
+    while(list && *list) {
+        if( (!strncasecmp(list, name, len) && (list[len] == ',' || !list[len])) ||
+            (!strncasecmp(list, "all", 3) && (list[3] == ',' || !list[3])) )
+            return 1;
+        list = strchr(list, ',');
+        if(list)  list++;
+    }
+    return 0;
+}
+
+/* Rebalance the isosurfaces the first time an output module asks in a time step */
+
+struct isomesh *rebalonce(struct rebalinfo *rebal, struct isoinfo *iso, int *done,
+                          double *shuffletime)
+{
+    double t;
+    int m;
+
+    if(!*done) {
+        timer_tick(&t, rebal->comm, 0);
+        rebalmeshes(rebal, iso->nmeshes, iso->meshes, iso->indexed);
+        timer_tock(&t);
+        *shuffletime += t;
+        if(rebal->rank == 0) {
+            printf("      Rebalanced to %d ranks:\n", rebal->ntargets);   fflush(stdout);
+        }
+        for(m = 0; m < rebal->nmeshes; m++)
+            print_stats(rebal->comm, rebal->rank, rebal->nprocs, rebal->meshes[m].ntris);
+        *done = 1;
+    }
+    return rebal->meshes;
+}
+
+/* Copy n meshes to dst, growing it (maxdst meshes allocated) as needed */
+
+void stagemeshes(struct isomesh **dst, int *maxdst, int n, const struct isomesh *src,
+                 int nxvals)
+{
+    int m, x;
+
+    if(n > *maxdst) {
+        *dst = (struct isomesh *) realloc(*dst, n*sizeof(struct isomesh));
+        for(m = *maxdst; m < n; m++) {
+            memset(&(*dst)[m], 0, sizeof(struct isomesh));
+            (*dst)[m].xvals = (float **) calloc(nxvals+1, sizeof(float *));
+        }
+        *maxdst = n;
+    }
+    for(m = 0; m < n; m++) {
+        struct isomesh *d = &(*dst)[m];
+        const struct isomesh *sm = &src[m];
+        int fail;
+        if(sm->npoints > d->maxpoints) {
+            d->maxpoints = sm->npoints;
+            d->points = (float *) realloc(d->points, d->maxpoints*3*sizeof(float));
+            d->norms = (float *) realloc(d->norms, d->maxpoints*3*sizeof(float));
+            for(x = 0; x < nxvals; x++)
+                d->xvals[x] = (float *) realloc(d->xvals[x], d->maxpoints*sizeof(float));
+        }
+        if(sm->tris && sm->ntris*3 > d->maxtriverts) {
+            d->maxtriverts = sm->ntris*3;
+            d->tris = (uint64_t *) realloc(d->tris, d->maxtriverts*sizeof(uint64_t));
+        }
+        fail = sm->npoints && (!d->points || !d->norms);
+        for(x = 0; x < nxvals; x++)
+            fail = fail || (sm->npoints && !d->xvals[x]);
+        if(fail || (sm->tris && sm->ntris && !d->tris)) {
+            fprintf(stderr, "stagemeshes ERROR : could not allocate %llu points\n",
+                    (unsigned long long)sm->npoints);
+            exit(1);
+        }
+        d->thresh = sm->thresh;
+        d->ntris = sm->ntris;
+        d->npoints = sm->npoints;
+        memcpy(d->points, sm->points, sm->npoints*3*sizeof(float));
+        memcpy(d->norms, sm->norms, sm->npoints*3*sizeof(float));
+        for(x = 0; x < nxvals; x++)
+            memcpy(d->xvals[x], sm->xvals[x], sm->npoints*sizeof(float));
+        if(sm->tris)
+            memcpy(d->tris, sm->tris, sm->ntris*3*sizeof(uint64_t));
+    }
+}
+
+void freemeshes(struct isomesh *meshes, int n, int nxvals)
+{
+    int m, x;
+
+    for(m = 0; m < n; m++) {
+        free(meshes[m].points);
+        free(meshes[m].norms);
+        for(x = 0; x < nxvals; x++)
+            free(meshes[m].xvals[x]);
+        free(meshes[m].xvals);
+        free(meshes[m].tris);
+    }
+    free(meshes);
+}
+
+/* What the output modules write a time step from, so that the output can
+ * run in the background while the next time step computes */
+struct cartout {
+    MPI_Comm comm, isocomm;    /* Communicators of the writers */
+    int rank, isorank, nprocs;
+    int tt;
+    int full, iso;             /* Which of the outputs to write */
+    int ni, nj, nk;
+    int is, js, ks;
+    int cni, cnj, cnk;
+    int oni, onj, onk;
+    float deltax, deltay, deltaz;
+    int nxfields;
+    char **xnames;
+    float *data, **xdata;      /* Full output fields */
+    int nmeshes;
+    char **isonames;
+    struct isomesh *meshes;    /* Isosurfaces */
+    struct isomesh *rmeshes;   /* Rebalanced, for the modules in rebalance */
+    char *rebalance;
+    int vtkztype, vtkzlevel, vtkshared;
+    int naggs;                 /* Aggregators of the shared files, 0 for MPI-IO's */
+    int stripes;               /* Stripe count of the shared files */
+    struct bbuf *bb;           /* Stage of the output, if --stagedir */
+
+    /*## Add Output Modules' Variables Here ##*/
+
+#ifdef HAS_PVTI
+    int pvtiout;
+#endif
+
+#ifdef HAS_PVTP
+    int pvtpout;
+#endif
+
+#ifdef HAS_ADIOS
+    char *adiosfullmethod;
+    struct adiosfullinfo *adiosfull_nfo;
+    char *adiosisomethod;
+    struct adiosisoinfo *adiosiso_nfo;
+#endif
+
+#ifdef HAS_HDF5
+    int hdf5iout;
+    int hdf5pout;
+    hsize_t *hdf5i_chunk;
+    hsize_t *hdf5p_chunk;
+    struct hdf5opts *hdf5_opts;
+    char **hdf5i_names;        /* The field and noise fields, in one file */
+    float **hdf5i_data;
+#endif
+
+    /*## End of Output Module Variables ##*/
+};
+
+/* Write the full output of a time step */
+
+void fulloutput(struct cartout *o)
+{
+    int rank = o->rank, nprocs = o->nprocs, tt = o->tt;
+    int xf;
+    double vtktime;    /* This rank's PVTI output, for compression stats */
+    char *dir;         /* Where the output goes, and if this rank makes its */
+    int nodelocal;     /* directories for its node */
+
+    bbuf_begin(o->bb);
+    dir = bbuf_dir(o->bb);
+    nodelocal = bbuf_mkdirs(o->bb);
+
+    /*## Add FULL OUTPUT Modules' Function Calls Per Timestep Here ##*/
+
+#ifdef HAS_PVTI
+    if(o->pvtiout) {
+        if(rank == 0) {
+            printf("      Writing pvti...\n");   fflush(stdout);
+        }
+        timer_tick(&vtktime, o->comm, 0);
+        if(o->vtkshared) {
+            writevtishared(dir, "cartiso", "value", o->comm, rank, nprocs, tt,
+                           o->ni, o->nj, o->nk, o->is, o->is+o->cni-1, o->js, o->js+o->cnj-1, o->ks, o->ks+o->cnk-1, 
+                           o->deltax, o->deltay, o->deltaz, o->data, o->vtkztype, o->vtkzlevel,
+                           o->naggs, o->stripes);
+            for(xf = 0; xf < o->nxfields; xf++)
+                writevtishared(dir, "cartiso", o->xnames[xf], o->comm, rank, nprocs, tt,
+                               o->ni, o->nj, o->nk,
+                               o->is, o->is+o->cni-1, o->js, o->js+o->cnj-1,
+                               o->ks, o->ks+o->cnk-1, o->deltax, o->deltay, o->deltaz,
+                               o->xdata[xf], o->vtkztype, o->vtkzlevel, o->naggs,
+                               o->stripes);
+        } else {
+            writepvti(dir, nodelocal, "cartiso", "value", o->comm, rank, nprocs, tt,
+                      o->ni, o->nj, o->nk, o->is, o->is+o->cni-1, o->js, o->js+o->cnj-1, o->ks, o->ks+o->cnk-1, 
+                      o->deltax, o->deltay, o->deltaz, o->data, o->vtkztype, o->vtkzlevel);
+            for(xf = 0; xf < o->nxfields; xf++)
+                writepvti(dir, nodelocal, "cartiso", o->xnames[xf], o->comm, rank, nprocs, tt,
+                          o->ni, o->nj, o->nk,
+                          o->is, o->is+o->cni-1, o->js, o->js+o->cnj-1,
+                          o->ks, o->ks+o->cnk-1, o->deltax, o->deltay, o->deltaz,
+                          o->xdata[xf], o->vtkztype, o->vtkzlevel);
+        }
+        timer_tock(&vtktime);
+#  ifdef HAS_VTKZ
+        if(o->vtkztype)
+            print_zstats(o->comm, rank, vtktime);
+#  endif
+    }
+#endif
+
+#ifdef HAS_ADIOS
+    if(o->adiosfullmethod) {
+        if(rank == 0) {
+            printf("      Writing adios full...\n");   fflush(stdout);
+        }
+        adiosfull_write(o->adiosfull_nfo, dir, tt);
+    }
+#endif
+#ifdef HAS_HDF5
+    if(o->hdf5iout) {
+        if(rank == 0) {
+            printf("      Writing hdf5i...\n");   fflush(stdout);
+        }
+        writehdf5i(dir, "cartiso", o->nxfields+1, o->hdf5i_names, o->comm, rank, nprocs, tt,
+                   o->ni, o->nj, o->nk,
+                   o->is, o->is+o->oni-1, o->js, o->js+o->onj-1, o->ks, o->ks+o->onk-1,
+		   o->deltax, o->deltay, o->deltaz, o->cni, o->cnj, o->cnk, o->hdf5i_data,
+		   o->hdf5i_chunk, o->hdf5_opts);
+    }
+#endif
+
+    /*## End of FULL OUTPUT Module Function Calls Per Timestep ##*/
+
+    bbuf_end(o->bb);
+}
+
+/* Write the isosurface output of a time step */
+
+void isooutput(struct cartout *o)
+{
+    int rank = o->rank, nprocs = o->nprocs, tt = o->tt;
+    int m;
+    double vtktime;    /* This rank's PVTP output, for compression stats */
+    char *dir;         /* Where the output goes, and if this rank makes its */
+    int nodelocal;     /* directories for its node */
+
+    bbuf_begin(o->bb);
+    dir = bbuf_dir(o->bb);
+    nodelocal = bbuf_mkdirs(o->bb);
+
+    /*## Add ISOSURFACE OUTPUT Modules' Function Calls Per Timestep Here ##*/
+
+#ifdef HAS_PVTP 
+    if(o->pvtpout) {
+        struct isomesh *meshes = rebalfor(o->rebalance, "pvtp") ? o->rmeshes : o->meshes;
+        if(rank == 0) {
+            printf("      Writing pvtp...\n");   fflush(stdout);
+        }
+        timer_tick(&vtktime, o->comm, 0);
+        for(m = 0; m < o->nmeshes; m++) {
+            struct isomesh *mesh = &meshes[m];
+            if(o->vtkshared)
+                writevtpshared(dir, "cartiso", o->isonames[m], o->isocomm, o->isorank, nprocs,
+                               tt, mesh->ntris, mesh->npoints, mesh->points, mesh->norms,
+                               o->nxfields, mesh->xvals, o->xnames, mesh->tris, o->vtkztype,
+                               o->vtkzlevel, o->naggs, o->stripes);
+            else
+                writepvtp(dir, nodelocal, "cartiso", o->isonames[m], o->isocomm, o->isorank,
+                          nprocs, tt, mesh->ntris, mesh->npoints, mesh->points, mesh->norms,
+                          o->nxfields, mesh->xvals, o->xnames, mesh->tris, o->vtkztype,
+                          o->vtkzlevel);
+        }
+        timer_tock(&vtktime);
+#  ifdef HAS_VTKZ
+        if(o->vtkztype)
+            print_zstats(o->comm, rank, vtktime);
+#  endif
+    }
+#endif
+
+#ifdef HAS_ADIOS
+    if(o->adiosisomethod) {
+        struct isomesh *meshes = rebalfor(o->rebalance, "adiosiso") ? o->rmeshes : o->meshes;
+        if(rank == 0) {
+            printf("      Writing adios iso...\n");   fflush(stdout);
+        }
+        for(m = 0; m < o->nmeshes; m++) {
+            struct isomesh *mesh = &meshes[m];
+            adiosiso_write(&o->adiosiso_nfo[m], dir, tt, mesh->ntris, mesh->npoints, mesh->points,
+                           mesh->norms, mesh->xvals, mesh->tris);
+        }
+    }
+#endif
+#ifdef HAS_HDF5
+    if(o->hdf5pout) {
+        struct isomesh *meshes = rebalfor(o->rebalance, "hdf5p") ? o->rmeshes : o->meshes;
+        if(rank == 0) {
+            printf("      Writing hdf5p...\n");   fflush(stdout);
+        }
+        /* Several isosurfaces go in groups of the same file */
+        for(m = 0; m < o->nmeshes; m++) {
+            struct isomesh *mesh = &meshes[m];
+            writehdf5p(dir, "cartiso", o->isonames[m], o->isocomm, o->isorank, nprocs, tt,
+                       mesh->ntris, mesh->npoints, mesh->points, mesh->norms, o->nxfields,
+                       mesh->xvals, o->xnames, mesh->tris,
+                       o->nmeshes > 1 ? o->isonames[m] : NULL, m == 0, o->hdf5p_chunk,
+                       o->hdf5_opts);
+        }
+    }
+#endif
+
+    /*## End of ISOSURFACE OUTPUT Module Function Calls Per Timestep ##*/
+
+    bbuf_end(o->bb);
+}
+
+/* Write a time step's output, for asyncout */
+
+void stepoutput(void *arg)
+{
+    struct cartout *o = (struct cartout *)arg;
+
+    if(o->full)
+        fulloutput(o);
+    if(o->iso)
+        isooutput(o);
+}
+
+/* Tables of one axis of the separable field
+ *   The field is a Gaussian times a sum of sinusoids, and each factor of
+ *   the Gaussian and term of the sum depends on a single axis.  Fills the
+ *   coordinates, the sinusoid term (cosine if usecos), and the Gaussian
+ *   factor, exp(-alpha*(v-c)^2/sigma2), of the n points from v0 by dv. */
+
+void axis_tables(int n, float v0, float dv, float omega, int usecos, float c,
+                 float sigma2, float alpha, float *coord, float *wave, float *gauss)
+{
+    int i;
+    float v = v0;
+
+    for(i = 0; i < n; i++) {
+        coord[i] = v;
+        wave[i] = usecos ? cos(omega*v) : sin(omega*v);
+        gauss[i] = exp( -alpha*(v-c)*(v-c)/sigma2 );
+        v += dv;
+    }
+}
 
 
 int main(int argc, char **argv)
@@ -144,9 +591,11 @@ int main(int argc, char **argv)
     int i, j, k, t;    /* Indices */
     int tt;         /* Actual time step from tstart */
     int a;
-    float x, y, z;
     float deltax, deltay, deltaz;
-    float *data, *xdata;
+    float *data, **xdata;
+    float *xc, *xwave, *xgauss;   /* Per axis field tables, see axis_tables */
+    float *yc, *ywave, *ygauss;
+    float *zc, *zwave, *zgauss;
     int inp = 0;      /* Number of tasks in i */
     int jnp = 0;      /* Number of tasks in j */
     int knp = 0;      /* Number of tasks in k */
@@ -180,18 +629,57 @@ int main(int argc, char **argv)
     typedef enum { sin2gauss, gaussmove, gaussresize } modetype;
     modetype mode = sin2gauss;       /* Time animation mode */
     int gaussmovebackward = 0;       /* Whether gaussmove goes backward */
+    int curve = sfc3_serpentine;     /* Space filling curve type, -1 invalid */
+    int curveorder = 0;              /* Order isosurface output ranks along the curve */
     struct sfc3_ctx sfc;     /* Space filling curve for gaussmove */
     int sfc0i=0, sfc0j=0, sfc0k=0;    /* Space filling curve 1st of 2 points */
     struct isoinfo iso;       /* Isosurface context */
     struct osn_context *osn;    /* Open simplex noise context */
     float isothresh = -1.f;    /* Threshold of isosurface, -1 invalid */
-    double computetime, fullouttime, isotime, isoouttime;   /* Timers */
+    float *isovalues = NULL;   /* Thresholds of the isosurfaces, default isothresh */
+    int nisovalues = 0;
+    char **isonames;           /* Output name of each isosurface */
+    int nxfields = 1;          /* Noise fields carried by the isosurfaces */
+    char **xnames;             /* Names of the noise fields */
+    int m, xf;
+    int gradcache = 1;         /* Reuse grid point normals in isosurf */
+    int indexed = 0;           /* Share points between triangles */
+    int brick = 8;             /* Edge of the isosurface min/max bricks, 0 none */
+    char *rebalance = NULL;    /* Isosurface output modules to rebalance for */
+    int rebalanceto = 0;       /* Ranks receiving rebalanced triangles, 0 all */
+    struct rebalinfo rebal;    /* Isosurface rebalancing context */
+    int rebalanced;            /* Whether this time step's isosurfaces are rebalanced */
+    double computetime, fullouttime = 0., isotime, isoouttime;   /* Timers */
+    double shuffletime;        /* Part of isoouttime spent rebalancing */
+    int needrebal = 0;         /* Some output module writes rebalanced isosurfaces */
+    struct isomesh *rmeshes;   /* This time step's rebalanced isosurfaces, or NULL */
+    int vtkztype = 0;          /* PVTI & PVTP compressor, 0 none */
+    int vtkzlevel = 1;
+    int vtkshared = 0;         /* PVTI & PVTP pieces in one file per step */
+    double exchangetime;       /* Part of computetime spent waiting for ghosts */
+    struct haloinfo halo;      /* Ghost point exchange context */
+    int pass;
+    struct cartout out;        /* What the output modules write from */
+    int async = 0;             /* Write output in the background */
+    struct asyncout aout;      /* Background output context */
+    char *stagedir = NULL;     /* Burst buffer stage of the output */
+    int naggs = 0;             /* Ranks writing the shared files, 0 for MPI-IO's */
+    int stripes = 1;           /* Stripe count of the shared files */
+    int drainthreads = 1;
+    int sharedfiles = 0;       /* Some output is one file from all ranks */
+    struct bbuf bb;            /* Stage and drain context */
+    struct isomesh *smeshes = NULL, *srmeshes = NULL;   /* Snapshots of the isosurfaces */
+    int maxsmeshes = 0, maxsrmeshes = 0;
  
     /* MPI vars */
     int rank, nprocs; 
+    int provided;     /* MPI thread support */
     int cprocs[3], cpers[3], crnk[3];  /* MPI Cartesian info */
     MPI_Comm comm;    /* MPI Cartesian communicator */
+    MPI_Comm isocomm;    /* Communicator of the isosurface output, maybe in curve order */
+    int isorank;
     int cni, cnj, cnk;   /* Points in this task */
+    int oni, onj, onk;   /* Points owned by this task, without ghosts */
     int is, js, ks;     /* Global index starting points */
     float xs, ys, zs;    /* Global coordinate starting points */
 
@@ -209,7 +697,7 @@ int main(int argc, char **argv)
     char *adiosfullmethod = NULL;
     struct adiosfullinfo adiosfull_nfo;
     char *adiosisomethod = NULL;
-    struct adiosisoinfo adiosiso_nfo;
+    struct adiosisoinfo *adiosiso_nfo = NULL;
 #endif
  
 #ifdef HAS_HDF5
@@ -217,12 +705,15 @@ int main(int argc, char **argv)
     int hdf5pout = 0;
     hsize_t *hdf5i_chunk=NULL;
     hsize_t *hdf5p_chunk=NULL;
+    struct hdf5opts hdf5_opts = { 0, 0, 0, 0 };
+    char **hdf5i_names = NULL;    /* The field and noise fields, in one file */
+    float **hdf5i_data = NULL;
 #endif
 
     /*## End of Output Module Variables ##*/
 
-    /* Init MPI */
-    MPI_Init(&argc, &argv);
+    /* Init MPI; threads for --async */
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &provided);
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
     MPI_Comm_size(MPI_COMM_WORLD, &nprocs);
 
@@ -273,6 +764,46 @@ int main(int argc, char **argv)
             mode = gaussresize;
         } else if(!strcasecmp(argv[a], "--backward")) {
             gaussmovebackward = 1;
+        } else if(!strcasecmp(argv[a], "--curve")) {
+            curve = sfc3_type_byname(argv[++a]);
+        } else if(!strcasecmp(argv[a], "--curveorder")) {
+            curveorder = 1;
+        } else if(!strcasecmp(argv[a], "--nogradcache")) {
+            gradcache = 0;
+        } else if(!strcasecmp(argv[a], "--indexed")) {
+            indexed = 1;
+        } else if(!strcasecmp(argv[a], "--brick")) {
+            brick = atoi(argv[++a]);
+        } else if(!strcasecmp(argv[a], "--isovalues")) {
+            char *s = argv[++a], *end;
+            nisovalues = 1;
+            for(end = s; *end; end++)
+                if(*end == ',')  nisovalues++;
+            isovalues = (float *) realloc(isovalues, nisovalues*sizeof(float));
+            for(m = 0; m < nisovalues; m++) {
+                isovalues[m] = strtof(s, &end);
+                if(end == s) {
+                    print_usage(rank, "Error: isovalues incorrect");
+                    MPI_Abort(MPI_COMM_WORLD, 1);
+                }
+                s = (*end == ',') ? end+1 : end;
+            }
+        } else if(!strcasecmp(argv[a], "--xfields")) {
+            nxfields = atoi(argv[++a]);
+        } else if(!strcasecmp(argv[a], "--rebalance")) {
+            rebalance = argv[++a];
+        } else if(!strcasecmp(argv[a], "--rebalanceto")) {
+            rebalanceto = atoi(argv[++a]);
+        } else if(!strcasecmp(argv[a], "--async")) {
+            async = 1;
+        } else if(!strcasecmp(argv[a], "--stagedir")) {
+            stagedir = argv[++a];
+        } else if(!strcasecmp(argv[a], "--drainthreads")) {
+            drainthreads = atoi(argv[++a]);
+        } else if(!strcasecmp(argv[a], "--aggregators")) {
+            naggs = atoi(argv[++a]);
+        } else if(!strcasecmp(argv[a], "--stripes")) {
+            stripes = atoi(argv[++a]);
         } 
 
         /*## Add Output Modules' Command Line Arguments Here ##*/
@@ -289,6 +820,25 @@ int main(int argc, char **argv)
         }
 #endif
 
+#if defined(HAS_PVTI) || defined(HAS_PVTP)
+        else if(!strcasecmp(argv[a], "--vtkshared")) {
+            vtkshared = 1;
+        }
+#endif
+
+#ifdef HAS_VTKZ
+        else if(!strcasecmp(argv[a], "--vtkcompress")) {
+            vtkztype = vtkz_type_byname(argv[++a]);
+            if(vtkztype < 0) {
+                print_usage(rank, "Error: unknown compressor");
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+        }
+        else if(!strcasecmp(argv[a], "--vtkcompresslevel")) {
+            vtkzlevel = atoi(argv[++a]);
+        }
+#endif
+
 #ifdef HAS_ADIOS
         else if(!strcasecmp(argv[a], "--adiosfull")) {
             adiosfullmethod = argv[++a];
@@ -315,6 +865,16 @@ int main(int argc, char **argv)
 	  hdf5p_chunk = malloc(1 * sizeof(hsize_t));
 	  hdf5p_chunk[0] = (hsize_t)strtoul(argv[++a], NULL, 0);
         }
+        else if(!strcasecmp(argv[a], "--hdf5collmeta")) {
+	  hdf5_opts.collmeta = 1;
+        }
+        else if(!strcasecmp(argv[a], "--hdf5mdc")) {
+	  hdf5_opts.mdcsize = (size_t)(atof(argv[++a]) * 1048576.);
+        }
+        else if(!strcasecmp(argv[a], "--hdf5align")) {
+	  hdf5_opts.alignthresh = (hsize_t)strtoul(argv[++a], NULL, 0);
+	  hdf5_opts.align = (hsize_t)strtoul(argv[++a], NULL, 0);
+        }
 #endif
 
         /*## End of Output Module Command Line Arguments ##*/
@@ -339,6 +899,22 @@ int main(int argc, char **argv)
         print_usage(rank, "Error: product of tasks does not equal total MPI tasks");
         MPI_Abort(MPI_COMM_WORLD, 1);
     }
+    if(nxfields < 0) {
+        print_usage(rank, "Error: number of xfields must be >= 0");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    if(brick < 0) {
+        print_usage(rank, "Error: brick size must be >= 0");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    if(curve < 0) {
+        print_usage(rank, "Error: curve must be serpentine, hilbert, or morton");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    if(rebalanceto < 0 || rebalanceto > nprocs) {
+        print_usage(rank, "Error: rebalance ranks must be >= 0 and <= total MPI tasks");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
     if(ni % inp || nj % jnp || nk % knp) {
         print_usage(rank, "Error: number of points on an axis is not evenly divisible "
                 "by axis tasks.\n   This is required for proper load balancing.");
@@ -351,6 +927,12 @@ int main(int argc, char **argv)
     MPI_Cart_create(MPI_COMM_WORLD, 3, cprocs, cpers, 1, &comm);
     MPI_Comm_rank(comm, &rank);
     MPI_Cart_coords(comm, rank, 3, crnk);
+    if(curveorder)
+        MPI_Comm_split(comm, 0, sfc3_index(curve, inp, jnp, knp, crnk[0], crnk[1], crnk[2]),
+                       &isocomm);
+    else
+        isocomm = comm;
+    MPI_Comm_rank(isocomm, &isorank);
 
     /* Assign default arguments for A & isothresh */ 
     if(isothresh == -1.f) {
@@ -359,7 +941,35 @@ int main(int argc, char **argv)
     }
     if(A == -1.f)
         A = (1 - exp(-0.5));   /* Default is at gaussian of 1*sigma, but from bottom */
-    if(rank==0)  printf("isothresh = %f, A = %f\n", isothresh, A);
+    if(!isovalues) {
+        nisovalues = 1;
+        isovalues = (float *) malloc(sizeof(float));
+        isovalues[0] = isothresh;
+    }
+    if(rank==0) {
+        printf("isothresh =");
+        for(m = 0; m < nisovalues; m++)
+            printf(" %f", isovalues[m]);
+        printf(", A = %f\n", A);
+    }
+
+    /* Output names: one isosurface keeps the plain name */
+    isonames = (char **) malloc(nisovalues*sizeof(char *));
+    for(m = 0; m < nisovalues; m++) {
+        isonames[m] = (char *) malloc(16);
+        if(nisovalues == 1)
+            snprintf(isonames[m], 16, "iso");
+        else
+            snprintf(isonames[m], 16, "iso%d", m);
+    }
+    xnames = (char **) malloc((nxfields+1)*sizeof(char *));
+    for(xf = 0; xf < nxfields; xf++) {
+        xnames[xf] = (char *) malloc(16);
+        if(xf == 0)
+            snprintf(xnames[xf], 16, "noise");
+        else
+            snprintf(xnames[xf], 16, "noise%d", xf);
+    }
  
     /* Data inits */
     omegax = fx * 2 * M_PI;
@@ -377,19 +987,23 @@ int main(int argc, char **argv)
     xs = is * deltax;
     ys = js * deltay;
     zs = ks * deltaz;
-    /* add a ghost point to the far side of each axis for pvti & iso continuity */
-    /* note: this seems to confuse readability of formats that don't expect continuity, 
-     *       like ADIOS and ?, but it does not hurt for mere benchmarking of those */
-    if(1 && crnk[0] < inp-1)   cni++;
-    if(1 && crnk[1] < jnp-1)   cnj++;
-    if(1 && crnk[2] < knp-1)   cnk++;
+    oni = cni;
+    onj = cnj;
+    onk = cnk;
+    /* add a ghost point to the far side of each axis for pvti & iso continuity;
+     * its values come from the neighboring tasks, and the HDF5 & ADIOS full
+     * output leave it to them */
+    if(crnk[0] < inp-1)   cni++;
+    if(crnk[1] < jnp-1)   cnj++;
+    if(crnk[2] < knp-1)   cnk++;
+    haloinit(&halo, comm, cni, cnj, cnk);
 
     /* Set up space filling curve for gaussmove
           The curve moves through each parallel task */
     if(mode == gaussmove || centertask) {
-        sfc3_serpentine_init(&sfc, inp, jnp, knp, gaussmovebackward);
+        sfc3_init(&sfc, curve, inp, jnp, knp, gaussmovebackward);
         sfc0i = sfc.i;  sfc0j = sfc.j;  sfc0k = sfc.k;
-        sfc3_serpentine_next(&sfc);
+        sfc3_next(&sfc);
     }
     /* Set up center coords if centertask is on */
     if(centertask) {
@@ -399,31 +1013,139 @@ int main(int argc, char **argv)
         if(rank==0)  printf("x0=%f, y0=%f, z0=%f\n", x0, y0, z0);
     }
     /* Set up isosurfacing structure */
-    isoinit(&iso, xs, ys, zs, deltax, deltay, deltaz, cni, cnj, cnk, 1);
+    isoinit(&iso, xs, ys, zs, deltax, deltay, deltaz, cni, cnj, cnk, nxfields);
+    iso.gradcache = gradcache;
+    iso.indexed = indexed;
+    iso.brick = brick;
+    if(rebalance)
+        rebalinit(&rebal, isocomm, rebalanceto, nxfields);
     /* Set up osn */
     open_simplex_noise(12345, &osn);   /* Fixed seed, for now */
 
     /* Allocate arrays */
     data = (float *) malloc((size_t)cni*cnj*cnk*sizeof(float));
-    xdata = (float *) malloc((size_t)cni*cnj*cnk*sizeof(float));
+    xdata = (float **) malloc((nxfields+1)*sizeof(float *));
+    for(xf = 0; xf < nxfields; xf++)
+        xdata[xf] = (float *) malloc((size_t)cni*cnj*cnk*sizeof(float));
+    xc = (float *) malloc(3*cni*sizeof(float));
+    xwave = xc + cni;  xgauss = xwave + cni;
+    yc = (float *) malloc(3*cnj*sizeof(float));
+    ywave = yc + cnj;  ygauss = ywave + cnj;
+    zc = (float *) malloc(3*cnk*sizeof(float));
+    zwave = zc + cnk;  zgauss = zwave + cnk;
+
+    /* Output context; in the background, the writers have their own
+     * communicators and a snapshot of the fields */
+    asyncout_init(&aout, comm, async);
+    out.rank = rank;
+    out.isorank = isorank;
+    out.nprocs = nprocs;
+    out.ni = ni;  out.nj = nj;  out.nk = nk;
+    out.is = is;  out.js = js;  out.ks = ks;
+    out.cni = cni;  out.cnj = cnj;  out.cnk = cnk;
+    out.oni = oni;  out.onj = onj;  out.onk = onk;
+    out.deltax = deltax;  out.deltay = deltay;  out.deltaz = deltaz;
+    out.nxfields = nxfields;
+    out.xnames = xnames;
+    out.nmeshes = nisovalues;
+    out.isonames = isonames;
+    out.rebalance = rebalance;
+    out.vtkztype = vtkztype;
+    out.vtkzlevel = vtkzlevel;
+    out.vtkshared = vtkshared;
+    out.naggs = naggs;
+    out.stripes = stripes;
+    if(aout.enabled) {
+        MPI_Comm_dup(comm, &out.comm);
+        if(curveorder)
+            MPI_Comm_dup(isocomm, &out.isocomm);
+        else
+            out.isocomm = out.comm;
+        out.data = (float *) malloc((size_t)cni*cnj*cnk*sizeof(float));
+        out.xdata = (float **) malloc((nxfields+1)*sizeof(float *));
+        for(xf = 0; xf < nxfields; xf++)
+            out.xdata[xf] = (float *) malloc((size_t)cni*cnj*cnk*sizeof(float));
+    } else {
+        out.comm = comm;
+        out.isocomm = isocomm;
+        out.data = data;
+        out.xdata = xdata;
+    }
 
     /*## Add Output Modules' Initialization Here ##*/
 
 #ifdef HAS_ADIOS
     if(adiosfullmethod) {
-        adiosfull_init(&adiosfull_nfo, adiosfullmethod, "cartiso.full", comm, rank, nprocs, nt,
-                       ni, nj, nk, is, cni, js, cnj, ks, cnk, deltax, deltay, deltaz);
-        adiosfull_addvar(&adiosfull_nfo, "value", data);
-        adiosfull_addvar(&adiosfull_nfo, "noise", xdata);
+        adiosfull_init(&adiosfull_nfo, adiosfullmethod, "cartiso.full", out.comm, rank, nprocs,
+                       nt, ni, nj, nk, is, oni, js, onj, ks, onk, cni, cnj, cnk,
+                       deltax, deltay, deltaz);
+        adiosfull_addvar(&adiosfull_nfo, "value", out.data);
+        for(xf = 0; xf < nxfields; xf++)
+            adiosfull_addvar(&adiosfull_nfo, xnames[xf], out.xdata[xf]);
     }
     if(adiosisomethod) {
-        adiosiso_init(&adiosiso_nfo, adiosisomethod, "cartiso.iso", comm, rank, nprocs, nt,
-                       ni, nj, nk, cni, cnj, cnk);
-        adiosiso_addxvar(&adiosiso_nfo, "noise");
+        /* An ADIOS group of each isosurface */
+        adiosiso_nfo = (struct adiosisoinfo *) malloc(nisovalues*sizeof(struct adiosisoinfo));
+        for(m = 0; m < nisovalues; m++) {
+            char *gname = (char *) malloc(32);
+            snprintf(gname, 32, "cartiso.%s", isonames[m]);
+            adiosiso_init(&adiosiso_nfo[m], adiosisomethod, gname, out.isocomm, isorank, nprocs, nt,
+                           ni, nj, nk, cni, cnj, cnk);
+            for(xf = 0; xf < nxfields; xf++)
+                adiosiso_addxvar(&adiosiso_nfo[m], xnames[xf]);
+        }
+    }
+#endif
+
+#ifdef HAS_HDF5
+    if(hdf5iout) {
+        /* The field and noise fields are datasets of one file per step */
+        hdf5i_names = (char **) malloc((nxfields+1)*sizeof(char *));
+        hdf5i_data = (float **) malloc((nxfields+1)*sizeof(float *));
+        hdf5i_names[0] = "value";
+        hdf5i_data[0] = out.data;
+        for(xf = 0; xf < nxfields; xf++) {
+            hdf5i_names[1+xf] = xnames[xf];
+            hdf5i_data[1+xf] = out.xdata[xf];
+        }
     }
 #endif
 
+    /* The output modules' part of the context */
+#ifdef HAS_PVTI
+    out.pvtiout = pvtiout;
+    sharedfiles = sharedfiles || (pvtiout && vtkshared);
+#endif
+#ifdef HAS_PVTP
+    out.pvtpout = pvtpout;
+    needrebal = needrebal || (pvtpout && rebalfor(rebalance, "pvtp"));
+    sharedfiles = sharedfiles || (pvtpout && vtkshared);
+#endif
+#ifdef HAS_ADIOS
+    out.adiosfullmethod = adiosfullmethod;
+    out.adiosfull_nfo = &adiosfull_nfo;
+    out.adiosisomethod = adiosisomethod;
+    out.adiosiso_nfo = adiosiso_nfo;
+    needrebal = needrebal || (adiosisomethod && rebalfor(rebalance, "adiosiso"));
+    sharedfiles = sharedfiles || adiosfullmethod || adiosisomethod;
+#endif
+#ifdef HAS_HDF5
+    out.hdf5iout = hdf5iout;
+    out.hdf5pout = hdf5pout;
+    out.hdf5i_chunk = hdf5i_chunk;
+    out.hdf5p_chunk = hdf5p_chunk;
+    out.hdf5_opts = &hdf5_opts;
+    out.hdf5i_names = hdf5i_names;
+    out.hdf5i_data = hdf5i_data;
+    needrebal = needrebal || (hdf5pout && rebalfor(rebalance, "hdf5p"));
+    sharedfiles = sharedfiles || hdf5iout || hdf5pout;
+#endif
+
     /*## End of Output Module Initialization ##*/
+
+    /* Stage the output for a background drain */
+    bbuf_init(&bb, comm, stagedir, drainthreads, sharedfiles);
+    out.bb = &bb;
  
     /* Main loops */
  
@@ -457,7 +1179,7 @@ int main(int argc, char **argv)
                 tpar_sfc = tpar*(nprocs-1) - sfc.ndx + 1;  /* Param between points */
                 while(tpar_sfc > 1.f) {        /* while param>1, it's time to advance sfc */
                     sfc0i = sfc.i;  sfc0j = sfc.j;  sfc0k = sfc.k;
-                    sfc3_serpentine_next(&sfc);
+                    sfc3_next(&sfc);
                     tpar_sfc -= 1.f;
                 }
                 x0 = (1-tpar_sfc) * ((sfc0i + 1.f) / inp - .5f / inp) +
@@ -476,149 +1198,201 @@ int main(int argc, char **argv)
         sigmay2 = 2*sigmay*sigmay;
         sigmaz2 = 2*sigmaz*sigmaz;
       
-        /* Spatial loops */
-        z = zs;
-        for(k = 0, ii = 0; k < cnk; k++) {
-            y = ys;
-            for(j = 0; j < cnj; j++) {
-                x = xs;
-                for(i = 0; i < cni; i++, ii++) {
-                    float sinusoid = ( sin(omegax*x) + sin(omegay*y) + \
-                                       cos(omegaz*z) + sinshift ) * sinscale;
-                    data[ii] = exp( -alpha*( (x-x0)*(x-x0)/sigmax2 + \
-					     (y-y0)*(y-y0)/sigmay2 +	\
-                                             (z-z0)*(z-z0)/sigmaz2 ) ) * sinusoid;
-                    xdata[ii] = (float)open_simplex_noise4(osn, x * noisespacefreq, 
-                                  y * noisespacefreq, z * noisespacefreq, tt*noisetimefreq);
-                    /* need other frequencies */
-                    x += deltax;
+        /* Spatial loops
+         *   Each point is xgauss*ygauss*zgauss*(xwave+ywave+zwave+sinshift)*sinscale,
+         *   so a row takes the j,k terms once and is a vectorizable product.
+         *   The owned points go in two passes: first those the neighbors need
+         *   as ghosts, with i, j, or k of 0, then the rest while they travel. */
+        axis_tables(oni, xs, deltax, omegax, 0, x0, sigmax2, alpha, xc, xwave, xgauss);
+        axis_tables(onj, ys, deltay, omegay, 0, y0, sigmay2, alpha, yc, ywave, ygauss);
+        axis_tables(onk, zs, deltaz, omegaz, 1, z0, sigmaz2, alpha, zc, zwave, zgauss);
+        for(pass = 0; pass < 2; pass++) {
+            for(k = 0; k < onk; k++) {
+                for(j = 0; j < onj; j++) {
+                    int face = (j == 0 || k == 0);
+                    int i0 = pass ? 1 : 0;
+                    int i1 = (pass || face) ? oni : 1;
+                    float *row;
+                    float rowscale = ygauss[j] * zgauss[k] * sinscale;
+                    float rowshift = ywave[j] + zwave[k] + sinshift;
+                    if(pass && face)
+                        continue;
+                    ii = ((size_t)k*cnj + j)*cni;
+                    row = data + ii;
+                    for(i = i0; i < i1; i++)
+                        row[i] = xgauss[i] * (xwave[i] + rowshift) * rowscale;
+                    /* Noise fields at multiples of the space frequency */
+                    for(xf = 0; xf < nxfields; xf++) {
+                        double f = noisespacefreq * (xf+1);
+                        for(i = i0; i < i1; i++)
+                            xdata[xf][ii+i] = (float)open_simplex_noise4(osn, xc[i] * f,
+                                                    yc[j] * f, zc[k] * f, tt*noisetimefreq);
+                    }
                 }
-                y += deltay;
             }
-            z += deltaz;
-        }
-
-        timer_tock(&computetime);
-
-        if(rank == 0) {
-            printf("   Full Output...\n");   fflush(stdout);
+            if(pass == 0) {
+                halostart(&halo, data);
+                for(xf = 0; xf < nxfields; xf++)
+                    halostart(&halo, xdata[xf]);
+            }
         }
-        timer_tick(&fullouttime, comm, 1);
+        timer_tick(&exchangetime, comm, 0);
+        halowait(&halo);
+        timer_tock(&exchangetime);
 
-        /*## Add FULL OUTPUT Modules' Function Calls Per Timestep Here ##*/
+        /* Fold the finished planes into the isosurface brick ranges */
+        for(k = 0; k < cnk; k++)
+            isorange(&iso, k, data + (size_t)k*cni*cnj);
 
-#ifdef HAS_PVTI
-        if(pvtiout) {
-            if(rank == 0) {
-                printf("      Writing pvti...\n");   fflush(stdout);
-            }
-            writepvti("cartiso", "value", comm, rank, nprocs, tt, ni, nj, nk,
-                      is, is+cni-1, js, js+cnj-1, ks, ks+cnk-1, 
-                      deltax, deltay, deltaz, data);
-            writepvti("cartiso", "noise", comm, rank, nprocs, tt, ni, nj, nk,
-                      is, is+cni-1, js, js+cnj-1, ks, ks+cnk-1, 
-                      deltax, deltay, deltaz, xdata);
-        }
-#endif
+        timer_tock(&computetime);
 
-#ifdef HAS_ADIOS
-        if(adiosfullmethod) {
-            if(rank == 0) {
-                printf("      Writing adios full...\n");   fflush(stdout);
-            }
-            adiosfull_write(&adiosfull_nfo, tt);
-	}
-#endif
-#ifdef HAS_HDF5
-        if(hdf5iout) {
+        /* Full output now, unless it goes with the isosurfaces in the background */
+        if(!aout.enabled) {
+            out.tt = tt;
             if(rank == 0) {
-                printf("      Writing hdf5i...\n");   fflush(stdout);
+                printf("   Full Output...\n");   fflush(stdout);
             }
-            writehdf5i("cartiso", "value", comm, rank, nprocs, tt, ni, nj, nk,
-                      is, is+cni-1, js, js+cnj-1, ks, ks+cnk-1,
-		       deltax, deltay, deltaz, cni, cnj, cnk, data, hdf5i_chunk);
-            writehdf5i("cartiso", "noise", comm, rank, nprocs, tt, ni, nj, nk,
-                      is, is+cni-1, js, js+cnj-1, ks, ks+cnk-1,
-                      deltax, deltay, deltaz, cni, cnj, cnk, xdata, hdf5i_chunk);
+            timer_tick(&fullouttime, comm, 1);
+            fulloutput(&out);
+            timer_tock(&fullouttime);
         }
-#endif
-
-        /*## End of FULL OUTPUT Module Function Calls Per Timestep ##*/
-
-        timer_tock(&fullouttime);
 
         /* Generate isosurface */
         if(rank == 0) {
             printf("   Isosurface...\n");   fflush(stdout);
         }
         timer_tick(&isotime, comm, 1);
-        isosurf(&iso, isothresh, data, xdata);
+        isosurfs(&iso, nisovalues, isovalues, data, (const float * const *)xdata);
         timer_tock(&isotime);
-        /*printf("      %d tris = %llu\n", rank, iso.ntris);*/
-        print_stats(comm, rank, nprocs, iso.ntris);
+        for(m = 0; m < iso.nmeshes; m++) {
+            if(rank == 0 && nisovalues > 1)
+                printf("      Isovalue %f:\n", iso.meshes[m].thresh);
+            print_stats(comm, rank, nprocs, iso.meshes[m].ntris);
+            if(indexed) {
+                uint64_t totpoints;
+                MPI_Reduce(&iso.meshes[m].npoints, &totpoints, 1, MPI_UNSIGNED_LONG_LONG,
+                           MPI_SUM, 0, comm);
+                if(rank == 0)
+                    printf("      Unique points = %.0f\n", (double)totpoints);
+            }
+        }
+        if(brick > 0) {
+            uint64_t totcells;
+            MPI_Reduce(&iso.ncells, &totcells, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, comm);
+            if(rank == 0)
+                printf("      Cells visited = %.0f of %.0f\n", (double)totcells,
+                       (double)(ni-1)*(nj-1)*(nk-1)*nisovalues);   /* For every isovalue */
+        }
 
         if(rank == 0) {
-            printf("   Isosurface Output...\n");   fflush(stdout);
+            printf(aout.enabled ? "   Output...\n" : "   Isosurface Output...\n");
+            fflush(stdout);
         }
+        rebalanced = 0;
+        shuffletime = 0.;
         timer_tick(&isoouttime, comm, 1);
-
-        /*## Add ISOSURFACE OUTPUT Modules' Function Calls Per Timestep Here ##*/
-
-#ifdef HAS_PVTP 
-        if(pvtpout) {
-            if(rank == 0) {
-                printf("      Writing pvtp...\n");   fflush(stdout);
+        rmeshes = needrebal ? rebalonce(&rebal, &iso, &rebalanced, &shuffletime) : NULL;
+        if(aout.enabled) {
+            /* Snapshot what the last output is done with, and hand it off */
+            asyncout_wait(&aout);
+            out.tt = tt;
+            memcpy(out.data, data, (size_t)cni*cnj*cnk*sizeof(float));
+            for(xf = 0; xf < nxfields; xf++)
+                memcpy(out.xdata[xf], xdata[xf], (size_t)cni*cnj*cnk*sizeof(float));
+            stagemeshes(&smeshes, &maxsmeshes, iso.nmeshes, iso.meshes, nxfields);
+            out.meshes = smeshes;
+            out.rmeshes = NULL;
+            if(rmeshes) {
+                stagemeshes(&srmeshes, &maxsrmeshes, rebal.nmeshes, rmeshes, nxfields);
+                out.rmeshes = srmeshes;
             }
-            writepvtp("cartiso", "iso", comm, rank, nprocs, tt, iso.ntris,
-                      iso.points, iso.norms, iso.xvals, "noise");
+            out.full = out.iso = 1;
+            asyncout_post(&aout, stepoutput, &out);
+        } else {
+            out.meshes = iso.meshes;
+            out.rmeshes = rmeshes;
+            isooutput(&out);
         }
-#endif
-
-#ifdef HAS_ADIOS
-        if(adiosisomethod) {
-            if(rank == 0) {
-                printf("      Writing adios iso...\n");   fflush(stdout);
-            }
-            adiosiso_write(&adiosiso_nfo, tt, iso.ntris, iso.points, iso.norms,
-                           &iso.xvals);
-	}
-#endif
-#ifdef HAS_HDF5
-        if(hdf5pout) {
-            if(rank == 0) {
-                printf("      Writing hdf5p...\n");   fflush(stdout);
-            }
-            writehdf5p("cartiso", "iso", comm, rank, nprocs, tt, iso.ntris,
-		       iso.points, iso.norms, iso.xvals, "noise", hdf5p_chunk);
-        }
-#endif
-
-        /*## End of ISOSURFACE OUTPUT Module Function Calls Per Timestep ##*/
-
         timer_tock(&isoouttime);
         timer_collectprintstats(computetime, comm, 0, "   Compute");
-        timer_collectprintstats(fullouttime, comm, 0, "   FullOutput");
+        timer_collectprintstats(exchangetime, comm, 0, "   Exchange");
+        if(!aout.enabled)
+            timer_collectprintstats(fullouttime, comm, 0, "   FullOutput");
         timer_collectprintstats(isotime, comm, 0, "   Isosurface");
-        timer_collectprintstats(isoouttime, comm, 0, "   IsoOutput");
+        if(aout.enabled) {
+            /* Both outputs, the wait for the last step's, and its hidden part */
+            asyncout_printstats(&aout, isoouttime, comm);
+            if(rebalance)
+                timer_collectprintstats(shuffletime, comm, 0, "   IsoShuffle");
+        } else {
+            timer_collectprintstats(isoouttime, comm, 0, "   IsoOutput");
+            if(rebalance) {
+                timer_collectprintstats(shuffletime, comm, 0, "   IsoShuffle");
+                timer_collectprintstats(isoouttime - shuffletime, comm, 0, "   IsoWrite");
+            }
+        }
+        bbuf_printstats(&bb);
     }
 
+    /* The last time step's output has nothing to hide behind */
+    asyncout_finalize(&aout);
+    if(aout.enabled)
+        timer_collectprintstats(aout.waittime, comm, 0, "   OutputDrain");
+    bbuf_finalize(&bb);
+
     /*## Add Output Modules' Cleanup Here ##*/
 
 #ifdef HAS_ADIOS
     if(adiosfullmethod)  adiosfull_finalize(&adiosfull_nfo);
-    if(adiosisomethod) adiosiso_finalize(&adiosiso_nfo);
+    if(adiosisomethod) {
+        for(m = 0; m < nisovalues; m++) {
+            adiosiso_finalize(&adiosiso_nfo[m]);
+            free(adiosiso_nfo[m].name);
+        }
+        free(adiosiso_nfo);
+    }
 #endif
 
     /*## End of Output Module Cleanup ##*/
 
     open_simplex_noise_free(osn);
     isofree(&iso);
+    halofree(&halo);
+    if(rebalance)
+        rebalfree(&rebal);
+    if(curveorder)
+        MPI_Comm_free(&isocomm);
+    if(aout.enabled) {
+        if(out.isocomm != out.comm)
+            MPI_Comm_free(&out.isocomm);
+        MPI_Comm_free(&out.comm);
+        free(out.data);
+        for(xf = 0; xf < nxfields; xf++)
+            free(out.xdata[xf]);
+        free(out.xdata);
+        freemeshes(smeshes, maxsmeshes, nxfields);
+        freemeshes(srmeshes, maxsrmeshes, nxfields);
+    }
     free(data);
+    for(xf = 0; xf < nxfields; xf++) {
+        free(xdata[xf]);
+        free(xnames[xf]);
+    }
     free(xdata);
+    free(xnames);
+    free(xc);
+    free(yc);
+    free(zc);
+    for(m = 0; m < nisovalues; m++)
+        free(isonames[m]);
+    free(isonames);
+    free(isovalues);
 
 #ifdef HAS_HDF5
     free(hdf5i_chunk);
     free(hdf5p_chunk);
+    free(hdf5i_names);
+    free(hdf5i_data);
 #endif
  
     MPI_Finalize();
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) DoD HPCMP PETTT.  All rights reserved.
+ * See LICENSE file for details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "halo.h"
+
+/* Region of a neighbor in direction d, a bit per axis (1 i, 2 j, 4 k):
+ *   along the axes of d, the single plane at index at[], and along the
+ *   others, the points owned */
+
+static void region_type(int d, const int *sizes, const int *owned, const int *at,
+                        MPI_Datatype *type)
+{
+    int subsizes[3], starts[3], a;
+
+    /* Axes in C order, k slowest */
+    for(a = 0; a < 3; a++) {
+        if(d & (1 << a)) {
+            subsizes[2-a] = 1;
+            starts[2-a] = at[a];
+        } else {
+            subsizes[2-a] = owned[a];
+            starts[2-a] = 0;
+        }
+    }
+    MPI_Type_create_subarray(3, sizes, subsizes, starts, MPI_ORDER_C, MPI_FLOAT, type);
+    MPI_Type_commit(type);
+}
+
+void haloinit(struct haloinfo *nfo, MPI_Comm comm, int cni, int cnj, int cnk)
+{
+    int dims[3], periods[3], coords[3], nbr[3];
+    int sizes[3] = { cnk, cnj, cni };
+    int cn[3] = { cni, cnj, cnk };
+    int owned[3], ghostat[3], zero[3] = { 0, 0, 0 };
+    int a, d, up, down;
+
+    nfo->comm = comm;
+    MPI_Cart_get(comm, 3, dims, periods, coords);
+    for(a = 0; a < 3; a++) {
+        owned[a] = coords[a] < dims[a]-1 ? cn[a]-1 : cn[a];
+        ghostat[a] = cn[a]-1;
+    }
+
+    nfo->nrecv = nfo->nsend = 0;
+    for(d = 1; d < 8; d++) {
+        for(up = down = 1, a = 0; a < 3; a++) {
+            if(d & (1 << a)) {
+                up = up && coords[a] < dims[a]-1;
+                down = down && coords[a] > 0;
+            }
+        }
+        /* Ghosts from the task above in direction d, its first points */
+        if(up) {
+            for(a = 0; a < 3; a++)
+                nbr[a] = coords[a] + ((d >> a) & 1);
+            MPI_Cart_rank(comm, nbr, &nfo->recvrank[nfo->nrecv]);
+            nfo->recvtag[nfo->nrecv] = d;
+            region_type(d, sizes, owned, ghostat, &nfo->recvtype[nfo->nrecv]);
+            nfo->nrecv++;
+        }
+        /* First points to the task below in direction d */
+        if(down) {
+            for(a = 0; a < 3; a++)
+                nbr[a] = coords[a] - ((d >> a) & 1);
+            MPI_Cart_rank(comm, nbr, &nfo->sendrank[nfo->nsend]);
+            nfo->sendtag[nfo->nsend] = d;
+            region_type(d, sizes, owned, zero, &nfo->sendtype[nfo->nsend]);
+            nfo->nsend++;
+        }
+    }
+
+    nfo->nreqs = 0;
+    nfo->maxreqs = 0;
+    nfo->reqs = NULL;
+}
+
+void halofree(struct haloinfo *nfo)
+{
+    int n;
+
+    for(n = 0; n < nfo->nrecv; n++)
+        MPI_Type_free(&nfo->recvtype[n]);
+    for(n = 0; n < nfo->nsend; n++)
+        MPI_Type_free(&nfo->sendtype[n]);
+    free(nfo->reqs);
+    nfo->reqs = NULL;
+    nfo->nreqs = nfo->maxreqs = 0;
+}
+
+void halostart(struct haloinfo *nfo, float *data)
+{
+    int n;
+
+    if(nfo->nreqs + nfo->nrecv + nfo->nsend > nfo->maxreqs) {
+        nfo->maxreqs = 2*(nfo->nreqs + nfo->nrecv + nfo->nsend);
+        nfo->reqs = (MPI_Request *) realloc(nfo->reqs, nfo->maxreqs*sizeof(MPI_Request));
+        if(!nfo->reqs) {
+            fprintf(stderr, "halostart ERROR : could not allocate %d requests\n",
+                    nfo->maxreqs);
+            MPI_Abort(nfo->comm, 1);
+        }
+    }
+    /* Messages between two tasks with the same tag arrive in order, so the
+     * arrays of several calls do not mix */
+    for(n = 0; n < nfo->nrecv; n++)
+        MPI_Irecv(data, 1, nfo->recvtype[n], nfo->recvrank[n], nfo->recvtag[n],
+                  nfo->comm, &nfo->reqs[nfo->nreqs++]);
+    for(n = 0; n < nfo->nsend; n++)
+        MPI_Isend(data, 1, nfo->sendtype[n], nfo->sendrank[n], nfo->sendtag[n],
+                  nfo->comm, &nfo->reqs[nfo->nreqs++]);
+}
+
+void halowait(struct haloinfo *nfo)
+{
+    MPI_Waitall(nfo->nreqs, nfo->reqs, MPI_STATUSES_IGNORE);
+    nfo->nreqs = 0;
+}
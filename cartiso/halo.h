@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) DoD HPCMP PETTT.  All rights reserved.
+ * See LICENSE file for details.
+ */
+
+#include <mpi.h>
+
+/* Exchange of the ghost points on the far side of each axis of a block
+ *   A task has a ghost layer along an axis when a task follows it on that
+ *   axis; the layer holds that task's first points.  The ghosts come from
+ *   the up to 7 tasks above along i, j, and k, faces, edges, and corner. */
+struct haloinfo {
+    MPI_Comm comm;     /* Cartesian communicator of the tasks */
+    int nrecv, nsend;  /* Neighbors to receive from and send to */
+    int recvrank[7], sendrank[7];
+    int recvtag[7], sendtag[7];
+    MPI_Datatype recvtype[7];  /* Ghost regions of the block */
+    MPI_Datatype sendtype[7];  /* Owned regions that are a neighbor's ghosts */
+    int nreqs;         /* Requests in flight */
+    int maxreqs;
+    MPI_Request *reqs;
+};
+
+/* Initialize info for the exchange of blocks of cni x cnj x cnk points,
+ * i fastest, which include the ghosts */
+
+void haloinit(struct haloinfo *nfo, MPI_Comm comm, int cni, int cnj, int cnk);
+
+/* Free up resources from the exchange */
+
+void halofree(struct haloinfo *nfo);
+
+/* Start exchanging the ghosts of one array
+ *   The owned points the neighbors need, those with i, j, or k of 0, must
+ *   be final; the array must not change until halowait.  Can be called for
+ *   several arrays before a single halowait. */
+
+void halostart(struct haloinfo *nfo, float *data);
+
+/* Wait until the exchanges started are done and the ghosts are filled */
+
+void halowait(struct haloinfo *nfo);
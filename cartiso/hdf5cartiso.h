@@ -2,11 +2,31 @@
 #  include "hdf5.h"
 #endif
 
-void writehdf5p(char *name, char *varname, MPI_Comm comm, int rank, int nprocs, 
-               int tstep, uint64_t ntris, float *points, float *norms, 
-		float *xvals, char *xname, hsize_t *h5_chunk);
+/* File access tuning of the HDF5 output, 0s for HDF5's defaults */
+struct hdf5opts {
+  int collmeta;          /* Collective metadata reads and writes */
+  size_t mdcsize;        /* Initial bytes of the metadata cache */
+  hsize_t alignthresh;   /* Objects of at least this many bytes are aligned */
+  hsize_t align;         /* to multiples of this many bytes */
+};
 
-void writehdf5i(char *name, char *varname, MPI_Comm comm, int rank, int nprocs, 
+/* File access properties for collective I/O of comm's tasks, tuned by
+ * opts (may be NULL); close with H5Pclose */
+hid_t hdf5_fapl(MPI_Comm comm, struct hdf5opts *opts);
+
+/* Writes the isosurface into group, or the file root if NULL, of the time
+ * step's file in directory dir; newfile creates the file, otherwise the
+ * group is added */
+void writehdf5p(char *dir, char *name, char *varname, MPI_Comm comm, int rank, int nprocs, 
+               int tstep, uint64_t ntris, uint64_t npoints, float *points, float *norms, 
+		int nxvals, float **xvals, char **xnames, uint64_t *tris,
+		char *group, int newfile, hsize_t *h5_chunk, struct hdf5opts *opts);
+
+/* Writes extent is-ie, js-je, ks-ke of the nci x ncj x nck blocks datas,
+ * which may hold ghost points past it, as the nvars datasets varnames of
+ * the time step's file in directory dir */
+void writehdf5i(char *dir, char *name, int nvars, char **varnames, MPI_Comm comm, int rank, int nprocs, 
                int tstep, int ni, int nj, int nk, int is, int ie, int js, int je,
-		int ks, int ke, float deltax, float deltay, float deltaz, int nci, int ncj, int nck, float *data, hsize_t *h5_chunk);
+		int ks, int ke, float deltax, float deltay, float deltaz, int nci, int ncj, int nck, float **datas, hsize_t *h5_chunk,
+		struct hdf5opts *opts);
 
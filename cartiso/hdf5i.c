@@ -12,71 +12,18 @@
 #include <mpi.h>
 
 #include "hdf5.h"
+#include "hdf5cartiso.h"
 
 static const int fnstrmax = 4095;
 
 void
-write_xdmf_xml_value(char *fname, char *fname_xdmf, char *varname, float deltax, float deltay, float deltaz, int ni, int nj, int nk);
+write_xdmf_xml_value(char *fname, char *fname_xdmf, int nvars, char **varnames, float deltax, float deltay, float deltaz, int ni, int nj, int nk);
 
-void writehdf5i(char *name, char *varname, MPI_Comm comm, int rank, int nprocs, 
-               int tstep, int ni, int nj, int nk, int is, int ie, int js, int je,
-		int ks, int ke, float deltax, float deltay, float deltaz, int nci, int ncj, int nck, float *data, hsize_t *h5_chunk)
+hid_t hdf5_fapl(MPI_Comm comm, struct hdf5opts *opts)
 {
-    char fname[fnstrmax+1];
-    char fname_xdmf[fnstrmax+1];
-    int timedigits = 4;
     MPI_Info info = MPI_INFO_NULL;
-
-    hid_t file_id;
     hid_t plist_id;
-    hid_t memspace;
-    hid_t filespace;
-    hid_t did;
-    hsize_t start[3], count[3];
-    hsize_t dims[3];
-    herr_t err;
-    hid_t chunk_pid;
-
-    snprintf(fname, fnstrmax, "cart.%s_t%0*d.h5", varname, timedigits, tstep);
-    snprintf(fname_xdmf, fnstrmax, "cart.%s_t%0*d.xmf", varname, timedigits, tstep);
-
-
-
-    /* Create pvti file */
-    if(rank == 0) {
-
-      if( (file_id = H5Fcreate(fname, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT)) < 0) {
-	fprintf(stderr, "writehdf5i error: could not create %s \n", fname);
-	MPI_Abort(comm, 1);
-      }
-
-      /* Create dataset */
-      dims[0] = (hsize_t)ni;
-      dims[1] = (hsize_t)nj;
-      dims[2] = (hsize_t)nk;
-      filespace = H5Screate_simple(3, dims, NULL);
-      
-      chunk_pid = H5Pcreate(H5P_DATASET_CREATE);
-
-      if(h5_chunk) {
-	H5Pset_layout(chunk_pid, H5D_CHUNKED);
-	H5Pset_chunk(chunk_pid, 3, h5_chunk);
-      }
-
-      /* Create the dataset with default properties and close filespace. */
-      did = H5Dcreate(file_id, varname, H5T_NATIVE_FLOAT, filespace, H5P_DEFAULT, chunk_pid, H5P_DEFAULT);
-      H5Dclose(did);
-
-      if(h5_chunk)
-	H5Pclose(chunk_pid);
-
-      H5Sclose(filespace);
-
-      H5Fclose(file_id);
-
-    } /* end rank==0 */
-
-    MPI_Barrier(comm);
+    H5AC_cache_config_t mdc;
 
     /* Set up MPI info */
     MPI_Info_create(&info);
@@ -84,17 +31,76 @@ void writehdf5i(char *name, char *varname, MPI_Comm comm, int rank, int nprocs,
 
     /* Set up file access property list with parallel I/O access */
     if( (plist_id = H5Pcreate(H5P_FILE_ACCESS)) < 0) {
-      printf("writehdf5i error: Could not create property list \n");
+      printf("hdf5_fapl error: Could not create property list \n");
       MPI_Abort(comm, 1);
     }
     H5Pset_libver_bounds(plist_id, H5F_LIBVER_LATEST, H5F_LIBVER_LATEST);
-    if(H5Pset_fapl_mpio(plist_id, MPI_COMM_WORLD, info) < 0) {
-      printf("writehdf5i error: Could not create property list \n");
+    if(H5Pset_fapl_mpio(plist_id, comm, info) < 0) {
+      printf("hdf5_fapl error: Could not create property list \n");
       MPI_Abort(comm, 1);
     }
+    MPI_Info_free(&info);
+
+    if(!opts)
+      return plist_id;
+
+    /* Every task reads and writes the metadata together, rather than each
+     * reading it on its own and rank 0 writing it */
+    if(opts->collmeta) {
+      H5Pset_all_coll_metadata_ops(plist_id, 1);
+      H5Pset_coll_metadata_write(plist_id, 1);
+    }
 
-    if( (file_id = H5Fopen(fname, H5F_ACC_RDWR, plist_id)) < 0) {
-      fprintf(stderr, "writehdf5i error: could not open %s \n", fname);
+    if(opts->mdcsize) {
+      mdc.version = H5AC__CURR_CACHE_CONFIG_VERSION;
+      H5Pget_mdc_config(plist_id, &mdc);
+      mdc.set_initial_size = 1;
+      mdc.initial_size = opts->mdcsize;
+      if(mdc.max_size < mdc.initial_size)
+	mdc.max_size = mdc.initial_size;
+      if(mdc.min_size > mdc.initial_size)
+	mdc.min_size = mdc.initial_size;
+      if(H5Pset_mdc_config(plist_id, &mdc) < 0) {
+	printf("hdf5_fapl error: Could not set metadata cache \n");
+	MPI_Abort(comm, 1);
+      }
+    }
+
+    if(opts->align)
+      H5Pset_alignment(plist_id, opts->alignthresh, opts->align);
+
+    return plist_id;
+}
+
+void writehdf5i(char *dir, char *name, int nvars, char **varnames, MPI_Comm comm, int rank, int nprocs, 
+               int tstep, int ni, int nj, int nk, int is, int ie, int js, int je,
+		int ks, int ke, float deltax, float deltay, float deltaz, int nci, int ncj, int nck, float **datas, hsize_t *h5_chunk,
+		struct hdf5opts *opts)
+{
+    char fname[fnstrmax+1];
+    char rel_fname[fnstrmax+1];
+    char fname_xdmf[fnstrmax+1];
+    int timedigits = 4;
+
+    hid_t file_id;
+    hid_t plist_id;
+    hid_t memspace;
+    hid_t filespace;
+    hid_t did;
+    hsize_t start[3], count[3], zero[3] = { 0, 0, 0 };
+    hsize_t dims[3], mdims[3];
+    herr_t err;
+    hid_t chunk_pid;
+    int v;
+
+    snprintf(fname, fnstrmax, "%s/cart_t%0*d.h5", dir, timedigits, tstep);
+    snprintf(rel_fname, fnstrmax, "cart_t%0*d.h5", timedigits, tstep);
+    snprintf(fname_xdmf, fnstrmax, "%s/cart_t%0*d.xmf", dir, timedigits, tstep);
+
+    /* All tasks create the file together */
+    plist_id = hdf5_fapl(comm, opts);
+    if( (file_id = H5Fcreate(fname, H5F_ACC_TRUNC, H5P_DEFAULT, plist_id)) < 0) {
+      fprintf(stderr, "writehdf5i error: could not create %s \n", fname);
       MPI_Abort(comm, 1);
     }
 
@@ -103,37 +109,57 @@ void writehdf5i(char *name, char *varname, MPI_Comm comm, int rank, int nprocs,
       MPI_Abort(comm, 1);
     }
 
+    /* Dataset shape */
+    dims[0] = (hsize_t)ni;
+    dims[1] = (hsize_t)nj;
+    dims[2] = (hsize_t)nk;
+    chunk_pid = H5Pcreate(H5P_DATASET_CREATE);
+    if(h5_chunk) {
+      H5Pset_layout(chunk_pid, H5D_CHUNKED);
+      H5Pset_chunk(chunk_pid, 3, h5_chunk);
+    }
+
     start[0] = ks;
     start[1] = js;
     start[2] = is;
 
-    count[0] = (hsize_t)nck;
-    count[1] = (hsize_t)ncj;
-    count[2] = (hsize_t)nci;
-
-    memspace = H5Screate_simple(3, count, NULL);
+    count[0] = (hsize_t)(ke-ks+1);
+    count[1] = (hsize_t)(je-js+1);
+    count[2] = (hsize_t)(ie-is+1);
 
-    did = H5Dopen(file_id, varname, H5P_DEFAULT);
-      
-    /* Select hyperslab in the file.*/
-    filespace = H5Dget_space(did);
-    H5Sselect_hyperslab(filespace, H5S_SELECT_SET, start, NULL, count, NULL );
+    /* The block in memory may have ghosts past the extent; leave them out */
+    mdims[0] = (hsize_t)nck;
+    mdims[1] = (hsize_t)ncj;
+    mdims[2] = (hsize_t)nci;
+    memspace = H5Screate_simple(3, mdims, NULL);
+    H5Sselect_hyperslab(memspace, H5S_SELECT_SET, zero, NULL, count, NULL);
 
     /* Create property list for collective dataset write. */
     plist_id = H5Pcreate(H5P_DATASET_XFER);
     H5Pset_dxpl_mpio(plist_id, H5FD_MPIO_COLLECTIVE);
 
-    err = H5Dwrite(did, H5T_NATIVE_FLOAT, memspace, filespace, plist_id, data);
-    if( err < 0) {
-      fprintf(stderr, "writehdf5i error: could not write dataset %s \n", varname);
-      MPI_Abort(comm, 1);
-    }
+    for(v = 0; v < nvars; v++) {
+      /* Create the dataset, collectively, and select hyperslab in the file */
+      filespace = H5Screate_simple(3, dims, NULL);
+      did = H5Dcreate(file_id, varnames[v], H5T_NATIVE_FLOAT, filespace, H5P_DEFAULT, chunk_pid, H5P_DEFAULT);
+      if(did < 0) {
+	fprintf(stderr, "writehdf5i error: could not create dataset %s \n", varnames[v]);
+	MPI_Abort(comm, 1);
+      }
+      H5Sselect_hyperslab(filespace, H5S_SELECT_SET, start, NULL, count, NULL );
 
+      err = H5Dwrite(did, H5T_NATIVE_FLOAT, memspace, filespace, plist_id, datas[v]);
+      if( err < 0) {
+	fprintf(stderr, "writehdf5i error: could not write dataset %s \n", varnames[v]);
+	MPI_Abort(comm, 1);
+      }
 
-    err = H5Dclose(did);
+      err = H5Dclose(did);
+      err = H5Sclose(filespace);
+    }
 
-    err = H5Sclose(filespace);
     err = H5Sclose(memspace);
+    H5Pclose(chunk_pid);
     
     if(H5Pclose(plist_id) < 0)
       printf("writehdf5i error: Could not close property list \n");
@@ -143,16 +169,17 @@ void writehdf5i(char *name, char *varname, MPI_Comm comm, int rank, int nprocs,
 
     /* Create xdmf file for timestep */
     if(rank == 0) {
-      write_xdmf_xml_value(fname, fname_xdmf, varname, deltax, deltay, deltaz, ni, nj, nk);
+      write_xdmf_xml_value(rel_fname, fname_xdmf, nvars, varnames, deltax, deltay, deltaz, ni, nj, nk);
     }
 
 }
 
 
 void
-write_xdmf_xml_value(char *fname, char *fname_xdmf, char *varname, float deltax, float deltay, float deltaz, int ni, int nj, int nk)
+write_xdmf_xml_value(char *fname, char *fname_xdmf, int nvars, char **varnames, float deltax, float deltay, float deltaz, int ni, int nj, int nk)
 {
     FILE *xmf = 0;
+    int v;
  
     /*
      * Open the file and write the XML description of the mesh.
@@ -173,11 +200,13 @@ write_xdmf_xml_value(char *fname, char *fname_xdmf, char *varname, float deltax,
     fprintf(xmf, "            %f %f %f \n",deltax, deltay, deltaz);
     fprintf(xmf, "       </DataItem>\n");
     fprintf(xmf, "    </Geometry>\n");
-    fprintf(xmf, "    <Attribute Name=\"%s\" AttributeType=\"Scalar\" Center=\"Node\">\n", varname);
-    fprintf(xmf, "       <DataItem Dimensions=\"%d %d %d\" NumberType=\"Float\" Precision=\"4\" Format=\"HDF\">\n", ni, nj, nk);
-    fprintf(xmf, "        %s:/%s\n", fname, varname);
-    fprintf(xmf, "       </DataItem>\n");
-    fprintf(xmf, "    </Attribute>\n");
+    for(v = 0; v < nvars; v++) {
+      fprintf(xmf, "    <Attribute Name=\"%s\" AttributeType=\"Scalar\" Center=\"Node\">\n", varnames[v]);
+      fprintf(xmf, "       <DataItem Dimensions=\"%d %d %d\" NumberType=\"Float\" Precision=\"4\" Format=\"HDF\">\n", ni, nj, nk);
+      fprintf(xmf, "        %s:/%s\n", fname, varnames[v]);
+      fprintf(xmf, "       </DataItem>\n");
+      fprintf(xmf, "    </Attribute>\n");
+    }
     fprintf(xmf, "  </Grid>\n");
     fprintf(xmf, " </Domain>\n");
     fprintf(xmf, "</Xdmf>\n");
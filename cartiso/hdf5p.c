@@ -13,24 +13,30 @@
 #include <inttypes.h>
 
 #include "hdf5.h"
+#include "hdf5cartiso.h"
 
 static const int fnstrmax = 4095;
 
 void
-write_xdmf_xml(char *fname, char *fname_xdmf, uint64_t npoints, char *xname);
+write_xdmf_xml(char *fname, char *fname_xdmf, char *prefix, uint64_t ntris, uint64_t npoints,
+               int nxvals, char **xnames);
 
-void writehdf5p(char *name, char *varname, MPI_Comm comm, int rank, int nprocs, 
-               int tstep, uint64_t ntris, float *points, float *norms, 
-		float *xvals, char *xname, hsize_t *h5_chunk)
+void writehdf5p(char *dir, char *name, char *varname, MPI_Comm comm, int rank, int nprocs, 
+               int tstep, uint64_t ntris, uint64_t npoints, float *points, float *norms, 
+		int nxvals, float **xvals, char **xnames, uint64_t *tris,
+		char *group, int newfile, hsize_t *h5_chunk, struct hdf5opts *opts)
 {
     char fname[fnstrmax+1];
+    char rel_fname[fnstrmax+1];
     char fname_xdmf[fnstrmax+1];
+    char prefix[fnstrmax+1];   /* Path of the group in the file */
     int timedigits = 4;
-    MPI_Info info = MPI_INFO_NULL;
     uint64_t *rntris;   /* All triangle counts from each task */
-    uint64_t tot_tris;
+    uint64_t *rnpoints;   /* All point counts from each task */
+    uint64_t tot_tris, tot_points, pointstart;
 
     hid_t file_id;
+    hid_t base_id;    /* The group, or the file if none */
     hid_t plist_id;
     hid_t group_id;
     hid_t memspace;
@@ -38,121 +44,117 @@ void writehdf5p(char *name, char *varname, MPI_Comm comm, int rank, int nprocs,
     hid_t did;
     hsize_t start[1], count[1];
     hsize_t dims[1];
-    int j;
+    int j, x;
     uint64_t *temparr;
     herr_t err;
     hid_t chunk_pid;
     
 
-    snprintf(fname, fnstrmax, "cartiso_t%0*d.h5", timedigits, tstep);
-    snprintf(fname_xdmf, fnstrmax, "cartiso_t%0*d.xmf", timedigits, tstep);
+    snprintf(fname, fnstrmax, "%s/cartiso_t%0*d.h5", dir, timedigits, tstep);
+    snprintf(rel_fname, fnstrmax, "cartiso_t%0*d.h5", timedigits, tstep);
+    if(group) {
+      snprintf(fname_xdmf, fnstrmax, "%s/cartiso_%s_t%0*d.xmf", dir, group, timedigits,
+               tstep);
+      snprintf(prefix, fnstrmax, "/%s", group);
+    } else {
+      snprintf(fname_xdmf, fnstrmax, "%s/cartiso_t%0*d.xmf", dir, timedigits, tstep);
+      prefix[0] = '\0';
+    }
 
     /* Gather tri counts, in case some are zero, to leave them out */
     rntris = (uint64_t *) malloc(nprocs*sizeof(uint64_t));
 
     MPI_Allgather(&ntris, 1, MPI_UNSIGNED_LONG_LONG, rntris, 1, MPI_LONG_LONG, comm);
+    rnpoints = (uint64_t *) malloc(nprocs*sizeof(uint64_t));
+    MPI_Allgather(&npoints, 1, MPI_UNSIGNED_LONG_LONG, rnpoints, 1, MPI_LONG_LONG, comm);
 
     tot_tris=0;
-    if(rank == 0) {
-      uint64_t i;
-      for (i=0; i<nprocs; i++)
-	{
-	  tot_tris = tot_tris + rntris[i];
-	}
-
-      if( (file_id = H5Fcreate(fname, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT)) < 0) {
-	fprintf(stderr, "writehdf5p error: could not create %s \n", fname);
-	MPI_Abort(comm, 1);
-      }
-
-      dims[0] = 9*(hsize_t)tot_tris;
-      filespace = H5Screate_simple(1, dims, NULL);
-
-      /* Create Grid Group */
-      group_id = H5Gcreate(file_id, "grid points", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
-      
-      chunk_pid = H5Pcreate(H5P_DATASET_CREATE);
-
-      if(h5_chunk) {
-
-	H5Pset_layout(chunk_pid, H5D_CHUNKED);
+    tot_points=0;
+    pointstart=0;
+    for (j=0; j<nprocs; j++) {
+      tot_tris = tot_tris + rntris[j];
+      tot_points = tot_points + rnpoints[j];
+      if (j < rank)
+	pointstart = pointstart + rnpoints[j];
+    }
 
-	hsize_t chunk = (dims[0] * h5_chunk[0])/100;
-	H5Pset_chunk(chunk_pid, 1, &chunk);
-      }
+    /* All tasks create the file, or open it to add the group, together */
+    plist_id = hdf5_fapl(comm, opts);
+    if(newfile)
+      file_id = H5Fcreate(fname, H5F_ACC_TRUNC, H5P_DEFAULT, plist_id);
+    else
+      file_id = H5Fopen(fname, H5F_ACC_RDWR, plist_id);
+    if(file_id < 0) {
+      fprintf(stderr, "writehdf5p error: could not create %s \n", fname);
+      MPI_Abort(comm, 1);
+    }
 
-      /* Create the dataset with default properties */
-      did = H5Dcreate(group_id, "xyz", H5T_NATIVE_FLOAT, filespace, H5P_DEFAULT, chunk_pid, H5P_DEFAULT);
-      H5Dclose(did);
+    if(H5Pclose(plist_id) < 0) {
+      printf("writehdf5p error: Could not close property list \n");
+      MPI_Abort(comm, 1);
+    }
 
-      /* Create the dataset with default properties and close filespace. */
-      did = H5Dcreate(group_id, "Normals", H5T_NATIVE_FLOAT, filespace, H5P_DEFAULT, chunk_pid, H5P_DEFAULT);
-      H5Dclose(did);
+    /* Groups and datasets are created collectively, by every task */
+    base_id = file_id;
+    if(group)
+      base_id = H5Gcreate(file_id, group, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
 
-      if(h5_chunk)
-	H5Pclose(chunk_pid);
+    dims[0] = 3*(hsize_t)tot_points;
+    filespace = H5Screate_simple(1, dims, NULL);
 
-      H5Sclose(filespace);
-      H5Gclose(group_id);
+    /* Create Grid Group */
+    group_id = H5Gcreate(base_id, "grid points", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+      
+    chunk_pid = H5Pcreate(H5P_DATASET_CREATE);
 
-      /* Create connectivity dataset */
-      dims[0] = 3*(hsize_t)tot_tris;
-      filespace = H5Screate_simple(1, dims, NULL);
+    if(h5_chunk) {
 
-      /* Create the dataset with default properties and close filespace. */
-      did = H5Dcreate(file_id, "conn", H5T_NATIVE_ULLONG, filespace, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
-      H5Dclose(did);
+      H5Pset_layout(chunk_pid, H5D_CHUNKED);
 
-      if(xvals) {
-	did = H5Dcreate(file_id, xname, H5T_NATIVE_FLOAT, filespace, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
-	H5Dclose(did);
-      }
-      H5Sclose(filespace);
-      H5Fclose(file_id);
+      hsize_t chunk = (dims[0] * h5_chunk[0])/100;
+      H5Pset_chunk(chunk_pid, 1, &chunk);
     }
-    
-    MPI_Barrier(comm);
 
-    /* Set up MPI info */
-    MPI_Info_create(&info);
-    MPI_Info_set(info, "striping_factor", "1");
+    /* Create the dataset with default properties */
+    did = H5Dcreate(group_id, "xyz", H5T_NATIVE_FLOAT, filespace, H5P_DEFAULT, chunk_pid, H5P_DEFAULT);
+    H5Dclose(did);
 
-    /* Set up file access property list with parallel I/O access */
-    if( (plist_id = H5Pcreate(H5P_FILE_ACCESS)) < 0) {
-      printf("writehdf5p error: Could not create property list \n");
-      MPI_Abort(comm, 1);
-    }
+    /* Create the dataset with default properties and close filespace. */
+    did = H5Dcreate(group_id, "Normals", H5T_NATIVE_FLOAT, filespace, H5P_DEFAULT, chunk_pid, H5P_DEFAULT);
+    H5Dclose(did);
 
-    H5Pset_libver_bounds(plist_id, H5F_LIBVER_LATEST, H5F_LIBVER_LATEST);
+    H5Pclose(chunk_pid);
 
-    if(H5Pset_fapl_mpio(plist_id, MPI_COMM_WORLD, info) < 0) {
-      printf("writehdf5p error: Could not create property list \n");
-      MPI_Abort(comm, 1);
-    }
+    H5Sclose(filespace);
+    H5Gclose(group_id);
 
-    if( (file_id = H5Fopen(fname, H5F_ACC_RDWR, plist_id)) < 0) {
-      fprintf(stderr, "writehdf5p error: could not open %s \n", fname);
-      MPI_Abort(comm, 1);
-    }
+    /* Create connectivity dataset */
+    dims[0] = 3*(hsize_t)tot_tris;
+    filespace = H5Screate_simple(1, dims, NULL);
 
-    if(H5Pclose(plist_id) < 0) {
-      printf("writehdf5p error: Could not close property list \n");
-      MPI_Abort(comm, 1);
+    /* Create the dataset with default properties and close filespace. */
+    did = H5Dcreate(base_id, "conn", H5T_NATIVE_ULLONG, filespace, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+    H5Dclose(did);
+    H5Sclose(filespace);
+
+    /* Create the point value dataset */
+    dims[0] = (hsize_t)tot_points;
+    filespace = H5Screate_simple(1, dims, NULL);
+    for(x = 0; x < nxvals; x++) {
+      did = H5Dcreate(base_id, xnames[x], H5T_NATIVE_FLOAT, filespace, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+      H5Dclose(did);
     }
+    H5Sclose(filespace);
 
-    group_id = H5Gopen(file_id, "grid points", H5P_DEFAULT);
+    group_id = H5Gopen(base_id, "grid points", H5P_DEFAULT);
     did = H5Dopen(group_id, "xyz",H5P_DEFAULT);
     /* 
      * Each process defines dataset in memory and writes it to the hyperslab
      * in the file.
      */
 
-    start[0] = 0;
-    for (j=0; j<rank; j++) {
-      start[0] = start[0] + 9*rntris[j];
-    }
-
-    count[0] = (hsize_t)ntris*9;
+    start[0] = 3*pointstart;
+    count[0] = (hsize_t)npoints*3;
       
     memspace = H5Screate_simple(1, count, NULL);
       
@@ -177,12 +179,8 @@ void writehdf5p(char *name, char *varname, MPI_Comm comm, int rank, int nprocs,
      * in the file.
      */
 
-    start[0] = 0;
-    for (j=0; j<rank; j++) {
-      start[0] = start[0] + 9*rntris[j];
-    }
-
-    count[0] = (hsize_t)ntris*9;
+    start[0] = 3*pointstart;
+    count[0] = (hsize_t)npoints*3;
       
     memspace = H5Screate_simple(1, count, NULL);
       
@@ -197,7 +195,7 @@ void writehdf5p(char *name, char *varname, MPI_Comm comm, int rank, int nprocs,
     err = H5Sclose(memspace);
     err = H5Gclose(group_id);
 
-    did = H5Dopen(file_id, "conn",H5P_DEFAULT);
+    did = H5Dopen(base_id, "conn",H5P_DEFAULT);
 
     /* 
      * Each process defines dataset in memory and writes it to the hyperslab
@@ -224,41 +222,53 @@ void writehdf5p(char *name, char *varname, MPI_Comm comm, int rank, int nprocs,
       start[0] = start[0] + 3*rntris[j];
     }
 
+    /* Connections to this task's points, which come after lower tasks' points */
     for(j = 0; j < ntris*3; j++)
-      temparr[j] = start[0] + j;
+      temparr[j] = pointstart + (tris ? tris[j] : j);
 
     err = H5Dwrite(did, H5T_NATIVE_ULLONG, memspace, filespace, plist_id, temparr);
 
     err = H5Dclose(did);
+    err = H5Sclose(filespace);
+    err = H5Sclose(memspace);
 
-    if(xvals) {
-      did = H5Dopen(file_id, xname, H5P_DEFAULT);
-      err = H5Dwrite(did, H5T_NATIVE_FLOAT, memspace, filespace, plist_id, xvals);
+    for(x = 0; x < nxvals; x++) {
+      start[0] = pointstart;
+      count[0] = (hsize_t)npoints;
+      memspace = H5Screate_simple(1, count, NULL);
+      did = H5Dopen(base_id, xnames[x], H5P_DEFAULT);
+      filespace = H5Dget_space(did);
+      H5Sselect_hyperslab(filespace, H5S_SELECT_SET, start, NULL, count, NULL );
+      err = H5Dwrite(did, H5T_NATIVE_FLOAT, memspace, filespace, plist_id, xvals[x]);
       H5Dclose(did);
+      err = H5Sclose(filespace);
+      err = H5Sclose(memspace);
     }
-
-    err = H5Sclose(filespace);
-    err = H5Sclose(memspace);
+    if(group)
+      H5Gclose(base_id);
 
     if(H5Pclose(plist_id) < 0)
       printf("writehdf5p error: Could not close property list \n");
 
     free(temparr);
     free(rntris);
+    free(rnpoints);
     if(H5Fclose(file_id) != 0)
       printf("writehdf5p error: Could not close HDF5 file \n");
 
     /* Create xdmf file for timestep */
     if(rank == 0) {
-      write_xdmf_xml(fname, fname_xdmf, tot_tris, xname);
+      write_xdmf_xml(rel_fname, fname_xdmf, prefix, tot_tris, tot_points, nxvals, xnames);
     }
     
 }
 
 void
-write_xdmf_xml(char *fname, char *fname_xdmf, uint64_t npoints, char *xname)
+write_xdmf_xml(char *fname, char *fname_xdmf, char *prefix, uint64_t ntris, uint64_t npoints,
+               int nxvals, char **xnames)
 {
     FILE *xmf = 0;
+    int x;
  
     /*
      * Open the file and write the XML description of the mesh.
@@ -270,24 +280,26 @@ write_xdmf_xml(char *fname, char *fname_xdmf, uint64_t npoints, char *xname)
     fprintf(xmf, "<Xdmf Version=\"3.0\">\n");
     fprintf(xmf, " <Domain>\n");
     fprintf(xmf, "  <Grid Name=\"Unstructured Mesh\">\n");
-    fprintf(xmf, "    <Topology TopologyType=\"Triangle\" NumberOfElements=\"%" PRIu64"\">\n", npoints);
-    fprintf(xmf, "      <DataItem Dimensions=\"%" PRIu64"\" Format=\"HDF\">\n", npoints*3);
-    fprintf(xmf, "      %s:/conn\n",fname);
+    fprintf(xmf, "    <Topology TopologyType=\"Triangle\" NumberOfElements=\"%" PRIu64"\">\n", ntris);
+    fprintf(xmf, "      <DataItem Dimensions=\"%" PRIu64"\" Format=\"HDF\">\n", ntris*3);
+    fprintf(xmf, "      %s:%s/conn\n",fname, prefix);
     fprintf(xmf, "      </DataItem>\n");
     fprintf(xmf, "    </Topology>\n");
     fprintf(xmf, "    <Geometry GeometryType=\"XYZ\">\n");
-    fprintf(xmf, "       <DataItem Name=\"XYZ\" Dimensions=\"%" PRIu64"\" Format=\"HDF\">\n", 9*npoints);
-    fprintf(xmf, "        %s:/grid points/xyz\n",fname);
+    fprintf(xmf, "       <DataItem Name=\"XYZ\" Dimensions=\"%" PRIu64"\" Format=\"HDF\">\n", 3*npoints);
+    fprintf(xmf, "        %s:%s/grid points/xyz\n",fname, prefix);
     fprintf(xmf, "       </DataItem>\n");
     fprintf(xmf, "    </Geometry>\n");
-    fprintf(xmf, "    <Attribute Name=\"%s\" AttributeType=\"Scalar\" Center=\"Node\">\n", xname);
-    fprintf(xmf, "       <DataItem Dimensions=\"%" PRIu64"\" NumberType=\"Float\" Precision=\"4\" Format=\"HDF\">\n", npoints*3);
-    fprintf(xmf, "        %s:/%s\n", fname, xname);
-    fprintf(xmf, "       </DataItem>\n");
-    fprintf(xmf, "    </Attribute>\n");
+    for(x = 0; x < nxvals; x++) {
+      fprintf(xmf, "    <Attribute Name=\"%s\" AttributeType=\"Scalar\" Center=\"Node\">\n", xnames[x]);
+      fprintf(xmf, "       <DataItem Dimensions=\"%" PRIu64"\" NumberType=\"Float\" Precision=\"4\" Format=\"HDF\">\n", npoints);
+      fprintf(xmf, "        %s:%s/%s\n", fname, prefix, xnames[x]);
+      fprintf(xmf, "       </DataItem>\n");
+      fprintf(xmf, "    </Attribute>\n");
+    }
     fprintf(xmf, "    <Attribute Name=\"Normals\" AttributeType=\"Vector\" Center=\"Node\">\n");
-    fprintf(xmf, "       <DataItem Dimensions=\"%" PRIu64"\" NumberType=\"Float\" Precision=\"4\" Format=\"HDF\">\n", npoints*9);
-    fprintf(xmf, "        %s:/grid points/Normals\n", fname);
+    fprintf(xmf, "       <DataItem Dimensions=\"%" PRIu64"\" NumberType=\"Float\" Precision=\"4\" Format=\"HDF\">\n", npoints*3);
+    fprintf(xmf, "        %s:%s/grid points/Normals\n", fname, prefix);
     fprintf(xmf, "       </DataItem>\n");
     fprintf(xmf, "    </Attribute>\n");
     fprintf(xmf, "  </Grid>\n");
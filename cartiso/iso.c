@@ -5,7 +5,9 @@
 
 #include <stdio.h>
 #include <math.h>
+#include <float.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 
 #include <mpi.h>
@@ -57,7 +59,7 @@ static void make_cubes(const float *data, float x0, float y0, float z0,
         float xd, float yd, float zd,
 		int xdim, int ydim, int zdim, 
 		float x[8], float y[8], float z[8], float d[8],
-		int i, int j, int k, const float *xdata, float xdc[8])
+		int i, int j, int k)
 {
   uint64_t i0 = (uint64_t)k*ydim*xdim+j*xdim+i;
   uint64_t i1 = i0+1;
@@ -107,167 +109,461 @@ static void make_cubes(const float *data, float x0, float y0, float z0,
   y[3] = (j+1)*yd+y0;  //(float)(j+y0+1)/(gydim-1);
   z[3] = (k+1)*zd+z0;  //(float)(k+z0+1)/(gzdim-1);
   d[3] = data[i7];
+} /*make_cubes*/
+
+
+/*************************************************************************
+ * calc_normal_point
+ * 
+ * Calculate the normal at one grid point.  Uses a central difference
+ * method (one sided on the domain boundary) to create a vector, then
+ * normalizes it.
+ *************************************************************************/
 
-  if (xdata != NULL)
-  {
-    xdc[4] = xdata[i0];
-    xdc[5] = xdata[i1];
-    xdc[6] = xdata[i2];
-    xdc[7] = xdata[i3];
-    xdc[0] = xdata[i4];
-    xdc[1] = xdata[i5];
-    xdc[2] = xdata[i6];
-    xdc[3] = xdata[i7];
+static void calc_normal_point(const float *data, int xdim, int ydim, int zdim,
+		      int i, int j, int k, float n[3])
+{
+  uint64_t xydim = (uint64_t)xdim*ydim;
+  double xxi, yxi, zxi, fxi;
+  double xeta, yeta, zeta, feta;
+  double xzeta, yzeta, zzeta, fzeta;
+
+  uint64_t index = (uint64_t)k*xydim+j*xdim+i;
+  if (i == 0) {
+     xxi = 1;
+     yxi = 0;
+     zxi = 0;
+     fxi = data[index+1]-data[index];
+  } else if (i == xdim-1)	{
+     xxi = 1;
+     yxi = 0;
+     zxi = 0;
+     fxi = data[index]-data[index-1];
+  } else {
+     xxi = 1;
+     yxi = 0;
+     zxi = 0;
+     fxi = 0.5*(data[index+1]-data[index-1]);
   }
-} /*make_cubes*/
+  if (j == 0) {
+     xeta = 0;
+     yeta = 1;
+     zeta = 0;
+     feta = data[index+xdim]-data[index];
+  } else if (j == ydim-1)	{
+     xeta = 0;
+     yeta = 1;
+     zeta = 0;
+     feta = data[index]-data[index-xdim];
+  } else {
+     xeta = 0;
+     yeta = 1;
+     zeta = 0;
+     feta = 0.5*(data[index+xdim]-data[index-xdim]);
+  }
+  if (k == 0) {
+     xzeta = 0;
+     yzeta = 0;
+     zzeta = 1;
+     fzeta = data[index+xydim]-data[index];
+  }
+  else if (k == zdim-1) {
+     xzeta = 0;
+     yzeta = 0;
+     zzeta = 1;
+     fzeta = data[index]-data[index-xydim];
+  } else {
+     xzeta = 0;
+     yzeta = 0;
+     zzeta = 1;
+     fzeta = 0.5*(data[index+xydim]-data[index-xydim]);
+  }
+
+  if (xeta == 0 && yeta == 0 && zeta == 0)
+     xeta = yeta = zeta = 0.0000001;
+  double aj = (xxi*yeta*zzeta+yxi*zeta*xzeta+zxi*xeta*yzeta -
+  	     zxi*yeta*xzeta-yxi*xeta*zzeta-xxi*zeta*yzeta);
+  if (aj != 0)
+    aj = 1/aj;
+  double xix =  aj*(yeta*zzeta-zeta*yzeta);
+  double xiy = -aj*(xeta*zzeta-zeta*xzeta);
+  double xiz =  aj*(xeta*yzeta-yeta*xzeta);
 
+  double etax = -aj*(yxi*zzeta-zxi*yzeta);
+  double etay =  aj*(xxi*zzeta-zxi*xzeta);
+  double etaz = -aj*(xxi*yzeta-yxi*xzeta);
+
+  double zetax =  aj*(yxi*zeta-zxi*yeta);
+  double zetay = -aj*(xxi*zeta-zxi*xeta);
+  double zetaz =  aj*(xxi*yeta-yxi*xeta);
+
+  double nxv = xix*fxi+etax*feta+zetax*fzeta;
+  double nyv = xiy*fxi+etay*feta+zetay*fzeta;
+  double nzv = xiz*fxi+etaz*feta+zetaz*fzeta;
+  double mag = Mag(nxv, nyv, nzv);
+  if (mag == 0) {
+     fprintf(stderr,
+    "isosurf ERROR : magnitude of 0\n   %f,%f,%f,%f\n   %f,%f,%f,%f\n   %f,%f,%f,%f\n"
+    "i,j,k = %d, %d, %d",
+  	   xxi, yxi, zxi, fxi, xeta, yeta, zeta, feta, xzeta,
+  	   yzeta, zzeta, fzeta, i, j, k);
+  }
+  n[X] = -nxv/mag;
+  n[Y] = -nyv/mag;
+  n[Z] = -nzv/mag;
+}
 
 /*************************************************************************
  * calc_normal_cube
  * 
- * Calculate the normals for the current cube of data.  Uses a central
- * difference method to create a vector for each vertex of the cube, then
- * normalizes the vectors.
+ * Calculate the normals for the current cube of data, at each vertex of
+ * the cube.
  *************************************************************************/
 
 static void calc_normal_cube(const float *data, int xdim, int ydim, int zdim,
 		      float nx[8], float ny[8], float nz[8],
-		      int iindex, int jindex, int kindex, int uselast)
+		      int iindex, int jindex, int kindex)
 {
   int ni[8] = { 4, 5, 7, 6, 0, 1, 3, 2 };
   int count = 0;
-  uint64_t xydim = (uint64_t)xdim*ydim;
-  double xxi, yxi, zxi, fxi;
-  double xeta, yeta, zeta, feta;
   int i, j, k;
+  float n[3];
 
-  double xzeta, yzeta, zzeta, fzeta;
   for (k = kindex; k < kindex+2; ++k) {
     for (j = jindex; j < jindex+2; ++j) {
       for (i = iindex; i < iindex+2; ++i) {
 	int nindex = ni[count++];
-	uint64_t index = (uint64_t)k*xydim+j*xdim+i;
-	if (i == 0) {
-	   xxi = 1;
-	   yxi = 0;
-	   zxi = 0;
-	   fxi = data[index+1]-data[index];
-	} else if (i == xdim-1)	{
-	   xxi = 1;
-	   yxi = 0;
-	   zxi = 0;
-	   fxi = data[index]-data[index-1];
-	} else {
-	   xxi = 1;
-	   yxi = 0;
-	   zxi = 0;
-	   fxi = 0.5*(data[index+1]-data[index-1]);
-	}
-	if (j == 0) {
-	   xeta = 0;
-	   yeta = 1;
-	   zeta = 0;
-	   feta = data[index+xdim]-data[index];
-	} else if (j == ydim-1)	{
-	   xeta = 0;
-	   yeta = 1;
-	   zeta = 0;
-	   feta = data[index]-data[index-xdim];
-	} else {
-	   xeta = 0;
-	   yeta = 1;
-	   zeta = 0;
-	   feta = 0.5*(data[index+xdim]-data[index-xdim]);
-	}
-	if (k == 0) {
-	   xzeta = 0;
-	   yzeta = 0;
-	   zzeta = 1;
-	   fzeta = data[index+xydim]-data[index];
-	}
-	else if (k == zdim-1) {
-	   xzeta = 0;
-	   yzeta = 0;
-	   zzeta = 1;
-	   fzeta = data[index]-data[index-xydim];
-	} else {
-	   xzeta = 0;
-	   yzeta = 0;
-	   zzeta = 1;
-	   fzeta = 0.5*(data[index+xydim]-data[index-xydim]);
-	}
+	calc_normal_point(data, xdim, ydim, zdim, i, j, k, n);
+	nx[nindex] = n[X];
+	ny[nindex] = n[Y];
+	nz[nindex] = n[Z];
+      }
+    }
+  }
+} 
 
-	if (xeta == 0 && yeta == 0 && zeta == 0)
-	   xeta = yeta = zeta = 0.0000001;
-	double aj = (xxi*yeta*zzeta+yxi*zeta*xzeta+zxi*xeta*yzeta -
-		     zxi*yeta*xzeta-yxi*xeta*zzeta-xxi*zeta*yzeta);
-	if (aj != 0)
-	  aj = 1/aj;
-	double xix =  aj*(yeta*zzeta-zeta*yzeta);
-	double xiy = -aj*(xeta*zzeta-zeta*xzeta);
-	double xiz =  aj*(xeta*yzeta-yeta*xzeta);
-
-	double etax = -aj*(yxi*zzeta-zxi*yzeta);
-	double etay =  aj*(xxi*zzeta-zxi*xzeta);
-	double etaz = -aj*(xxi*yzeta-yxi*xzeta);
-
-	double zetax =  aj*(yxi*zeta-zxi*yeta);
-	double zetay = -aj*(xxi*zeta-zxi*xeta);
-	double zetaz =  aj*(xxi*yeta-yxi*xeta);
-
-	double nxv = xix*fxi+etax*feta+zetax*fzeta;
-	double nyv = xiy*fxi+etay*feta+zetay*fzeta;
-	double nzv = xiz*fxi+etaz*feta+zetaz*fzeta;
-	double mag = Mag(nxv, nyv, nzv);
-	if (mag == 0) {
-	   fprintf(stderr,
-    "isosurf ERROR : magnitude of 0\n   %f,%f,%f,%f\n   %f,%f,%f,%f\n   %f,%f,%f,%f\n"
-    "i,j,k = %d, %d, %d",
-		   xxi, yxi, zxi, fxi, xeta, yeta, zeta, feta, xzeta,
-		   yzeta, zzeta, fzeta, i, j, k);
+/*************************************************************************
+ * cached_normal_cube
+ * 
+ * Same as calc_normal_cube, but takes the normals from a cache of two
+ * k-planes of grid points.  A point is computed the first time a cell
+ * needs it and reused by the up to 7 other cells that share it: those of
+ * the same k from the current plane, those of the next k from the plane
+ * that is then the previous one.  A slot is valid if its stamp is k.
+ *************************************************************************/
+
+static void cached_normal_cube(struct isoinfo *nfo, const float *data,
+		      float nx[8], float ny[8], float nz[8],
+		      int iindex, int jindex, int kindex)
+{
+  int ni[8] = { 4, 5, 7, 6, 0, 1, 3, 2 };
+  int count = 0;
+  uint64_t xydim = (uint64_t)nfo->xdim*nfo->ydim;
+  int i, j, k;
+
+  for (k = kindex; k < kindex+2; ++k) {
+    for (j = jindex; j < jindex+2; ++j) {
+      for (i = iindex; i < iindex+2; ++i) {
+	int nindex = ni[count++];
+	uint64_t slot = (k & 1)*xydim + (uint64_t)j*nfo->xdim + i;
+	float *n = nfo->gcache + slot*3;
+
+	if (nfo->gstamp[slot] != k) {
+	  calc_normal_point(data, nfo->xdim, nfo->ydim, nfo->zdim, i, j, k, n);
+	  nfo->gstamp[slot] = k;
 	}
-	nx[nindex] = -nxv/mag;   
-	ny[nindex] = -nyv/mag;   
-	nz[nindex] = -nzv/mag;
+	nx[nindex] = n[X];
+	ny[nindex] = n[Y];
+	nz[nindex] = n[Z];
       }
     }
   }
-} 
+}
+
+/* Grid offsets (i,j,k) of the cube vertices of make_cubes */
+static const int cornerofs[8][3] = {
+  {0,0,1}, {1,0,1}, {1,1,1}, {0,1,1}, {0,0,0}, {1,0,0}, {1,1,0}, {0,1,0}
+};
+
+/*************************************************************************
+ * edge_slot
+ * 
+ * Find the slot in the edge cache of the grid edge between cube vertices
+ * v1 and v2 of cell (i,j,k).  An edge is keyed by its lower end point and
+ * its axis, in one of two k-planes like the normals; kplane is set to the
+ * k of its end point.  Returns -1 if v1 and v2 are not the ends of an
+ * edge, so the point can not be shared.
+ *************************************************************************/
+
+static int64_t edge_slot(struct isoinfo *nfo, int i, int j, int k, int v1, int v2,
+		      int *kplane)
+{
+  int a, axis = -1;
+  int lo[3];
+
+  for (a = 0; a < 3; a++) {
+    lo[a] = cornerofs[v1][a] < cornerofs[v2][a] ? cornerofs[v1][a] : cornerofs[v2][a];
+    if (cornerofs[v1][a] != cornerofs[v2][a]) {
+      if (axis >= 0)
+	return -1;
+      axis = a;
+    }
+  }
+  if (axis < 0)
+    return -1;
+  *kplane = k + lo[Z];
+  return ((int64_t)(*kplane & 1)*nfo->xdim*nfo->ydim + (int64_t)(j+lo[Y])*nfo->xdim +
+	  i+lo[X])*3 + axis;
+}
 
 void isoinit(struct isoinfo *nfo, float x0, float y0, float z0,
         float xd, float yd, float zd, int xdim, int ydim, int zdim,
         int numxarrays)
 {
-    int xdim1 = xdim-1;
-    int ydim1 = ydim-1;
-    int zdim1 = zdim-1;
-
     nfo->x0 = x0;   nfo->y0 = y0;   nfo->z0 = z0;
     nfo->xd = xd;   nfo->yd = yd;   nfo->zd = zd;
     nfo->xdim = xdim;   nfo->ydim = ydim;   nfo->zdim = zdim;
-    nfo->ntris = 0;
-    /* Allocate list for all possible triangles */
-    /*    max of 4 tris per cell */
-    nfo->points = (float *) malloc( xdim1*ydim1*zdim1*3*4*sizeof(float) );
-    nfo->norms = (float *) malloc( xdim1*ydim1*zdim1*3*4*sizeof(float) );
-    if(numxarrays > 0)
-        nfo->xvals = (float *) malloc( xdim1*ydim1*zdim1*4*sizeof(float) );
-    else
-        nfo->xvals = NULL;
-    if(numxarrays > 1)
-        fprintf(stderr, "isoinit WARNING: numxarrays > 1 not currently supported.\n");
+    nfo->numxarrays = numxarrays > 0 ? numxarrays : 0;
+    /* Meshes; allocated by isosurfs for as many isovalues as it is given */
+    nfo->nmeshes = 0;
+    nfo->maxmeshes = 0;
+    nfo->meshes = NULL;
+    /* Normals of two k-planes of grid points */
+    nfo->gradcache = 1;
+    nfo->gcache = (float *) malloc( (size_t)2*xdim*ydim*3*sizeof(float) );
+    nfo->gstamp = (int *) malloc( (size_t)2*xdim*ydim*sizeof(int) );
+    /* Shared points of each mesh; allocated by isosurfs if indexed */
+    nfo->indexed = 0;
+    /* Brick ranges; allocated by isorange */
+    nfo->brick = 8;
+    nfo->bni = nfo->bnj = nfo->bnk = 0;
+    nfo->bmin = NULL;
+    nfo->bmax = NULL;
+    nfo->bplanes = 0;
+    nfo->ncells = 0;
+    /* Classification of a row of cells */
+    nfo->rowflags = (uint8_t *) malloc( (size_t)4*xdim*sizeof(uint8_t) );
+    nfo->cases = (uint8_t *) malloc( (size_t)xdim*sizeof(uint8_t) );
+    nfo->active = (int *) malloc( (size_t)xdim*sizeof(int) );
 }
 
 void isofree(struct isoinfo *nfo)
 {
+    int m, x;
+
+    for(m = 0; m < nfo->maxmeshes; m++) {
+        struct isomesh *mesh = &nfo->meshes[m];
+        free(mesh->points);
+        free(mesh->norms);
+        for(x = 0; x < nfo->numxarrays; x++)
+            free(mesh->xvals[x]);
+        free(mesh->xvals);
+        free(mesh->tris);
+        free(mesh->ecache);
+        free(mesh->estamp);
+    }
+    free(nfo->meshes);
+    nfo->meshes = NULL;
+    nfo->nmeshes = nfo->maxmeshes = 0;
     nfo->xdim = nfo->ydim = nfo->zdim = 0;
-    nfo->ntris = 0;
-    free(nfo->points);
-    free(nfo->norms);
-    if(nfo->xvals)   free(nfo->xvals);
-    nfo->points = NULL;
-    nfo->norms = NULL;
-    nfo->xvals = NULL;
+    free(nfo->gcache);
+    free(nfo->gstamp);
+    nfo->gcache = NULL;
+    nfo->gstamp = NULL;
+    free(nfo->bmin);
+    free(nfo->bmax);
+    nfo->bmin = NULL;
+    nfo->bmax = NULL;
+    nfo->bplanes = 0;
+    free(nfo->rowflags);
+    free(nfo->cases);
+    free(nfo->active);
+    nfo->rowflags = NULL;
+    nfo->cases = NULL;
+    nfo->active = NULL;
+}
+
+/* Allocate the meshes up to nmeshes; their points grow as needed */
+
+static void alloc_meshes(struct isoinfo *nfo, int nmeshes)
+{
+    int m, x;
+
+    if(nmeshes <= nfo->maxmeshes)
+        return;
+    nfo->meshes = (struct isomesh *) realloc(nfo->meshes, nmeshes*sizeof(struct isomesh));
+    for(m = nfo->maxmeshes; m < nmeshes; m++) {
+        struct isomesh *mesh = &nfo->meshes[m];
+        mesh->thresh = 0.f;
+        mesh->ntris = 0;
+        mesh->npoints = 0;
+        mesh->maxpoints = 0;
+        mesh->maxtriverts = 0;
+        mesh->points = NULL;
+        mesh->norms = NULL;
+        mesh->xvals = (float **) malloc( (nfo->numxarrays+1)*sizeof(float *) );
+        for(x = 0; x < nfo->numxarrays; x++)
+            mesh->xvals[x] = NULL;
+        mesh->tris = NULL;
+        mesh->ecache = NULL;
+        mesh->estamp = NULL;
+    }
+    nfo->maxmeshes = nmeshes;
+}
+
+/* Make room in a mesh for npoints points and, if indexed, ntriverts
+ * triangle vertices, doubling what it has; kept between calls */
+
+static void meshgrow(struct isoinfo *nfo, struct isomesh *mesh, uint64_t npoints,
+                     uint64_t ntriverts)
+{
+    uint64_t maxpoints = mesh->maxpoints ? mesh->maxpoints : 4096;
+    uint64_t maxtriverts = mesh->maxtriverts ? mesh->maxtriverts : 4096;
+    int x, fail = 0;
+
+    if(npoints > mesh->maxpoints) {
+        while(maxpoints < npoints)
+            maxpoints *= 2;
+        mesh->points = (float *) realloc(mesh->points, maxpoints*3*sizeof(float));
+        mesh->norms = (float *) realloc(mesh->norms, maxpoints*3*sizeof(float));
+        fail = !mesh->points || !mesh->norms;
+        for(x = 0; x < nfo->numxarrays; x++) {
+            mesh->xvals[x] = (float *) realloc(mesh->xvals[x], maxpoints*sizeof(float));
+            fail = fail || !mesh->xvals[x];
+        }
+        mesh->maxpoints = maxpoints;
+    }
+    if(nfo->indexed && ntriverts > mesh->maxtriverts) {
+        while(maxtriverts < ntriverts)
+            maxtriverts *= 2;
+        mesh->tris = (uint64_t *) realloc(mesh->tris, maxtriverts*sizeof(uint64_t));
+        fail = fail || !mesh->tris;
+        mesh->maxtriverts = maxtriverts;
+    }
+    if(fail) {
+        fprintf(stderr, "isosurf ERROR : could not grow isosurface to %llu points\n",
+                (unsigned long long)npoints);
+        exit(1);
+    }
+}
+
+/* Widen the range of brick ib,jb,kb to include lo..hi */
+
+static void widen_brick(struct isoinfo *nfo, int ib, int jb, int kb, float lo, float hi)
+{
+  uint64_t b = ((uint64_t)kb*nfo->bnj + jb)*nfo->bni + ib;
+
+  if(lo < nfo->bmin[b])  nfo->bmin[b] = lo;
+  if(hi > nfo->bmax[b])  nfo->bmax[b] = hi;
+}
+
+/* Brick ranges: a brick covers brick^3 cells, so the grid points on a
+ * brick face belong to the bricks on both sides of it */
+
+void isorange(struct isoinfo *nfo, int k, const float *plane)
+{
+  int b = nfo->brick;
+  int xdim = nfo->xdim;
+  int ydim = nfo->ydim;
+  int zdim = nfo->zdim;
+  int i, j, ib, jb, kb, iend;
+  int kface, jface;   /* Plane/row is also the last of the previous brick */
+  uint64_t n, bnij;
+  float lo, hi;
+
+  if(b <= 0 || xdim < 2 || ydim < 2 || zdim < 2)
+    return;
+
+  if(!nfo->bmin) {
+    nfo->bni = (xdim-2)/b + 1;
+    nfo->bnj = (ydim-2)/b + 1;
+    nfo->bnk = (zdim-2)/b + 1;
+    n = (uint64_t)nfo->bni*nfo->bnj*nfo->bnk;
+    nfo->bmin = (float *) malloc( n*sizeof(float) );
+    nfo->bmax = (float *) malloc( n*sizeof(float) );
+  }
+  bnij = (uint64_t)nfo->bni*nfo->bnj;
+
+  if(k == 0)
+    nfo->bplanes = 0;
+  kb = k/b;
+  kface = (k % b == 0 && k > 0);
+
+  /* First plane of a layer of bricks starts their ranges */
+  if(k % b == 0 && kb < nfo->bnk) {
+    for(n = kb*bnij; n < (kb+1)*bnij; n++) {
+      nfo->bmin[n] = FLT_MAX;
+      nfo->bmax[n] = -FLT_MAX;
+    }
+  }
+
+  for(j = 0; j < ydim; j++) {
+    const float *row = plane + (uint64_t)j*xdim;
+    jb = j/b;
+    jface = (j % b == 0 && j > 0);
+
+    for(ib = 0; ib < nfo->bni; ib++) {
+      /* Points of this brick along the row, both ends included */
+      i = ib*b;
+      iend = i+b < xdim-1 ? i+b : xdim-1;
+      lo = hi = row[i];
+      for(i++; i <= iend; i++) {
+        if(row[i] < lo)  lo = row[i];
+        if(row[i] > hi)  hi = row[i];
+      }
+
+      if(kb < nfo->bnk) {
+        if(jb < nfo->bnj)  widen_brick(nfo, ib, jb, kb, lo, hi);
+        if(jface)          widen_brick(nfo, ib, jb-1, kb, lo, hi);
+      }
+      if(kface) {
+        if(jb < nfo->bnj)  widen_brick(nfo, ib, jb, kb-1, lo, hi);
+        if(jface)          widen_brick(nfo, ib, jb-1, kb-1, lo, hi);
+      }
+    }
+  }
+
+  nfo->bplanes++;
+}
+
+/* Classify cells i0..i1-1 of the row of cells whose first grid point is
+ * row, and append those the isosurface crosses to active.  The loops have
+ * no branches, so the compiler can vectorize them: compare the 4 grid rows
+ * around the cells with the threshold, combine neighboring flags into case
+ * codes, then compact the active cells.  Returns the number appended. */
+
+static int classify_row(const float *row, uint64_t xdim, uint64_t XYdim,
+        int i0, int i1, float thresh, uint8_t *restrict flags,
+        uint8_t *restrict cases, int *restrict active)
+{
+  const float *restrict r0 = row;              /* j,   k   */
+  const float *restrict r1 = row + xdim;       /* j+1, k   */
+  const float *restrict r2 = row + XYdim;      /* j,   k+1 */
+  const float *restrict r3 = row + XYdim + xdim;   /* j+1, k+1 */
+  uint8_t *restrict f0 = flags;
+  uint8_t *restrict f1 = flags + xdim;
+  uint8_t *restrict f2 = flags + 2*xdim;
+  uint8_t *restrict f3 = flags + 3*xdim;
+  int i, n = 0;
+
+  for(i = i0; i <= i1; i++) {
+    f0[i] = r0[i] >= thresh;
+    f1[i] = r1[i] >= thresh;
+    f2[i] = r2[i] >= thresh;
+    f3[i] = r3[i] >= thresh;
+  }
+
+  /* Same bits as the cell tables' vertex numbers */
+  for(i = i0; i < i1; i++)
+    cases[i] = f2[i] | f2[i+1] << 1 | f3[i+1] << 2 | f3[i] << 3 |
+               f0[i] << 4 | f0[i+1] << 5 | f1[i+1] << 6 | f1[i] << 7;
+
+  /* Cases 0 and 255 have no triangles */
+  for(i = i0; i < i1; i++) {
+    active[n] = i;
+    n += (uint8_t)(cases[i] + 1) > 1;
+  }
+  return n;
 }
 
 /* Isosurfacing function */
@@ -277,97 +573,191 @@ void isosurf(
 		 float thresh,          /* Isosurface threshold */
 		 const float *data,    /* Pointer to data, i,j,k order */
 		 const float *xdata)     /* Extra data */
+{
+  isosurfs(nfo, 1, &thresh, data, nfo->numxarrays > 0 ? &xdata : NULL);
+}
+
+/* Isosurfacing of several isovalues: each row of cells is classified and
+ * triangulated for every isovalue before moving on, so the data, the
+ * normals cache and the brick ranges are shared while in cache */
+
+void isosurfs(
+         struct isoinfo *nfo,   /* Isosurface info */
+		 int nthresh,           /* Number of isovalues */
+		 const float *threshs,  /* Isosurface thresholds */
+		 const float *data,    /* Pointer to data, i,j,k order */
+		 const float * const *xdata)     /* Extra data arrays */
 {
   float xc[8], yc[8], zc[8], dc[8];    /* Cubes for each component of data */
   float nxc[8], nyc[8], nzc[8];        /* Cubes to contain normals */
-  float xdc[8];                      /* Extra data cube */
   int cubeindex;              /* The marching cubes case index */
   float p[3];      /* The interpolated coordinates for a point of a poly */
   float n[3];      /* The calculated normals for a point of the poly */
   int v1, v2;       /* The vertex numbers to interpolate between */
-  int i,j,k, ii;
+  int i,j,k, ii, m, x;
   int xdim1, ydim1, zdim1;   /* Dimensions - 1 */
-  int uselastcube;    /* If last cube had polygons, use for next */
   float interp_scale;
   uint64_t XYdim;       /* xdim*ydim; need this for DATA macro */
   int xdim = nfo->xdim;
   int ydim = nfo->ydim;
   int zdim = nfo->zdim;
-  uint64_t npoints = 0;
+  int numx = xdata ? nfo->numxarrays : 0;
+  struct isomesh *mesh;
+  float thresh;
+  uint64_t npoints;
+  uint64_t ntriverts;   /* Triangle vertices, 3 per triangle */
+  int64_t slot;
+  int kplane;
+  int b = nfo->brick;
+  int usebricks;      /* Skip cells of bricks whose range excludes thresh */
+  const float *rmin = NULL, *rmax = NULL;   /* Brick ranges along the row */
+  uint64_t ncells = 0;
+  int i0, i1;         /* Cells of the row classified together */
+  int a, nactive;     /* Active cells along the row */
 
   XYdim = (uint64_t)xdim * ydim;
   xdim1 = xdim-1;
   ydim1 = ydim-1;
   zdim1 = zdim-1;
-  nfo->ntris = 0;
+
+  alloc_meshes(nfo, nthresh);
+  nfo->nmeshes = nthresh;
+
+  /* The data changed, so no cached normal is valid */
+  if(nfo->gradcache)
+    memset(nfo->gstamp, 0xff, 2*XYdim*sizeof(int));
+
+  for(m = 0; m < nthresh; m++) {
+    mesh = &nfo->meshes[m];
+    mesh->thresh = threshs[m];
+    mesh->npoints = 0;
+    mesh->ntris = 0;    /* Counts triangle vertices until the end */
+
+    /* Indexed: each point is shared by the triangles of the cells around its
+     * edge, found in the edge cache of two k-planes */
+    if(nfo->indexed) {
+      if(!mesh->ecache) {
+        mesh->ecache = (uint64_t *) malloc( 2*XYdim*3*sizeof(uint64_t) );
+        mesh->estamp = (int *) malloc( 2*XYdim*3*sizeof(int) );
+      }
+      memset(mesh->estamp, 0xff, 2*XYdim*3*sizeof(int));
+    }
+  }
+
+  /* Bricks are only usable when isorange has seen every plane of this data */
+  usebricks = (b > 0 && nfo->bmin && nfo->bplanes == zdim);
+  nfo->bplanes = 0;
 
   for(k = 0; k < zdim1; k++) {
      
     for(j = 0; j < ydim1; j++) {
-      uselastcube = 0;
-      for(i = 0; i < xdim1; i++) {
-	
-        /* Determine the index into the MC case array */
-        cubeindex = 0;
-        if(DATA(i,j,k+1) >= thresh)     cubeindex += 1;
-        if(DATA(i+1,j,k+1) >= thresh)   cubeindex += 2;
-        if(DATA(i+1,j+1,k+1) >= thresh) cubeindex += 4;
-        if(DATA(i,j+1,k+1) >= thresh)   cubeindex += 8;
-        if(DATA(i,j,k) >= thresh)       cubeindex += 16;
-        if(DATA(i+1,j,k) >= thresh)     cubeindex += 32;
-        if(DATA(i+1,j+1,k) >= thresh)   cubeindex += 64;
-        if(DATA(i,j+1,k) >= thresh)     cubeindex += 128;
-
-        if( (cubeindex == 0) || (cubeindex == 255) ) {
-          uselastcube = 0;
-          continue;
+      if(usebricks) {
+        uint64_t r = ((uint64_t)(k/b)*nfo->bnj + j/b)*nfo->bni;
+        rmin = nfo->bmin + r;
+        rmax = nfo->bmax + r;
+      }
+
+      for(m = 0; m < nthresh; m++) {
+        mesh = &nfo->meshes[m];
+        thresh = mesh->thresh;
+        npoints = mesh->npoints;
+        ntriverts = mesh->ntris;
+
+        /* Find the active cells of the row, a brick at a time, skipping whole
+         * bricks the isosurface cannot pass through */
+        nactive = 0;
+        for(i0 = 0; i0 < xdim1; i0 = i1) {
+          i1 = xdim1;
+          if(usebricks) {
+            int ib = i0/b;
+            i1 = i0+b < xdim1 ? i0+b : xdim1;
+            if(rmax[ib] < thresh || rmin[ib] >= thresh)
+              continue;
+          }
+          nactive += classify_row(&DATA(0,j,k), xdim, XYdim, i0, i1, thresh,
+                                  nfo->rowflags, nfo->cases, nfo->active + nactive);
+          ncells += i1-i0;
         }
+
+        for(a = 0; a < nactive; a++) {
+          i = nfo->active[a];
+          cubeindex = nfo->cases[i];
+
+          /* Room for the most a cell makes: 5 triangles */
+          if(npoints + 15 > mesh->maxpoints ||
+             (nfo->indexed && ntriverts + 15 > mesh->maxtriverts))
+            meshgrow(nfo, mesh, npoints + 15, ntriverts + 15);
 	
-        make_cubes(data, nfo->x0, nfo->y0, nfo->z0, nfo->xd, nfo->yd, nfo->zd, 
-                xdim, ydim, zdim, xc, yc, zc, dc, i, j, k, xdata, xdc);
-        calc_normal_cube(data, xdim, ydim, zdim, nxc, nyc, nzc, i, j, k, 
-                 uselastcube);
-
-        //uselastcube = 1;
-
-        /* Calculate the vertices for each triangle in cube */
-        for(ii = 0; vertex1[cubeindex][ii] > -1; ii++) {
-           uint64_t npoints3 = npoints * 3;
-           v1 = vertex1[cubeindex][ii];
-           v2 = vertex2[cubeindex][ii];
+          make_cubes(data, nfo->x0, nfo->y0, nfo->z0, nfo->xd, nfo->yd, nfo->zd, 
+                  xdim, ydim, zdim, xc, yc, zc, dc, i, j, k);
+          if(nfo->gradcache)
+            cached_normal_cube(nfo, data, nxc, nyc, nzc, i, j, k);
+          else
+            calc_normal_cube(data, xdim, ydim, zdim, nxc, nyc, nzc, i, j, k);
+
+          /* Calculate the vertices for each triangle in cube */
+          for(ii = 0; vertex1[cubeindex][ii] > -1; ii++) {
+             uint64_t npoints3 = npoints * 3;
+             v1 = vertex1[cubeindex][ii];
+             v2 = vertex2[cubeindex][ii];
+
+             if(nfo->indexed) {
+                slot = edge_slot(nfo, i, j, k, v1, v2, &kplane);
+                if(slot >= 0 && mesh->estamp[slot] == kplane) {
+                   mesh->tris[ntriverts++] = mesh->ecache[slot];
+                   continue;
+                }
+                if(slot >= 0) {
+                   mesh->ecache[slot] = npoints;
+                   mesh->estamp[slot] = kplane;
+                }
+                mesh->tris[ntriverts++] = npoints;
+             }
 	  
-           interp_scale = calc_interp_scale(dc[v1], dc[v2], thresh);
+             interp_scale = calc_interp_scale(dc[v1], dc[v2], thresh);
 	   
-           p[X] = interp(interp_scale, xc[v1], xc[v2]);
-           p[Y] = interp(interp_scale, yc[v1], yc[v2]);
-           p[Z] = interp(interp_scale, zc[v1], zc[v2]);
+             p[X] = interp(interp_scale, xc[v1], xc[v2]);
+             p[Y] = interp(interp_scale, yc[v1], yc[v2]);
+             p[Z] = interp(interp_scale, zc[v1], zc[v2]);
 	   
-           n[X] = interp(interp_scale, nxc[v1], nxc[v2]);
-           n[Y] = interp(interp_scale, nyc[v1], nyc[v2]);
-           n[Z] = interp(interp_scale, nzc[v1], nzc[v2]);
+             n[X] = interp(interp_scale, nxc[v1], nxc[v2]);
+             n[Y] = interp(interp_scale, nyc[v1], nyc[v2]);
+             n[Z] = interp(interp_scale, nzc[v1], nzc[v2]);
 	   
-           if(xdata != NULL) {
-              float xval = interp(interp_scale, xdc[v1], xdc[v2]);
-              nfo->xvals[npoints] = xval;
-           }
+             if(numx > 0) {
+                uint64_t d1 = (uint64_t)(k+cornerofs[v1][Z])*XYdim +
+                              (uint64_t)(j+cornerofs[v1][Y])*xdim + i+cornerofs[v1][X];
+                uint64_t d2 = (uint64_t)(k+cornerofs[v2][Z])*XYdim +
+                              (uint64_t)(j+cornerofs[v2][Y])*xdim + i+cornerofs[v2][X];
+                for(x = 0; x < numx; x++)
+                   mesh->xvals[x][npoints] = interp(interp_scale, xdata[x][d1], xdata[x][d2]);
+             }
 	    
-           nfo->points[npoints3]   = p[X];
-           nfo->points[npoints3+1] = p[Y];
-           nfo->points[npoints3+2] = p[Z];
-           nfo->norms[npoints3]   = n[X];
-           nfo->norms[npoints3+1] = n[Y];
-           nfo->norms[npoints3+2] = n[Z];
-
-           npoints++;
+             mesh->points[npoints3]   = p[X];
+             mesh->points[npoints3+1] = p[Y];
+             mesh->points[npoints3+2] = p[Z];
+             mesh->norms[npoints3]   = n[X];
+             mesh->norms[npoints3+1] = n[Y];
+             mesh->norms[npoints3+2] = n[Z];
+
+             npoints++;
 	  
-        } /*for(ii)*/
+          } /*for(ii)*/
 	
-      } /*for(i)*/
+        } /*for(a)*/
+
+        mesh->npoints = npoints;
+        mesh->ntris = ntriverts;
+      } /*for(m)*/
     } /*for(j)*/
 
   } /*for(k)*/
 
-  nfo->ntris = npoints / 3;
+  for(m = 0; m < nthresh; m++) {
+    mesh = &nfo->meshes[m];
+    mesh->ntris = (nfo->indexed ? mesh->ntris : mesh->npoints) / 3;
+  }
+  nfo->ncells = ncells;
 
 } /*iso_surface*/
 
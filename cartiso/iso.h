@@ -5,14 +5,41 @@
 
 #include <stdint.h>
 
+/* Isosurface of one isovalue */
+struct isomesh {
+    float thresh;          /* Isovalue */
+    uint64_t ntris;        /* Number of triangles */
+    uint64_t npoints;      /* Number of points; 3 per triangle unless indexed */
+    uint64_t maxpoints;    /* Points allocated; grows as needed */
+    uint64_t maxtriverts;  /* Indexed: triangle vertices allocated; grows as needed */
+    float *points;     /* Points of triangles */
+    float *norms;     /* Normals of triangles */
+    float **xvals;     /* Extra values on triangle points, one array per extra field */
+    uint64_t *tris;    /* Indexed: 3 point indices per triangle, else NULL */
+    uint64_t *ecache;  /* Indexed: point on each edge of two k-planes, 3 per grid point */
+    int *estamp;       /* Indexed: k each cached edge was found for, -1 none */
+};
+
 struct isoinfo {
     float x0, y0, z0;    /* Starting coordinates */
     float xd, yd, zd;    /* Coordinate deltas */
     int xdim, ydim, zdim;   /* Dimensions of local data */
-    uint64_t ntris;        /* Number of triangles */
-    float *points;     /* Points of triangles */
-    float *norms;     /* Normals of triangles */
-    float *xvals;     /* Extra values on triangle points */
+    int numxarrays;    /* Extra fields interpolated onto the points */
+    int nmeshes;       /* Isovalues of the last isosurf */
+    int maxmeshes;     /* Meshes allocated */
+    struct isomesh *meshes;   /* Isosurface of each isovalue */
+    int gradcache;     /* Reuse normals of grid points between cells; default on */
+    float *gcache;     /* Normals of two k-planes of grid points */
+    int *gstamp;       /* k each cached normal was computed for, -1 none */
+    int indexed;       /* Share points between triangles; default off */
+    int brick;         /* Cells along each edge of a min/max brick, 0 none; default 8 */
+    int bni, bnj, bnk;    /* Bricks along each axis */
+    float *bmin, *bmax;   /* Data range of the grid points of each brick */
+    int bplanes;       /* k-planes of data in the brick ranges; all needed to skip */
+    uint64_t ncells;   /* Cells classified by the last isosurf, over all isovalues */
+    uint8_t *rowflags; /* Points >= threshold on the 4 grid rows around a cell row */
+    uint8_t *cases;    /* Marching cubes case of each cell along the row */
+    int *active;       /* i of the cells along the row the isosurface crosses */
 };
 
 /* Initialize info for isosurface
@@ -29,10 +56,26 @@ void isoinit(struct isoinfo *nfo, float x0, float y0, float z0,
 
 void isofree(struct isoinfo *nfo);
 
+/* Add k-plane k of the data to the min/max ranges of its bricks
+ *   Call for each k in order, after that plane of data is final, so isosurf
+ *   can skip the bricks whose range does not include the threshold.
+ *   plane points to the k-plane, i,j order. */
+
+void isorange(struct isoinfo *nfo, int k, const float *plane);
+
 /* Generate an isosurface */
 
 void isosurf(struct isoinfo *nfo,   /* Isosurface info */
              float thresh,          /* Isosurface threshold */
              const float *data,    /* Pointer to data, i,j,k order */
-             const float *xdata);    /* Extra data */
+             const float *xdata);    /* Extra data, NULL if numxarrays is 0 */
+
+/* Generate the isosurfaces of several isovalues in one pass over the data
+ *   The surface of threshs[m] is in meshes[m] */
+
+void isosurfs(struct isoinfo *nfo,   /* Isosurface info */
+              int nthresh,           /* Number of isovalues */
+              const float *threshs,  /* Isosurface thresholds */
+              const float *data,     /* Pointer to data, i,j,k order */
+              const float * const *xdata);   /* numxarrays extra data arrays */
 
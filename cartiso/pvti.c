@@ -12,13 +12,18 @@
 #include <mpi.h>
 
 #include "pdirs.h"
+#include "vtkshared.h"
 #include "pvti.h"
+#ifdef HAS_VTKZ
+#  include "vtkz.h"
+#endif
 
 static const int fnstrmax = 4095;
 
-void writepvti(char *name, char *varname, MPI_Comm comm, int rank, int nprocs, 
-               int tstep, int ni, int nj, int nk, int is, int ie, int js, int je,
-               int ks, int ke, float deltax, float deltay, float deltaz, float *data)
+void writepvti(char *dir, int nodelocal, char *name, char *varname, MPI_Comm comm, int rank,
+               int nprocs, int tstep, int ni, int nj, int nk, int is, int ie, int js, int je,
+               int ks, int ke, float deltax, float deltay, float deltaz, float *data,
+               int ztype, int zlevel)
 {
     char dirname[fnstrmax+1];
     char fname[fnstrmax+1];
@@ -37,10 +42,15 @@ void writepvti(char *name, char *varname, MPI_Comm comm, int rank, int nprocs,
     int ret;
     uint64_t ijkelems;
     int32_t ijkbytes32;
+    char *version = "0.1";
+    char compstr[80] = "";
+#ifdef HAS_VTKZ
+    struct vtkzbuf zb = { 0, 0, NULL };
+#endif
 
     /* Make directory for timestep */
-    snprintf(dirname, fnstrmax, "%s.%s.%0*d.d", name, varname, timedigits, tstep);
-    mkdir1task(dirname, comm);
+    snprintf(dirname, fnstrmax, "%s/%s.%s.%0*d.d", dir, name, varname, timedigits, tstep);
+    mkdir1task(dirname, comm, nodelocal);
 
     /* Gather subset sizes from all processes of communicator to rank 0 */
     if(rank == 0) {
@@ -50,7 +60,7 @@ void writepvti(char *name, char *varname, MPI_Comm comm, int rank, int nprocs,
 
     /* Create pvti file */
     if(rank == 0) {
-        snprintf(fname, fnstrmax, "%s.%s.%0*d.pvti", name, varname, timedigits, tstep);
+        snprintf(fname, fnstrmax, "%s/%s.%s.%0*d.pvti", dir, name, varname, timedigits, tstep);
         if( ! (f = fopen(fname, "w")) ) {
             fprintf(stderr, "writepvti error: Could not create .pvti file.\n");
             MPI_Abort(comm, 1);
@@ -85,7 +95,7 @@ void writepvti(char *name, char *varname, MPI_Comm comm, int rank, int nprocs,
     MPI_Info_set(info, "striping_factor", "1");
 
     /* Write .vti files */
-    snprintf(fname, fnstrmax, "%s.%s.%0*d.d/%0*d.vti", name, varname, timedigits,
+    snprintf(fname, fnstrmax, "%s/%s.%s.%0*d.d/%0*d.vti", dir, name, varname, timedigits,
              tstep, rankdigits, rank);
     ret = MPI_File_open(MPI_COMM_SELF, fname, MPI_MODE_WRONLY | MPI_MODE_CREATE,
                         info, &mf);
@@ -93,9 +103,19 @@ void writepvti(char *name, char *varname, MPI_Comm comm, int rank, int nprocs,
         fprintf(stderr, "writepvti error: could not open %s\n", fname);
         MPI_Abort(comm, 1);
     }
+    ijkelems = (uint64_t)(ie-is+1) * (je-js+1) * (ke-ks+1);
+#ifdef HAS_VTKZ
+    /* Compressed blocks have UInt64 headers */
+    if(ztype) {
+        version = "1.0";
+        vtkz_compress(&zb, ztype, zlevel, data, ijkelems*sizeof(float));
+        snprintf(compstr, sizeof(compstr), " header_type=\"UInt64\" compressor=\"%s\"",
+                 vtkz_compressor(ztype));
+    }
+#endif
     snprintf(line, fnstrmax, "<?xml version=\"1.0\"?>\n"
-             "<VTKFile type=\"ImageData\" version=\"0.1\" byte_order=\"%s\">\n",
-             endianstr);
+             "<VTKFile type=\"ImageData\" version=\"%s\" byte_order=\"%s\"%s>\n",
+             version, endianstr, compstr);
     MPI_File_write(mf, line, strlen(line), MPI_CHAR, &mstat);
     snprintf(line, fnstrmax, "  <ImageData WholeExtent=\"%d %d %d %d %d %d\" "
              "Origin=\"0 0 0\" Spacing=\"%f %f %f\">\n    "
@@ -114,13 +134,117 @@ void writepvti(char *name, char *varname, MPI_Comm comm, int rank, int nprocs,
              "  <AppendedData encoding=\"raw\">\n"
              "   _");
     MPI_File_write(mf, line, strlen(line), MPI_CHAR, &mstat);
-    ijkelems = (ie-is+1) * (je-js+1) * (ke-ks+1);
-    ijkbytes32 = (int32_t)(ijkelems * sizeof(float));
-    MPI_File_write(mf, &ijkbytes32, 1, MPI_INT, &mstat);
-    MPI_File_write(mf, data, ijkelems, MPI_FLOAT, &mstat);
+#ifdef HAS_VTKZ
+    if(ztype) {
+        MPI_File_write(mf, zb.buf, zb.size, MPI_BYTE, &mstat);
+        vtkz_free(&zb);
+    } else
+#endif
+    {
+        ijkbytes32 = (int32_t)(ijkelems * sizeof(float));
+        MPI_File_write(mf, &ijkbytes32, 1, MPI_INT, &mstat);
+        MPI_File_write(mf, data, ijkelems, MPI_FLOAT, &mstat);
+    }
     snprintf(line, fnstrmax, "\n  </AppendedData>\n</VTKFile>\n"); 
     MPI_File_write(mf, line, strlen(line), MPI_CHAR, &mstat);
     MPI_File_close(&mf);
 }
 
 
+
+void writevtishared(char *dir, char *name, char *varname, MPI_Comm comm, int rank,
+                    int nprocs, int tstep, int ni, int nj, int nk, int is, int ie, int js, int je,
+                    int ks, int ke, float deltax, float deltay, float deltaz, float *data,
+                    int ztype, int zlevel, int naggs, int stripes)
+{
+    char fname[fnstrmax+1];
+    int timedigits = 4;
+    char typestr[] = "Float32";
+    int r;
+    uint64_t subset[8] = { is, ie, js, je, ks, ke, 0, 0 };  /* Extent, offset, bytes */
+    uint64_t *rsubsets = NULL;   /* The same from each task */
+    uint64_t ijkelems, nbytes, offset = 0, total = 0;
+    unsigned char *buf;
+    struct vtkxml xml = { 0, 0, NULL };
+#ifdef HAS_VTKZ
+    struct vtkzbuf zb = { 0, 0, NULL };
+#endif
+
+    /* This rank's appended bytes: the compressed blocks, or the byte count
+     * and the array */
+    ijkelems = (uint64_t)(ie-is+1) * (je-js+1) * (ke-ks+1);
+#ifdef HAS_VTKZ
+    if(ztype) {
+        vtkz_compress(&zb, ztype, zlevel, data, ijkelems*sizeof(float));
+        buf = zb.buf;
+        nbytes = zb.size;
+    } else
+#endif
+    {
+        nbytes = ijkelems*sizeof(float) + sizeof(uint64_t);
+        buf = (unsigned char *) malloc(nbytes);
+        if(!buf) {
+            fprintf(stderr, "writevtishared error: could not allocate %"PRIu64" bytes\n",
+                    nbytes);
+            MPI_Abort(comm, 1);
+        }
+        ijkelems *= sizeof(float);
+        memcpy(buf, &ijkelems, sizeof(uint64_t));
+        memcpy(buf + sizeof(uint64_t), data, ijkelems);
+    }
+
+    /* Place of the rank's bytes in the appended data */
+    MPI_Exscan(&nbytes, &offset, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, comm);
+    if(rank == 0)
+        offset = 0;
+    subset[6] = offset;
+    subset[7] = nbytes;
+
+    /* Gather pieces from all processes of communicator to rank 0 */
+    if(rank == 0)
+        rsubsets = (uint64_t *) malloc(nprocs*8*sizeof(uint64_t));
+    MPI_Gather(subset, 8, MPI_UNSIGNED_LONG_LONG, rsubsets, 8, MPI_UNSIGNED_LONG_LONG, 0,
+               comm);
+
+    if(rank == 0) {
+        vtkxml_printf(&xml, "<?xml version=\"1.0\"?>\n"
+                      "<VTKFile type=\"ImageData\" version=\"1.0\" byte_order=\"LittleEndian\" "
+                      "header_type=\"UInt64\"");
+#ifdef HAS_VTKZ
+        if(ztype)
+            vtkxml_printf(&xml, " compressor=\"%s\"", vtkz_compressor(ztype));
+#endif
+        vtkxml_printf(&xml, ">\n  <ImageData WholeExtent=\"0 %d 0 %d 0 %d\" "
+                      "Origin=\"0 0 0\" Spacing=\"%f %f %f\">\n", ni-1, nj-1, nk-1,
+                      deltax, deltay, deltaz);
+        /* Write info for each block */
+        for(r = 0; r < nprocs; ++r) {
+            uint64_t *rsub = rsubsets + r*8;    /* Remote subset indices */
+            vtkxml_printf(&xml, "    <Piece Extent=\"%d %d %d %d %d %d\">\n"
+                          "      <PointData Scalars=\"%s\">\n"
+                          "        <DataArray type=\"%s\" Name=\"%s\" "
+                          "format=\"appended\" offset=\"%"PRIu64"\"/>\n"
+                          "      </PointData>\n"
+                          "      <CellData></CellData>\n"
+                          "    </Piece>\n", (int)rsub[0], (int)rsub[1], (int)rsub[2],
+                          (int)rsub[3], (int)rsub[4], (int)rsub[5], varname, typestr,
+                          varname, rsub[6]);
+            total += rsub[7];
+        }
+        vtkxml_printf(&xml, "  </ImageData>\n"
+                      "  <AppendedData encoding=\"raw\">\n"
+                      "   _");
+        free(rsubsets);
+    }
+
+    snprintf(fname, fnstrmax, "%s/%s.%s.%0*d.vti", dir, name, varname, timedigits, tstep);
+    vtkshared_write(fname, comm, &xml, total, buf, nbytes, offset, naggs, stripes);
+
+    free(xml.text);
+#ifdef HAS_VTKZ
+    if(ztype)
+        vtkz_free(&zb);
+    else
+#endif
+        free(buf);
+}
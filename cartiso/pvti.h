@@ -6,6 +6,18 @@
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h>
 
-void writepvti(char *name, char *varname, MPI_Comm comm, int rank, int nprocs, 
-               int tstep, int ni, int nj, int nk, int is, int ie, int js, int je,
-               int ks, int ke, float deltax, float deltay, float deltaz, float *data);
+/* The files go in directory dir, and nodelocal says this rank creates the
+ * step's directory for its node, as from bbuf_dir and bbuf_mkdirs; ztype is
+ * a vtkz compressor of the appended data, 0 for raw, and zlevel its level */
+void writepvti(char *dir, int nodelocal, char *name, char *varname, MPI_Comm comm, int rank,
+               int nprocs, int tstep, int ni, int nj, int nk, int is, int ie, int js, int je,
+               int ks, int ke, float deltax, float deltay, float deltaz, float *data,
+               int ztype, int zlevel);
+
+/* Same, but all ranks' pieces go in one dir/name.varname.tstep.vti file with
+ * one shared appended data section, written with a collective call, through
+ * naggs aggregator ranks if not 0, and striped over stripes targets */
+void writevtishared(char *dir, char *name, char *varname, MPI_Comm comm, int rank,
+                    int nprocs, int tstep, int ni, int nj, int nk, int is, int ie, int js, int je,
+                    int ks, int ke, float deltax, float deltay, float deltaz, float *data,
+                    int ztype, int zlevel, int naggs, int stripes);
@@ -12,13 +12,185 @@
 #include <mpi.h>
 
 #include "pdirs.h"
+#include "vtkshared.h"
 #include "pvtp.h"
+#ifdef HAS_VTKZ
+#  include "vtkz.h"
+#endif
 
 static const int fnstrmax = 4095;
 
-void writepvtp(char *name, char *varname, MPI_Comm comm, int rank, int nprocs, 
-               int tstep, uint64_t ntris, float *points, float *norms, 
-               float *xvals, char *xname)
+/* Appended arrays of a piece, in file order: normals, xvals, points,
+ * connectivity, offsets */
+struct vtparrays {
+    int narrs;
+    const void **arrs;
+    uint64_t *nbytes;   /* Bytes of each array */
+    uint64_t *asizes;   /* Bytes of each in the appended data, with its header */
+    uint64_t *conns;    /* Connectivity, created unless the triangles share points */
+    uint64_t *polyoffs; /* Offsets of the polygons in the connectivity */
+    int ztype;
+#ifdef HAS_VTKZ
+    struct vtkzbuf *zbs;   /* Compressed arrays */
+#endif
+};
+
+static void vtparrays_init(struct vtparrays *va, uint64_t ntris, uint64_t npoints,
+                           float *points, float *norms, int nxvals, float **xvals,
+                           uint64_t *tris, int ztype, int zlevel)
+{
+    uint64_t i;
+    int a, x;
+
+    va->narrs = nxvals + 4;
+    va->arrs = (const void **) malloc(va->narrs*sizeof(void *));
+    va->nbytes = (uint64_t *) malloc(va->narrs*sizeof(uint64_t));
+    va->asizes = (uint64_t *) malloc(va->narrs*sizeof(uint64_t));
+    va->ztype = ztype;
+
+    /* Connections: shared points have them, otherwise create them */
+    if(tris) {
+        va->conns = tris;
+    } else {
+        va->conns = (uint64_t *) malloc(ntris*3*sizeof(uint64_t));
+        for(i = 0; i < ntris*3; i++)
+            va->conns[i] = i;
+    }
+    va->polyoffs = (uint64_t *) malloc(ntris*sizeof(uint64_t));
+    for(i = 0; i < ntris; i++)
+        va->polyoffs[i] = (i+1)*3;
+
+    va->arrs[0] = norms;
+    va->nbytes[0] = npoints*3*sizeof(float);
+    for(x = 0; x < nxvals; x++) {
+        va->arrs[1+x] = xvals[x];
+        va->nbytes[1+x] = npoints*sizeof(float);
+    }
+    va->arrs[nxvals+1] = points;
+    va->nbytes[nxvals+1] = npoints*3*sizeof(float);
+    va->arrs[nxvals+2] = va->conns;
+    va->nbytes[nxvals+2] = ntris*3*sizeof(uint64_t);
+    va->arrs[nxvals+3] = va->polyoffs;
+    va->nbytes[nxvals+3] = ntris*sizeof(uint64_t);
+    for(a = 0; a < va->narrs; a++)
+        va->asizes[a] = va->nbytes[a] + sizeof(uint64_t);
+#ifdef HAS_VTKZ
+    va->zbs = NULL;
+    if(ztype) {
+        va->zbs = (struct vtkzbuf *) calloc(va->narrs, sizeof(struct vtkzbuf));
+        for(a = 0; a < va->narrs; a++) {
+            vtkz_compress(&va->zbs[a], ztype, zlevel, va->arrs[a], va->nbytes[a]);
+            va->asizes[a] = va->zbs[a].size;
+        }
+    }
+#endif
+}
+
+/* Copy the appended bytes of array a to dst, or write them to mf if dst is NULL */
+
+static void vtparrays_put(struct vtparrays *va, int a, unsigned char *dst, MPI_File mf)
+{
+    MPI_Status mstat;
+
+#ifdef HAS_VTKZ
+    if(va->ztype) {
+        if(dst)
+            memcpy(dst, va->zbs[a].buf, va->zbs[a].size);
+        else
+            MPI_File_write(mf, va->zbs[a].buf, va->zbs[a].size, MPI_BYTE, &mstat);
+        return;
+    }
+#endif
+    if(dst) {
+        memcpy(dst, &va->nbytes[a], sizeof(uint64_t));
+        memcpy(dst + sizeof(uint64_t), va->arrs[a], va->nbytes[a]);
+    } else {
+        MPI_File_write(mf, &va->nbytes[a], 1, MPI_UNSIGNED_LONG_LONG, &mstat);
+        MPI_File_write(mf, va->arrs[a], va->nbytes[a], MPI_BYTE, &mstat);
+    }
+}
+
+static void vtparrays_free(struct vtparrays *va, uint64_t *tris)
+{
+#ifdef HAS_VTKZ
+    int a;
+
+    if(va->zbs) {
+        for(a = 0; a < va->narrs; a++)
+            vtkz_free(&va->zbs[a]);
+        free(va->zbs);
+    }
+#endif
+    if(!tris)
+        free(va->conns);
+    free(va->polyoffs);
+    free(va->arrs);
+    free(va->nbytes);
+    free(va->asizes);
+}
+
+/* Start of a .vtp file, through <PolyData> */
+
+static void vtp_begin(struct vtkxml *xml, int ztype)
+{
+    vtkxml_printf(xml, "<?xml version=\"1.0\"?>\n"
+                  "<VTKFile type=\"PolyData\" version=\"2.0\" byte_order=\"LittleEndian\" "
+                  "header_type=\"UInt64\"");
+#ifdef HAS_VTKZ
+    if(ztype)
+        vtkxml_printf(xml, " compressor=\"%s\"", vtkz_compressor(ztype));
+#endif
+    vtkxml_printf(xml, ">\n  <PolyData>\n");
+}
+
+/* A <Piece> whose arrays, of asizes bytes, start at offset in the appended data */
+
+static void vtp_piece(struct vtkxml *xml, uint64_t npoints, uint64_t ntris, int nxvals,
+                      char **xnames, const uint64_t *asizes, uint64_t offset)
+{
+    char typestr[] = "Float32";
+    int x;
+
+    vtkxml_printf(xml, "    <Piece NumberOfPoints=\"%"PRIu64"\" NumberOfVerts=\"0\" "
+                  "NumberOfLines=\"0\" NumberOfStrips=\"0\" NumberOfPolys=\"%"PRIu64"\">\n",
+                  npoints, ntris);
+    vtkxml_printf(xml, "      <PointData Normals=\"Normals\">\n"
+                  "        <DataArray type=\"%s\" Name=\"Normals\" NumberOfComponents=\"3\" "
+                  "format=\"appended\" offset=\"%"PRIu64"\"/>\n", typestr, offset);
+    offset += asizes[0];   /* Add size of normals for points */
+    for(x = 0; x < nxvals; x++) {
+        vtkxml_printf(xml, "        <DataArray type=\"%s\" Name=\"%s\" "
+                      "NumberOfComponents=\"1\" "
+                      "format=\"appended\" offset=\"%"PRIu64"\"/>\n", typestr, xnames[x], offset);
+        offset += asizes[1+x];   /* Add size of xdata array */
+    }
+    vtkxml_printf(xml, "      </PointData>\n"
+                  "      <Points>\n"
+                  "        <DataArray type=\"%s\" Name=\"Points\" NumberOfComponents=\"3\" "
+                  "format=\"appended\" offset=\"%"PRIu64"\"/>\n"
+                  "      </Points>\n", typestr, offset);
+    offset += asizes[nxvals+1];   /* Add size of points */
+    vtkxml_printf(xml, "      <Polys>\n"
+                  "        <DataArray type=\"UInt64\" Name=\"connectivity\" "
+                  "format=\"appended\" offset=\"%"PRIu64"\"/>\n", offset);
+    offset += asizes[nxvals+2];   /* Add size of connections */
+    vtkxml_printf(xml, "        <DataArray type=\"UInt64\" Name=\"offsets\" "
+                  "format=\"appended\" offset=\"%"PRIu64"\"/>\n"
+                  "      </Polys>\n    </Piece>\n", offset);
+}
+
+/* End of a .vtp file's XML, through the "_" that starts the appended data */
+
+static void vtp_end(struct vtkxml *xml)
+{
+    vtkxml_printf(xml, "  </PolyData>\n"
+                  "  <AppendedData encoding=\"raw\">\n"
+                  "   _");
+}
+
+void writepvtp(char *dir, int nodelocal, char *name, char *varname, MPI_Comm comm, int rank,
+               int nprocs, int tstep, uint64_t ntris, uint64_t npoints, float *points, float *norms, 
+               int nxvals, float **xvals, char **xnames, uint64_t *tris, int ztype, int zlevel)
 {
     char dirname[fnstrmax+1];
     char fname[fnstrmax+1];
@@ -31,13 +203,13 @@ void writepvtp(char *name, char *varname, MPI_Comm comm, int rank, int nprocs,
     MPI_File mf;
     MPI_Status mstat;
     MPI_Info info = MPI_INFO_NULL;
-    int r;
+    int r, x;
     uint64_t *rntris=NULL;   /* All triangle counts from each task */
     int ret;
     
     /* Make directory for timestep */
-    snprintf(dirname, fnstrmax, "%s.%s.%0*d.d", name, varname, timedigits, tstep);
-    mkdir1task(dirname, comm);
+    snprintf(dirname, fnstrmax, "%s/%s.%s.%0*d.d", dir, name, varname, timedigits, tstep);
+    mkdir1task(dirname, comm, nodelocal);
 
     /* Gather tri counts, in case some are zero, to leave them out */
     if(rank == 0)
@@ -46,7 +218,7 @@ void writepvtp(char *name, char *varname, MPI_Comm comm, int rank, int nprocs,
 
     /* Create pvtp file */
     if(rank == 0) {
-        snprintf(fname, fnstrmax, "%s.%s.%0*d.pvtp", name, varname, timedigits, tstep);
+        snprintf(fname, fnstrmax, "%s/%s.%s.%0*d.pvtp", dir, name, varname, timedigits, tstep);
         if( ! (f = fopen(fname, "w")) ) {
             fprintf(stderr, "writepvtp error: Could not create .pvtp file.\n");
             MPI_Abort(comm, 1);
@@ -59,9 +231,9 @@ void writepvtp(char *name, char *varname, MPI_Comm comm, int rank, int nprocs,
         fprintf(f, "    <PPointData Normals=\"Normals\">\n"
                    "      <PDataArray type=\"%s\" Name=\"Normals\" NumberOfComponents=\"3\"/>\n",
                    typestr);
-        if(xvals) {
+        for(x = 0; x < nxvals; x++) {
             fprintf(f, "      <PDataArray type=\"%s\" Name=\"%s\" NumberOfComponents=\"1\"/>\n",
-                    typestr, xname);
+                    typestr, xnames[x]);
         }
         fprintf(f, "    </PPointData>\n");
         fprintf(f, "    <PPoints>\n"
@@ -89,89 +261,100 @@ void writepvtp(char *name, char *varname, MPI_Comm comm, int rank, int nprocs,
 
     /* Write .vtp files, if we have polys */
     if(ntris > 0) {
-        uint64_t i, offsets = 0;   /* Offsets into the binary portion for each field */
-        uint64_t *temparr;
-        snprintf(fname, fnstrmax, "%s.%s.%0*d.d/%0*d.vtp", name, varname, timedigits,
-                 tstep, rankdigits, rank);
+        struct vtparrays va;
+        struct vtkxml xml = { 0, 0, NULL };
+        int a;
+
+        vtparrays_init(&va, ntris, npoints, points, norms, nxvals, xvals, tris, ztype, zlevel);
+        snprintf(fname, fnstrmax, "%s/%s.%s.%0*d.d/%0*d.vtp", dir, name, varname,
+                 timedigits, tstep, rankdigits, rank);
         ret = MPI_File_open(MPI_COMM_SELF, fname, MPI_MODE_WRONLY | MPI_MODE_CREATE,
                             info, &mf);
         if(ret) {
             fprintf(stderr, "writepvtp error: could not open %s\n", fname);
             MPI_Abort(comm, 1);
         }
-        snprintf(line, fnstrmax, "<?xml version=\"1.0\"?>\n"
-                 "<VTKFile type=\"PolyData\" version=\"2.0\" byte_order=\"%s\" "
-                 "header_type=\"UInt64\">\n"
-                 "  <PolyData>\n", endianstr);
-        MPI_File_write(mf, line, strlen(line), MPI_CHAR, &mstat);
-        snprintf(line, fnstrmax, "    <Piece NumberOfPoints=\"%"PRIu64"\" NumberOfVerts=\"0\" "
-                 "NumberOfLines=\"0\" NumberOfStrips=\"0\" NumberOfPolys=\"%"PRIu64"\">\n",
-                 ntris*3, ntris);
-        MPI_File_write(mf, line, strlen(line), MPI_CHAR, &mstat);
-        snprintf(line, fnstrmax, "      <PointData Normals=\"Normals\">\n"
-                 "        <DataArray type=\"%s\" Name=\"Normals\" NumberOfComponents=\"3\" "
-                 "format=\"appended\" offset=\"0\"/>\n", typestr);
-        MPI_File_write(mf, line, strlen(line), MPI_CHAR, &mstat);
-        offsets += ntris*9*sizeof(float)+sizeof(uint64_t);   /* Add size of normals for points */
-        if(xvals) {
-            snprintf(line, fnstrmax, "        <DataArray type=\"%s\" Name=\"%s\" "
-                     "NumberOfComponents=\"1\" "
-                     "format=\"appended\" offset=\"%"PRIu64"\"/>\n", typestr, xname, offsets);
-            MPI_File_write(mf, line, strlen(line), MPI_CHAR, &mstat);
-            offsets += ntris*3*sizeof(float)+sizeof(uint64_t);   /* Add size of xdata array */
-        }
-        snprintf(line, fnstrmax, "      </PointData>\n"
-                 "      <Points>\n"
-                 "        <DataArray type=\"%s\" Name=\"Points\" NumberOfComponents=\"3\" "
-                 "format=\"appended\" offset=\"%"PRIu64"\"/>\n"
-                 "      </Points>\n", typestr, offsets);
-        MPI_File_write(mf, line, strlen(line), MPI_CHAR, &mstat);
-        offsets += ntris*9*sizeof(float)+sizeof(uint64_t);   /* Add size of points */
-        snprintf(line, fnstrmax, "      <Polys>\n"
-                 "        <DataArray type=\"UInt64\" Name=\"connectivity\" "
-                 "format=\"appended\" offset=\"%"PRIu64"\"/>\n", offsets);
-        MPI_File_write(mf, line, strlen(line), MPI_CHAR, &mstat);
-        offsets += ntris*3*sizeof(uint64_t)+sizeof(uint64_t);   /* Add size of connections */
-        snprintf(line, fnstrmax, "        <DataArray type=\"UInt64\" Name=\"offsets\" "
-                 "format=\"appended\" offset=\"%"PRIu64"\"/>\n"
-                 "      </Polys>\n    </Piece>\n  </PolyData>\n"
-                 "  <AppendedData encoding=\"raw\">\n"
-                 "   _", offsets);
-        MPI_File_write(mf, line, strlen(line), MPI_CHAR, &mstat);
+        vtp_begin(&xml, ztype);
+        vtp_piece(&xml, npoints, ntris, nxvals, xnames, va.asizes, 0);
+        vtp_end(&xml);
+        MPI_File_write(mf, xml.text, xml.len, MPI_CHAR, &mstat);
+        free(xml.text);
         
-        /* Normals header & array */
-        offsets = ntris*9*sizeof(float);
-        MPI_File_write(mf, &offsets, 1, MPI_UNSIGNED_LONG_LONG, &mstat);
-        MPI_File_write(mf, norms, ntris*9, MPI_FLOAT, &mstat);
-        /* xvals header & array */
-        if(xvals) {
-            offsets = ntris*3*sizeof(float);
-            MPI_File_write(mf, &offsets, 1, MPI_UNSIGNED_LONG_LONG, &mstat);
-            MPI_File_write(mf, xvals, ntris*3, MPI_FLOAT, &mstat);
-        }
-        /* Points header & array */
-        offsets = ntris*9*sizeof(float);
-        MPI_File_write(mf, &offsets, 1, MPI_UNSIGNED_LONG_LONG, &mstat);
-        MPI_File_write(mf, points, ntris*9, MPI_FLOAT, &mstat);
-        /* Create connections & write */
-        temparr = (uint64_t *) malloc(ntris*3*sizeof(uint64_t));
-        for(i = 0; i < ntris*3; i++)
-            temparr[i] = i;
-        offsets = ntris*3*sizeof(uint64_t);
-        MPI_File_write(mf, &offsets, 1, MPI_UNSIGNED_LONG_LONG, &mstat);
-        MPI_File_write(mf, temparr, ntris*3, MPI_UNSIGNED_LONG_LONG, &mstat);
-        /* Create offsets & write */
-        for(i = 1; i <= ntris; i++)
-            temparr[i] = i*3;
-        offsets = ntris*sizeof(uint64_t);
-        MPI_File_write(mf, &offsets, 1, MPI_UNSIGNED_LONG_LONG, &mstat);
-        MPI_File_write(mf, temparr, ntris, MPI_UNSIGNED_LONG_LONG, &mstat);
+        /* Headers & arrays: compressed blocks, or the byte count and the array */
+        for(a = 0; a < va.narrs; a++)
+            vtparrays_put(&va, a, NULL, mf);
         /* Finish and close */
-        free(temparr);
         snprintf(line, fnstrmax, "\n  </AppendedData>\n</VTKFile>\n"); 
         MPI_File_write(mf, line, strlen(line), MPI_CHAR, &mstat);
         MPI_File_close(&mf);
+        vtparrays_free(&va, tris);
     }
 
 }
 
+void writevtpshared(char *dir, char *name, char *varname, MPI_Comm comm, int rank,
+                    int nprocs, int tstep, uint64_t ntris, uint64_t npoints, float *points, float *norms, 
+                    int nxvals, float **xvals, char **xnames, uint64_t *tris, int ztype,
+                    int zlevel, int naggs, int stripes)
+{
+    char fname[fnstrmax+1];
+    int timedigits = 4;
+    int nmeta = nxvals + 7;   /* Triangles, points, offset, and array sizes of a rank */
+    uint64_t *meta, *rmeta = NULL;
+    uint64_t nbytes = 0, offset = 0, total = 0;
+    unsigned char *data;
+    struct vtparrays va;
+    struct vtkxml xml = { 0, 0, NULL };
+    int a, r;
+
+    /* This rank's appended bytes, its pieces' arrays one after another */
+    vtparrays_init(&va, ntris, npoints, points, norms, nxvals, xvals, tris, ztype, zlevel);
+    if(ntris > 0)
+        for(a = 0; a < va.narrs; a++)
+            nbytes += va.asizes[a];
+    data = (unsigned char *) malloc(nbytes ? nbytes : 1);
+    for(offset = 0, a = 0; ntris > 0 && a < va.narrs; a++) {
+        vtparrays_put(&va, a, data + offset, MPI_FILE_NULL);
+        offset += va.asizes[a];
+    }
+
+    /* Place of the rank's bytes in the appended data */
+    offset = 0;
+    MPI_Exscan(&nbytes, &offset, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, comm);
+    if(rank == 0)
+        offset = 0;
+
+    /* Rank 0 describes every rank's piece, leaving out those with no triangles */
+    meta = (uint64_t *) malloc(nmeta*sizeof(uint64_t));
+    meta[0] = ntris;
+    meta[1] = npoints;
+    meta[2] = offset;
+    for(a = 0; a < va.narrs; a++)
+        meta[3+a] = va.asizes[a];
+    if(rank == 0)
+        rmeta = (uint64_t *) malloc(nprocs*nmeta*sizeof(uint64_t));
+    MPI_Gather(meta, nmeta, MPI_UNSIGNED_LONG_LONG, rmeta, nmeta, MPI_UNSIGNED_LONG_LONG,
+               0, comm);
+    if(rank == 0) {
+        vtp_begin(&xml, ztype);
+        for(r = 0; r < nprocs; r++) {
+            uint64_t *rm = rmeta + r*nmeta;
+            if(rm[0] > 0) {
+                vtp_piece(&xml, rm[1], rm[0], nxvals, xnames, rm+3, rm[2]);
+                total = rm[2];
+                for(a = 0; a < va.narrs; a++)
+                    total += rm[3+a];
+            }
+        }
+        vtp_end(&xml);
+        free(rmeta);
+    }
+
+    snprintf(fname, fnstrmax, "%s/%s.%s.%0*d.vtp", dir, name, varname, timedigits, tstep);
+    vtkshared_write(fname, comm, &xml, total, data, nbytes, offset, naggs, stripes);
+
+    free(xml.text);
+    free(meta);
+    free(data);
+    vtparrays_free(&va, tris);
+}
@@ -6,6 +6,20 @@
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h>
 
-void writepvtp(char *name, char *varname, MPI_Comm comm, int rank, int nprocs, 
-               int tstep, uint64_t ntris, float *points, float *norms, 
-               float *xvals, char *xname);
+/* The files go in directory dir, and nodelocal says this rank creates the
+ * step's directory for its node, as from bbuf_dir and bbuf_mkdirs.  Points,
+ * normals and the nxvals xvals arrays named xnames are npoints long; tris
+ * holds 3 point indices per triangle, or is NULL if each triangle has its
+ * own 3 points.  ztype is a vtkz compressor of the appended data, 0 for
+ * raw, and zlevel its level */
+void writepvtp(char *dir, int nodelocal, char *name, char *varname, MPI_Comm comm, int rank,
+               int nprocs, int tstep, uint64_t ntris, uint64_t npoints, float *points, float *norms, 
+               int nxvals, float **xvals, char **xnames, uint64_t *tris, int ztype, int zlevel);
+
+/* Same, but all ranks' pieces go in one dir/name.varname.tstep.vtp file with
+ * one shared appended data section, written with a collective call, through
+ * naggs aggregator ranks if not 0, and striped over stripes targets */
+void writevtpshared(char *dir, char *name, char *varname, MPI_Comm comm, int rank,
+                    int nprocs, int tstep, uint64_t ntris, uint64_t npoints, float *points, float *norms, 
+                    int nxvals, float **xvals, char **xnames, uint64_t *tris, int ztype,
+                    int zlevel, int naggs, int stripes);
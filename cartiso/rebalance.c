@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) DoD HPCMP PETTT.  All rights reserved.
+ * See LICENSE file for details.
+ */
+
+/* Rebalancing of the isosurface triangles before output.  The isosurface
+ * is wherever the data puts it, so a few ranks may hold most of it and the
+ * writers wait on them.  An exclusive scan of the triangle counts gives each
+ * triangle its place in rank order, which is cut into equal pieces, one per
+ * target rank, and the triangles move there with MPI_Alltoallv.  The order
+ * of the triangles over all ranks stays the same. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iso.h"
+#include "rebalance.h"
+
+void rebalinit(struct rebalinfo *nfo, MPI_Comm comm, int ntargets, int nxvals)
+{
+    nfo->comm = comm;
+    MPI_Comm_rank(comm, &nfo->rank);
+    MPI_Comm_size(comm, &nfo->nprocs);
+    nfo->ntargets = (ntargets < 1 || ntargets > nfo->nprocs) ? nfo->nprocs : ntargets;
+    nfo->nxvals = nxvals;
+    nfo->nmeshes = nfo->maxmeshes = 0;
+    nfo->meshes = NULL;
+    nfo->maxflat = 0;
+    nfo->flatpoints = NULL;
+    nfo->flatnorms = NULL;
+    nfo->flatxvals = (float **) calloc(nxvals+1, sizeof(float *));
+    MPI_Type_contiguous(9, MPI_FLOAT, &nfo->tri3);
+    MPI_Type_commit(&nfo->tri3);
+    MPI_Type_contiguous(3, MPI_FLOAT, &nfo->tri1);
+    MPI_Type_commit(&nfo->tri1);
+    nfo->sendcounts = (int *) malloc(nfo->nprocs*sizeof(int));
+    nfo->senddispls = (int *) malloc(nfo->nprocs*sizeof(int));
+    nfo->recvcounts = (int *) malloc(nfo->nprocs*sizeof(int));
+    nfo->recvdispls = (int *) malloc(nfo->nprocs*sizeof(int));
+}
+
+void rebalfree(struct rebalinfo *nfo)
+{
+    int m, x;
+
+    for(m = 0; m < nfo->maxmeshes; m++) {
+        struct isomesh *mesh = &nfo->meshes[m];
+        free(mesh->points);
+        free(mesh->norms);
+        for(x = 0; x < nfo->nxvals; x++)
+            free(mesh->xvals[x]);
+        free(mesh->xvals);
+    }
+    free(nfo->meshes);
+    nfo->meshes = NULL;
+    nfo->nmeshes = nfo->maxmeshes = 0;
+    free(nfo->flatpoints);
+    free(nfo->flatnorms);
+    for(x = 0; x < nfo->nxvals; x++)
+        free(nfo->flatxvals[x]);
+    free(nfo->flatxvals);
+    MPI_Type_free(&nfo->tri3);
+    MPI_Type_free(&nfo->tri1);
+    free(nfo->sendcounts);
+    free(nfo->senddispls);
+    free(nfo->recvcounts);
+    free(nfo->recvdispls);
+}
+
+/* Make room for npoints points in an output mesh, keeping nothing */
+
+static void rebalgrow(struct rebalinfo *nfo, struct isomesh *mesh, uint64_t npoints)
+{
+    int x, fail;
+
+    if(npoints <= mesh->maxpoints)
+        return;
+    mesh->maxpoints = npoints + npoints/4;
+    mesh->points = (float *) realloc(mesh->points, mesh->maxpoints*3*sizeof(float));
+    mesh->norms = (float *) realloc(mesh->norms, mesh->maxpoints*3*sizeof(float));
+    fail = !mesh->points || !mesh->norms;
+    for(x = 0; x < nfo->nxvals; x++) {
+        mesh->xvals[x] = (float *) realloc(mesh->xvals[x], mesh->maxpoints*sizeof(float));
+        fail = fail || !mesh->xvals[x];
+    }
+    if(fail) {
+        fprintf(stderr, "rebalance ERROR : could not grow isosurface to %llu points\n",
+                (unsigned long long)npoints);
+        MPI_Abort(nfo->comm, 1);
+    }
+}
+
+/* Give each triangle of an indexed mesh its own 3 points */
+
+static void rebalflatten(struct rebalinfo *nfo, const struct isomesh *in)
+{
+    uint64_t t, v;
+    int c, x, fail = 0;
+
+    if(in->ntris > nfo->maxflat) {
+        nfo->maxflat = in->ntris + in->ntris/4;
+        nfo->flatpoints = (float *) realloc(nfo->flatpoints, nfo->maxflat*9*sizeof(float));
+        nfo->flatnorms = (float *) realloc(nfo->flatnorms, nfo->maxflat*9*sizeof(float));
+        fail = !nfo->flatpoints || !nfo->flatnorms;
+        for(x = 0; x < nfo->nxvals; x++) {
+            nfo->flatxvals[x] = (float *) realloc(nfo->flatxvals[x],
+                                                  nfo->maxflat*3*sizeof(float));
+            fail = fail || !nfo->flatxvals[x];
+        }
+        if(fail) {
+            fprintf(stderr, "rebalance ERROR : could not flatten %llu triangles\n",
+                    (unsigned long long)in->ntris);
+            MPI_Abort(nfo->comm, 1);
+        }
+    }
+    for(t = 0; t < in->ntris*3; t++) {
+        v = in->tris[t];
+        for(c = 0; c < 3; c++) {
+            nfo->flatpoints[t*3+c] = in->points[v*3+c];
+            nfo->flatnorms[t*3+c] = in->norms[v*3+c];
+        }
+        for(x = 0; x < nfo->nxvals; x++)
+            nfo->flatxvals[x][t] = in->xvals[x][v];
+    }
+}
+
+/* Rebalance one mesh into out */
+
+static void rebalmesh(struct rebalinfo *nfo, const struct isomesh *in, int indexed,
+                      struct isomesh *out)
+{
+    uint64_t ntris = in->ntris, offset = 0, total = 0, nrecv;
+    const float *points = in->points, *norms = in->norms;
+    float *const *xvals = in->xvals;
+    int p, t, x;
+
+    if(indexed) {
+        rebalflatten(nfo, in);
+        points = nfo->flatpoints;
+        norms = nfo->flatnorms;
+        xvals = nfo->flatxvals;
+    }
+
+    /* Place of the first triangle in rank order */
+    MPI_Exscan(&ntris, &offset, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, nfo->comm);
+    if(nfo->rank == 0)
+        offset = 0;
+    MPI_Allreduce(&ntris, &total, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, nfo->comm);
+
+    /* Target t gets the triangles at places t*total/ntargets up to the next
+     * target's, and is rank t*nprocs/ntargets */
+    memset(nfo->sendcounts, 0, nfo->nprocs*sizeof(int));
+    for(t = 0; t < nfo->ntargets; t++) {
+        uint64_t lo = (uint64_t)t*total/nfo->ntargets;
+        uint64_t hi = (uint64_t)(t+1)*total/nfo->ntargets;
+        if(lo < offset)  lo = offset;
+        if(hi > offset+ntris)  hi = offset+ntris;
+        if(lo < hi)
+            nfo->sendcounts[(int)((uint64_t)t*nfo->nprocs/nfo->ntargets)] = (int)(hi-lo);
+    }
+    MPI_Alltoall(nfo->sendcounts, 1, MPI_INT, nfo->recvcounts, 1, MPI_INT, nfo->comm);
+
+    for(nrecv = 0, p = 0; p < nfo->nprocs; p++) {
+        nfo->senddispls[p] = p ? nfo->senddispls[p-1] + nfo->sendcounts[p-1] : 0;
+        nfo->recvdispls[p] = p ? nfo->recvdispls[p-1] + nfo->recvcounts[p-1] : 0;
+        nrecv += nfo->recvcounts[p];
+    }
+    rebalgrow(nfo, out, nrecv*3);
+
+    MPI_Alltoallv(points, nfo->sendcounts, nfo->senddispls, nfo->tri3,
+                  out->points, nfo->recvcounts, nfo->recvdispls, nfo->tri3, nfo->comm);
+    MPI_Alltoallv(norms, nfo->sendcounts, nfo->senddispls, nfo->tri3,
+                  out->norms, nfo->recvcounts, nfo->recvdispls, nfo->tri3, nfo->comm);
+    for(x = 0; x < nfo->nxvals; x++)
+        MPI_Alltoallv(xvals[x], nfo->sendcounts, nfo->senddispls, nfo->tri1,
+                      out->xvals[x], nfo->recvcounts, nfo->recvdispls, nfo->tri1, nfo->comm);
+
+    out->thresh = in->thresh;
+    out->ntris = nrecv;
+    out->npoints = nrecv*3;
+}
+
+void rebalmeshes(struct rebalinfo *nfo, int nmeshes, const struct isomesh *meshes,
+                 int indexed)
+{
+    int m, x;
+
+    if(nmeshes > nfo->maxmeshes) {
+        nfo->meshes = (struct isomesh *) realloc(nfo->meshes, nmeshes*sizeof(struct isomesh));
+        for(m = nfo->maxmeshes; m < nmeshes; m++) {
+            struct isomesh *mesh = &nfo->meshes[m];
+            memset(mesh, 0, sizeof(struct isomesh));
+            mesh->xvals = (float **) malloc( (nfo->nxvals+1)*sizeof(float *) );
+            for(x = 0; x < nfo->nxvals; x++)
+                mesh->xvals[x] = NULL;
+        }
+        nfo->maxmeshes = nmeshes;
+    }
+    for(m = 0; m < nmeshes; m++)
+        rebalmesh(nfo, &meshes[m], indexed, &nfo->meshes[m]);
+    nfo->nmeshes = nmeshes;
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) DoD HPCMP PETTT.  All rights reserved.
+ * See LICENSE file for details.
+ */
+
+#include <stdint.h>
+#include <mpi.h>
+
+/* Redistribution of the isosurface triangles over the ranks before writing */
+struct rebalinfo {
+    MPI_Comm comm;
+    int rank, nprocs;
+    int ntargets;      /* Ranks receiving triangles, evenly spaced over comm */
+    int nxvals;        /* Extra values on the points */
+    int nmeshes;       /* Meshes of the last rebalmeshes */
+    int maxmeshes;     /* Meshes allocated */
+    struct isomesh *meshes;   /* Rebalanced isosurfaces; never indexed */
+    uint64_t maxflat;  /* Triangles the flat buffers hold */
+    float *flatpoints;   /* Indexed input with 3 points of its own per triangle */
+    float *flatnorms;
+    float **flatxvals;
+    MPI_Datatype tri3;   /* 3 components on each of a triangle's 3 points */
+    MPI_Datatype tri1;   /* 1 value on each of a triangle's 3 points */
+    int *sendcounts, *senddispls, *recvcounts, *recvdispls;   /* In triangles */
+};
+
+/* Initialize rebalancing info
+ *   ntargets is the number of ranks the triangles go to; 0 or more than the
+ *   ranks of comm means all of them */
+
+void rebalinit(struct rebalinfo *nfo, MPI_Comm comm, int ntargets, int nxvals);
+
+/* Free up resources from rebalancing */
+
+void rebalfree(struct rebalinfo *nfo);
+
+/* Rebalance the isosurfaces of several isovalues
+ *   Each target rank gets an equal, contiguous piece of the triangles of
+ *   each isosurface, in rank order, and the other ranks get none.  The
+ *   rebalanced surface of meshes[m] is in nfo->meshes[m]. */
+
+void rebalmeshes(struct rebalinfo *nfo, int nmeshes, const struct isomesh *meshes,
+                 int indexed);
@@ -3,10 +3,12 @@
  * See LICENSE file for details.
  */
 
+#include <strings.h>
 #include "sfc.h"
 
 void sfc3_serpentine_init(struct sfc3_ctx *ctx, int ni, int nj, int nk, int reverse)
 {
+    ctx->type = sfc3_serpentine;
     ctx->ni = ni;
     ctx->nj = nj;
     ctx->nk = nk;
@@ -59,6 +61,171 @@ void sfc3_serpentine_next(struct sfc3_ctx *ctx)
         ctx->valid = 0;
 }
 
+/* Coordinates of the point at key on the Morton curve */
+
+static void morton_point(struct sfc3_ctx *ctx, uint64_t key)
+{
+    int b;
+
+    ctx->i = ctx->j = ctx->k = 0;
+    for(b = 0; b < ctx->bits; b++) {
+        ctx->i |= (int)((key >> (3*b)) & 1) << b;
+        ctx->j |= (int)((key >> (3*b+1)) & 1) << b;
+        ctx->k |= (int)((key >> (3*b+2)) & 1) << b;
+    }
+}
+
+/* Coordinates of the point at key on the Hilbert curve
+ *   Skilling's transpose: the key's bits, from the top, are dealt in turn to
+ *   the axes, then Gray decoded and the excess rotations undone */
+
+static void hilbert_point(struct sfc3_ctx *ctx, uint64_t key)
+{
+    int x[3] = {0, 0, 0};
+    int b, a, t, p, q;
+
+    for(b = 0; b < ctx->bits; b++)
+        for(a = 0; a < 3; a++)
+            x[a] |= (int)((key >> (3*b + 2-a)) & 1) << b;
+    t = x[2] >> 1;
+    for(a = 2; a > 0; a--)
+        x[a] ^= x[a-1];
+    x[0] ^= t;
+    for(q = 2; q != 1 << ctx->bits; q <<= 1) {
+        p = q - 1;
+        for(a = 2; a >= 0; a--) {
+            if(x[a] & q) {
+                x[0] ^= p;
+            } else {
+                t = (x[0] ^ x[a]) & p;
+                x[0] ^= t;
+                x[a] ^= t;
+            }
+        }
+    }
+    ctx->i = x[0];
+    ctx->j = x[1];
+    ctx->k = x[2];
+}
+
+/* Move the key of a Hilbert or Morton curve to the next point in the space,
+ * the current key first if step is 0 */
+
+static void cube_advance(struct sfc3_ctx *ctx, int step)
+{
+    uint64_t nkeys = (uint64_t)1 << 3*ctx->bits;
+
+    for(;;) {
+        if(step) {
+            if(ctx->reverse ? ctx->key == 0 : ctx->key == nkeys-1) {
+                ctx->valid = 0;
+                return;
+            }
+            ctx->key += ctx->reverse ? -1 : 1;
+        }
+        step = 1;
+        if(ctx->type == sfc3_hilbert)
+            hilbert_point(ctx, ctx->key);
+        else
+            morton_point(ctx, ctx->key);
+        if(ctx->i < ctx->ni && ctx->j < ctx->nj && ctx->k < ctx->nk)
+            return;
+    }
+}
+
+static void cube_init(struct sfc3_ctx *ctx, enum sfc3_type type, int ni, int nj, int nk,
+                      int reverse)
+{
+    int n = ni > nj ? ni : nj;
+
+    if(nk > n)  n = nk;
+    ctx->type = type;
+    ctx->ni = ni;
+    ctx->nj = nj;
+    ctx->nk = nk;
+    ctx->reverse = reverse;
+    ctx->ndx = 0;
+    ctx->valid = 1;
+    ctx->idir = ctx->jdir = ctx->kdir = 1;
+    for(ctx->bits = 1; (1 << ctx->bits) < n; ctx->bits++)
+        ;
+    ctx->key = reverse ? ((uint64_t)1 << 3*ctx->bits) - 1 : 0;
+    cube_advance(ctx, 0);
+}
+
+void sfc3_hilbert_init(struct sfc3_ctx *ctx, int ni, int nj, int nk, int reverse)
+{
+    cube_init(ctx, sfc3_hilbert, ni, nj, nk, reverse);
+}
+
+void sfc3_hilbert_next(struct sfc3_ctx *ctx)
+{
+    cube_advance(ctx, 1);
+    ctx->ndx += 1;
+}
+
+void sfc3_morton_init(struct sfc3_ctx *ctx, int ni, int nj, int nk, int reverse)
+{
+    cube_init(ctx, sfc3_morton, ni, nj, nk, reverse);
+}
+
+void sfc3_morton_next(struct sfc3_ctx *ctx)
+{
+    cube_advance(ctx, 1);
+    ctx->ndx += 1;
+}
+
+void sfc3_init(struct sfc3_ctx *ctx, enum sfc3_type type, int ni, int nj, int nk, int reverse)
+{
+    switch(type) {
+        case sfc3_hilbert:
+            sfc3_hilbert_init(ctx, ni, nj, nk, reverse);
+            break;
+        case sfc3_morton:
+            sfc3_morton_init(ctx, ni, nj, nk, reverse);
+            break;
+        default:
+            sfc3_serpentine_init(ctx, ni, nj, nk, reverse);
+            break;
+    }
+}
+
+void sfc3_next(struct sfc3_ctx *ctx)
+{
+    switch(ctx->type) {
+        case sfc3_hilbert:
+            sfc3_hilbert_next(ctx);
+            break;
+        case sfc3_morton:
+            sfc3_morton_next(ctx);
+            break;
+        default:
+            sfc3_serpentine_next(ctx);
+            break;
+    }
+}
+
+int sfc3_index(enum sfc3_type type, int ni, int nj, int nk, int i, int j, int k)
+{
+    struct sfc3_ctx ctx;
+
+    for(sfc3_init(&ctx, type, ni, nj, nk, 0); ctx.valid; sfc3_next(&ctx))
+        if(ctx.i == i && ctx.j == j && ctx.k == k)
+            return ctx.ndx;
+    return -1;
+}
+
+int sfc3_type_byname(const char *name)
+{
+    if(!strcasecmp(name, "serpentine"))
+        return sfc3_serpentine;
+    if(!strcasecmp(name, "hilbert"))
+        return sfc3_hilbert;
+    if(!strcasecmp(name, "morton"))
+        return sfc3_morton;
+    return -1;
+}
+
 #ifdef SFC_SERPENTINE_TEST
 
 #include <stdio.h>
@@ -67,11 +234,12 @@ void sfc3_serpentine_next(struct sfc3_ctx *ctx)
 int main(int argc, char **argv)
 {
     struct sfc3_ctx sfc;
-    int ni, nj, nk, reverse;
+    int ni, nj, nk, reverse, type = sfc3_serpentine;
 
-    if(argc != 5) {
-        printf("Invalid arguments.\nUsage: %s ni nj nk reverse\n", argv[0]);
-        printf("   reverse = 0 or 1     1 runs the curve in reverse from the end");
+    if(argc != 5 && argc != 6) {
+        printf("Invalid arguments.\nUsage: %s ni nj nk reverse [curve]\n", argv[0]);
+        printf("   reverse = 0 or 1     1 runs the curve in reverse from the end\n");
+        printf("   curve = serpentine, hilbert, or morton; default serpentine");
         return 1;
     }
 
@@ -84,12 +252,16 @@ int main(int argc, char **argv)
         printf("Invalid number or ni, nj, or nk.\n");
         return 1;
     }
+    if(argc == 6 && (type = sfc3_type_byname(argv[5])) < 0) {
+        printf("Invalid curve %s.\n", argv[5]);
+        return 1;
+    }
 
-    sfc3_serpentine_init(&sfc, ni, nj, nk, reverse);
+    sfc3_init(&sfc, type, ni, nj, nk, reverse);
 
     do {
         printf("%d %d %d\n", sfc.i, sfc.j, sfc.k);
-        sfc3_serpentine_next(&sfc);
+        sfc3_next(&sfc);
     } while(sfc.valid);
 
     return 0;
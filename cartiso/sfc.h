@@ -1,9 +1,14 @@
 /*
- * Copyright (c) DoD HPCMP PETTT.  All rights reserved.  
+ * Copyright (c) DoD HPCMP PETTT.  All rights reserved.
  * See LICENSE file for details.
  */
 
+#include <stdint.h>
+
+enum sfc3_type { sfc3_serpentine, sfc3_hilbert, sfc3_morton };
+
 struct sfc3_ctx {
+    enum sfc3_type type;   /* Which curve */
     int ni, nj, nk;   /* Total size of space */
     int reverse;      /* Whether the curve advances in reverse from the end */
     int ndx;          /* Current index */
@@ -12,8 +17,27 @@ struct sfc3_ctx {
     int idir;         /* Current direction along i, +1 or -1 */
     int jdir;         /* Current direction along j, +1 or -1 */
     int kdir;         /* Current direction along k, +1 or -1 */
+    int bits;         /* Hilbert & Morton: bits per axis of the cube enclosing the space */
+    uint64_t key;     /* Hilbert & Morton: current position on the curve of that cube */
 };
 
 void sfc3_serpentine_init(struct sfc3_ctx *ctx, int ni, int nj, int nk, int reverse);
 void sfc3_serpentine_next(struct sfc3_ctx *ctx);
 
+/* Hilbert and Morton curves of the power of 2 cube enclosing the space,
+ * skipping the points outside it.  Consecutive points are neighbors along
+ * the Hilbert curve only when the space is that cube. */
+void sfc3_hilbert_init(struct sfc3_ctx *ctx, int ni, int nj, int nk, int reverse);
+void sfc3_hilbert_next(struct sfc3_ctx *ctx);
+void sfc3_morton_init(struct sfc3_ctx *ctx, int ni, int nj, int nk, int reverse);
+void sfc3_morton_next(struct sfc3_ctx *ctx);
+
+/* Any of the curves, by type */
+void sfc3_init(struct sfc3_ctx *ctx, enum sfc3_type type, int ni, int nj, int nk, int reverse);
+void sfc3_next(struct sfc3_ctx *ctx);
+
+/* Index of point i,j,k along a curve, e.g. to order ranks by it; -1 if outside */
+int sfc3_index(enum sfc3_type type, int ni, int nj, int nk, int i, int j, int k);
+
+/* Curve type of a name: serpentine, hilbert, or morton; -1 if none */
+int sfc3_type_byname(const char *name);
@@ -0,0 +1,87 @@
+/*
+ * Functions to write a VTK XML file of the pieces of all ranks, with one
+ * shared appended data section, from an MPI code
+ *
+ * Copyright (c) DoD HPCMP PETTT.  All rights reserved.
+ * See LICENSE file for details.
+ */
+
+#include <stdarg.h>
+#include <mpi.h>
+
+#include "agg.h"
+
+/* Growing text of the XML part of a file */
+struct vtkxml {
+    size_t len;
+    size_t max;
+    char *text;
+};
+
+/* Append formatted text to xml */
+
+static void vtkxml_printf(struct vtkxml *xml, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if(xml->len + n + 1 > xml->max) {
+        xml->max = 2*(xml->len + n + 1);
+        xml->text = (char *) realloc(xml->text, xml->max);
+    }
+    va_start(ap, fmt);
+    vsnprintf(xml->text + xml->len, n + 1, fmt, ap);
+    va_end(ap);
+    xml->len += n;
+}
+
+/* Write the shared file
+ *    fname: name of the file
+ *    comm: MPI communicator of all ranks
+ *    xml: rank 0's XML, through the "_" that starts the appended data
+ *    total: rank 0's sum of the appended bytes of all ranks
+ *    data, nbytes: appended bytes of this rank
+ *    offset: where they go in the appended data, the ranks' exclusive scan
+ *    naggs: ranks that write the appended data, 0 to leave it to MPI-IO
+ *    stripes: targets the file is striped over, apart from naggs so that
+ *             sweeping one leaves the other alone
+ * note: the file is created once and written with one collective call, no
+ *       matter how many ranks */
+
+static void vtkshared_write(char *fname, MPI_Comm comm, struct vtkxml *xml, uint64_t total,
+                            const void *data, uint64_t nbytes, uint64_t offset, int naggs,
+                            int stripes)
+{
+    char sfactor[16];
+    const char footer[] = "\n  </AppendedData>\n</VTKFile>\n";
+    uint64_t xmllen = 0;
+    int rank, ret;
+    MPI_File mf;
+    MPI_Status mstat;
+    MPI_Info info;
+
+    MPI_Comm_rank(comm, &rank);
+    if(rank == 0)
+        xmllen = xml->len;
+    MPI_Bcast(&xmllen, 1, MPI_UNSIGNED_LONG_LONG, 0, comm);
+
+    MPI_Info_create(&info);
+    snprintf(sfactor, sizeof(sfactor), "%d", stripes > 0 ? stripes : 1);
+    MPI_Info_set(info, "striping_factor", sfactor);
+    ret = MPI_File_open(comm, fname, MPI_MODE_WRONLY | MPI_MODE_CREATE, info, &mf);
+    if(ret) {
+        fprintf(stderr, "vtkshared error: could not open %s\n", fname);
+        MPI_Abort(comm, 1);
+    }
+    MPI_File_set_size(mf, 0);   /* Drop a longer file of a previous run */
+    if(rank == 0) {
+        MPI_File_write_at(mf, 0, xml->text, (int)xmllen, MPI_CHAR, &mstat);
+        MPI_File_write_at(mf, xmllen + total, footer, (int)strlen(footer), MPI_CHAR, &mstat);
+    }
+    agg_write_at_all(mf, comm, naggs, xmllen + offset, data, nbytes);
+    MPI_File_close(&mf);
+    MPI_Info_free(&info);
+}
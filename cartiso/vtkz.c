@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) DoD HPCMP PETTT.  All rights reserved.
+ * See LICENSE file for details.
+ */
+
+/* Block compression of VTK XML appended data.  Each block is compressed
+ * into its own slot of a scratch buffer, so threads can take blocks
+ * independently, then the blocks are packed behind the header. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <mpi.h>
+#include <zlib.h>
+#ifdef HAS_LZ4
+#  include <lz4.h>
+#endif
+
+#include "vtkz.h"
+
+static const uint64_t blocksize = 32768;   /* VTK's default */
+
+static struct vtkzstats totals = { 0, 0, 0. };
+
+/* Largest compressed size of a block */
+
+static uint64_t block_bound(int type)
+{
+#ifdef HAS_LZ4
+    if(type == vtkz_lz4)
+        return (uint64_t)LZ4_compressBound((int)blocksize);
+#endif
+    return (uint64_t)compressBound((uLong)blocksize);
+}
+
+/* Compress one block into dst, which holds block_bound bytes; returns its size */
+
+static uint64_t block_compress(int type, int level, unsigned char *dst,
+                               const unsigned char *src, uint64_t n)
+{
+    uLongf zn = (uLongf)block_bound(type);
+
+#ifdef HAS_LZ4
+    if(type == vtkz_lz4)
+        return (uint64_t)LZ4_compress_fast((const char *)src, (char *)dst, (int)n, (int)zn,
+                                           level);
+#endif
+    if(compress2(dst, &zn, src, (uLong)n, level) != Z_OK)
+        return 0;
+    return (uint64_t)zn;
+}
+
+void vtkz_compress(struct vtkzbuf *zb, int type, int level, const void *data,
+                   uint64_t nbytes)
+{
+    const unsigned char *src = (const unsigned char *)data;
+    uint64_t nblocks = (nbytes + blocksize - 1) / blocksize;
+    uint64_t bound = block_bound(type);
+    uint64_t hdrbytes = (3 + nblocks) * sizeof(uint64_t);
+    uint64_t need = hdrbytes + nblocks*bound;
+    uint64_t *hdr, pos;
+    int64_t b;
+    int fail = 0;
+    double t = MPI_Wtime();
+
+    if(need > zb->maxsize) {
+        zb->maxsize = need;
+        zb->buf = (unsigned char *) realloc(zb->buf, need);
+        if(!zb->buf) {
+            fprintf(stderr, "vtkz ERROR : could not allocate %llu bytes\n",
+                    (unsigned long long)need);
+            exit(1);
+        }
+    }
+    hdr = (uint64_t *)zb->buf;
+    hdr[0] = nblocks;
+    hdr[1] = blocksize;
+    hdr[2] = nbytes % blocksize;
+
+#ifdef HAS_OPENMP
+#   pragma omp parallel for schedule(dynamic) reduction(||:fail)
+#endif
+    for(b = 0; b < (int64_t)nblocks; b++) {
+        uint64_t n = (b == (int64_t)nblocks-1 && hdr[2]) ? hdr[2] : blocksize;
+        hdr[3+b] = block_compress(type, level, zb->buf + hdrbytes + b*bound,
+                                  src + b*blocksize, n);
+        fail = fail || !hdr[3+b];
+    }
+    if(fail) {
+        fprintf(stderr, "vtkz ERROR : compression failed\n");
+        exit(1);
+    }
+
+    /* Pack the blocks behind the header */
+    for(pos = hdrbytes, b = 0; b < (int64_t)nblocks; b++) {
+        memmove(zb->buf + pos, zb->buf + hdrbytes + b*bound, hdr[3+b]);
+        pos += hdr[3+b];
+    }
+    zb->size = pos;
+
+    totals.rawbytes += nbytes;
+    totals.zbytes += zb->size;
+    totals.ztime += MPI_Wtime() - t;
+}
+
+void vtkz_free(struct vtkzbuf *zb)
+{
+    free(zb->buf);
+    zb->buf = NULL;
+    zb->size = zb->maxsize = 0;
+}
+
+const char *vtkz_compressor(int type)
+{
+    switch(type) {
+        case vtkz_zlib:
+            return "vtkZLibDataCompressor";
+        case vtkz_lz4:
+            return "vtkLZ4DataCompressor";
+        default:
+            return NULL;
+    }
+}
+
+int vtkz_type_byname(const char *name)
+{
+    if(!strcasecmp(name, "none"))
+        return vtkz_none;
+    if(!strcasecmp(name, "zlib"))
+        return vtkz_zlib;
+#ifdef HAS_LZ4
+    if(!strcasecmp(name, "lz4"))
+        return vtkz_lz4;
+#endif
+    return -1;
+}
+
+void vtkz_getstats(struct vtkzstats *stats, int reset)
+{
+    *stats = totals;
+    if(reset) {
+        totals.rawbytes = totals.zbytes = 0;
+        totals.ztime = 0.;
+    }
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) DoD HPCMP PETTT.  All rights reserved.
+ * See LICENSE file for details.
+ */
+
+#include <stdint.h>
+
+/* Compressors of VTK XML appended data */
+enum vtkz_type { vtkz_none, vtkz_zlib, vtkz_lz4 };
+
+/* An array compressed for VTK: a UInt64 header of the number of blocks,
+ * the block size, the size of the partial last block (0 if none), and the
+ * compressed size of each block, followed by the compressed blocks */
+struct vtkzbuf {
+    uint64_t size;      /* Bytes of header and blocks */
+    uint64_t maxsize;   /* Bytes allocated; grows as needed */
+    unsigned char *buf;
+};
+
+/* Totals of all arrays compressed, to report how well compression pays */
+struct vtkzstats {
+    uint64_t rawbytes;   /* Bytes before compression */
+    uint64_t zbytes;     /* Bytes after, with headers */
+    double ztime;        /* Seconds spent compressing */
+};
+
+/* Compress nbytes of data in blocks, in parallel if built with OpenMP
+ *   level is the zlib level, 1-9, or the LZ4 acceleration, >= 1 */
+
+void vtkz_compress(struct vtkzbuf *zb, int type, int level, const void *data,
+                   uint64_t nbytes);
+
+void vtkz_free(struct vtkzbuf *zb);
+
+/* VTK's name of a compressor, for the compressor attribute; NULL if none */
+
+const char *vtkz_compressor(int type);
+
+/* Compressor type of a name: none, zlib, or lz4 (if built with LZ4); -1 if none */
+
+int vtkz_type_byname(const char *name);
+
+/* Get the totals since the last reset, and reset them */
+
+void vtkz_getstats(struct vtkzstats *stats, int reset);
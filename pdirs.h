@@ -14,15 +14,17 @@
 /* Create a directory from one rank (rank=0)
  *    dirname: name of directory
  *    comm: MPI communicator 
+ *    nodelocal: flag, dirname is on node-local storage, such as a burst
+ *               buffer stage, and this rank creates it for its node too
  * note: this can be called from any/all ranks as long as rank 0 calls it
  * note: aborts for any error except when the directory already exists */
 
-static void mkdir1task(char *dirname, MPI_Comm comm)
+static void mkdir1task(char *dirname, MPI_Comm comm, int nodelocal)
 {
     int rank, ret;
 
     MPI_Comm_rank(comm, &rank);
-    if(rank == 0) {
+    if(rank == 0 || nodelocal) {
         ret = mkdir(dirname, 0777);
         if( ret && errno != EEXIST ) {  /* An error for anything but pre-existing */
             fprintf(stderr, "pvtk error: Could not create directory.\n");
@@ -42,7 +44,7 @@ static void mkdir1task(char *dirname, MPI_Comm comm)
 
 static void chkdir1task(char *dirname, MPI_Comm comm)
 {
-    int rank, nprocs, ret;
+    int rank, nprocs, retry = 0;
     struct stat fsbuf;
 
     MPI_Comm_rank(comm, &rank);
@@ -50,17 +52,14 @@ static void chkdir1task(char *dirname, MPI_Comm comm)
 
     /* Have the last rank ensure that the directory is available */
     if(rank == nprocs-1) { 
-        do {
-            int retry = 0;
-            usleep(200000);
-            ret = stat(dirname, &fsbuf);
-            if(ret && retry > 50) {   /* 50 retries * 200000 us = 10 s timeout */
+        while(stat(dirname, &fsbuf)) {
+            if(++retry > 50) {   /* 50 retries * 200000 us = 10 s timeout */
                 fprintf(stderr, "pvtk error: timeout waiting for directory %s\n",
                         dirname);
                 MPI_Abort(comm, 1);
             }
-        } while(ret);
+            usleep(200000);
+        }
     }
     MPI_Barrier(comm);   /* Everyone is safe to use directory after barrier */
 }
-
@@ -7,7 +7,6 @@
 #include <stdlib.h>
 
 #include "adiosstruct.h"
-#include "pdirs.h"
 
 static const int fnstrmax = 4095;
 
@@ -99,7 +98,7 @@ void adiosstruct_addintxvar(struct adiosstructinfo *nfo, char *varname, int *dat
     
 }
 
-void adiosstruct_write(struct adiosstructinfo *nfo, int tstep) {
+void adiosstruct_write(struct adiosstructinfo *nfo, char *dir, int tstep) {
     char fname[fnstrmax+1];
     int timedigits = 4;
     uint64_t ijkelems, groupsize, totalsize;
@@ -123,7 +122,7 @@ void adiosstruct_write(struct adiosstructinfo *nfo, int tstep) {
     }
 
     /* Set filename */
-    snprintf(fname, fnstrmax, "%s.%0*d.bp", nfo->name, timedigits, tstep);
+    snprintf(fname, fnstrmax, "%s/%s.%0*d.bp", dir, nfo->name, timedigits, tstep);
 
     /* Open & Write */
     ret = adios_open(&handle, nfo->name, fname, "w", nfo->comm);
@@ -41,7 +41,8 @@ void adiosstruct_addrealxvar(struct adiosstructinfo *nfo, char *varname, float *
 
 void adiosstruct_addintxvar(struct adiosstructinfo *nfo, char *varname, int *data);
 
-void adiosstruct_write(struct adiosstructinfo *nfo, int tstep);
+/* Writes the time step's file in directory dir */
+void adiosstruct_write(struct adiosstructinfo *nfo, char *dir, int tstep);
   
 void adiosstruct_finalize(struct adiosstructinfo *nfo);
 
@@ -20,13 +20,15 @@ write_xdmf_xml(char *fname, char *fname_xdmf, int num_xname, char **xname,
 	       int ni, int nj, int nk,
 	       float deltax, float deltay, float deltaz);
 
-void writehdf5(const int num_varnames, char **varnames, MPI_Comm comm, int rank, int nprocs, int tstep, 
+void writehdf5(char *dir, const int num_varnames, char **varnames, MPI_Comm comm, int rank,
+               int nprocs, int tstep,
 	       int is, int js, int ks,
                int ni, int nj, int nk, int cni, int cnj, int cnk, 
                float deltax, float deltay, float deltaz, 
                float *data, float *height, int *ola_mask, int *ol_mask)
 {
     char fname[fnstrmax+1];
+    char rel_fname[fnstrmax+1];
     char fname_xdmf[fnstrmax+1];
     int timedigits = 4;
     MPI_Info info = MPI_INFO_NULL;
@@ -41,8 +43,9 @@ void writehdf5(const int num_varnames, char **varnames, MPI_Comm comm, int rank,
     int j;
     herr_t err;
     
-    snprintf(fname, fnstrmax, "struct_t%0*d.h5", timedigits, tstep);
-    snprintf(fname_xdmf, fnstrmax, "struct_t%0*d.xmf", timedigits, tstep);
+    snprintf(fname, fnstrmax, "%s/struct_t%0*d.h5", dir, timedigits, tstep);
+    snprintf(rel_fname, fnstrmax, "struct_t%0*d.h5", timedigits, tstep);
+    snprintf(fname_xdmf, fnstrmax, "%s/struct_t%0*d.xmf", dir, timedigits, tstep);
 
     if(rank == 0) {
 
@@ -90,10 +93,11 @@ void writehdf5(const int num_varnames, char **varnames, MPI_Comm comm, int rank,
 
     H5Pset_libver_bounds(plist_id, H5F_LIBVER_LATEST, H5F_LIBVER_LATEST);
 
-    if(H5Pset_fapl_mpio(plist_id, MPI_COMM_WORLD, info) < 0) {
+    if(H5Pset_fapl_mpio(plist_id, comm, info) < 0) {
       printf("writehdf5p error: Could not create property list \n");
       MPI_Abort(comm, 1);
     }
+    MPI_Info_free(&info);
 
     if( (file_id = H5Fopen(fname, H5F_ACC_RDWR, plist_id)) < 0) {
       fprintf(stderr, "writehdf5p error: could not open %s \n", fname);
@@ -164,7 +168,7 @@ void writehdf5(const int num_varnames, char **varnames, MPI_Comm comm, int rank,
 
       /* Create xdmf file for timestep */
     if(rank == 0) {
-      write_xdmf_xml(fname, fname_xdmf, num_varnames, varnames, ni, nj, nk, deltax, deltay, deltaz);
+      write_xdmf_xml(rel_fname, fname_xdmf, num_varnames, varnames, ni, nj, nk, deltax, deltay, deltaz);
     }
 }
 
@@ -3,7 +3,9 @@
 * See LICENSE file for details.
 */
 
-void writehdf5(const int num_varnames, char **varnames, MPI_Comm comm, int rank, int nprocs, int tstep, 
+/* Writes the time step's file in directory dir */
+void writehdf5(char *dir, const int num_varnames, char **varnames, MPI_Comm comm, int rank,
+               int nprocs, int tstep,
 	       int is, int js, int ks,
                int ni, int nj, int nk, int cni, int cnj, int cnk, 
                float deltax, float deltay, float deltaz, 
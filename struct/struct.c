@@ -5,11 +5,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 #include <math.h>
 #include <mpi.h>
 #include "open-simplex-noise.h"
 #include "timer.h"
+#include "asyncout.h"
+#include "bbuf.h"
 
 
 /* #include <limits.h> */
@@ -27,6 +30,58 @@ static const float FILLVALUE = -999;
 
 void print_usage(int rank, const char *errstr);
 
+/* What the output writes a time step from, so that it can run in the
+ * background while the next time step computes */
+struct structout {
+  MPI_Comm comm;       /* Communicator of the writers */
+  int rank, nprocs;
+  int tt;
+  int is, js, ks;
+  int ni, nj, nk;
+  int cni, cnj, cnk;
+  float deltax, deltay, deltaz;
+  int num_varnames;
+  char **varnames;
+  float *data, *height;
+  int *ola_mask, *ol_mask;
+#ifdef HAS_ADIOS
+  struct adiosstructinfo *adiosstruct_nfo;
+#endif
+#ifdef HAS_HDF5
+  int hdf5out;
+#endif
+  struct bbuf *bb;     /* Stage of the output, if --stagedir */
+};
+
+/* Write a time step's output, for asyncout */
+
+void writeout(void *arg)
+{
+  struct structout *o = (struct structout *)arg;
+
+  bbuf_begin(o->bb);
+#ifdef HAS_ADIOS
+
+  adiosstruct_write(o->adiosstruct_nfo, bbuf_dir(o->bb), o->tt);
+    
+#endif
+ 
+#ifdef HAS_HDF5
+  if(o->hdf5out) {
+    if(o->rank == 0) {
+      printf("      Writing hdf5...\n");   fflush(stdout);
+    }
+    writehdf5(bbuf_dir(o->bb), o->num_varnames, o->varnames, o->comm, o->rank, o->nprocs, o->tt,
+	      o->is, o->js, o->ks,
+	      o->ni, o->nj, o->nk, o->cni, o->cnj, o->cnk,  
+	      o->deltax, o->deltay, o->deltaz,
+	      o->data, o->height, o->ola_mask, o->ol_mask);
+  }
+#endif
+
+  bbuf_end(o->bb);
+}
+
 int main(int argc, char **argv)
 {
   int debug=0;                  /* Flag to generate debug prints statements */
@@ -62,6 +117,12 @@ int main(int argc, char **argv)
   int mask_thres_index;
   struct osn_context *simpnoise;    /* Open simplex noise context */
   double heighttime, computetime, outtime;   /* Timers */
+  int async = 0;                /* Write output in the background */
+  struct asyncout aout;         /* Background output context */
+  struct structout out;         /* What the output writes from */
+  char *stagedir = NULL;        /* Burst buffer stage of the output */
+  int drainthreads = 1;
+  struct bbuf bb;               /* Stage and drain context */
   
   const int num_varnames=4;
   char *varnames[num_varnames];
@@ -71,6 +132,7 @@ int main(int argc, char **argv)
   MPI_Comm comm = MPI_COMM_WORLD;
   int cprocs[3], cpers[3], crnk[3];  /* MPI Cartesian info */
   int rank, nprocs;
+  int provided;        /* MPI thread support */
   int cni, cnj, cnk;   /* Points in this task */
   int is, js, ks;     /* Global index starting points */
   float xs, ys, zs;    /* Global coordinate starting points */  
@@ -90,7 +152,8 @@ int main(int argc, char **argv)
   struct adiosstructinfo adiosstruct_nfo;
 #endif
 
-  MPI_Init(&argc, &argv);
+  /* Threads for --async */
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &provided);
   MPI_Comm_rank(MPI_COMM_WORLD, &rank);
   MPI_Comm_size(MPI_COMM_WORLD, &nprocs);
     
@@ -121,6 +184,12 @@ int main(int argc, char **argv)
       debug = 1;
     }else if(!strcasecmp(argv[a], "--debugIO")) {
       debugIO = 1; 
+    }else if(!strcasecmp(argv[a], "--async")) {
+      async = 1;
+    }else if(!strcasecmp(argv[a], "--stagedir")) {
+      stagedir = argv[++a];
+    }else if(!strcasecmp(argv[a], "--drainthreads")) {
+      drainthreads = atoi(argv[++a]);
     }else if(!strcasecmp(argv[a], "--hdf5")) {
 #ifdef HAS_HDF5
       hdf5out = 1;
@@ -211,18 +280,49 @@ int main(int argc, char **argv)
   varnames[2] = "ola_mask";
   varnames[3] = "ol_mask";
 
+  /* Output context; in the background, the writers have their own
+   * communicator and a snapshot of data, the only field that changes */
+  asyncout_init(&aout, comm, async);
+  out.rank = rank;
+  out.nprocs = nprocs;
+  out.is = is;  out.js = js;  out.ks = ks;
+  out.ni = ni;  out.nj = nj;  out.nk = nk;
+  out.cni = cni;  out.cnj = cnj;  out.cnk = cnk;
+  out.deltax = deltax;  out.deltay = deltay;  out.deltaz = deltaz;
+  out.num_varnames = num_varnames;
+  out.varnames = varnames;
+  out.height = height;
+  out.ola_mask = ola_mask;
+  out.ol_mask = ol_mask;
+  if(aout.enabled) {
+    MPI_Comm_dup(comm, &out.comm);
+    out.data = (float *) malloc((size_t)cni*cnj*cnk*sizeof(float));
+  } else {
+    out.comm = comm;
+    out.data = data;
+  }
+#ifdef HAS_HDF5
+  out.hdf5out = hdf5out;
+#endif
+
+  /* Stage the output for a background drain; every output here is one
+   * file from all ranks */
+  bbuf_init(&bb, comm, stagedir, drainthreads, 1);
+  out.bb = &bb;
+
   /* init ADIOS */
 #ifdef HAS_ADIOS
 
-  adiosstruct_init(&adiosstruct_nfo, adios_method, adios_groupname, comm, rank, nprocs, nt,
+  adiosstruct_init(&adiosstruct_nfo, adios_method, adios_groupname, out.comm, rank, nprocs, nt,
 		   ni, nj, nk, is, cni, js, cnj, ks, cnk, deltax, deltay, deltaz, FILLVALUE);
-  adiosstruct_addrealxvar(&adiosstruct_nfo, varnames[0], data);
+  adiosstruct_addrealxvar(&adiosstruct_nfo, varnames[0], out.data);
 
   if (debugIO) {
     adiosstruct_addrealxvar(&adiosstruct_nfo, varnames[1], height);
     adiosstruct_addintxvar(&adiosstruct_nfo, varnames[2], ola_mask);
     adiosstruct_addintxvar(&adiosstruct_nfo, varnames[3], ol_mask);
   }
+  out.adiosstruct_nfo = &adiosstruct_nfo;
 #endif
 
   /* generate masked grid */
@@ -351,39 +451,37 @@ int main(int argc, char **argv)
     timer_tock(&computetime);
 
 
+    /* Snapshot what the last output is done with, and hand it off */
     timer_tick(&outtime, comm, 1);
-#ifdef HAS_ADIOS
-
-    adiosstruct_write(&adiosstruct_nfo, tt);
-    
-#endif
- 
-#ifdef HAS_HDF5
-    if(hdf5out) {
-      if(rank == 0) {
-	printf("      Writing hdf5...\n");   fflush(stdout);
-      }
-      writehdf5(num_varnames, varnames, comm, rank, nprocs, tt,
-		is, js, ks,
-		ni, nj, nk, cni, cnj, cnk,  
-		deltax, deltay, deltaz,
-		data, height, ola_mask, ol_mask);
-    }
-#endif
-
+    asyncout_wait(&aout);
+    out.tt = tt;
+    if(aout.enabled)
+      memcpy(out.data, data, (size_t)cni*cnj*cnk*sizeof(float));
+    asyncout_post(&aout, writeout, &out);
     timer_tock(&outtime);
     timer_collectprintstats(computetime, comm, 0, "   Compute");
-    timer_collectprintstats(outtime, comm, 0, "   Output");
+    asyncout_printstats(&aout, outtime, comm);
+    bbuf_printstats(&bb);
     timer_collectprintstats(heighttime, comm, 0, "   Height");
 
   }
 
+  /* The last time step's output has nothing to hide behind */
+  asyncout_finalize(&aout);
+  if(aout.enabled)
+    timer_collectprintstats(aout.waittime, comm, 0, "   OutputDrain");
+  bbuf_finalize(&bb);
+
     /* finalize ADIOS */
 #ifdef HAS_ADIOS
     adiosstruct_finalize(&adiosstruct_nfo);
 #endif
 
   open_simplex_noise_free(simpnoise);
+  if(aout.enabled) {
+    MPI_Comm_free(&out.comm);
+    free(out.data);
+  }
   free(data);
   free(height);
   free(ola_mask);
@@ -422,6 +520,11 @@ void print_usage(int rank, const char *errstr)
 	  "      FNT : time frequency value;  Default: 0.25\n"
 	  "    --tsteps NT : Number of time steps; valid values are > 0 (Default value 10)\n"
 	  "    --tstart TS : Starting time step; valid values are >= 0  (Default value 0)\n"
+	  "    --async : Write each time step's output in a background thread while the\n"
+	  "      next one computes\n"
+	  "    --stagedir DIR : Write the output to DIR, such as node-local NVMe, and drain\n"
+	  "      it to the current directory in background threads\n"
+	  "    --drainthreads N : Threads draining the stage of each node; Default: 1\n"
 #ifdef HAS_HDF5
 	  "    --hdf5 : Enable HDF5 output (i.e. XDMF)\n"
 #endif
@@ -68,8 +68,8 @@ void adiosunstruct_addvar(struct adiosinfo *nfo, char *varname)
                      "cnpoints", "npoints", "cspoints");
 }
 
-void adiosunstruct_write(struct adiosinfo *nfo, int tstep, float *xpts, float *ypts,
-                         float *zpts, uint64_t *conns3, uint64_t *conns2, float **vars)
+void adiosunstruct_write(struct adiosinfo *nfo, char *dir, int tstep, float *xpts,
+                         float *ypts, float *zpts, uint64_t *conns3, uint64_t *conns2, float **vars)
 {
     char fname[fnstrmax+1];
     int timedigits = 4;
@@ -109,7 +109,7 @@ void adiosunstruct_write(struct adiosinfo *nfo, int tstep, float *xpts, float *y
     }
     
     /* Set filename */
-    snprintf(fname, fnstrmax, "%s.%0*d.bp", nfo->name, timedigits, tstep);
+    snprintf(fname, fnstrmax, "%s/%s.%0*d.bp", dir, nfo->name, timedigits, tstep);
 
     /* Open & Write */
     ret = adios_open(&handle, nfo->name, fname, "w", nfo->comm);
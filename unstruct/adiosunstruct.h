@@ -31,8 +31,9 @@ void adiosunstruct_init(struct adiosinfo *nfo, char *method, char *name, MPI_Com
 
 void adiosunstruct_addvar(struct adiosinfo *nfo, char *varname);
 
-void adiosunstruct_write(struct adiosinfo *nfo, int tstep, float *xpts, float *ypts,
-                         float *zpts, uint64_t *conns3, uint64_t *conns2, float **vars);
+/* Writes the time step's file in directory dir */
+void adiosunstruct_write(struct adiosinfo *nfo, char *dir, int tstep, float *xpts,
+                         float *ypts, float *zpts, uint64_t *conns3, uint64_t *conns2, float **vars);
 
 void adiosunstruct_finalize(struct adiosinfo *nfo);
 
@@ -14,18 +14,20 @@
 uint64_t nelems_in[2];
 uint64_t nelems_out[2];
 
-void writehdf5(char *name, MPI_Comm comm, int tstep, uint64_t npoints, uint64_t nptstask,
-               float *xpts, float *ypts, float *zpts, uint64_t nelems3, uint64_t *conns3,
-               uint64_t nelems2, uint64_t *conns2, char *varname, float *data);
+void writehdf5(char *dir, int nodelocal, char *name, MPI_Comm comm, int tstep, uint64_t npoints,
+               uint64_t nptstask, float *xpts, float *ypts, float *zpts, uint64_t nelems3,
+               uint64_t *conns3, uint64_t nelems2, uint64_t *conns2, char *varname,
+               float *data);
 
 void
 write_xdmf_xml(char *fname, char *fname_xdmf, uint64_t npoints);
 
 static const int fnstrmax = 4095;
 
-void writehdf5(char *name, MPI_Comm comm, int tstep, uint64_t npoints, uint64_t nptstask, 
-               float *xpts, float *ypts, float *zpts, uint64_t nelems3, uint64_t *conns3,
-               uint64_t nelems2, uint64_t *conns2, char *varname, float *data)
+void writehdf5(char *dir, int nodelocal, char *name, MPI_Comm comm, int tstep, uint64_t npoints,
+               uint64_t nptstask, float *xpts, float *ypts, float *zpts, uint64_t nelems3,
+               uint64_t *conns3, uint64_t nelems2, uint64_t *conns2, char *varname,
+               float *data)
 {
     char dirname[fnstrmax+1];
     char fname[fnstrmax+1];
@@ -46,14 +48,14 @@ void writehdf5(char *name, MPI_Comm comm, int tstep, uint64_t npoints, uint64_t
     hsize_t dims[1];
     herr_t err;
 
-    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
-    MPI_Comm_size(MPI_COMM_WORLD, &nprocs);
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &nprocs);
 
     /* Make dir for all output and subdir for timestep */
-    snprintf(dirname, fnstrmax, "%s.hdf5.d", name);
-    mkdir1task(dirname, comm);
-    snprintf(dirname, fnstrmax, "%s.hdf5.d/t%0*d.d", name, timedigits, tstep);
-    mkdir1task(dirname, comm);
+    snprintf(dirname, fnstrmax, "%s/%s.hdf5.d", dir, name);
+    mkdir1task(dirname, comm, nodelocal);
+    snprintf(dirname, fnstrmax, "%s/%s.hdf5.d/t%0*d.d", dir, name, timedigits, tstep);
+    mkdir1task(dirname, comm, nodelocal);
 
     /* Set up MPI info */
     MPI_Info_create(&info);
@@ -61,9 +63,9 @@ void writehdf5(char *name, MPI_Comm comm, int tstep, uint64_t npoints, uint64_t
 
     chkdir1task(dirname, comm);
 
-    snprintf(fname, fnstrmax, "unstruct.hdf5.d/t%0*d.d/r.h5", timedigits, tstep);
+    snprintf(fname, fnstrmax, "%s/%s.hdf5.d/t%0*d.d/r.h5", dir, name, timedigits, tstep);
     snprintf(rel_fname, fnstrmax, "t%0*d.d/r.h5", timedigits, tstep);
-    snprintf(fname_xdmf, fnstrmax, "unstruct.hdf5.d/t%0*d.d.xmf", timedigits, tstep);
+    snprintf(fname_xdmf, fnstrmax, "%s/%s.hdf5.d/t%0*d.d.xmf", dir, name, timedigits, tstep);
 
     /* Set up file access property list with parallel I/O access */
     if( (plist_id = H5Pcreate(H5P_FILE_ACCESS)) < 0) {
@@ -73,10 +75,11 @@ void writehdf5(char *name, MPI_Comm comm, int tstep, uint64_t npoints, uint64_t
 
     H5Pset_libver_bounds(plist_id, H5F_LIBVER_LATEST, H5F_LIBVER_LATEST);
 
-    if(H5Pset_fapl_mpio(plist_id, MPI_COMM_WORLD, info) < 0) {
+    if(H5Pset_fapl_mpio(plist_id, comm, info) < 0) {
       printf("writehdf5 error: Could not create property list \n");
       MPI_Abort(comm, 1);
     }
+    MPI_Info_free(&info);
     
     if( (file_id = H5Fcreate(fname, H5F_ACC_TRUNC, H5P_DEFAULT, plist_id)) < 0) {
       fprintf(stderr, "writehdf5 error: could not open %s \n", fname);
@@ -141,7 +144,7 @@ void writehdf5(char *name, MPI_Comm comm, int tstep, uint64_t npoints, uint64_t
     nelems_in[0] = nelems3 ;
     nelems_in[1] = nelems2 ;
 
-    MPI_Allreduce( nelems_in, nelems_out, 2, MPI_UNSIGNED_LONG_LONG, MPI_SUM, MPI_COMM_WORLD );
+    MPI_Allreduce( nelems_in, nelems_out, 2, MPI_UNSIGNED_LONG_LONG, MPI_SUM, comm );
 
     //MSB is it possible that some processors have 0?
 
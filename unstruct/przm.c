@@ -12,7 +12,7 @@
 
 static const int fnstrmax = 4095;
 
-void writeprzm(char *name, MPI_Comm comm, int tstep, uint64_t npoints,
+void writeprzm(char *dir, int nodelocal, char *name, MPI_Comm comm, int tstep, uint64_t npoints,
                float *xpts, float *ypts, float *zpts, uint64_t nelems3, uint64_t *conns3,
                uint64_t nelems2, uint64_t *conns2, char *varname, float *data)
 {
@@ -35,10 +35,10 @@ void writeprzm(char *name, MPI_Comm comm, int tstep, uint64_t npoints,
     rankdigits = nprocs > 1 ? (int)(log10(nprocs-1)+1.5) : 1;
 
     /* Make dir for all output and subdir for timestep */
-    snprintf(dirname, fnstrmax, "%s.przm", name);
-    mkdir1task(dirname, comm);
-    snprintf(dirname, fnstrmax, "%s.przm/t%0*d.d", name, timedigits, tstep);
-    mkdir1task(dirname, comm);
+    snprintf(dirname, fnstrmax, "%s/%s.przm", dir, name);
+    mkdir1task(dirname, comm, nodelocal);
+    snprintf(dirname, fnstrmax, "%s/%s.przm/t%0*d.d", dir, name, timedigits, tstep);
+    mkdir1task(dirname, comm, nodelocal);
 
     /* Placeholder to create a metadata file, if we decide we need one for reading */
 
@@ -3,7 +3,9 @@
  * See LICENSE file for details.
  */
 
-void writeprzm(char *name, MPI_Comm comm, int tstep, uint64_t npoints,
+/* The files go in directory dir, and nodelocal says this rank creates the
+ * step's directories for its node, as from bbuf_dir and bbuf_mkdirs */
+void writeprzm(char *dir, int nodelocal, char *name, MPI_Comm comm, int tstep, uint64_t npoints,
                float *xpts, float *ypts, float *zpts, uint64_t nelems3, uint64_t *conns3,
                uint64_t nelems2, uint64_t *conns2, char *varname, float *data);
 
@@ -2,11 +2,15 @@
 #include <math.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <string.h>
 #include <strings.h>
 #include <assert.h>
 #include <stdint.h>
 #include <mpi.h>
 #include "open-simplex-noise.h"
+#include "timer.h"
+#include "asyncout.h"
+#include "bbuf.h"
 
 /*## Add Output Modules' Includes Here ##*/
 
@@ -46,6 +50,11 @@ void print_usage(int rank, const char *errstr)
 "      FNS : space frequency value; Default: 10.0\n"
 "    --noisetimefreq FNT : Temporal frequency of noise function\n"
 "      FNT : time frequency value;  Default: 0.25\n"
+"    --async : Write each time step's output in a background thread while the\n"
+"      next one computes\n"
+"    --stagedir DIR : Write the output to DIR, such as node-local NVMe, and drain\n"
+"      it to the current directory in background threads\n"
+"    --drainthreads N : Threads draining the stage of each node; Default: 1\n"
     );
 
     /*## Add Output Modules' Usage String ##*/
@@ -137,6 +146,85 @@ float sqs(double w, double m)
     return (float)(sgn(sin(w)) * pow(fabs(sin(w)), m));
 }
 
+/* What the output modules write a time step from, so that the output can
+ * run in the background while the next time step computes */
+struct unstructout {
+    MPI_Comm comm;               /* Communicator of the writers */
+    int rank;
+    int t;
+    uint64_t npoints, nptstask;
+    float *xpts, *ypts, *zpts;
+    uint64_t nelems2, *conns2;
+    uint64_t nelems3, *conns3;
+    float *data;
+    struct bbuf *bb;             /* Stage of the output, if --stagedir */
+
+    /*## Add Output Modules' Variables Here ##*/
+
+#ifdef HAS_PRZM
+    int przmout;
+#endif
+
+#ifdef HAS_ADIOS
+    char *adiosmethod;
+    struct adiosinfo *adiosnfo;
+#endif
+
+#ifdef HAS_HDF5
+    int hdf5out;
+#endif
+
+    /*## End of Output Module Variables ##*/
+};
+
+/* Write a time step's output, for asyncout */
+
+void writeout(void *arg)
+{
+    struct unstructout *o = (struct unstructout *)arg;
+    char *dir;       /* Where the output goes, and if this rank makes its */
+    int nodelocal;   /* directories for its node */
+
+    bbuf_begin(o->bb);
+    dir = bbuf_dir(o->bb);
+    nodelocal = bbuf_mkdirs(o->bb);
+
+    /*## Add Output Modules' Function Calls Per Timestep Here ##*/
+        
+#ifdef HAS_PRZM
+    if(o->przmout) {
+        if(o->rank == 0) {
+            printf("      Writing przm...\n");   fflush(stdout);
+        }
+        writeprzm(dir, nodelocal, "unstruct", o->comm, o->t, o->nptstask, o->xpts, o->ypts,
+                  o->zpts, o->nelems3, o->conns3, o->nelems2, o->conns2, "noise", o->data);
+    }
+#endif       
+
+#ifdef HAS_ADIOS
+    if(o->adiosmethod) {
+        if(o->rank == 0) {
+            printf("      Writing adios...\n");    fflush(stdout);
+        }
+        adiosunstruct_write(o->adiosnfo, dir, o->t, o->xpts, o->ypts, o->zpts, o->conns3,
+                            o->conns2, &o->data);
+    }
+#endif
+
+#ifdef HAS_HDF5
+    if(o->hdf5out) {
+        if(o->rank == 0) {
+            printf("      Writing hdf5...\n");   fflush(stdout);
+        }
+        writehdf5(dir, nodelocal, "unstruct", o->comm, o->t, o->npoints, o->nptstask,
+                  o->xpts, o->ypts, o->zpts, o->nelems3, o->conns3, o->nelems2, o->conns2, "noise", o->data);
+    }
+#endif
+
+    /*## End of Output Module Functions Calls Per Timestep ##*/
+
+    bbuf_end(o->bb);
+}
 
 int main(int argc, char **argv)
 {
@@ -161,9 +249,19 @@ int main(int argc, char **argv)
     double noisespacefreq = 10;    /* Spatial frequency of noise */
     double noisetimefreq = 0.25;    /* Temporal frequency of noise */
     struct osn_context *osn;    /* Open simplex noise context */
+    int gridchanged;            /* Whether this time step moved the grid points */
+    double computetime, outtime;   /* Timers */
+    int async = 0;              /* Write output in the background */
+    struct asyncout aout;       /* Background output context */
+    struct unstructout out;     /* What the output modules write from */
+    char *stagedir = NULL;      /* Burst buffer stage of the output */
+    int drainthreads = 1;
+    int sharedfiles = 0;        /* Some output is one file from all ranks */
+    struct bbuf bb;             /* Stage and drain context */
 
     /* MPI vars */
     int rank, nprocs;
+    int provided;            /* MPI thread support */
     int uprocs, vprocs;      /* Number of tasks on u & v spherical axes respectively */
     int urank, vrank;        /* 2D rank along u & v */
 
@@ -184,8 +282,8 @@ int main(int argc, char **argv)
 
     /*## End of Output Module Variables ##*/
 
-    /* Init MPI */
-    MPI_Init(&argc, &argv);
+    /* Init MPI; threads for --async */
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &provided);
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
     MPI_Comm_size(MPI_COMM_WORLD, &nprocs);
 
@@ -209,6 +307,12 @@ int main(int argc, char **argv)
             noisespacefreq = strtod(argv[++a], NULL);
         } else if(!strcasecmp(argv[a], "--noisetimefreq")) {
             noisetimefreq = strtod(argv[++a], NULL);
+        } else if(!strcasecmp(argv[a], "--async")) {
+            async = 1;
+        } else if(!strcasecmp(argv[a], "--stagedir")) {
+            stagedir = argv[++a];
+        } else if(!strcasecmp(argv[a], "--drainthreads")) {
+            drainthreads = atoi(argv[++a]);
         }
 
         /*## Add Output Modules' Command Line Arguments Here ##*/
@@ -326,18 +430,56 @@ int main(int argc, char **argv)
     /* Allocate data */
     data = (float *) malloc(nptstask*sizeof(float));
 
+    /* Output context; in the background, the writers have their own
+     * communicator and a snapshot of the grid points and data */
+    asyncout_init(&aout, MPI_COMM_WORLD, async);
+    out.rank = rank;
+    out.npoints = npoints;
+    out.nptstask = nptstask;
+    out.nelems2 = nelems2;
+    out.conns2 = conns2;
+    out.nelems3 = nelems3;
+    out.conns3 = conns3;
+    if(aout.enabled) {
+        MPI_Comm_dup(MPI_COMM_WORLD, &out.comm);
+        out.xpts = (float *) malloc(nptstask*sizeof(float));
+        out.ypts = (float *) malloc(nptstask*sizeof(float));
+        out.zpts = (float *) malloc(nptstask*sizeof(float));
+        out.data = (float *) malloc(nptstask*sizeof(float));
+    } else {
+        out.comm = MPI_COMM_WORLD;
+        out.xpts = xpts;  out.ypts = ypts;  out.zpts = zpts;
+        out.data = data;
+    }
+
     /*## Add Output Modules' Initialization Here ##*/
 
+#ifdef HAS_PRZM
+    out.przmout = przmout;
+#endif
+
 #ifdef HAS_ADIOS
     if(adiosmethod) {
-        adiosunstruct_init(&adiosnfo, adiosmethod, "unstruct.out", MPI_COMM_WORLD, 
+        adiosunstruct_init(&adiosnfo, adiosmethod, "unstruct.out", out.comm, 
                            rank, nprocs, nt, nptstask, nelems3, nelems2);
         adiosunstruct_addvar(&adiosnfo, "noise");
     }
+    out.adiosmethod = adiosmethod;
+    out.adiosnfo = &adiosnfo;
+    sharedfiles = sharedfiles || adiosmethod;
+#endif
+
+#ifdef HAS_HDF5
+    out.hdf5out = hdf5out;
+    sharedfiles = sharedfiles || hdf5out;
 #endif
 
     /*## End of Output Module Initialization ##*/
 
+    /* Stage the output for a background drain */
+    bbuf_init(&bb, MPI_COMM_WORLD, stagedir, drainthreads, sharedfiles);
+    out.bb = &bb;
+
     /* Main loops */
     for(t = 0; t < nt; t++) {
         float tpar = (float)t / (nt-1);    /* Time anim. parameter [0,1] */
@@ -346,9 +488,11 @@ int main(int argc, char **argv)
         }
 
         /* Generate grid points with superquadric */
+        timer_tick(&computetime, MPI_COMM_WORLD, 1);
         uround = (1-tpar)*uround0 + tpar*uround1;
         vround = (1-tpar)*vround0 + tpar*vround1;
-        if( uround0 != uround1 || t == 0 ) {   /* Grid only updated if animating or time 0 */
+        gridchanged = uround0 != uround1 || t == 0;
+        if(gridchanged) {   /* Grid only updated if animating or time 0 */
             for(k = 0, ii = 0; k < nlyr; k++) {
                 /* layer w in [1,3] by squares: */
                 float w = 1.f + powf((float)k/(nlyr-1), 2.f) * 2.f;
@@ -370,43 +514,33 @@ int main(int argc, char **argv)
                     ypts[i]*noisespacefreq, zpts[i]*noisespacefreq, t*noisetimefreq);
         }
 
-        /*## Add Output Modules' Function Calls Per Timestep Here ##*/
-        
-#ifdef HAS_PRZM
-        if(przmout) {
-            if(rank == 0) {
-                printf("      Writing przm...\n");   fflush(stdout);
+        timer_tock(&computetime);
+
+        /* Snapshot what the last output is done with, and hand it off */
+        timer_tick(&outtime, MPI_COMM_WORLD, 1);
+        asyncout_wait(&aout);
+        out.t = t;
+        if(aout.enabled) {
+            if(gridchanged) {
+                memcpy(out.xpts, xpts, nptstask*sizeof(float));
+                memcpy(out.ypts, ypts, nptstask*sizeof(float));
+                memcpy(out.zpts, zpts, nptstask*sizeof(float));
             }
-            writeprzm("unstruct", MPI_COMM_WORLD, t, nptstask, xpts, ypts, zpts,
-                      nelems3, conns3, nelems2, conns2, "noise", data);
+            memcpy(out.data, data, nptstask*sizeof(float));
         }
-#endif       
-
-#ifdef HAS_ADIOS
-        if(adiosmethod) {
-            if(rank == 0) {
-                printf("      Writing adios...\n");    fflush(stdout);
-            }
-            adiosunstruct_write(&adiosnfo, t, xpts, ypts, zpts, conns3, conns2, &data);
-        }
-#endif
-
-#ifdef HAS_HDF5
-        if(hdf5out) {
-            if(rank == 0) {
-                printf("      Writing hdf5...\n");   fflush(stdout);
-            }
-            writehdf5("unstruct", MPI_COMM_WORLD, t, npoints, nptstask, xpts, ypts, zpts,
-                      nelems3, conns3, nelems2, conns2, "noise", data);
-
-	    
-        }
-#endif
-
-        /*## End of Output Module Functions Calls Per Timestep ##*/
-
+        asyncout_post(&aout, writeout, &out);
+        timer_tock(&outtime);
+        timer_collectprintstats(computetime, MPI_COMM_WORLD, 0, "   Compute");
+        asyncout_printstats(&aout, outtime, MPI_COMM_WORLD);
+        bbuf_printstats(&bb);
     }
 
+    /* The last time step's output has nothing to hide behind */
+    asyncout_finalize(&aout);
+    if(aout.enabled)
+        timer_collectprintstats(aout.waittime, MPI_COMM_WORLD, 0, "   OutputDrain");
+    bbuf_finalize(&bb);
+
     /*## Add Output Modules' Cleanup Here ##*/
 
 #ifdef HAS_ADIOS
@@ -418,6 +552,11 @@ int main(int argc, char **argv)
 
     /* Cleanup */
     open_simplex_noise_free(osn);
+    if(aout.enabled) {
+        MPI_Comm_free(&out.comm);
+        free(out.xpts);  free(out.ypts);  free(out.zpts);
+        free(out.data);
+    }
     free(xpts);  free(ypts);  free(zpts);
     free(conns2);  free(conns3);
     free(data);